@@ -0,0 +1,320 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// capture.h - session capture files and replay
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+#ifndef __LAZY_SOCKET_CAPTURE
+#define __LAZY_SOCKET_CAPTURE
+
+// include parent header
+#include "lazy_sockets.h"
+
+
+// file layout, everything little endian as written by the host:
+//   CaptureFileHeader
+//   CaptureRecordHeader + size payload bytes, repeated, no padding
+// frames are stored without their end tag, the tag is kept once in the header
+struct CaptureFileHeader {
+	char magic[8]; // "LSCCAPT\0"
+	uint32_t version;
+	int32_t sock_type; // SOCK_STREAM or SOCK_DGRAM of the captured socket
+	uint32_t tag_size;
+	char tag[16];
+};
+
+#pragma pack(push, 1)
+struct CaptureRecordHeader {
+	uint64_t timestamp_ns; // wall clock, kernel receive time if available
+	uint32_t size;
+};
+#pragma pack(pop)
+
+// a frame inside a mapped capture file
+struct CaptureFrame {
+	uint64_t timestamp_ns;
+	const char* data; // points into the mapping, valid while the reader is open
+	uint32_t size;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// CaptureWriter - appends frames to a capture file
+///////////////////////////////////////////////////////////////////////////////
+
+
+// buffered through stdio, frames become visible to readers after Flush()
+// only one thread may call Write()
+class CaptureWriter {
+public:
+	static constexpr uint32_t VERSION = 1;
+
+	CaptureWriter() = default;
+
+	inline ~CaptureWriter() {
+		Close();
+	}
+
+	// no moving/coping this object, receivers hold on to it
+	CaptureWriter(const CaptureWriter&) = delete;
+	CaptureWriter& operator=(const CaptureWriter&) = delete;
+
+	// creates (or overwrites) :path:, :tag: is what terminated the frames
+	// of a :sock_type: socket, the replay puts it back on
+	// returns 0 on success or -1 on error
+	inline int Open(const std::string& path, const void* tag, size_t tag_size, int sock_type = SOCK_STREAM) {
+		Close();
+
+		CaptureFileHeader header;
+		memset(&header, 0, sizeof(header));
+		if (tag_size > sizeof(header.tag)) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		m_file = fopen(path.c_str(), "wb");
+		if (!m_file)
+			return -1;
+
+		memcpy(header.magic, "LSCCAPT", 8);
+		header.version = VERSION;
+		header.sock_type = sock_type;
+		header.tag_size = (uint32_t)tag_size;
+		memcpy(header.tag, tag, tag_size);
+
+		if (fwrite(&header, sizeof(header), 1, m_file) != 1) {
+			Close();
+			return -1;
+		}
+
+		m_count = 0;
+		return 0;
+	}
+
+	template<typename T>
+	inline int Open(const std::string& path, const T& tag, int sock_type = SOCK_STREAM) {
+		return Open(path, &tag, sizeof(tag), sock_type);
+	}
+
+	inline bool IsOpen() const {
+		return m_file != nullptr;
+	}
+
+	// appends a frame, :timestamp_ns: of 0 uses the current wall clock time
+	// returns 0 on success or -1 on error
+	inline int Write(const void* data, size_t len, uint64_t timestamp_ns = 0) {
+		if (!m_file) {
+			errno = EBADF;
+			return -1;
+		}
+
+		CaptureRecordHeader record;
+		record.timestamp_ns = timestamp_ns ? timestamp_ns : get_wall_time_ns();
+		record.size = (uint32_t)len;
+		if (fwrite(&record, sizeof(record), 1, m_file) != 1)
+			return -1;
+		if (len && fwrite(data, len, 1, m_file) != 1)
+			return -1;
+
+		m_count++;
+		return 0;
+	}
+
+	// returns 0 on success or -1 on error
+	inline int Flush() {
+		return m_file ? fflush(m_file) : 0;
+	}
+
+	inline void Close() {
+		if (m_file)
+			fclose(m_file);
+		m_file = nullptr;
+	}
+
+	inline uint64_t GetFrameCount() const {
+		return m_count;
+	}
+
+private:
+	FILE* m_file = nullptr;
+	uint64_t m_count = 0;
+}; // class CaptureWriter
+
+
+///////////////////////////////////////////////////////////////////////////////
+// CaptureReader - walks a memory mapped capture file
+///////////////////////////////////////////////////////////////////////////////
+
+
+// frames are handed out as pointers into the mapping, nothing is copied
+class CaptureReader {
+public:
+	CaptureReader() = default;
+
+	// no moving/coping this object, frames point into it
+	CaptureReader(const CaptureReader&) = delete;
+	CaptureReader& operator=(const CaptureReader&) = delete;
+
+	// maps :path: and indexes the frames, a frame cut off by a crash
+	// at the end of the file is ignored
+	// returns 0 on success or -1 on error
+	inline int Open(const std::string& path) {
+		m_frames.clear();
+		m_pos = 0;
+
+		if (m_file.OpenReadOnly(path))
+			return -1;
+
+		if (m_file.Size() < sizeof(CaptureFileHeader)) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		memcpy(&m_header, m_file.Data(), sizeof(m_header));
+		if (memcmp(m_header.magic, "LSCCAPT", 8)
+			|| m_header.version != CaptureWriter::VERSION
+			|| m_header.tag_size > sizeof(m_header.tag)) {
+			m_file.Close();
+			errno = EINVAL;
+			return -1;
+		}
+
+		size_t off = sizeof(CaptureFileHeader);
+		while (off + sizeof(CaptureRecordHeader) <= m_file.Size()) {
+			CaptureRecordHeader record;
+			memcpy(&record, m_file.Data() + off, sizeof(record));
+			off += sizeof(record);
+			if (off + record.size > m_file.Size())
+				break; // truncated
+
+			m_frames.push_back({record.timestamp_ns, m_file.Data() + off, record.size});
+			off += record.size;
+		}
+
+		return 0;
+	}
+
+	// returns the next frame in :frame:, false at the end of the capture
+	inline bool Next(CaptureFrame& frame) {
+		if (m_pos >= m_frames.size())
+			return false;
+
+		frame = m_frames[m_pos++];
+		return true;
+	}
+
+	// starts over from the first frame
+	inline void Rewind() {
+		m_pos = 0;
+	}
+
+	inline size_t GetFrameCount() const {
+		return m_frames.size();
+	}
+
+	inline const CaptureFrame& GetFrame(size_t index) const {
+		return m_frames[index];
+	}
+
+	inline const void* GetTag() const {
+		return m_header.tag;
+	}
+
+	inline size_t GetTagSize() const {
+		return m_header.tag_size;
+	}
+
+	inline int GetSockType() const {
+		return m_header.sock_type;
+	}
+
+private:
+	MappedFile m_file;
+	CaptureFileHeader m_header = {};
+	std::vector<CaptureFrame> m_frames;
+	size_t m_pos = 0;
+}; // class CaptureReader
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ReplayCapture - sends a capture back out through a socket
+///////////////////////////////////////////////////////////////////////////////
+
+
+// how ReplayCapture paces the frames
+enum EReplayMode {
+	EReplay_line_rate = 0, // as fast as the socket takes them
+	EReplay_original = 1 // with the gaps between the original receive timestamps
+};
+
+// sends every frame of :reader: (with its end tag put back on) through a
+// connected :soc:, starting from the current position of the reader
+// stream frames go out in batches at line rate, datagrams one at a time,
+// :speed: scales the original timing (2.0 replays twice as fast)
+// returns the number of frames sent or -1 on error (EINVAL if :speed: isn't
+// positive)
+template<int FAM, int TYP, int PROTO>
+inline int ReplayCapture(
+	CaptureReader& reader,
+	LSocket<FAM, TYP, PROTO>& soc,
+	EReplayMode mode = EReplay_line_rate,
+	double speed = 1.0
+) {
+	// also catches NaN
+	if (!(speed > 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	const void* tag = reader.GetTag();
+	size_t tag_size = reader.GetTagSize();
+
+	// two buffers per frame, payload and tag
+	liovec_t iov[LSC_IOV_MAX];
+	int iov_count = 0;
+	int sent = 0;
+
+	auto flush = [&]() -> int {
+		if (!iov_count)
+			return 0;
+
+		// a datagram socket sends it all in one go or fails
+		int res = TYP == SOCK_DGRAM
+			? soc.SendV(iov, iov_count, ESend_nosignal)
+			: soc.SendAllV(iov, iov_count, ESend_nosignal);
+		iov_count = 0;
+		return res < 0 ? -1 : 0;
+	};
+
+	uint64_t first_ts = 0;
+	auto start = std::chrono::steady_clock::now();
+
+	CaptureFrame frame;
+	while (reader.Next(frame)) {
+		if (mode == EReplay_original) {
+			if (!first_ts)
+				first_ts = frame.timestamp_ns;
+
+			uint64_t offset = frame.timestamp_ns > first_ts ? frame.timestamp_ns - first_ts : 0;
+			std::this_thread::sleep_until(start + std::chrono::nanoseconds((uint64_t)(offset / speed)));
+		}
+
+		set_iovec(iov[iov_count++], frame.data, frame.size);
+		set_iovec(iov[iov_count++], tag, tag_size);
+
+		// every datagram is a frame, and timed frames can't wait for a batch
+		if (TYP == SOCK_DGRAM || mode == EReplay_original || iov_count + 2 > LSC_IOV_MAX) {
+			if (flush())
+				return -1;
+		}
+
+		sent++;
+	}
+
+	if (flush())
+		return -1;
+
+	return sent;
+}
+
+#endif // #ifndef __LAZY_SOCKET_CAPTURE
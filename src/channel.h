@@ -0,0 +1,444 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// channel.h - sequenced datagram channel, reliable or latest-only per message
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+#ifndef __LAZY_SOCKET_CHANNEL
+#define __LAZY_SOCKET_CHANNEL
+
+// include parent header
+#include "lazy_sockets.h"
+
+
+// "LC" on the wire
+static constexpr uint16_t LSC_CHANNEL_MAGIC = 0x434c;
+
+// how a message is delivered, picked per message
+enum EChannelMode: uint8_t {
+	EChannel_latest = 1, // unreliable, anything older than what already arrived is dropped
+	EChannel_reliable = 2 // retransmitted until acked, delivered once and in order
+};
+
+// in front of every datagram of a channel, a datagram is a header and
+// at most LSC_CHANNEL_MAX_PAYLOAD bytes of one message
+#pragma pack(push, 1)
+struct ChannelHeader {
+	uint16_t magic; // LSC_CHANNEL_MAGIC
+	uint8_t kind; // EChannelMode, or 0 for a bare ack
+	uint8_t reserved;
+	uint32_t seq; // per mode sequence number, starts at 1
+	uint32_t ack; // next reliable seq the sender expects, every earlier one arrived
+	uint32_t sack; // bit i set if reliable seq ack + 1 + i arrived too
+};
+#pragma pack(pop)
+
+// plain copy of the counters of a DatagramChannel
+struct ChannelStats {
+	uint64_t sent; // datagrams sent, acks included
+	uint64_t resent; // reliable messages sent again
+	uint64_t received; // valid datagrams received
+	uint64_t acked; // reliable messages the peer acked
+	uint64_t duplicates; // reliable messages received more than once
+	uint64_t stale; // latest messages dropped for being older than the newest
+	uint64_t malformed; // datagrams that weren't channel datagrams
+	uint64_t srtt_ns; // smoothed round trip
+	uint64_t rto_ns; // current retransmit timeout
+	uint32_t in_flight; // reliable messages not acked yet
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// DatagramChannel - sequencing, selective acks and retransmits over datagrams
+///////////////////////////////////////////////////////////////////////////////
+
+// one end of a channel to one peer, it doesn't own a socket, datagrams go
+// out through a send function and come in through OnDatagram(), see
+// ChannelSendTo() and PumpChannel() for running it over an LSocket
+//
+// EChannel_latest messages are for state that is replaced by the next
+// message anyway, e.g. poses, they are never retransmitted and never wait
+// for anything, a late one is dropped instead of delivered out of order
+//
+// EChannel_reliable messages are for control traffic, up to
+// LSC_CHANNEL_WINDOW of them can be in flight, every datagram carries the
+// cumulative ack and a selective ack bitmap of the 32 seqs after it, so a
+// lost datagram is resent once the peer shows it got later ones, or after
+// the retransmit timeout, whichever is first, and one loss doesn't hold up
+// latest messages behind it like it would on a stream
+//
+// not thread safe, one thread sends, feeds datagrams and calls Update()
+class DatagramChannel {
+public:
+	// sends one datagram, returns the number of bytes sent or -1 on error
+	using send_t = std::function<int(const void*, size_t)>;
+
+	inline explicit DatagramChannel(send_t send): m_send(std::move(send)) {
+		m_slots.resize(LSC_CHANNEL_WINDOW);
+	}
+
+	// no moving/coping this object, the send function may hold on to it
+	DatagramChannel(const DatagramChannel&) = delete;
+	DatagramChannel& operator=(const DatagramChannel&) = delete;
+
+	// sends a message of :len: bytes with :mode:
+	// returns 0 on success or -1 on error (EMSGSIZE if :len: is over
+	// LSC_CHANNEL_MAX_PAYLOAD, EAGAIN if LSC_CHANNEL_WINDOW reliable
+	// messages are in flight already, or whatever the send function failed
+	// with, a reliable message is still resent after a send error)
+	inline int Send(const void* data, size_t len, EChannelMode mode) {
+		if (len > LSC_CHANNEL_MAX_PAYLOAD || (mode != EChannel_latest && mode != EChannel_reliable)) {
+			errno = len > LSC_CHANNEL_MAX_PAYLOAD ? EMSGSIZE : EINVAL;
+			return -1;
+		}
+
+		if (mode == EChannel_latest)
+			return send_datagram(EChannel_latest, m_next_latest++, data, len);
+
+		if (m_pending.size() >= LSC_CHANNEL_WINDOW) {
+			errno = EAGAIN;
+			return -1;
+		}
+
+		Pending msg;
+		msg.seq = m_next_reliable++;
+		msg.data.assign((const char*)data, len);
+		msg.sent_ns = get_time_ns();
+		m_pending.push_back(std::move(msg));
+
+		const Pending& back = m_pending.back();
+		return send_datagram(EChannel_reliable, back.seq, back.data.data(), back.data.size());
+	}
+
+	inline int Send(const std::string& data, EChannelMode mode) {
+		return Send(data.data(), data.size(), mode);
+	}
+
+	// takes a datagram received from the peer at :now_ns:
+	// returns false if it isn't a channel datagram
+	inline bool OnDatagram(const void* data, size_t len, uint64_t now_ns) {
+		ChannelHeader header;
+		if (len < sizeof(header)) {
+			m_stats.malformed++;
+			return false;
+		}
+
+		memcpy(&header, data, sizeof(header));
+		if (header.magic != LSC_CHANNEL_MAGIC || header.kind > EChannel_reliable) {
+			m_stats.malformed++;
+			return false;
+		}
+
+		m_stats.received++;
+		on_ack(header.ack, header.sack, now_ns);
+
+		const char* payload = (const char*)data + sizeof(header);
+		size_t payload_len = len - sizeof(header);
+		if (header.kind == EChannel_latest) {
+			if (m_has_latest && (int32_t)(header.seq - m_last_latest) <= 0) {
+				m_stats.stale++;
+				return true;
+			}
+
+			m_has_latest = true;
+			m_last_latest = header.seq;
+			m_inbox.push_back({EChannel_latest, std::string(payload, payload_len)});
+		} else if (header.kind == EChannel_reliable) {
+			on_reliable(header.seq, payload, payload_len);
+		}
+
+		return true;
+	}
+
+	// pops the next delivered message into :out: and its :mode:
+	// returns false if there is none
+	inline bool Receive(std::string& out, EChannelMode& mode) {
+		if (m_inbox.empty())
+			return false;
+
+		out.swap(m_inbox.front().data);
+		mode = m_inbox.front().mode;
+		m_inbox.pop_front();
+		return true;
+	}
+
+	// resends reliable messages that timed out and acks what arrived since
+	// the last datagram went out, call it every few ms and after feeding
+	// datagrams
+	// returns 0 on success or -1 on error (ETIMEDOUT if a message went
+	// unacked LSC_CHANNEL_MAX_RETRIES times, the peer is gone)
+	inline int Update(uint64_t now_ns) {
+		for (Pending& msg : m_pending) {
+			if (msg.acked)
+				continue;
+
+			uint64_t timeout = std::min(m_rto_ns << std::min(msg.retries, 6u), (uint64_t)LSC_CHANNEL_MAX_RTO);
+			if (now_ns - msg.sent_ns < timeout)
+				continue;
+
+			if (msg.retries >= LSC_CHANNEL_MAX_RETRIES) {
+				errno = ETIMEDOUT;
+				return -1;
+			}
+
+			if (resend(msg, now_ns))
+				return -1;
+		}
+
+		if (m_ack_due)
+			return send_datagram(0, 0, nullptr, 0) < 0 ? -1 : 0;
+
+		return 0;
+	}
+
+	// reliable messages sent but not acked yet
+	inline size_t GetInFlight() const {
+		return m_pending.size();
+	}
+
+	inline ChannelStats GetStats() const {
+		ChannelStats out = m_stats;
+		out.srtt_ns = m_srtt_ns;
+		out.rto_ns = m_rto_ns;
+		out.in_flight = (uint32_t)m_pending.size();
+		return out;
+	}
+
+private:
+	struct Pending {
+		uint32_t seq;
+		std::string data;
+		uint64_t sent_ns;
+		uint32_t retries = 0;
+		bool acked = false;
+	};
+
+	struct Message {
+		EChannelMode mode;
+		std::string data;
+	};
+
+	// a reliable message from the peer, out of order ones wait in m_slots
+	inline void on_reliable(uint32_t seq, const char* payload, size_t len) {
+		m_ack_due = true;
+		uint32_t ahead = seq - m_expected;
+		if ((int32_t)ahead < 0) {
+			m_stats.duplicates++;
+			return;
+		}
+		if (ahead >= LSC_CHANNEL_WINDOW)
+			return; // the peer doesn't send this far ahead, junk
+
+		Slot& slot = m_slots[seq % LSC_CHANNEL_WINDOW];
+		if (slot.present) {
+			m_stats.duplicates++;
+			return;
+		}
+
+		slot.present = true;
+		slot.data.assign(payload, len);
+		while (m_slots[m_expected % LSC_CHANNEL_WINDOW].present) {
+			Slot& next = m_slots[m_expected % LSC_CHANNEL_WINDOW];
+			m_inbox.push_back({EChannel_reliable, std::move(next.data)});
+			next.present = false;
+			next.data.clear();
+			m_expected++;
+		}
+	}
+
+	// what the peer says it got of ours
+	inline void on_ack(uint32_t ack, uint32_t sack, uint64_t now_ns) {
+		uint32_t highest = ack; // one past the highest seq the peer has
+		for (uint32_t i=0; i < 32; i++)
+			if ((sack >> i) & 1)
+				highest = ack + 2 + i;
+
+		for (Pending& msg : m_pending) {
+			uint32_t past = msg.seq - ack;
+			bool got = (int32_t)past < 0 || (past >= 1 && past <= 32 && (sack >> (past - 1)) & 1);
+			if (got && !msg.acked) {
+				msg.acked = true;
+				m_stats.acked++;
+				if (!msg.retries) // karn, a resent message's round trip is ambiguous
+					on_rtt(now_ns - msg.sent_ns);
+			}
+		}
+
+		while (!m_pending.empty() && m_pending.front().acked)
+			m_pending.pop_front();
+
+		// later ones made it, this one most likely didn't, don't wait for
+		// the timeout, at most once per round trip
+		for (Pending& msg : m_pending) {
+			if ((int32_t)(msg.seq - highest) >= 0)
+				break;
+			if (!msg.acked && now_ns - msg.sent_ns >= (m_has_rtt ? m_srtt_ns : m_rto_ns))
+				resend(msg, now_ns);
+		}
+	}
+
+	// rfc 6298 style smoothing
+	inline void on_rtt(uint64_t rtt_ns) {
+		if (!m_has_rtt) {
+			m_has_rtt = true;
+			m_srtt_ns = rtt_ns;
+			m_rttvar_ns = rtt_ns / 2;
+		} else {
+			uint64_t diff = rtt_ns > m_srtt_ns ? rtt_ns - m_srtt_ns : m_srtt_ns - rtt_ns;
+			m_rttvar_ns = (3 * m_rttvar_ns + diff) / 4;
+			m_srtt_ns = (7 * m_srtt_ns + rtt_ns) / 8;
+		}
+
+		m_rto_ns = m_srtt_ns + 4 * m_rttvar_ns;
+		m_rto_ns = std::min(std::max(m_rto_ns, (uint64_t)LSC_CHANNEL_MIN_RTO), (uint64_t)LSC_CHANNEL_MAX_RTO);
+	}
+
+	inline int resend(Pending& msg, uint64_t now_ns) {
+		msg.retries++;
+		msg.sent_ns = now_ns;
+		m_stats.resent++;
+		return send_datagram(EChannel_reliable, msg.seq, msg.data.data(), msg.data.size()) < 0 ? -1 : 0;
+	}
+
+	// cumulative ack and bitmap of what arrived after it
+	inline uint32_t make_sack() const {
+		uint32_t sack = 0;
+		for (uint32_t i=0; i < 32 && i + 1 < LSC_CHANNEL_WINDOW; i++)
+			if (m_slots[(m_expected + 1 + i) % LSC_CHANNEL_WINDOW].present)
+				sack |= 1u << i;
+		return sack;
+	}
+
+	// a full datagram, every one of them carries the acks, so a lost
+	// datagram that can't be resent yet doesn't fail the message
+	inline int send_datagram(uint8_t kind, uint32_t seq, const void* payload, size_t len) {
+		ChannelHeader header = {LSC_CHANNEL_MAGIC, kind, 0, seq, m_expected, make_sack()};
+		memcpy(m_scratch, &header, sizeof(header));
+		if (len)
+			memcpy(m_scratch + sizeof(header), payload, len);
+
+		m_ack_due = false;
+		m_stats.sent++;
+		int res = m_send(m_scratch, sizeof(header) + len);
+		if (res >= 0)
+			return 0;
+
+		// a full socket buffer or a peer that isn't up (yet) is just
+		// another lost datagram
+		int err = lerrno;
+		return err == LSOCK_WOULDBLOCK || err == LSOCK_NOBUFS || err == LSOCK_CONNREFUSED ? 0 : -1;
+	}
+
+	struct Slot {
+		bool present = false;
+		std::string data;
+	};
+
+	send_t m_send;
+	char m_scratch[sizeof(ChannelHeader) + LSC_CHANNEL_MAX_PAYLOAD];
+	static_assert(sizeof(ChannelHeader) + LSC_CHANNEL_MAX_PAYLOAD <= LSC_MAX_DATAGRAM, "channel datagrams have to fit LSC_MAX_DATAGRAM");
+
+	// sending side
+	uint32_t m_next_latest = 1;
+	uint32_t m_next_reliable = 1;
+	std::deque<Pending> m_pending; // by seq
+	bool m_has_rtt = false;
+	uint64_t m_srtt_ns = 0;
+	uint64_t m_rttvar_ns = 0;
+	uint64_t m_rto_ns = LSC_CHANNEL_INITIAL_RTO;
+
+	// receiving side
+	uint32_t m_expected = 1;
+	std::vector<Slot> m_slots; // reliable messages by seq % LSC_CHANNEL_WINDOW
+	bool m_has_latest = false;
+	uint32_t m_last_latest = 0;
+	bool m_ack_due = false;
+	std::deque<Message> m_inbox;
+
+	ChannelStats m_stats = {};
+}; // class DatagramChannel
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Running a channel over a socket
+///////////////////////////////////////////////////////////////////////////////
+
+// a send function that SendTo()s :peer: on :soc:, for unconnected datagram
+// sockets talking to more than one peer
+template<int FAM, int TYP, int PROTO>
+inline DatagramChannel::send_t ChannelSendTo(std::shared_ptr<LSocket<FAM, TYP, PROTO>> soc, lcsockaddr_in peer) {
+	static_assert(TYP == SOCK_DGRAM, "channels are made of datagrams");
+	return [soc, peer](const void* data, size_t len) mutable {
+		return soc->SendTo(data, len, peer, sizeof(peer), ESend_nowait);
+	};
+}
+
+// same with Send() on a connected socket
+template<int FAM, int TYP, int PROTO>
+inline DatagramChannel::send_t ChannelSend(std::shared_ptr<LSocket<FAM, TYP, PROTO>> soc) {
+	static_assert(TYP == SOCK_DGRAM, "channels are made of datagrams");
+	return [soc](const void* data, size_t len) {
+		return soc->Send(data, len, ESend_nowait);
+	};
+}
+
+// waits up to :timeout_ms: for datagrams on :soc: and calls :on_datagram:
+// (const void*, size_t) for every one that is there, with :peer: only for
+// datagrams from that address (RecvFrom), without it for all (Recv)
+// an icmp port unreachable for something we sent earlier is skipped
+// returns the number of datagrams taken or -1 on error
+template<int FAM, int TYP, int PROTO, typename F>
+inline int recv_datagrams(LSocket<FAM, TYP, PROTO>& soc, int timeout_ms, const lcsockaddr_in* peer, F&& on_datagram) {
+	static_assert(TYP == SOCK_DGRAM, "only datagrams here");
+
+	char buff[LSC_MAX_DATAGRAM];
+	int taken = 0;
+	for (bool first = true;; first = false) {
+		// ERecv_nowait is 0 on windows, so every receive is polled for
+		// first and only the first poll may wait
+		int res = soc.Poll(EPoll_in, first ? timeout_ms : 0);
+		if (res < 0)
+			return -1;
+		if (res == 0)
+			break;
+
+		lcsockaddr_in from;
+		size_t from_size = sizeof(from);
+		int len = peer ? soc.RecvFrom(buff, sizeof(buff), from, from_size, ERecv_nowait) : soc.Recv(buff, sizeof(buff), ERecv_nowait);
+		if (len < 0) {
+			int err = lerrno;
+			if (err == LSOCK_WOULDBLOCK)
+				break;
+			if (err == LSOCK_CONNREFUSED)
+				continue; // one of ours didn't make it, the peer isn't up
+			return -1;
+		}
+
+		if (peer && (from.sin_addr.s_addr != peer->sin_addr.s_addr || from.sin_port != peer->sin_port))
+			continue;
+
+		on_datagram((const void*)buff, (size_t)len);
+		taken++;
+	}
+
+	return taken;
+}
+
+// waits up to :timeout_ms: for datagrams on :soc:, feeds all that are
+// there to :chan: and calls its Update(), :peer: same as in recv_datagrams()
+// returns the number of datagrams taken or -1 on error
+template<int FAM, int TYP, int PROTO>
+inline int PumpChannel(LSocket<FAM, TYP, PROTO>& soc, DatagramChannel& chan, int timeout_ms, const lcsockaddr_in* peer = nullptr) {
+	int taken = recv_datagrams(soc, timeout_ms, peer, [&chan](const void* data, size_t len) {
+		chan.OnDatagram(data, len, get_time_ns());
+	});
+	if (taken < 0)
+		return -1;
+
+	if (chan.Update(get_time_ns()))
+		return -1;
+
+	return taken;
+}
+
+#endif // #ifndef __LAZY_SOCKET_CHANNEL
@@ -0,0 +1,324 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// clock_sync.h - ping pong clock offset and drift estimation between peers
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+#ifndef __LAZY_SOCKET_CLOCK_SYNC
+#define __LAZY_SOCKET_CLOCK_SYNC
+
+// include parent header
+#include "lazy_sockets.h"
+
+
+// "LCKS" on the wire
+static constexpr uint32_t LSC_CLOCK_SYNC_MAGIC = 0x534b434c;
+
+// one ping pong, ntp style, every time is get_time_ns() of the side that
+// took it, the requester fills in t1, the responder t2 and t3
+#pragma pack(push, 1)
+struct ClockSyncMsg {
+	uint32_t magic; // LSC_CLOCK_SYNC_MAGIC
+	uint32_t seq;
+	uint64_t t1; // request sent, requester clock
+	uint64_t t2; // request received, responder clock
+	uint64_t t3; // reply sent, responder clock
+};
+#pragma pack(pop)
+
+// responder side, turns the request in :msg:, received at :recv_ns:,
+// into its reply, t3 is taken right here so send it right away
+// returns false if :msg: isn't a clock sync request
+inline bool AnswerClockSync(ClockSyncMsg& msg, uint64_t recv_ns) {
+	if (msg.magic != LSC_CLOCK_SYNC_MAGIC || msg.t2 || msg.t3)
+		return false;
+
+	msg.t2 = recv_ns;
+	msg.t3 = get_time_ns();
+	return true;
+}
+
+// remote clock = local clock + offset_ns + drift * (local clock - ref_ns)
+struct ClockEstimate {
+	uint64_t ref_ns; // local time the estimate is centered on
+	int64_t offset_ns; // remote - local at ref_ns
+	double drift; // remote ns gained per local ns, 1e-6 is 1 ppm
+	uint64_t rtt_ns; // shortest round trip in the window
+	uint32_t samples; // samples the estimate is based on
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ClockSync - offset/drift estimator for one remote clock
+///////////////////////////////////////////////////////////////////////////////
+
+// keeps the last :window: ping pongs, a ping pong that sat in a queue
+// somewhere has a long round trip and an offset that is off by up to
+// half of the extra time, so only the ones within 25% of the shortest
+// round trip are used, once those span LSC_CLOCK_SYNC_DRIFT_SPAN of local
+// time a line is fit through them for the drift, before that it's 0
+//
+// requests, replies and samples have to come from a single thread,
+// the estimate and the conversions can be read from any thread,
+// they never wait on that thread
+class ClockSync {
+public:
+	inline explicit ClockSync(size_t window = 64): m_window(window ? window : 1) {}
+
+	// no moving/coping this object, the threads hold on to it
+	ClockSync(const ClockSync&) = delete;
+	ClockSync& operator=(const ClockSync&) = delete;
+
+	// fills in a new request, send it right away
+	inline void MakeRequest(ClockSyncMsg& msg) {
+		msg.magic = LSC_CLOCK_SYNC_MAGIC;
+		msg.seq = ++m_seq;
+		msg.t2 = 0;
+		msg.t3 = 0;
+		msg.t1 = get_time_ns();
+	}
+
+	// takes the reply :msg:, received at :recv_ns:, as a sample
+	// returns false if it isn't a reply to a request of ours or a reply to
+	// an older request than the last one taken (a late duplicate)
+	inline bool OnReply(const ClockSyncMsg& msg, uint64_t recv_ns) {
+		if (msg.magic != LSC_CLOCK_SYNC_MAGIC || !msg.t2 || !msg.seq)
+			return false;
+		if (msg.seq > m_seq || msg.seq <= m_last_reply)
+			return false;
+		if (recv_ns < msg.t1 || msg.t3 < msg.t2)
+			return false;
+
+		m_last_reply = msg.seq;
+		AddSample(msg.t1, msg.t2, msg.t3, recv_ns);
+		return true;
+	}
+
+	// takes a ping pong that was sent at :t1:, received by the remote at
+	// :t2:, answered at :t3: and the answer was received at :t4:
+	inline void AddSample(uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4) {
+		Sample sample;
+		sample.local_ns = t1 + (t4 - t1) / 2;
+		sample.offset_ns = ((int64_t)(t2 - t1) + (int64_t)(t3 - t4)) / 2;
+		sample.rtt_ns = (t4 - t1) - std::min(t4 - t1, t3 - t2);
+
+		if (m_samples.size() < m_window)
+			m_samples.push_back(sample);
+		else
+			m_samples[m_next % m_window] = sample;
+		m_next++;
+
+		update_estimate();
+	}
+
+	// copies the current estimate into :out:, returns false if there's none yet
+	inline bool GetEstimate(ClockEstimate& out) const {
+		return m_estimate.Latest(out);
+	}
+
+	inline bool IsSynced() const {
+		return m_estimate.Count() > 0;
+	}
+
+	// :remote_ns: on the remote clock as local get_time_ns() time,
+	// unchanged if there is no estimate yet
+	inline uint64_t RemoteToLocal(uint64_t remote_ns) const {
+		ClockEstimate est;
+		if (!m_estimate.Latest(est))
+			return remote_ns;
+
+		double since_ref = (double)((int64_t)(remote_ns - est.ref_ns) - est.offset_ns) / (1.0 + est.drift);
+		return est.ref_ns + (int64_t)std::llround(since_ref);
+	}
+
+	// the reverse of RemoteToLocal()
+	inline uint64_t LocalToRemote(uint64_t local_ns) const {
+		ClockEstimate est;
+		if (!m_estimate.Latest(est))
+			return local_ns;
+
+		double since_ref = (double)(int64_t)(local_ns - est.ref_ns);
+		return local_ns + est.offset_ns + (int64_t)std::llround(since_ref * est.drift);
+	}
+
+private:
+	struct Sample {
+		uint64_t local_ns; // local time halfway through the ping pong
+		int64_t offset_ns; // remote - local
+		uint64_t rtt_ns; // round trip minus the time the remote held it
+	};
+
+	inline void update_estimate() {
+		ClockEstimate est = {};
+		est.rtt_ns = UINT64_MAX;
+		for (const Sample& s : m_samples)
+			est.rtt_ns = std::min(est.rtt_ns, s.rtt_ns);
+
+		// only the ones about as quick as the quickest
+		uint64_t limit = est.rtt_ns + est.rtt_ns / 4;
+		m_best.clear();
+		uint64_t first = UINT64_MAX, last = 0;
+		for (const Sample& s : m_samples) {
+			if (s.rtt_ns > limit)
+				continue;
+
+			m_best.push_back(s);
+			first = std::min(first, s.local_ns);
+			last = std::max(last, s.local_ns);
+		}
+		size_t keep = m_best.size();
+		est.samples = (uint32_t)keep;
+
+		// everything relative to the first sample, keeps the doubles small
+		double mean_t = 0, mean_off = 0;
+		for (const Sample& s : m_best) {
+			mean_t += (double)(s.local_ns - first);
+			mean_off += (double)s.offset_ns;
+		}
+		mean_t /= keep;
+		mean_off /= keep;
+
+		est.ref_ns = first + (uint64_t)std::llround(mean_t);
+		est.offset_ns = (int64_t)std::llround(mean_off);
+
+		// least squares line through the offsets, once they are far
+		// enough apart for the slope to mean anything
+		if (keep >= 2 && last - first >= (uint64_t)LSC_CLOCK_SYNC_DRIFT_SPAN) {
+			double cov = 0, var = 0;
+			for (const Sample& s : m_best) {
+				double dt = (double)(s.local_ns - first) - mean_t;
+				cov += dt * ((double)s.offset_ns - mean_off);
+				var += dt * dt;
+			}
+
+			est.drift = cov / var;
+		}
+
+		m_estimate.Push(est);
+	}
+
+	size_t m_window;
+	std::vector<Sample> m_samples;
+	std::vector<Sample> m_best; // scratch, reused
+	size_t m_next = 0;
+	uint32_t m_seq = 0;
+	uint32_t m_last_reply = 0;
+
+	SeqlockRing<ClockEstimate> m_estimate{1};
+}; // class ClockSync
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Running clock sync over a connection
+///////////////////////////////////////////////////////////////////////////////
+
+// these take over the socket while they run, use a connection dedicated to
+// clock sync or run them before the regular traffic starts
+// datagram sockets have to be connected
+
+// receives exactly one ClockSyncMsg into :msg:, waiting up to :timeout_ms:
+// (-1 for forever) for it to start and finish, :recv_ns: is when it was complete
+// a signal restarts the wait, what was already read is kept
+// returns 1 on success, 0 on timeout or -1 on error (ECONNRESET on a closed
+// connection or an empty datagram)
+template<int FAM, int TYP, int PROTO>
+inline int recv_clock_sync_msg(LSocket<FAM, TYP, PROTO>& soc, ClockSyncMsg& msg, uint64_t& recv_ns, int timeout_ms) {
+	size_t got = 0;
+	while (got < sizeof(msg)) {
+		int res = soc.Poll(EPoll_in, timeout_ms);
+		if (res < 0 && lerrno == LSOCK_EINTR)
+			continue;
+		if (res < 0)
+			return -1;
+		if (res == 0 && got) {
+			// half a message, the stream can't be trusted anymore
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		if (res == 0)
+			return 0;
+
+		// an empty datagram is how a datagram peer says it's done
+		res = soc.Recv((char*)&msg + got, sizeof(msg) - got);
+		if (res < 0 && lerrno == LSOCK_EINTR)
+			continue;
+		if (res < 0)
+			return -1;
+		if (res == 0) {
+			errno = ECONNRESET;
+			return -1;
+		}
+
+		got += res;
+		if (TYP == SOCK_DGRAM && got != sizeof(msg))
+			got = 0; // not one of ours, wait for the next one
+	}
+
+	recv_ns = get_time_ns();
+	return 1;
+}
+
+// answers clock sync requests on :soc: until the peer closes it
+// requests that aren't clock sync messages are dropped
+// returns 0 once the peer closed the connection or -1 on error
+template<int FAM, int TYP, int PROTO>
+inline int ServeClockSync(LSocket<FAM, TYP, PROTO>& soc) {
+	while (true) {
+		ClockSyncMsg msg{};
+		uint64_t recv_ns = 0;
+		int res = recv_clock_sync_msg(soc, msg, recv_ns, -1);
+		if (res < 0)
+			return errno == ECONNRESET ? 0 : -1;
+		if (res == 0)
+			continue; // a poll that came back early, nothing was read
+
+		if (!AnswerClockSync(msg, recv_ns))
+			continue;
+
+		if (soc.Send(&msg, sizeof(msg), ESend_nosignal) != (int)sizeof(msg))
+			return -1;
+	}
+}
+
+// does :rounds: ping pongs with a ServeClockSync() peer over :soc:,
+// waiting up to :timeout_ms: for each reply, a reply that doesn't come in
+// time is skipped, :sync: has to only be fed from this thread meanwhile
+// returns the number of samples taken or -1 on error
+template<int FAM, int TYP, int PROTO>
+inline int RunClockSync(LSocket<FAM, TYP, PROTO>& soc, ClockSync& sync, int rounds, int timeout_ms = 100) {
+	int samples = 0;
+	for (int i=0; i < rounds; i++) {
+		ClockSyncMsg msg;
+		sync.MakeRequest(msg);
+		if (soc.Send(&msg, sizeof(msg), ESend_nosignal) != (int)sizeof(msg))
+			return -1;
+
+		// a late reply to an earlier round is still a sample (unless a newer
+		// one was already taken, see OnReply()), the round keeps waiting for
+		// its own reply until the deadline
+		auto deadline = get_time_ns() + (uint64_t)timeout_ms * 1000000;
+		while (true) {
+			uint64_t now = get_time_ns();
+			if (now >= deadline)
+				break;
+
+			ClockSyncMsg reply{};
+			uint64_t recv_ns = 0;
+			int res = recv_clock_sync_msg(soc, reply, recv_ns, (int)((deadline - now + 999999) / 1000000));
+			if (res < 0)
+				return -1;
+			if (res == 0)
+				break;
+
+			if (sync.OnReply(reply, recv_ns)) {
+				samples++;
+				if (reply.seq == msg.seq)
+					break;
+			}
+		}
+	}
+
+	return samples;
+}
+
+#endif // #ifndef __LAZY_SOCKET_CLOCK_SYNC
@@ -0,0 +1,162 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// codec.h - building blocks for compact wire formats
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+#ifndef __LAZY_SOCKET_CODEC
+#define __LAZY_SOCKET_CODEC
+
+// include parent header
+#include "lazy_sockets.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Fixed point
+////////////////////////////////////////////////////////////////////////////////
+
+// :value: in steps of 1 / :scale:, rounded to the nearest step,
+// saturates at the int32 range, NaN becomes 0
+inline int32_t QuantizeFixed(float value, float scale) {
+	double v = std::round((double)value * scale);
+	if (!(v == v))
+		return 0;
+	if (v > INT32_MAX)
+		return INT32_MAX;
+	if (v < INT32_MIN)
+		return INT32_MIN;
+	return (int32_t)v;
+}
+
+inline float DequantizeFixed(int32_t value, float scale) {
+	return (float)((double)value / scale);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Quaternions
+////////////////////////////////////////////////////////////////////////////////
+
+// smallest three encoding of the unit quaternion :q:
+// the largest component is dropped and rebuilt from the unit length on
+// decode, the other three are within +-1/sqrt(2) and are stored with :bits:
+// bits each (sign included), q and -q are the same rotation so the sign is
+// picked to make the dropped one positive
+// :out: gets the index of the dropped component followed by the three others
+inline void QuantizeQuat(const float q[4], int bits, int32_t out[4]) {
+	int largest = 0;
+	for (int i=1; i < 4; i++)
+		if (std::fabs(q[i]) > std::fabs(q[largest]))
+			largest = i;
+
+	float sign = q[largest] < 0 ? -1.0f : 1.0f;
+	float max = (float)((1 << (bits - 1)) - 1);
+	out[0] = largest;
+	for (int i=0, j=1; i < 4; i++) {
+		if (i == largest)
+			continue;
+
+		float v = std::round(q[i] * sign * 1.41421356f * max);
+		out[j++] = (int32_t)std::min(std::max(v, -max), max);
+	}
+}
+
+// the reverse of QuantizeQuat, the result has unit length
+// within the precision of :bits:
+inline void DequantizeQuat(const int32_t in[4], int bits, float q[4]) {
+	float max = (float)((1 << (bits - 1)) - 1);
+	int largest = in[0] & 3;
+	float sum = 0;
+	for (int i=0, j=1; i < 4; i++) {
+		if (i == largest)
+			continue;
+
+		q[i] = (float)in[j++] / (max * 1.41421356f);
+		sum += q[i] * q[i];
+	}
+
+	q[largest] = std::sqrt(std::max(0.0f, 1.0f - sum));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Varints
+////////////////////////////////////////////////////////////////////////////////
+
+// maps small negative and positive numbers to small unsigned ones,
+// 0, -1, 1, -2, ... become 0, 1, 2, 3, ...
+inline uint64_t ZigZag(int64_t value) {
+	return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+inline int64_t UnZigZag(uint64_t value) {
+	return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// appends :value: 7 bits per byte, low bits first,
+// the top bit of a byte is set when more follow
+inline void PutVarint(std::string& out, uint64_t value) {
+	while (value >= 0x80) {
+		out.push_back((char)(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back((char)value);
+}
+
+// reads a varint at :p:, not past :end:, and moves :p: past it
+// returns false on a truncated or overlong varint
+inline bool GetVarint(const char*& p, const char* end, uint64_t& value) {
+	value = 0;
+	for (int shift=0; shift < 64 && p < end; shift += 7) {
+		uint8_t byte = (uint8_t)*p++;
+		value |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+
+	return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Byte stuffing
+////////////////////////////////////////////////////////////////////////////////
+
+// escape byte for EscapeBytes, followed by the escaped byte xor 0x20
+static constexpr char LSC_ESCAPE_BYTE = 0x7d;
+
+// appends :data: to :out: so that :reserved: never shows up in it,
+// binary payloads go through this before getting an end tag that starts
+// with :reserved:, otherwise the payload could contain the tag itself
+// and a receiver would cut the frame short
+// :reserved: and LSC_ESCAPE_BYTE are sent as 2 bytes, everything else as is,
+// :reserved: can't be LSC_ESCAPE_BYTE or LSC_ESCAPE_BYTE ^ 0x20
+inline void EscapeBytes(const void* data, size_t len, char reserved, std::string& out) {
+	const char* p = (const char*)data;
+	out.reserve(out.size() + len + len / 16);
+	for (size_t i=0; i < len; i++) {
+		if (p[i] == reserved || p[i] == LSC_ESCAPE_BYTE) {
+			out.push_back(LSC_ESCAPE_BYTE);
+			out.push_back(p[i] ^ 0x20);
+		} else
+			out.push_back(p[i]);
+	}
+}
+
+// the reverse of EscapeBytes, appends the original bytes to :out:
+// returns false if :data: ends in the middle of an escape
+inline bool UnescapeBytes(const void* data, size_t len, std::string& out) {
+	const char* p = (const char*)data;
+	out.reserve(out.size() + len);
+	for (size_t i=0; i < len; i++) {
+		if (p[i] != LSC_ESCAPE_BYTE) {
+			out.push_back(p[i]);
+			continue;
+		}
+
+		if (++i == len)
+			return false;
+		out.push_back(p[i] ^ 0x20);
+	}
+
+	return true;
+}
+
+#endif // #ifndef __LAZY_SOCKET_CODEC
@@ -18,6 +18,83 @@
 #endif
 #endif
 
+// size used to keep data touched by different threads on separate cache lines
+#ifndef LSC_CACHE_LINE_SIZE
+#define LSC_CACHE_LINE_SIZE 64
+#endif
+
+// max number of buffers gathered into a single vectored send
+#ifndef LSC_IOV_MAX
+#define LSC_IOV_MAX 64
+#endif
+
+// bytes a bulk send lane of weight 1 gets per writer batch
+#ifndef LSC_SEND_QUANTUM
+#define LSC_SEND_QUANTUM 1024
+#endif
+
+// max bulk bytes a send loop writes in one batch, bounds realtime latency
+#ifndef LSC_SEND_BATCH_BYTES
+#define LSC_SEND_BATCH_BYTES (64 * 1024)
+#endif
+
+// local nanoseconds clock sync samples have to span before drift is estimated
+#ifndef LSC_CLOCK_SYNC_DRIFT_SPAN
+#define LSC_CLOCK_SYNC_DRIFT_SPAN 1000000000
+#endif
+
+// message ids of a MessageSchema and MessageRouter types have to be below
+// this, it's the longest dispatch jump table either may get
+#ifndef LSC_SCHEMA_MAX_ID
+#define LSC_SCHEMA_MAX_ID 4096
+#endif
+
+// receive buffer of the datagram pumps, longer datagrams are truncated
+#ifndef LSC_MAX_DATAGRAM
+#define LSC_MAX_DATAGRAM 2048
+#endif
+
+// reliable messages a DatagramChannel keeps in flight, also how far ahead
+// of the next expected one the receiving side buffers
+#ifndef LSC_CHANNEL_WINDOW
+#define LSC_CHANNEL_WINDOW 256
+#endif
+
+// biggest DatagramChannel message, keeps a datagram under a typical mtu
+#ifndef LSC_CHANNEL_MAX_PAYLOAD
+#define LSC_CHANNEL_MAX_PAYLOAD 1200
+#endif
+
+// DatagramChannel retransmit timeouts in nanoseconds, the initial one is
+// used until a round trip was measured
+#ifndef LSC_CHANNEL_INITIAL_RTO
+#define LSC_CHANNEL_INITIAL_RTO 100000000
+#endif
+
+#ifndef LSC_CHANNEL_MIN_RTO
+#define LSC_CHANNEL_MIN_RTO 5000000
+#endif
+
+#ifndef LSC_CHANNEL_MAX_RTO
+#define LSC_CHANNEL_MAX_RTO 1000000000
+#endif
+
+// times a reliable message is resent before the peer is taken to be gone
+#ifndef LSC_CHANNEL_MAX_RETRIES
+#define LSC_CHANNEL_MAX_RETRIES 20
+#endif
+
+// groups a FecDecoder keeps around for their late shards
+#ifndef LSC_FEC_GROUPS
+#define LSC_FEC_GROUPS 16
+#endif
+
+// sse2 is there on every x86-64, define LSC_NO_SIMD to use the plain versions
+#if !defined(LSC_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define LSC_SSE2
+#include <emmintrin.h>
+#endif
+
 // platform defined types
 #ifdef LINUX
 
@@ -25,14 +102,25 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <poll.h>
 #include <netdb.h>
 #include <errno.h>
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <cstring>
 #include <string>
 
+// kernel timestamping, only on actual linux
+#ifdef __linux__
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
+#endif
+
 namespace lsc {
 
 // pass through for the socket() call
@@ -42,10 +130,44 @@ namespace lsc {
 
 #define lerrno errno
 
+// error codes that need special handling
+#define LSOCK_EINTR EINTR
+#define LSOCK_WOULDBLOCK EWOULDBLOCK
+#define LSOCK_NOTSUPPORTED EOPNOTSUPP
+#define LSOCK_NOBUFS ENOBUFS
+// an icmp port unreachable coming back on a connected datagram socket
+#define LSOCK_CONNREFUSED ECONNREFUSED
+
+// not every unix has it, but then there's no SIGPIPE to worry about either
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// same for MSG_MORE, it's only a hint anyway
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
 typedef struct sockaddr_in lcsockaddr_in;
 
 typedef int lsocket_t;
 
+// scatter/gather buffer descriptor
+typedef struct iovec liovec_t;
+
+inline void set_iovec(liovec_t& iov, const void* base, size_t len) {
+	iov.iov_base = (void*)base;
+	iov.iov_len = len;
+}
+
+inline char* get_iovec_base(const liovec_t& iov) {
+	return (char*)iov.iov_base;
+}
+
+inline size_t get_iovec_len(const liovec_t& iov) {
+	return iov.iov_len;
+}
+
 inline std::string getString(int err){
 	return std::strerror(err);
 }
@@ -56,6 +178,7 @@ inline std::string getString(int err){
 
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <mstcpip.h>
 #include <stdio.h>
 #include <windows.h>
 #include <string>
@@ -70,14 +193,43 @@ using socklen_t = int;
 
 // cuz on windows you can't have nice things
 #define MSG_DONTWAIT 0
+#define MSG_NOSIGNAL 0
+#define MSG_MORE 0
 #define LSOCK_ERR INVALID_SOCKET
 
 #define lerrno WSAGetLastError()
 
+// error codes that need special handling
+#define LSOCK_EINTR WSAEINTR
+#define LSOCK_WOULDBLOCK WSAEWOULDBLOCK
+#define LSOCK_NOTSUPPORTED WSAEOPNOTSUPP
+#define LSOCK_NOBUFS WSAENOBUFS
+// windows reports an icmp port unreachable as a reset, even for udp
+#define LSOCK_CONNREFUSED WSAECONNRESET
+
+// cuz on windows poll() is called something else
+#define poll WSAPoll
+
 typedef struct sockaddr_in lcsockaddr_in;
 
 typedef SOCKET lsocket_t;
 
+// scatter/gather buffer descriptor
+typedef WSABUF liovec_t;
+
+inline void set_iovec(liovec_t& iov, const void* base, size_t len) {
+	iov.buf = (char*)base;
+	iov.len = (ULONG)len;
+}
+
+inline char* get_iovec_base(const liovec_t& iov) {
+	return iov.buf;
+}
+
+inline size_t get_iovec_len(const liovec_t& iov) {
+	return iov.len;
+}
+
 static std::atomic<unsigned int>  __wsa_initialized_count = 0;
 
 // cuz on windows sockets require wsaStartup, call WSACleanup() yourself later, idc
@@ -0,0 +1,556 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// fec.h - forward error correction over groups of datagrams
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+#ifndef __LAZY_SOCKET_FEC
+#define __LAZY_SOCKET_FEC
+
+// include parent header
+#include "lazy_sockets.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+// GF(2^8) arithmetic
+////////////////////////////////////////////////////////////////////////////////
+
+// the field reed-solomon codes usually use, x^8 + x^4 + x^3 + x^2 + 1,
+// addition is xor, multiplication goes through log/exp tables
+struct GfTables {
+	uint8_t exp[512]; // doubled so exp[log a + log b] needs no modulo
+	uint8_t log[256];
+
+	GfTables() {
+		unsigned x = 1;
+		for (int i=0; i < 255; i++) {
+			exp[i] = (uint8_t)x;
+			log[x] = (uint8_t)i;
+			x <<= 1;
+			if (x & 0x100)
+				x ^= 0x11d;
+		}
+		for (int i=255; i < 512; i++)
+			exp[i] = exp[i - 255];
+		log[0] = 0; // never used
+	}
+};
+
+inline const GfTables& gf_tables() {
+	static const GfTables tables;
+	return tables;
+}
+
+inline uint8_t GfMul(uint8_t a, uint8_t b) {
+	if (!a || !b)
+		return 0;
+
+	const GfTables& t = gf_tables();
+	return t.exp[t.log[a] + t.log[b]];
+}
+
+// :a: has to be non zero
+inline uint8_t GfInv(uint8_t a) {
+	const GfTables& t = gf_tables();
+	return t.exp[255 - t.log[a]];
+}
+
+// dst[i] ^= :c: * src[i] for :len: bytes
+inline void GfMulAdd(uint8_t* dst, const uint8_t* src, uint8_t c, size_t len) {
+	if (!c)
+		return;
+
+	size_t i = 0;
+	if (c == 1) {
+		// plain xor, 8 bytes at a time
+		for (; i + 8 <= len; i += 8) {
+			uint64_t a, b;
+			memcpy(&a, dst + i, 8);
+			memcpy(&b, src + i, 8);
+			a ^= b;
+			memcpy(dst + i, &a, 8);
+		}
+		for (; i < len; i++)
+			dst[i] ^= src[i];
+		return;
+	}
+
+	// the row of the multiplication table for :c:, one lookup per byte
+	uint8_t row[256];
+	for (int v=0; v < 256; v++)
+		row[v] = GfMul(c, (uint8_t)v);
+	for (; i < len; i++)
+		dst[i] ^= row[src[i]];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Wire format and parameters
+////////////////////////////////////////////////////////////////////////////////
+
+// "LF" on the wire
+static constexpr uint16_t LSC_FEC_MAGIC = 0x464c;
+
+// in front of every datagram, data shards are the datagrams as they were
+// handed to the encoder, parity shards are sent after the last data shard
+// of their group
+#pragma pack(push, 1)
+struct FecHeader {
+	uint16_t magic; // LSC_FEC_MAGIC
+	uint8_t data_shards; // data shards in the group, only final in parity shards
+	uint8_t parity_shards;
+	uint32_t group;
+	uint8_t index; // 0 to data_shards - 1 for data, then parity
+	uint8_t reserved;
+};
+#pragma pack(pop)
+
+// the biggest datagram a FecEncoder takes
+static constexpr size_t k_fec_max_payload = LSC_MAX_DATAGRAM - sizeof(FecHeader) - sizeof(uint16_t);
+
+// :data_shards: datagrams get :parity_shards: extra ones, any :parity_shards:
+// of the group can be lost and all data shards are still there, the
+// overhead is parity_shards / data_shards, a group is also the longest a
+// lost datagram waits for its parity
+//   1 parity shard - xor, cheap, for random single losses
+//   more - reed-solomon, for bursts
+struct FecParams {
+	uint8_t data_shards = 8;
+	uint8_t parity_shards = 1;
+
+	// fewest parity shards for groups of :data_shards: so that at
+	// :loss: (0 to 1) independent loss per datagram at most :residual: of
+	// the groups lose more than they can rebuild, capped at :max_overhead:
+	// parity per data shard
+	static inline FecParams ForLoss(double loss, uint8_t data_shards = 8, double residual = 1e-3, double max_overhead = 1.0) {
+		FecParams out;
+		out.data_shards = std::min(std::max(data_shards, (uint8_t)1), (uint8_t)254);
+		int max_parity = std::min((int)(out.data_shards * max_overhead), 255 - out.data_shards);
+		max_parity = std::max(max_parity, 1);
+
+		for (int m=1; m <= max_parity; m++) {
+			out.parity_shards = (uint8_t)m;
+			int n = out.data_shards + m;
+
+			// chance more than m of n are lost
+			double fail = 0;
+			for (int lost=m + 1; lost <= n; lost++) {
+				double ways = 1;
+				for (int i=0; i < lost; i++)
+					ways = ways * (n - i) / (i + 1);
+				fail += ways * std::pow(loss, lost) * std::pow(1 - loss, n - lost);
+			}
+			if (fail <= residual)
+				break;
+		}
+
+		return out;
+	}
+
+	// coefficient of data shard :i: in parity shard :j:, a cauchy matrix
+	// scaled so parity shard 0 is the xor of the data, any square piece of
+	// it is invertible, which is what makes any :parity_shards: losses ok
+	static inline uint8_t Coefficient(uint8_t parity_shards, uint8_t j, uint8_t i) {
+		uint8_t y = (uint8_t)(parity_shards + i);
+		return GfMul(y, GfInv((uint8_t)(j ^ y)));
+	}
+};
+
+// plain copy of the counters of a FecDecoder
+struct FecStats {
+	uint64_t received; // valid datagrams, data and parity
+	uint64_t delivered; // data shards handed out, recovered ones included
+	uint64_t recovered; // data shards rebuilt from parity
+	uint64_t lost; // data shards that were gone for good
+	uint64_t duplicates;
+	uint64_t late; // for groups that were pushed out already
+	uint64_t malformed;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// FecEncoder - datagrams out, parity after every group
+///////////////////////////////////////////////////////////////////////////////
+
+// data shards go out right away, nothing waits for the group to fill up,
+// the parity shards go out right after the last one, call Flush() when
+// the stream pauses so a partial group gets its parity too
+//
+// the send function is the same as for a DatagramChannel, e.g. from
+// ChannelSendTo(), not thread safe
+class FecEncoder {
+public:
+	using send_t = DatagramChannel::send_t;
+
+	// :params: is clamped to at least 1 data and 1 parity shard and at
+	// most 255 shards in total
+	inline FecEncoder(const FecParams& params, send_t send): m_send(std::move(send)) {
+		SetParams(params);
+	}
+
+	// takes effect with the next group
+	inline void SetParams(const FecParams& params) {
+		m_next_params.data_shards = std::min(std::max(params.data_shards, (uint8_t)1), (uint8_t)254);
+		m_next_params.parity_shards = (uint8_t)std::min(std::max((int)params.parity_shards, 1), 255 - m_next_params.data_shards);
+		if (m_shards.empty())
+			m_params = m_next_params;
+	}
+
+	inline const FecParams& GetParams() const {
+		return m_next_params;
+	}
+
+	// sends :data: as the next data shard
+	// returns 0 on success or -1 on error (EMSGSIZE if :len: is over
+	// k_fec_max_payload, or whatever the send function failed with)
+	inline int Send(const void* data, size_t len) {
+		if (len > k_fec_max_payload) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+
+		// kept with its length in front, padded to the longest in the
+		// group once the parity is made, so the length is rebuilt too
+		m_shards.emplace_back();
+		std::string& shard = m_shards.back();
+		uint16_t size = (uint16_t)len;
+		shard.append((const char*)&size, sizeof(size));
+		shard.append((const char*)data, len);
+
+		FecHeader header = make_header((uint8_t)(m_shards.size() - 1));
+		int res = send_shard(header, data, len);
+
+		// a failed send is a lost datagram, the group still gets its parity
+		if (m_shards.size() >= m_params.data_shards && Flush())
+			return -1;
+
+		return res;
+	}
+
+	inline int Send(const std::string& data) {
+		return Send(data.data(), data.size());
+	}
+
+	// sends the parity of the current group, even if it isn't full, and
+	// starts the next one, no-op without pending data shards
+	// returns 0 on success or -1 on error
+	inline int Flush() {
+		if (m_shards.empty())
+			return 0;
+
+		size_t size = 0;
+		for (const std::string& shard : m_shards)
+			size = std::max(size, shard.size());
+
+		uint8_t count = (uint8_t)m_shards.size();
+		int res = 0;
+		for (uint8_t j=0; j < m_params.parity_shards; j++) {
+			m_parity.assign(size, '\0');
+			for (uint8_t i=0; i < count; i++)
+				GfMulAdd((uint8_t*)&m_parity[0], (const uint8_t*)m_shards[i].data(), FecParams::Coefficient(m_params.parity_shards, j, i), m_shards[i].size());
+
+			FecHeader header = make_header((uint8_t)(count + j));
+			header.data_shards = count;
+			if (send_shard(header, m_parity.data(), m_parity.size()))
+				res = -1;
+		}
+
+		m_shards.clear();
+		m_group++;
+		m_params = m_next_params;
+		return res;
+	}
+
+private:
+	inline FecHeader make_header(uint8_t index) const {
+		return {LSC_FEC_MAGIC, m_params.data_shards, m_params.parity_shards, m_group, index, 0};
+	}
+
+	inline int send_shard(const FecHeader& header, const void* data, size_t len) {
+		memcpy(m_scratch, &header, sizeof(header));
+		memcpy(m_scratch + sizeof(header), data, len);
+		return m_send(m_scratch, sizeof(header) + len) < 0 ? -1 : 0;
+	}
+
+	send_t m_send;
+	FecParams m_params, m_next_params;
+	uint32_t m_group = 0;
+	std::vector<std::string> m_shards; // length prefixed data of this group
+	std::string m_parity;
+	char m_scratch[LSC_MAX_DATAGRAM];
+}; // class FecEncoder
+
+
+///////////////////////////////////////////////////////////////////////////////
+// FecDecoder - datagrams in, lost ones rebuilt from parity
+///////////////////////////////////////////////////////////////////////////////
+
+// data shards are handed out as soon as they arrive, a lost one comes
+// out once enough of its group arrived, so later datagrams can come out
+// before a rebuilt one, use it for data that carries its own ordering,
+// e.g. poses with a sequence number or a time stamp
+//
+// the last LSC_FEC_GROUPS groups are remembered, data shards missing from
+// a group that gets pushed out are lost, not thread safe
+class FecDecoder {
+public:
+	inline FecDecoder(): m_groups(LSC_FEC_GROUPS) {}
+
+	// takes a datagram from a FecEncoder
+	// returns false if it isn't one, or is for a group long gone
+	inline bool OnDatagram(const void* data, size_t len) {
+		FecHeader header;
+		if (len < sizeof(header)) {
+			m_stats.malformed++;
+			return false;
+		}
+
+		memcpy(&header, data, sizeof(header));
+		size_t shards = (size_t)header.data_shards + header.parity_shards;
+		if (header.magic != LSC_FEC_MAGIC || !header.data_shards || !header.parity_shards ||
+			shards > 255 || header.index >= shards) {
+			m_stats.malformed++;
+			return false;
+		}
+
+		const char* payload = (const char*)data + sizeof(header);
+		size_t payload_len = len - sizeof(header);
+		bool parity = header.index >= header.data_shards;
+		if (parity ? payload_len < sizeof(uint16_t) : payload_len > k_fec_max_payload) {
+			m_stats.malformed++;
+			return false;
+		}
+
+		Group* group = find_group(header.group);
+		if (!group) {
+			m_stats.late++;
+			return false;
+		}
+
+		// parity shards carry the final shape of the group, a flushed
+		// group has fewer data shards than its data shards say
+		if (!group->known || parity) {
+			if (group->known && (group->data_shards != header.data_shards || group->parity_shards != header.parity_shards) && group->final) {
+				m_stats.malformed++;
+				return false;
+			}
+
+			group->known = true;
+			group->final = group->final || parity;
+			group->data_shards = header.data_shards;
+			group->parity_shards = header.parity_shards;
+		}
+
+		Shard& shard = group->shards[header.index];
+		if (shard.present) {
+			m_stats.duplicates++;
+			return true;
+		}
+
+		m_stats.received++;
+		shard.present = true;
+		if (parity) {
+			shard.data.assign(payload, payload_len);
+		} else {
+			uint16_t size = (uint16_t)payload_len;
+			shard.data.assign((const char*)&size, sizeof(size));
+			shard.data.append(payload, payload_len);
+			deliver(*group, header.index, payload, payload_len);
+		}
+
+		try_recover(*group);
+		return true;
+	}
+
+	// pops the next data shard into :out:, returns false if there is none
+	inline bool Receive(std::string& out) {
+		if (m_inbox.empty())
+			return false;
+
+		out.swap(m_inbox.front());
+		m_inbox.pop_front();
+		return true;
+	}
+
+	inline FecStats GetStats() const {
+		return m_stats;
+	}
+
+private:
+	struct Shard {
+		bool present = false;
+		bool delivered = false;
+		std::string data; // data shards length prefixed, parity as sent
+	};
+
+	struct Group {
+		bool used = false;
+		bool known = false; // shape seen
+		bool final = false; // shape from a parity shard
+		bool done = false; // every data shard handed out
+		uint32_t id = 0;
+		uint8_t data_shards = 0;
+		uint8_t parity_shards = 0;
+		std::array<Shard, 255> shards;
+	};
+
+	// the slot for :id:, a new group pushes out the one that was in the
+	// slot, nullptr if :id: is older than what the slot has
+	inline Group* find_group(uint32_t id) {
+		Group& group = m_groups[id % m_groups.size()];
+		if (group.used && group.id == id)
+			return &group;
+		if (group.used && (int32_t)(id - group.id) < 0)
+			return nullptr;
+
+		retire(group);
+		group.used = true;
+		group.id = id;
+		return &group;
+	}
+
+	inline void retire(Group& group) {
+		if (group.used && group.known && !group.done) {
+			// without parity the group may have been flushed early, only
+			// the gaps before the last data shard that came are sure
+			int end = group.data_shards;
+			if (!group.final)
+				while (end > 0 && !group.shards[end - 1].delivered)
+					end--;
+
+			for (int i=0; i < end; i++)
+				if (!group.shards[i].delivered)
+					m_stats.lost++;
+		}
+
+		for (Shard& shard : group.shards) {
+			shard.present = false;
+			shard.delivered = false;
+			shard.data.clear();
+		}
+		group.used = group.known = group.final = group.done = false;
+	}
+
+	inline void deliver(Group& group, uint8_t index, const char* data, size_t len) {
+		group.shards[index].delivered = true;
+		m_inbox.emplace_back(data, len);
+		m_stats.delivered++;
+
+		if (!group.final)
+			return;
+
+		group.done = true;
+		for (uint8_t i=0; i < group.data_shards; i++)
+			group.done = group.done && group.shards[i].delivered;
+	}
+
+	// rebuilds the missing data shards once any :data_shards: of the group
+	// are there, by inverting the rows of the code those shards came from
+	inline void try_recover(Group& group) {
+		if (!group.final || group.done)
+			return;
+
+		uint8_t k = group.data_shards;
+		size_t shards = (size_t)k + group.parity_shards;
+		m_rows.clear();
+		m_missing.clear();
+		for (uint8_t i=0; i < k; i++)
+			if (!group.shards[i].present)
+				m_missing.push_back(i);
+		if (m_missing.empty()) {
+			group.done = true; // everything arrived and went out already
+			return;
+		}
+
+		// the data shards that are there, then enough parity shards
+		size_t size = 0;
+		for (size_t i=0; i < shards && m_rows.size() < k; i++) {
+			if (!group.shards[i].present)
+				continue;
+
+			m_rows.push_back((uint8_t)i);
+			size = std::max(size, group.shards[i].data.size());
+		}
+		if (m_rows.size() < k)
+			return;
+
+		// k x k matrix of the rows, inverted with gauss-jordan
+		m_matrix.assign((size_t)k * k * 2, 0);
+		auto at = [&](size_t r, size_t c) -> uint8_t& {return m_matrix[r * k * 2 + c];};
+		for (size_t r=0; r < k; r++) {
+			uint8_t row = m_rows[r];
+			for (uint8_t c=0; c < k; c++)
+				at(r, c) = row < k ? (uint8_t)(row == c) : FecParams::Coefficient(group.parity_shards, (uint8_t)(row - k), c);
+			at(r, k + r) = 1;
+		}
+
+		for (size_t col=0; col < k; col++) {
+			size_t pivot = col;
+			while (pivot < k && !at(pivot, col))
+				pivot++;
+			if (pivot == k)
+				return; // can't happen with a cauchy matrix
+
+			if (pivot != col)
+				for (size_t c=0; c < (size_t)k * 2; c++)
+					std::swap(at(pivot, c), at(col, c));
+
+			uint8_t inv = GfInv(at(col, col));
+			for (size_t c=0; c < (size_t)k * 2; c++)
+				at(col, c) = GfMul(at(col, c), inv);
+
+			for (size_t r=0; r < k; r++) {
+				uint8_t f = at(r, col);
+				if (r == col || !f)
+					continue;
+				for (size_t c=0; c < (size_t)k * 2; c++)
+					at(r, c) ^= GfMul(f, at(col, c));
+			}
+		}
+
+		// data shard i is row i of the inverse times the received shards
+		for (uint8_t i : m_missing) {
+			m_shard.assign(size, '\0');
+			for (size_t r=0; r < k; r++) {
+				const std::string& src = group.shards[m_rows[r]].data;
+				GfMulAdd((uint8_t*)&m_shard[0], (const uint8_t*)src.data(), at(i, k + r), src.size());
+			}
+
+			uint16_t len;
+			memcpy(&len, m_shard.data(), sizeof(len));
+			if (len > size - sizeof(len)) {
+				m_stats.malformed++; // inconsistent shards
+				continue;
+			}
+
+			Shard& shard = group.shards[i];
+			shard.present = true;
+			shard.data = m_shard;
+			m_stats.recovered++;
+			deliver(group, i, m_shard.data() + sizeof(len), len);
+		}
+	}
+
+	std::vector<Group> m_groups;
+	std::deque<std::string> m_inbox;
+	FecStats m_stats = {};
+
+	// scratch, reused
+	std::vector<uint8_t> m_rows;
+	std::vector<uint8_t> m_missing;
+	std::vector<uint8_t> m_matrix;
+	std::string m_shard;
+}; // class FecDecoder
+
+
+// waits up to :timeout_ms: for datagrams on :soc: and feeds all that are
+// there to :dec:, :peer: same as in recv_datagrams()
+// returns the number of datagrams taken or -1 on error
+template<int FAM, int TYP, int PROTO>
+inline int PumpFec(LSocket<FAM, TYP, PROTO>& soc, FecDecoder& dec, int timeout_ms, const lcsockaddr_in* peer = nullptr) {
+	return recv_datagrams(soc, timeout_ms, peer, [&dec](const void* data, size_t len) {
+		dec.OnDatagram(data, len);
+	});
+}
+
+#endif // #ifndef __LAZY_SOCKET_FEC
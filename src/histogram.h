@@ -0,0 +1,193 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// histogram.h - lock-free log-linear latency histograms
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+#ifndef __LAZY_SOCKET_HISTOGRAM
+#define __LAZY_SOCKET_HISTOGRAM
+
+// include parent header
+#include "lazy_sockets.h"
+
+
+// monotonic time in nanoseconds, what all latency measurements are based on
+inline uint64_t get_time_ns() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()
+	).count();
+}
+
+// wall clock time in nanoseconds, what kernel socket timestamps are based on
+inline uint64_t get_wall_time_ns() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()
+	).count();
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// HistogramSnapshot - plain copy of a LatencyHistogram, can be merged
+///////////////////////////////////////////////////////////////////////////////
+
+
+// values are bucketed HDR style, every power of 2 range is split into
+// 2^LSC_HIST_SUB_BITS linear buckets, which keeps the relative error
+// under 1/2^LSC_HIST_SUB_BITS (about 3%) over the whole range
+// values are nanoseconds and clamped to 2^LSC_HIST_MAX_BITS (~18 minutes)
+#define LSC_HIST_SUB_BITS 5
+#define LSC_HIST_MAX_BITS 40
+
+class HistogramSnapshot {
+public:
+	static constexpr int SUB_BUCKETS = 1 << LSC_HIST_SUB_BITS;
+	static constexpr int BUCKETS = (LSC_HIST_MAX_BITS - LSC_HIST_SUB_BITS + 1) * SUB_BUCKETS;
+
+	// bucket a value falls into
+	inline static int BucketOf(uint64_t value) {
+		if (value >= (1ull << LSC_HIST_MAX_BITS))
+			value = (1ull << LSC_HIST_MAX_BITS) - 1;
+
+		if (value < (uint64_t)SUB_BUCKETS)
+			return (int)value;
+
+		int magnitude = 63 - count_leading_zeros(value);
+		int shift = magnitude - LSC_HIST_SUB_BITS;
+		return (shift + 1) * SUB_BUCKETS + (int)((value >> shift) & (SUB_BUCKETS - 1));
+	}
+
+	// smallest value that falls into :bucket:
+	inline static uint64_t BucketLow(int bucket) {
+		if (bucket < SUB_BUCKETS)
+			return bucket;
+
+		int shift = bucket / SUB_BUCKETS - 1;
+		return (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+	}
+
+	// largest value that falls into :bucket:
+	inline static uint64_t BucketHigh(int bucket) {
+		return bucket + 1 < BUCKETS ? BucketLow(bucket + 1) - 1 : (1ull << LSC_HIST_MAX_BITS) - 1;
+	}
+
+	inline HistogramSnapshot() {
+		m_counts.fill(0);
+	}
+
+	// adds :other: to this one, for combining receivers/sockets/threads
+	inline void Merge(const HistogramSnapshot& other) {
+		for (int i=0; i < BUCKETS; i++)
+			m_counts[i] += other.m_counts[i];
+
+		m_count += other.m_count;
+		m_sum += other.m_sum;
+		if (other.m_max > m_max)
+			m_max = other.m_max;
+	}
+
+	// value at or below which :percentile: (0 to 100) of the samples are,
+	// reported as the upper end of the bucket it falls into
+	inline uint64_t Percentile(double percentile) const {
+		if (!m_count)
+			return 0;
+
+		uint64_t target = (uint64_t)(percentile / 100.0 * m_count + 0.5);
+		if (target < 1)
+			target = 1;
+		if (target > m_count)
+			target = m_count;
+
+		uint64_t seen = 0;
+		for (int i=0; i < BUCKETS; i++) {
+			seen += m_counts[i];
+			if (seen >= target) {
+				uint64_t high = BucketHigh(i);
+				return high < m_max ? high : m_max;
+			}
+		}
+
+		return m_max;
+	}
+
+	inline uint64_t Count() const {
+		return m_count;
+	}
+
+	inline uint64_t Max() const {
+		return m_max;
+	}
+
+	inline double Mean() const {
+		return m_count ? (double)m_sum / m_count : 0.0;
+	}
+
+	inline uint64_t BucketCount(int bucket) const {
+		return m_counts[bucket];
+	}
+
+private:
+	inline static int count_leading_zeros(uint64_t value) {
+		#if defined(__GNUC__) || defined(__clang__)
+		return __builtin_clzll(value);
+		#else
+		int n = 0;
+		for (uint64_t bit = 1ull << 63; !(value & bit); bit >>= 1)
+			n++;
+		return n;
+		#endif
+	}
+
+	friend class LatencyHistogram;
+
+	std::array<uint64_t, BUCKETS> m_counts;
+	uint64_t m_count = 0;
+	uint64_t m_sum = 0;
+	uint64_t m_max = 0;
+}; // class HistogramSnapshot
+
+
+///////////////////////////////////////////////////////////////////////////////
+// LatencyHistogram - lock-free recording side
+///////////////////////////////////////////////////////////////////////////////
+
+
+// Record() is a handful of relaxed atomic adds, safe from any thread
+class LatencyHistogram {
+public:
+	inline LatencyHistogram() {
+		for (auto& i : m_counts)
+			i.store(0, std::memory_order_relaxed);
+	}
+
+	// no moving/coping this object, the threads hold on to it
+	LatencyHistogram(const LatencyHistogram&) = delete;
+	LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+	inline void Record(uint64_t value_ns) {
+		m_counts[HistogramSnapshot::BucketOf(value_ns)].fetch_add(1, std::memory_order_relaxed);
+		m_sum.fetch_add(value_ns, std::memory_order_relaxed);
+
+		uint64_t cur = m_max.load(std::memory_order_relaxed);
+		while (value_ns > cur && !m_max.compare_exchange_weak(cur, value_ns, std::memory_order_relaxed));
+	}
+
+	// copies the counts out, recording can go on while this runs
+	inline HistogramSnapshot Snapshot() const {
+		HistogramSnapshot out;
+		for (int i=0; i < HistogramSnapshot::BUCKETS; i++) {
+			out.m_counts[i] = m_counts[i].load(std::memory_order_relaxed);
+			out.m_count += out.m_counts[i]; // total always matches the buckets
+		}
+
+		out.m_sum = m_sum.load(std::memory_order_relaxed);
+		out.m_max = m_max.load(std::memory_order_relaxed);
+		return out;
+	}
+
+private:
+	std::array<std::atomic<uint64_t>, HistogramSnapshot::BUCKETS> m_counts;
+	alignas(LSC_CACHE_LINE_SIZE) std::atomic<uint64_t> m_sum{0};
+	std::atomic<uint64_t> m_max{0};
+}; // class LatencyHistogram
+
+#endif // #ifndef __LAZY_SOCKET_HISTOGRAM
@@ -10,11 +10,23 @@
 #include "defines.h"  // types, macros, defines, etc.
 #include <string>
 #include <cstring>
+#include <cstdio>
 #include <errno.h>
+#include <cstdint>
 
 #include <thread>
 #include <functional>
 #include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <deque>
+#include <array>
+#include <algorithm>
+#include <chrono>
+#include <type_traits>
+#include <cmath>
 
 
 namespace lsc {
@@ -29,10 +41,25 @@ enum ERecvFlags: int {
 // send flags acceptable for sockets
 enum ESendFlags: int {
 	ESend_none = 0,
-	ESend_nowait = MSG_DONTWAIT
+	ESend_nowait = MSG_DONTWAIT,
+	ESend_nosignal = MSG_NOSIGNAL, // don't raise SIGPIPE on a closed connection
+	ESend_more = MSG_MORE // more data follows, let the kernel merge it (stream only)
 	// TODO: add the rest of the flags
 };
 
+// events that can be waited for with LSocket::Poll
+enum EPollEvents: short {
+	EPoll_in = POLLIN,
+	EPoll_out = POLLOUT
+};
+
+// kernel timestamps that can be turned on with LSocket::EnableTimestamps
+enum ETimestampFlags: int {
+	ETstamp_none = 0,
+	ETstamp_rx = 0b01, // software receive timestamps, see the timestamped Recv/RecvFrom
+	ETstamp_tx = 0b10 // software transmit timestamps, see ReadTxTimestamp
+};
+
 // current status of the socket descriptor
 enum ESockStatus: int {
 	EStat_invalid		= 0b0000000,
@@ -54,6 +81,16 @@ enum EAcceptErrors {
 // generate a lcsockaddr_in using :family:, :addr: and :port:
 lcsockaddr_in get_inet_addr(int family, const std::string& addr, int port);
 
+// creates a pair of connected local sockets of :type: (SOCK_STREAM or SOCK_DGRAM)
+// in :fds:, like socketpair() (emulated over loopback on windows)
+// returns 0 on success or -1 on error
+int make_socket_pair(int type, lsocket_t fds[2]);
+
+
+// statistics counters used by LSocket
+#include "histogram.h"
+#include "stats.h"
+#include "trace.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 // LSocket - main socket class
@@ -66,6 +103,112 @@ class LSocket {
 	lsocket_t _soc_handle;
 	int _status = EStat_invalid;
 
+	// shared between clones, they're the same socket after all
+	std::shared_ptr<SocketStats> _stats = std::make_shared<SocketStats>();
+
+	// stat keeping for every receive/send syscall
+	inline void on_recv(int res) {
+		_stats->OnRecv(res);
+		if (TYPE == SOCK_DGRAM && res >= 0)
+			_stats->OnFrameIn(res); // every datagram is a message
+	}
+
+	// recvmsg() that also picks up the kernel receive timestamp,
+	// :timestamp_ns: is set to 0 if the kernel didn't attach one
+	inline int recv_timestamped(
+		void* buff,
+		size_t size,
+		lcsockaddr_in* sender,
+		size_t* sender_size,
+		uint64_t& timestamp_ns,
+		int flags
+	) {
+		timestamp_ns = 0;
+		LSC_TRACE_BEGIN("lsc.recv");
+
+		// compile time check for windows stupidity
+		#ifdef WIN
+		// no kernel timestamps here, plain receive
+		int res;
+		if (sender) {
+			int send_size = (int)*sender_size;
+			res = recvfrom(_soc_handle, (char*)buff, (int)size, flags, (sockaddr *)sender, &send_size);
+			*sender_size = send_size;
+		} else {
+			res = recv(_soc_handle, (char*)buff, (int)size, flags);
+		}
+		#elif defined(LINUX)
+		struct iovec iov;
+		iov.iov_base = buff;
+		iov.iov_len = size;
+
+		// room for either kind of timestamp
+		alignas(struct cmsghdr) char control[256];
+
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = sender;
+		msg.msg_namelen = sender ? (socklen_t)*sender_size : 0;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		int res = recvmsg(_soc_handle, &msg, flags);
+		if (sender)
+			*sender_size = msg.msg_namelen;
+		if (res >= 0)
+			timestamp_ns = read_cmsg_timestamp(msg);
+		#else
+		#error "unsupported platform"
+		#endif // #ifdef WIN
+		LSC_TRACE_END("lsc.recv", res);
+		on_recv(res);
+		return res;
+	}
+
+	#ifdef LINUX
+	// pulls a software timestamp out of the control messages of :msg:
+	// returns 0 if there is none
+	inline static uint64_t read_cmsg_timestamp(struct msghdr& msg) {
+		for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET)
+				continue;
+
+			struct timespec ts;
+			#ifdef SCM_TIMESTAMPNS
+			if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+				memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+				return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+			}
+			#endif
+			#ifdef SCM_TIMESTAMPING
+			if (cmsg->cmsg_type == SCM_TIMESTAMPING) {
+				// software timestamp is the first of the three
+				memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+				return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+			}
+			#endif
+		}
+
+		return 0;
+	}
+	#endif // #ifdef LINUX
+
+	// returns 0 if send latency isn't being recorded
+	inline uint64_t send_timer_start() {
+		return _stats->GetSendLatency() ? get_time_ns() : 0;
+	}
+
+	inline void on_send(int res, size_t size, uint64_t start) {
+		if (start)
+			_stats->GetSendLatency()->Record(get_time_ns() - start);
+
+		_stats->OnSend(res, size);
+		if (TYPE == SOCK_DGRAM && res >= 0)
+			_stats->OnFrameOut(res);
+	}
+
 public:
 	/////////////////////////////
 	// constructors/destructors
@@ -87,12 +230,14 @@ public:
 	inline LSocket(const LSocket<FAMILY, TYPE, PROTOCOL>& other) {
 		_soc_handle = other._soc_handle;
 		_status = other._status | EStat_cloned;  // if we're a copy, remember that
+		_stats = other._stats;
 	}
 
 	// move constructor
 	inline LSocket(LSocket<FAMILY, TYPE, PROTOCOL>&& other) {
 		_soc_handle = other._soc_handle;
 		_status = other._status;  // if we're moved, no cloned flag
+		_stats = other._stats;
 	}
 
 	// destructor
@@ -127,6 +272,7 @@ public:
 
 			_status = std::move(other._status);
 			_soc_handle = std::move(other._soc_handle);
+			_stats = other._stats;
 		}
 		return *this;	
 	}
@@ -193,60 +339,173 @@ public:
 	// receives a :size: bytes into :buffer:
 	// returns the number of received bytes or -1 on error
 	inline int Recv(void* buff, size_t size, ERecvFlags flags=ERecv_none) {
+		LSC_TRACE_BEGIN("lsc.recv");
 		// compile time check for windows stupidity
 		#ifdef WIN
-		return recv(_soc_handle, (char*)buff, (int)size, flags);
+		int res = recv(_soc_handle, (char*)buff, (int)size, flags);
 		#elif defined(LINUX)
-		return recv(_soc_handle, buff, size, flags);
+		int res = recv(_soc_handle, buff, size, flags);
 		#else
 		#error "unsupported platform"
 		#endif // #ifdef WIN
+		LSC_TRACE_END("lsc.recv", res);
+		on_recv(res);
+		return res;
+	}
+
+	// same as Recv, but also returns the kernel receive timestamp
+	// (wall clock nanoseconds) in :timestamp_ns:, see EnableTimestamps()
+	// :timestamp_ns: is 0 if the kernel didn't attach one
+	inline int Recv(void* buff, size_t size, uint64_t& timestamp_ns, ERecvFlags flags=ERecv_none) {
+		return recv_timestamped(buff, size, nullptr, nullptr, timestamp_ns, flags);
 	}
 
 	// receives a :size: bytes into :buffer:
 	// returns the number of received bytes or -1 on error
 	inline int RecvFrom(void* buff, size_t size, lcsockaddr_in& sender, size_t& sender_size, ERecvFlags flags=ERecv_none) {
+		LSC_TRACE_BEGIN("lsc.recv");
 		// compile time check for windows stupidity
 		#ifdef WIN
 		int send_size = sender_size; //use correct conversion, such as uint to int. 
 		int recv = recvfrom(_soc_handle, (char*)buff, (int)size, flags, (sockaddr *)&sender, &send_size);
 		sender_size = send_size;
+		LSC_TRACE_END("lsc.recv", recv);
+		on_recv(recv);
 		return recv;
 		#elif defined(LINUX)
         socklen_t send_size = sender_size;
 		int recv = recvfrom(_soc_handle, buff, size, flags, (sockaddr *)&sender, &send_size);
         sender_size = send_size;
+		LSC_TRACE_END("lsc.recv", recv);
+		on_recv(recv);
         return recv;
 		#else
 		#error "unsupported platform"
 		#endif // #ifdef WIN
 	}
 
+	// same as RecvFrom, but also returns the kernel receive timestamp,
+	// see the timestamped Recv
+	inline int RecvFrom(
+		void* buff,
+		size_t size,
+		lcsockaddr_in& sender,
+		size_t& sender_size,
+		uint64_t& timestamp_ns,
+		ERecvFlags flags=ERecv_none
+	) {
+		return recv_timestamped(buff, size, &sender, &sender_size, timestamp_ns, flags);
+	}
+
 	// sends a :size: bytes from :buffer:
 	// returns the number of sent bytes or -1 on error
 	inline int Send(const void* buff, size_t size, ESendFlags flags=ESend_none) {
+		LSC_TRACE_BEGIN("lsc.send");
+		uint64_t start = send_timer_start();
 		// compile time check for windows stupidity
 		#ifdef WIN
-		return send(_soc_handle, (const char*)buff, (int)size, flags);
+		int res = send(_soc_handle, (const char*)buff, (int)size, flags);
 		#elif defined(LINUX)
-		return send(_soc_handle, buff, size, flags);
+		int res = send(_soc_handle, buff, size, flags);
 		#else
 		#error "unsupported platform"
 		#endif // #ifdef WIN
+		LSC_TRACE_END("lsc.send", res);
+		on_send(res, size, start);
+		return res;
+	}
+
+
+	// sends all :size: bytes from :buffer:, finishing partial writes,
+	// on a non blocking socket waits for the socket to become writable
+	// returns :size: or -1 on error, on error an unknown amount was sent
+	inline int SendAll(const void* buff, size_t size, ESendFlags flags=ESend_none) {
+		liovec_t iov;
+		set_iovec(iov, buff, size);
+		return SendAllV(&iov, 1, flags);
+	}
+
+	// same as SendAll, but for :count: buffers described by :iov:,
+	// :iov: is modified in place to track the progress
+	// returns the total number of bytes or -1 on error
+	inline int SendAllV(liovec_t* iov, int count, ESendFlags flags=ESend_none) {
+		int total = 0;
+		while (count) {
+			int res = SendV(iov, count, flags);
+			if (res < 0) {
+				int err = lerrno;
+				if (err == LSOCK_EINTR)
+					continue;
+				if (err == LSOCK_WOULDBLOCK) {
+					if (Poll(EPoll_out, -1) >= 0 || lerrno == LSOCK_EINTR)
+						continue;
+				}
+
+				return -1;
+			}
+
+			total += res;
+
+			// skip over what the kernel took,
+			// a partially sent buffer gets trimmed in place
+			size_t sent = res;
+			while (count && sent >= get_iovec_len(*iov)) {
+				sent -= get_iovec_len(*iov);
+				iov++;
+				count--;
+			}
+			if (count)
+				set_iovec(*iov, get_iovec_base(*iov) + sent, get_iovec_len(*iov) - sent);
+		}
+
+		return total;
+	}
+
+	// sends :count: buffers described by :iov: with a single syscall
+	// returns the number of sent bytes or -1 on error
+	inline int SendV(const liovec_t* iov, int count, ESendFlags flags=ESend_none) {
+		LSC_TRACE_BEGIN("lsc.send");
+		uint64_t start = send_timer_start();
+		// compile time check for windows stupidity
+		#ifdef WIN
+		DWORD sent = 0;
+		int res = WSASend(_soc_handle, (LPWSABUF)iov, (DWORD)count, &sent, (DWORD)flags, NULL, NULL);
+		res = res ? -1 : (int)sent;
+		#elif defined(LINUX)
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = (struct iovec*)iov;
+		msg.msg_iovlen = count;
+		int res = sendmsg(_soc_handle, &msg, flags);
+		#else
+		#error "unsupported platform"
+		#endif // #ifdef WIN
+		LSC_TRACE_END("lsc.send", res);
+
+		size_t size = 0;
+		for (int i=0; i < count; i++)
+			size += get_iovec_len(iov[i]);
+		on_send(res, size, start);
+		return res;
 	}
 
 
 	// sends a :size: bytes from :buffer:
 	// returns the number of sent bytes or -1 on error
     inline int SendTo(const void* buff, size_t size, lcsockaddr_in& dest_addr, size_t dest_size, ESendFlags flags=ESend_none) {
+		LSC_TRACE_BEGIN("lsc.send");
+		uint64_t start = send_timer_start();
 		// compile time check for windows stupidity
 		#ifdef WIN
-		return sendto(_soc_handle, (const char*)buff, (int)size, flags, (sockaddr *)&dest_addr, dest_size);
+		int res = sendto(_soc_handle, (const char*)buff, (int)size, flags, (sockaddr *)&dest_addr, dest_size);
 		#elif defined(LINUX)
-        return sendto(_soc_handle, buff, size, flags, (sockaddr *)&dest_addr, dest_size);
+        int res = sendto(_soc_handle, buff, size, flags, (sockaddr *)&dest_addr, dest_size);
 		#else
 		#error "unsupported platform"
 		#endif // #ifdef WIN
+		LSC_TRACE_END("lsc.send", res);
+		on_send(res, size, start);
+		return res;
 	}
 
 
@@ -271,6 +530,234 @@ public:
 		return ioctl(_soc_handle, request, argp);
 	}
 
+	// pass through for setsockopt()
+	// returns 0 on success or -1 on error
+	inline int SetSockOpt(int level, int optname, const void* optval, socklen_t optlen) {
+		return setsockopt(_soc_handle, level, optname, (const char*)optval, optlen);
+	}
+
+	// pass through for getsockopt()
+	// returns 0 on success or -1 on error
+	inline int GetSockOpt(int level, int optname, void* optval, socklen_t* optlen) {
+		return getsockopt(_soc_handle, level, optname, (char*)optval, optlen);
+	}
+
+	// enables/disables nagle's algorithm (TCP_NODELAY)
+	// returns 0 on success or -1 on error
+	inline int SetNoDelay(bool enable) {
+		int val = enable;
+		return SetSockOpt(IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+	}
+
+	// switches the socket between blocking and non blocking mode
+	// returns 0 on success or -1 on error
+	inline int SetNonBlocking(bool enable) {
+		// compile time check for windows stupidity
+		#ifdef WIN
+		u_long mode = enable;
+		#elif defined(LINUX)
+		int mode = enable;
+		#else
+		#error "unsupported platform"
+		#endif // #ifdef WIN
+		return Ioctl(FIONBIO, &mode);
+	}
+
+	// waits up to :timeout_ms: (-1 for forever) for any of :events:
+	// returns a positive number if ready, 0 on timeout or -1 on error
+	inline int Poll(short events, int timeout_ms) {
+		struct pollfd pfd;
+		pfd.fd = _soc_handle;
+		pfd.events = events;
+		pfd.revents = 0;
+		return poll(&pfd, 1, timeout_ms);
+	}
+
+
+	// turns on kernel software timestamping for :flags: (ETimestampFlags),
+	// receive timestamps come back from the timestamped Recv/RecvFrom,
+	// transmit timestamps are read with ReadTxTimestamp
+	// returns 0 on success or -1 on error (not supported on windows)
+	inline int EnableTimestamps(int flags=ETstamp_rx) {
+		// compile time check for windows stupidity
+		#ifdef WIN
+		(void)flags;
+		WSASetLastError(LSOCK_NOTSUPPORTED);
+		return -1;
+		#elif defined(LINUX)
+		if (flags & ETstamp_rx) {
+			#ifdef SO_TIMESTAMPNS
+			int val = 1;
+			if (SetSockOpt(SOL_SOCKET, SO_TIMESTAMPNS, &val, sizeof(val)))
+				return -1;
+			#else
+			errno = LSOCK_NOTSUPPORTED;
+			return -1;
+			#endif
+		}
+
+		if (flags & ETstamp_tx) {
+			#ifdef SO_TIMESTAMPING
+			// OPT_ID numbers the sends, OPT_TSONLY skips looping the payload back
+			int val = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE
+				| SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+			if (SetSockOpt(SOL_SOCKET, SO_TIMESTAMPING, &val, sizeof(val)))
+				return -1;
+			#else
+			errno = LSOCK_NOTSUPPORTED;
+			return -1;
+			#endif
+		}
+
+		return 0;
+		#else
+		#error "unsupported platform"
+		#endif // #ifdef WIN
+	}
+
+	// reads one pending transmit timestamp (wall clock nanoseconds) from the
+	// socket error queue, :id: is the index of the send it belongs to
+	// (counting from 0 since EnableTimestamps(ETstamp_tx) for datagrams,
+	// the byte offset of the last byte of that send for streams)
+	// never blocks, returns 0 on success or -1 on error
+	// (EWOULDBLOCK if nothing is pending yet, ENOMSG if the queued error
+	// wasn't a timestamp, e.g. an icmp error, it's dropped either way)
+	inline int ReadTxTimestamp(uint64_t& timestamp_ns, uint32_t& id) {
+		timestamp_ns = 0;
+		id = 0;
+
+		// compile time check for windows stupidity
+		#ifdef WIN
+		WSASetLastError(LSOCK_NOTSUPPORTED);
+		return -1;
+		#elif defined(LINUX) && defined(MSG_ERRQUEUE) && defined(SO_EE_ORIGIN_TIMESTAMPING)
+		alignas(struct cmsghdr) char control[256];
+
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(_soc_handle, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			return -1;
+
+		bool timestamping = false;
+		for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			// the type numbers only mean something together with the level
+			if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+				&& !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+				continue;
+
+			struct sock_extended_err err;
+			memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+			if (err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+				id = err.ee_data;
+				timestamping = true;
+			}
+		}
+
+		timestamp_ns = read_cmsg_timestamp(msg);
+		if (!timestamping || !timestamp_ns) {
+			timestamp_ns = 0;
+			id = 0;
+			errno = ENOMSG;
+			return -1;
+		}
+
+		return 0;
+		#elif defined(LINUX)
+		errno = LSOCK_NOTSUPPORTED;
+		return -1;
+		#else
+		#error "unsupported platform"
+		#endif // #ifdef WIN
+	}
+
+
+	// fills :info: with the kernel's view of the connection,
+	// useful to tell network trouble (rtt, retransmits, a full send queue)
+	// apart from the app not keeping up (a full receive queue)
+	// returns 0 on success or -1 on error
+	inline int GetTcpInfo(LTcpInfo& info) {
+		static_assert(TYPE == SOCK_STREAM, "tcp info is only available for stream sockets");
+
+		memset(&info, 0, sizeof(info));
+		info.sample_time_ns = get_time_ns();
+
+		// compile time check for windows stupidity
+		#ifdef WIN
+		#ifdef SIO_TCP_INFO
+		DWORD version = 0;
+		TCP_INFO_v0 tcp;
+		DWORD ret_size = 0;
+		if (WSAIoctl(_soc_handle, SIO_TCP_INFO, &version, sizeof(version), &tcp, sizeof(tcp), &ret_size, NULL, NULL))
+			return -1;
+
+		info.rtt_us = tcp.RttUs;
+		info.retransmits = tcp.FastRetrans + tcp.TimeoutEpisodes;
+		info.cwnd_bytes = tcp.Cwnd;
+		info.unacked_bytes = tcp.BytesInFlight;
+		#endif // #ifdef SIO_TCP_INFO
+
+		u_long pending = 0;
+		if (Ioctl(FIONREAD, &pending))
+			return -1;
+		info.recv_queue = pending;
+		return 0;
+		#elif defined(LINUX)
+		#ifdef __linux__
+		struct tcp_info tcp;
+		socklen_t len = sizeof(tcp);
+		if (GetSockOpt(IPPROTO_TCP, TCP_INFO, &tcp, &len))
+			return -1;
+
+		info.rtt_us = tcp.tcpi_rtt;
+		info.rtt_var_us = tcp.tcpi_rttvar;
+		info.retransmits = tcp.tcpi_total_retrans;
+		info.cwnd_bytes = tcp.tcpi_snd_cwnd * tcp.tcpi_snd_mss;
+
+		// SIOCOUTQ is everything in the send buffer, SIOCOUTQNSD only the unsent part
+		int in_queue = 0, out_queue = 0, unsent = 0;
+		if (Ioctl(SIOCINQ, &in_queue) || Ioctl(SIOCOUTQ, &out_queue) || Ioctl(SIOCOUTQNSD, &unsent))
+			return -1;
+
+		info.recv_queue = in_queue;
+		info.send_queue = unsent;
+		info.unacked_bytes = out_queue - unsent;
+		return 0;
+		#else
+		errno = LSOCK_NOTSUPPORTED;
+		return -1;
+		#endif // #ifdef __linux__
+		#else
+		#error "unsupported platform"
+		#endif // #ifdef WIN
+	}
+
+
+	// returns the live statistics counters of the socket,
+	// receivers and senders update the frame level counters through this
+	inline SocketStats& GetStats() {
+		return *_stats;
+	}
+
+	// returns a copy of the statistics counters
+	inline SocketStatsSnapshot GetStatsSnapshot() {
+		return _stats->Snapshot();
+	}
+
+	// starts timing every send syscall on this socket and its clones,
+	// call it before the socket is shared between threads
+	inline void EnableSendLatency() {
+		_stats->EnableSendLatency();
+	}
+
+	// returns the send syscall durations in nanoseconds,
+	// empty if EnableSendLatency() wasn't called
+	inline HistogramSnapshot GetSendLatencySnapshot() {
+		LatencyHistogram* hist = _stats->GetSendLatency();
+		return hist ? hist->Snapshot() : HistogramSnapshot();
+	}
 
 	// returns the current status of the socket
 	inline ESockStatus GetStatus() {
@@ -301,7 +788,21 @@ public:
 
 
 // include utility interfaces
+#include "queues.h"
+#include "mapped_file.h"
+#include "recorder.h"
+#include "capture.h"
+#include "views.h"
+#include "schema.h"
+#include "router.h"
+#include "simd.h"
+#include "codec.h"
+#include "clock_sync.h"
+#include "channel.h"
+#include "fec.h"
 #include "receivers.h"
+#include "senders.h"
+#include "simnet.h"
 
 }  // namespace lsc
 
@@ -0,0 +1,74 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// mapped_file.h - memory mapped files
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+#ifndef __LAZY_SOCKET_MAPPED_FILE
+#define __LAZY_SOCKET_MAPPED_FILE
+
+// include parent header
+#include "lazy_sockets.h"
+
+
+///////////////////////////////////////////////////////////////////////////////
+// MappedFile - a file mapped into memory, shared with the page cache
+///////////////////////////////////////////////////////////////////////////////
+
+
+// writes land in the page cache right away, so they survive the process
+// crashing, Sync() is only needed to survive the machine going down
+// platform specific parts live in soc_unix.cpp/soc_win.cpp
+class MappedFile {
+public:
+	MappedFile() = default;
+
+	inline ~MappedFile() {
+		Close();
+	}
+
+	// no moving/coping this object, it owns the mapping
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	// creates or truncates :path: to :size: bytes and maps it read/write
+	// returns 0 on success or -1 on error
+	int Create(const std::string& path, size_t size);
+
+	// maps an existing file read only
+	// returns 0 on success or -1 on error
+	int OpenReadOnly(const std::string& path);
+
+	// flushes dirty pages to disk, :wait: blocks until they're written
+	// returns 0 on success or -1 on error
+	int Sync(bool wait = false);
+
+	void Close();
+
+	inline bool IsOpen() const {
+		return m_data != nullptr;
+	}
+
+	inline char* Data() {
+		return m_data;
+	}
+
+	inline const char* Data() const {
+		return m_data;
+	}
+
+	inline size_t Size() const {
+		return m_size;
+	}
+
+private:
+	char* m_data = nullptr;
+	size_t m_size = 0;
+
+	#ifdef WIN
+	HANDLE m_file = INVALID_HANDLE_VALUE;
+	HANDLE m_mapping = NULL;
+	#endif
+}; // class MappedFile
+
+#endif // #ifndef __LAZY_SOCKET_MAPPED_FILE
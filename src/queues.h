@@ -0,0 +1,346 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// queues.h - lock-free queues used to pass data between threads
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+#ifndef __LAZY_SOCKET_QUEUES
+#define __LAZY_SOCKET_QUEUES
+
+// include parent header
+#include "lazy_sockets.h"
+
+
+///////////////////////////////////////////////////////////////////////////////
+// SpscRing - bounded wait-free single producer single consumer ring
+///////////////////////////////////////////////////////////////////////////////
+
+// slots are allocated once on construction and reused forever,
+// so types that keep their capacity (like std::string) stop allocating
+// once the ring has warmed up
+//
+// only one thread may call the producer methods (Claim/Publish/TryPush)
+// and only one thread may call the consumer methods (Front/Pop/TryPop)
+template <typename T>
+class SpscRing {
+public:
+	// :capacity: is rounded up to the next power of 2
+	inline explicit SpscRing(size_t capacity) {
+		size_t cap = 1;
+		while (cap < capacity)
+			cap <<= 1;
+
+		m_mask = cap - 1;
+		m_slots = std::make_unique<T[]>(cap);
+	}
+
+	// no moving/coping this object, the threads hold on to it
+	SpscRing(const SpscRing&) = delete;
+	SpscRing& operator=(const SpscRing&) = delete;
+
+	/////////////////////////////
+	// producer side
+	/////////////////////////////
+
+	// returns the next free slot to be filled in or nullptr if the ring is full,
+	// the slot is handed to the consumer only after Publish() is called
+	inline T* Claim() {
+		size_t head = m_head.load(std::memory_order_relaxed);
+		if (head - m_cached_tail > m_mask) {
+			// looks full, refresh our view of the consumer
+			m_cached_tail = m_tail.load(std::memory_order_acquire);
+			if (head - m_cached_tail > m_mask)
+				return nullptr;
+		}
+
+		return &m_slots[head & m_mask];
+	}
+
+	// hands the last claimed slot to the consumer
+	inline void Publish() {
+		m_head.store(
+			m_head.load(std::memory_order_relaxed) + 1,
+			std::memory_order_release
+		);
+	}
+
+	// returns false if the ring is full
+	inline bool TryPush(const T& value) {
+		T* slot = Claim();
+		if (!slot)
+			return false;
+
+		*slot = value;
+		Publish();
+		return true;
+	}
+
+	// returns false if the ring is full, :value: is untouched in that case
+	inline bool TryPush(T&& value) {
+		T* slot = Claim();
+		if (!slot)
+			return false;
+
+		*slot = std::move(value);
+		Publish();
+		return true;
+	}
+
+	/////////////////////////////
+	// consumer side
+	/////////////////////////////
+
+	// returns the oldest published slot or nullptr if the ring is empty,
+	// the slot stays valid until Pop() is called
+	inline T* Front() {
+		size_t tail = m_tail.load(std::memory_order_relaxed);
+		if (tail == m_cached_head) {
+			// looks empty, refresh our view of the producer
+			m_cached_head = m_head.load(std::memory_order_acquire);
+			if (tail == m_cached_head)
+				return nullptr;
+		}
+
+		return &m_slots[tail & m_mask];
+	}
+
+	// releases the slot returned by Front() back to the producer
+	inline void Pop() {
+		m_tail.store(
+			m_tail.load(std::memory_order_relaxed) + 1,
+			std::memory_order_release
+		);
+	}
+
+	// swaps the oldest element into :out: and returns true,
+	// or returns false if the ring is empty
+	// the swap hands the old contents of :out: back to the ring,
+	// so buffers keep circulating instead of being reallocated
+	inline bool TryPop(T& out) {
+		T* slot = Front();
+		if (!slot)
+			return false;
+
+		using std::swap;
+		swap(out, *slot);
+		Pop();
+		return true;
+	}
+
+	/////////////////////////////
+	// utility
+	/////////////////////////////
+
+	// approximate number of queued elements, exact only when called
+	// from the producer or the consumer while the other side is idle
+	inline size_t Size() const {
+		return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire);
+	}
+
+	inline bool Empty() const {
+		return Size() == 0;
+	}
+
+	inline size_t Capacity() const {
+		return m_mask + 1;
+	}
+
+private:
+	// producer owned, the consumer only reads m_head
+	alignas(LSC_CACHE_LINE_SIZE) std::atomic<size_t> m_head{0};
+	size_t m_cached_tail = 0;
+
+	// consumer owned, the producer only reads m_tail
+	alignas(LSC_CACHE_LINE_SIZE) std::atomic<size_t> m_tail{0};
+	size_t m_cached_head = 0;
+
+	// read only after construction
+	alignas(LSC_CACHE_LINE_SIZE) size_t m_mask;
+	std::unique_ptr<T[]> m_slots;
+}; // class SpscRing
+
+
+///////////////////////////////////////////////////////////////////////////////
+// MpscQueue - unbounded lock-free multi producer single consumer queue
+///////////////////////////////////////////////////////////////////////////////
+
+// linked list of heap nodes with a dummy head (Vyukov style),
+// Push() is a single atomic exchange and never waits on anything,
+// the consumer may briefly see the queue as empty while a producer is
+// between its exchange and the link store, it will see the element
+// on the next try
+//
+// any thread may call Push(), only one thread may call TryPop()
+template <typename T>
+class MpscQueue {
+	struct Node {
+		std::atomic<Node*> next{nullptr};
+		T value;
+	};
+
+public:
+	inline MpscQueue() {
+		Node* stub = new Node;
+		m_head.store(stub, std::memory_order_relaxed);
+		m_tail = stub;
+	}
+
+	inline ~MpscQueue() {
+		while (m_tail) {
+			Node* next = m_tail->next.load(std::memory_order_relaxed);
+			delete m_tail;
+			m_tail = next;
+		}
+	}
+
+	// no moving/coping this object, the threads hold on to it
+	MpscQueue(const MpscQueue&) = delete;
+	MpscQueue& operator=(const MpscQueue&) = delete;
+
+	// thread safe
+	inline void Push(T&& value) {
+		Node* node = new Node;
+		node->value = std::move(value);
+
+		Node* prev = m_head.exchange(node, std::memory_order_acq_rel);
+		prev->next.store(node, std::memory_order_release);
+	}
+
+	inline void Push(const T& value) {
+		T copy = value;
+		Push(std::move(copy));
+	}
+
+	// moves the oldest element into :out:, returns false if the queue is empty
+	// consumer thread only
+	inline bool TryPop(T& out) {
+		Node* next = m_tail->next.load(std::memory_order_acquire);
+		if (!next)
+			return false;
+
+		out = std::move(next->value);
+
+		// the popped node becomes the new dummy
+		delete m_tail;
+		m_tail = next;
+		return true;
+	}
+
+	// consumer thread only
+	inline bool Empty() const {
+		return m_tail->next.load(std::memory_order_acquire) == nullptr;
+	}
+
+private:
+	alignas(LSC_CACHE_LINE_SIZE) std::atomic<Node*> m_head; // producers push here
+	alignas(LSC_CACHE_LINE_SIZE) Node* m_tail; // consumer pops from here
+}; // class MpscQueue
+
+
+///////////////////////////////////////////////////////////////////////////////
+// SeqlockRing - the last N values of a single writer, readable by anyone
+///////////////////////////////////////////////////////////////////////////////
+
+// the writer never waits for readers, readers never block the writer or
+// each other, a reader that raced with the writer just copies again
+//
+// values are stored as relaxed atomic words with a per slot sequence,
+// so T has to be trivially copyable, reads are meant for small structs
+// (a timestamped pose), not buffers
+//
+// only one thread may call Push(), any thread may call Get()/Latest()
+template <typename T>
+class SeqlockRing {
+	static_assert(std::is_trivially_copyable<T>::value, "SeqlockRing needs a trivially copyable type");
+
+	static constexpr size_t k_words = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+	struct alignas(LSC_CACHE_LINE_SIZE) Slot {
+		// 2 * index + 1 while index is being written, 2 * index + 2 after
+		std::atomic<uint64_t> seq{0};
+		std::atomic<uint64_t> words[k_words];
+	};
+
+public:
+	// :capacity: is rounded up to the next power of 2
+	inline explicit SeqlockRing(size_t capacity) {
+		size_t cap = 1;
+		while (cap < capacity)
+			cap <<= 1;
+
+		m_mask = cap - 1;
+		m_slots = std::make_unique<Slot[]>(cap);
+	}
+
+	// no moving/coping this object, the threads hold on to it
+	SeqlockRing(const SeqlockRing&) = delete;
+	SeqlockRing& operator=(const SeqlockRing&) = delete;
+
+	// writer thread only, overwrites the oldest value once the ring is full
+	inline void Push(const T& value) {
+		uint64_t index = m_count.load(std::memory_order_relaxed);
+		Slot& slot = m_slots[index & m_mask];
+
+		uint64_t words[k_words] = {};
+		memcpy(words, &value, sizeof(T));
+
+		slot.seq.store(2 * index + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		for (size_t i=0; i < k_words; i++)
+			slot.words[i].store(words[i], std::memory_order_relaxed);
+		slot.seq.store(2 * index + 2, std::memory_order_release);
+
+		m_count.store(index + 1, std::memory_order_release);
+	}
+
+	// copies the value pushed :age: pushes ago (0 is the newest) into :out:
+	// returns false if there is no such value (anymore)
+	inline bool Get(size_t age, T& out) const {
+		uint64_t words[k_words];
+		while (true) {
+			uint64_t count = m_count.load(std::memory_order_acquire);
+			if (age >= count || age > m_mask)
+				return false;
+
+			uint64_t index = count - 1 - age;
+			const Slot& slot = m_slots[index & m_mask];
+			uint64_t before = slot.seq.load(std::memory_order_acquire);
+			// reused for a newer value since count was read,
+			// start over relative to the new newest
+			if (before != 2 * index + 2)
+				continue;
+
+			for (size_t i=0; i < k_words; i++)
+				words[i] = slot.words[i].load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (slot.seq.load(std::memory_order_relaxed) == before)
+				break;
+		}
+
+		memcpy(&out, words, sizeof(T));
+		return true;
+	}
+
+	// copies the newest value into :out:, returns false if there is none
+	inline bool Latest(T& out) const {
+		return Get(0, out);
+	}
+
+	// number of values pushed so far
+	inline uint64_t Count() const {
+		return m_count.load(std::memory_order_acquire);
+	}
+
+	inline size_t Capacity() const {
+		return m_mask + 1;
+	}
+
+private:
+	alignas(LSC_CACHE_LINE_SIZE) std::atomic<uint64_t> m_count{0};
+
+	// read only after construction
+	alignas(LSC_CACHE_LINE_SIZE) size_t m_mask;
+	std::unique_ptr<Slot[]> m_slots;
+}; // class SeqlockRing
+
+#endif // #ifndef __LAZY_SOCKET_QUEUES
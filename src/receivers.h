@@ -54,18 +54,129 @@ public:
 		return m_buff_size;
 	}
 
+	// returns a copy of the statistics counters of the receiving socket
+	inline SocketStatsSnapshot GetStatsSnapshot() {
+		return m_soc->GetStatsSnapshot();
+	}
+
+	// records how long every frame waited between its last byte coming
+	// out of the kernel and the callback being invoked,
+	// with EnableTimestamps() the time is measured from the kernel receive
+	// timestamp instead, which also covers the time spent in socket buffers
+	// has to be called before Start()
+	inline void EnableLatencyHistogram() {
+		if (!m_latency)
+			m_latency = std::make_unique<LatencyHistogram>();
+	}
+
+	// returns the receive to callback latencies in nanoseconds,
+	// empty if EnableLatencyHistogram() wasn't called
+	inline HistogramSnapshot GetLatencySnapshot() {
+		return m_latency ? m_latency->Snapshot() : HistogramSnapshot();
+	}
+
+	// turns on kernel receive timestamps for the socket,
+	// has to be called before Start()
+	// returns 0 on success or -1 on error
+	inline int EnableTimestamps() {
+		int res = m_soc->EnableTimestamps(ETstamp_rx);
+		m_timestamps = res == 0;
+		return res;
+	}
+
+	// samples GetTcpInfo() from the receiver thread at most once every :period:,
+	// samples are taken right after a receive, so they stop while no data flows
+	// only for stream sockets, has to be called before Start()
+	inline void EnableTcpInfoSampling(std::chrono::milliseconds period) {
+		static_assert(TYP == SOCK_STREAM, "tcp info is only available for stream sockets");
+		m_tcp_info_period_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(period).count();
+		m_tcp_info_sampling = true;
+	}
+
+	// copies the latest tcp info sample into :info:,
+	// returns false if there is none yet
+	inline bool GetTcpInfoSample(LTcpInfo& info) {
+		std::lock_guard<std::mutex> lk(m_tcp_info_mutex);
+		if (!m_tcp_info.sample_time_ns)
+			return false;
+
+		info = m_tcp_info;
+		return true;
+	}
+
+	// keeps a copy of every frame in :recorder: before it's handed to the
+	// callback, so the last frames are still around after a crash
+	// has to be called before Start()
+	inline void AttachFlightRecorder(std::shared_ptr<FlightRecorder> recorder) {
+		m_recorder = recorder;
+	}
+
+	// appends every frame with its receive timestamp to :capture:,
+	// for replaying the session later, see ReplayCapture
+	// has to be called before Start()
+	inline void AttachCapture(std::shared_ptr<CaptureWriter> capture) {
+		m_capture = capture;
+	}
+
+	// kernel receive timestamp (wall clock nanoseconds) of the frame that was
+	// last handed to the callback, meant to be called from inside the callback
+	// 0 if timestamps aren't enabled or the kernel didn't attach one
+	inline uint64_t GetLastFrameTimestamp() {
+		return m_frame_timestamp.load(std::memory_order_relaxed);
+	}
+
 
 private:
 	inline static void thread_enter(ThreadedRecvLoop* self) {
 		self->thread_internal();
 	}
 
+	// the kernel timestamp is on the wall clock, which can step,
+	// so it's only used when it looks sane
+	inline void record_latency(uint64_t recv_time, uint64_t kernel_time) {
+		if (kernel_time) {
+			uint64_t now = get_wall_time_ns();
+			if (now >= kernel_time) {
+				m_latency->Record(now - kernel_time);
+				return;
+			}
+		}
+
+		m_latency->Record(get_time_ns() - recv_time);
+	}
+
+	inline void sample_tcp_info(uint64_t& next_sample) {
+		if constexpr (TYP == SOCK_STREAM) {
+			uint64_t now = get_time_ns();
+			if (now < next_sample)
+				return;
+
+			next_sample = now + m_tcp_info_period_ns;
+
+			LTcpInfo info;
+			if (m_soc->GetTcpInfo(info))
+				return;
+
+			std::lock_guard<std::mutex> lk(m_tcp_info_mutex);
+			m_tcp_info = info;
+		} else {
+			(void)next_sample;
+		}
+	}
+
 	inline void thread_internal() {
 
-		char* recv_buff = new char[m_buff_size + sizeof(m_tag)];
+		// the receiver thread owns the actual buffer size,
+		// m_buff_size is only used to hand over realloc requests
+		int buff_size = m_buff_size;
+		char* recv_buff = (char*)malloc(buff_size + sizeof(m_tag));
 		int recv_off = 0;
+		int scan_off = 0;
 		int recv_len;
 
+		SocketStats& stats = m_soc->GetStats();
+		uint64_t next_tcp_info = 0;
+
 		while (m_is_alive) {
 
 			// early stopping,
@@ -76,50 +187,94 @@ private:
 				break;
 
 			// check for a realloc call
-			if (m_realloc_buff){
-				recv_buff = (char*)realloc(recv_buff, m_buff_size + sizeof(m_tag));
-				m_realloc_buff = false;
+			if (m_realloc_buff.exchange(false)) {
+				buff_size = m_buff_size;
+				if (buff_size < recv_off)
+					buff_size = recv_off; // don't cut off already received data
+				recv_buff = (char*)realloc(recv_buff, buff_size + sizeof(m_tag));
+				LSC_TRACE_INSTANT("lsc.recv_loop.realloc", buff_size);
 			}
 
 			// check for too small of a buffer
-			if (m_buff_size - recv_off <= 0) {
-				m_buff_size += recv_off;
-				recv_buff = (char*)realloc(recv_buff, m_buff_size + sizeof(m_tag));
+			if (buff_size - recv_off <= 0) {
+				buff_size += recv_off;
+				m_buff_size = buff_size;
+				recv_buff = (char*)realloc(recv_buff, buff_size + sizeof(m_tag));
+				stats.OnBufferGrow();
+				LSC_TRACE_INSTANT("lsc.recv_loop.grow", buff_size);
 			}
 
 			// receive a partial message
-			recv_len = m_soc->Recv(recv_buff + recv_off, m_buff_size - recv_off);
+			uint64_t kernel_time = 0;
+			if (m_timestamps)
+				recv_len = m_soc->Recv(recv_buff + recv_off, buff_size - recv_off, kernel_time);
+			else
+				recv_len = m_soc->Recv(recv_buff + recv_off, buff_size - recv_off);
 
 			// check for an error
 			if (recv_len < 0) {
 				break;
 			}
 
+			// the peer closed a stream, every recv would return 0 from
+			// now on, an empty datagram is just an empty datagram
+			if (recv_len == 0 && TYP != SOCK_DGRAM)
+				break;
+
+			// only read the clock when someone asked for it
+			uint64_t recv_time = m_latency ? get_time_ns() : 0;
+
+			if (m_tcp_info_sampling)
+				sample_tcp_info(next_tcp_info);
+
 			recv_off += recv_len;
 
-			// now look for a packet end tag
-			for (int i=0;  i < recv_off; i++) {
+			// now look for packet end tags, a single receive can carry
+			// several frames if the peer batches its writes
+			int frame_start = 0;
+			for (int i=scan_off; i + (int)sizeof(m_tag) <= recv_off; i++) {
 				if (memcmp(recv_buff + i, &m_tag, sizeof(m_tag)) == 0) {
-					if (m_callback)
-						m_callback(recv_buff, i);
-
-					// after the packet was processed,
-					// we need to move the rest of the buffer
-					// to the begging to not lose any data
-					int off = i + sizeof(m_tag);
-					if (m_buff_size - off > 0) {
-						memmove(recv_buff, recv_buff + off, m_buff_size - off);
-						memset(recv_buff + i, 0, m_buff_size - i);
+					LSC_TRACE_INSTANT("lsc.recv_loop.tag", i - frame_start);
+					if (TYP != SOCK_DGRAM) // the socket counts datagrams itself
+						stats.OnFrameIn(i - frame_start);
+					if (recv_time)
+						record_latency(recv_time, kernel_time);
+					m_frame_timestamp.store(kernel_time, std::memory_order_relaxed);
+					if (m_recorder)
+						m_recorder->Record(recv_buff + frame_start, i - frame_start, kernel_time);
+					if (m_capture)
+						m_capture->Write(recv_buff + frame_start, i - frame_start, kernel_time);
+					if (m_callback) {
+						LSC_TRACE_BEGIN("lsc.recv_loop.callback");
+						m_callback(recv_buff + frame_start, i - frame_start);
+						LSC_TRACE_END("lsc.recv_loop.callback", i - frame_start);
 					}
 
-					recv_off = 0; // and zero off the offset
-					break;
+					frame_start = i + sizeof(m_tag);
+					i = frame_start - 1;
 				}
 			}
 
+			// after the packets were processed,
+			// we need to move the rest of the buffer
+			// to the begging to not lose any data
+			if (frame_start) {
+				memmove(recv_buff, recv_buff + frame_start, recv_off - frame_start);
+				recv_off -= frame_start;
+			}
+
+			// everything before the last sizeof(m_tag) - 1 bytes was already
+			// searched, no need to look at it again on the next receive
+			scan_off = recv_off - (int)sizeof(m_tag) + 1;
+			if (scan_off < 0)
+				scan_off = 0;
 		}
 
-		delete[] recv_buff; // we're done, we can free the buffer
+		// whatever is left is a frame that never got its end tag
+		if (recv_off)
+			stats.OnFramingError();
+
+		free(recv_buff); // we're done, we can free the buffer
 
 		// this can be used as a signal by other threads,
 		// so we need to reset it here
@@ -132,11 +287,156 @@ private:
 
 	const T& m_tag;
 
-	int m_buff_size;
+	std::atomic<int> m_buff_size;
+
+	std::unique_ptr<LatencyHistogram> m_latency = nullptr;
+	bool m_timestamps = false;
+	std::atomic<uint64_t> m_frame_timestamp{0};
+
+	std::shared_ptr<FlightRecorder> m_recorder = nullptr;
+	std::shared_ptr<CaptureWriter> m_capture = nullptr;
+
+	bool m_tcp_info_sampling = false;
+	uint64_t m_tcp_info_period_ns = 0;
+	std::mutex m_tcp_info_mutex;
+	LTcpInfo m_tcp_info = {};
 
 	std::unique_ptr<std::thread> m_thread = nullptr;
-	bool m_is_alive;
-	bool m_realloc_buff; // sync buff alloc trigger
+	std::atomic<bool> m_is_alive{false};
+	std::atomic<bool> m_realloc_buff{false}; // sync buff alloc trigger
 }; // class ThreadedRecvLoop 
 
+
+
+///////////////////////////////////////////////////////////////////////////////
+// QueuedRecvLoop - a ThreadedRecvLoop that pushes frames into an SpscRing
+//			 instead of calling back, for consumers that want to poll
+///////////////////////////////////////////////////////////////////////////////
+
+
+// a single frame handed over by a QueuedRecvLoop
+struct RecvFrame {
+	std::string data; // frame payload, without the end tag
+	uint64_t timestamp_ns = 0; // kernel receive timestamp, 0 if not enabled
+};
+
+// frames are copied into preallocated ring slots on the receiver thread,
+// a single consumer thread (e.g. a render/frame loop) polls them out
+// without taking any locks
+// if the consumer falls behind and the ring is full new frames are dropped
+// and counted, see GetDroppedCount()
+template<int FAM, int TYP, int PROTO, typename T>
+class QueuedRecvLoop {
+public:
+	inline QueuedRecvLoop(
+		std::shared_ptr<LSocket<FAM, TYP, PROTO>> soc,
+		const T& tag,
+		size_t queue_size = 64,
+		size_t recv_buff_size = 256
+	): m_queue(queue_size),
+		m_receiver(
+			soc,
+			tag,
+			[this](void* buff, size_t len) {on_frame(buff, len);},
+			recv_buff_size
+		) {}
+
+	inline void Start() {
+		m_receiver.Start();
+	}
+
+	inline bool IsAlive() {
+		return m_receiver.IsAlive();
+	}
+
+	inline void Stop() {
+		m_receiver.Stop();
+	}
+
+	inline void ReallocInternalBuffer(size_t new_size) {
+		m_receiver.ReallocInternalBuffer(new_size);
+	}
+
+	inline size_t GetBufferSize() {
+		return m_receiver.GetBufferSize();
+	}
+
+	inline SocketStatsSnapshot GetStatsSnapshot() {
+		return m_receiver.GetStatsSnapshot();
+	}
+
+	inline void EnableLatencyHistogram() {
+		m_receiver.EnableLatencyHistogram();
+	}
+
+	inline HistogramSnapshot GetLatencySnapshot() {
+		return m_receiver.GetLatencySnapshot();
+	}
+
+	inline int EnableTimestamps() {
+		return m_receiver.EnableTimestamps();
+	}
+
+	inline void EnableTcpInfoSampling(std::chrono::milliseconds period) {
+		m_receiver.EnableTcpInfoSampling(period);
+	}
+
+	inline bool GetTcpInfoSample(LTcpInfo& info) {
+		return m_receiver.GetTcpInfoSample(info);
+	}
+
+	inline void AttachFlightRecorder(std::shared_ptr<FlightRecorder> recorder) {
+		m_receiver.AttachFlightRecorder(recorder);
+	}
+
+	inline void AttachCapture(std::shared_ptr<CaptureWriter> capture) {
+		m_receiver.AttachCapture(capture);
+	}
+
+	/////////////////////////////
+	// consumer side
+	/////////////////////////////
+
+	// returns the oldest frame or nullptr if there is none,
+	// the frame stays valid until Pop() is called
+	inline RecvFrame* Front() {
+		return m_queue.Front();
+	}
+
+	// releases the frame returned by Front()
+	inline void Pop() {
+		m_queue.Pop();
+	}
+
+	// swaps the oldest frame into :out:, returns false if there is none
+	inline bool Poll(RecvFrame& out) {
+		return m_queue.TryPop(out);
+	}
+
+	// number of frames dropped because the queue was full
+	inline size_t GetDroppedCount() {
+		return m_dropped.load(std::memory_order_relaxed);
+	}
+
+private:
+	inline void on_frame(void* buff, size_t len) {
+		RecvFrame* frame = m_queue.Claim();
+		if (!frame) {
+			m_dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		frame->data.assign((const char*)buff, len);
+		frame->timestamp_ns = m_receiver.GetLastFrameTimestamp();
+		m_queue.Publish();
+	}
+
+private:
+	SpscRing<RecvFrame> m_queue;
+	std::atomic<size_t> m_dropped{0};
+
+	// declared last so its thread is joined before the queue goes away
+	ThreadedRecvLoop<FAM, TYP, PROTO, T> m_receiver;
+}; // class QueuedRecvLoop
+
 #endif // #ifndef __LAZY_SOCKET_RECEIVERS
\ No newline at end of file
@@ -0,0 +1,192 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// recorder.h - flight recorder of recent frames
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+#ifndef __LAZY_SOCKET_RECORDER
+#define __LAZY_SOCKET_RECORDER
+
+// include parent header
+#include "lazy_sockets.h"
+
+
+///////////////////////////////////////////////////////////////////////////////
+// FlightRecorder - last N frames of a connection in a memory mapped file
+///////////////////////////////////////////////////////////////////////////////
+
+
+// a frame read back from a flight recorder file
+struct FlightRecord {
+	uint64_t seq; // 1 based, counts every frame ever recorded
+	uint64_t timestamp_ns; // wall clock, kernel receive time if available
+	uint32_t size; // original frame size
+	std::string data; // frame payload, cut off at the slot size
+};
+
+// file layout, everything little endian as written by the host:
+//   FlightFileHeader
+//   slot_count slots of FlightSlotHeader + slot_size payload bytes
+struct FlightFileHeader {
+	char magic[8]; // "LSCFLTR\0"
+	uint32_t version;
+	uint32_t slot_count;
+	uint32_t slot_size;
+	uint32_t reserved;
+	uint64_t count; // frames recorded so far
+};
+
+struct FlightSlotHeader {
+	uint64_t seq; // 0 while the slot is being written
+	uint64_t timestamp_ns;
+	uint32_t size;
+	uint32_t stored; // bytes of payload actually kept
+};
+
+// Record() is a memcpy into the mapping and a few stores, no syscalls,
+// since the file is shared with the page cache whatever was recorded
+// is still there after the process crashes
+//
+// only one thread may call Record()
+class FlightRecorder {
+public:
+	static constexpr uint32_t VERSION = 1;
+
+	FlightRecorder() = default;
+
+	// no moving/coping this object, receivers hold on to it
+	FlightRecorder(const FlightRecorder&) = delete;
+	FlightRecorder& operator=(const FlightRecorder&) = delete;
+
+	// creates (or overwrites) :path: with room for :slot_count: frames
+	// of up to :slot_size: bytes each, longer frames get cut off
+	// returns 0 on success or -1 on error
+	inline int Open(const std::string& path, uint32_t slot_count = 256, uint32_t slot_size = 512) {
+		if (!slot_count || !slot_size) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		m_slot_count = slot_count;
+		m_slot_size = slot_size;
+		m_stride = slot_stride(slot_size);
+
+		if (m_file.Create(path, sizeof(FlightFileHeader) + (size_t)m_stride * slot_count))
+			return -1;
+
+		FlightFileHeader* header = file_header();
+		memset(header, 0, sizeof(*header));
+		memcpy(header->magic, "LSCFLTR", 8);
+		header->version = VERSION;
+		header->slot_count = slot_count;
+		header->slot_size = slot_size;
+		m_count = 0;
+		return 0;
+	}
+
+	inline bool IsOpen() const {
+		return m_file.IsOpen();
+	}
+
+	// keeps a copy of :len: bytes from :data:, overwriting the oldest frame
+	// :timestamp_ns: of 0 uses the current wall clock time
+	inline void Record(const void* data, size_t len, uint64_t timestamp_ns = 0) {
+		if (!m_file.IsOpen())
+			return;
+
+		uint64_t seq = ++m_count;
+		char* slot = m_file.Data() + sizeof(FlightFileHeader) + (size_t)m_stride * ((seq - 1) % m_slot_count);
+		FlightSlotHeader* slot_header = (FlightSlotHeader*)slot;
+
+		// a crash half way through leaves the slot marked invalid
+		slot_header->seq = 0;
+		std::atomic_thread_fence(std::memory_order_release);
+
+		uint32_t stored = len < m_slot_size ? (uint32_t)len : m_slot_size;
+		memcpy(slot + sizeof(FlightSlotHeader), data, stored);
+		slot_header->timestamp_ns = timestamp_ns ? timestamp_ns : get_wall_time_ns();
+		slot_header->size = (uint32_t)len;
+		slot_header->stored = stored;
+
+		std::atomic_thread_fence(std::memory_order_release);
+		slot_header->seq = seq;
+		file_header()->count = seq;
+	}
+
+	// pushes the recorded frames to disk, only needed to survive
+	// the whole machine going down, e.g. right after a bad frame
+	// returns 0 on success or -1 on error
+	inline int Sync(bool wait = false) {
+		return m_file.Sync(wait);
+	}
+
+	inline uint64_t GetRecordCount() const {
+		return m_count;
+	}
+
+	// reads the frames kept in a flight recorder file, oldest first
+	// returns 0 on success or -1 on error
+	inline static int ReadFile(const std::string& path, std::vector<FlightRecord>& out) {
+		out.clear();
+
+		MappedFile file;
+		if (file.OpenReadOnly(path))
+			return -1;
+
+		if (file.Size() < sizeof(FlightFileHeader)) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		FlightFileHeader header;
+		memcpy(&header, file.Data(), sizeof(header));
+		if (memcmp(header.magic, "LSCFLTR", 8) || header.version != VERSION) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		size_t stride = slot_stride(header.slot_size);
+		if (file.Size() < sizeof(FlightFileHeader) + stride * header.slot_count) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		for (uint32_t i=0; i < header.slot_count; i++) {
+			const char* slot = file.Data() + sizeof(FlightFileHeader) + stride * i;
+			FlightSlotHeader slot_header;
+			memcpy(&slot_header, slot, sizeof(slot_header));
+			if (!slot_header.seq || slot_header.stored > header.slot_size)
+				continue; // never written or torn
+
+			FlightRecord record;
+			record.seq = slot_header.seq;
+			record.timestamp_ns = slot_header.timestamp_ns;
+			record.size = slot_header.size;
+			record.data.assign(slot + sizeof(FlightSlotHeader), slot_header.stored);
+			out.push_back(std::move(record));
+		}
+
+		std::sort(out.begin(), out.end(), [](const FlightRecord& a, const FlightRecord& b) {
+			return a.seq < b.seq;
+		});
+		return 0;
+	}
+
+private:
+	// keeps the slot headers 8 byte aligned
+	inline static size_t slot_stride(uint32_t slot_size) {
+		return (sizeof(FlightSlotHeader) + slot_size + 7) & ~(size_t)7;
+	}
+
+	inline FlightFileHeader* file_header() {
+		return (FlightFileHeader*)m_file.Data();
+	}
+
+	MappedFile m_file;
+	uint32_t m_slot_count = 0;
+	uint32_t m_slot_size = 0;
+	size_t m_stride = 0;
+	uint64_t m_count = 0;
+}; // class FlightRecorder
+
+#endif // #ifndef __LAZY_SOCKET_RECORDER
@@ -0,0 +1,166 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// router.h - per message type handlers behind a receiver callback
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+#ifndef __LAZY_SOCKET_ROUTER
+#define __LAZY_SOCKET_ROUTER
+
+// include parent header
+#include "lazy_sockets.h"
+
+
+///////////////////////////////////////////////////////////////////////////////
+// MessageRouter - type field to handler, through a dense jump table
+///////////////////////////////////////////////////////////////////////////////
+
+// the runtime counterpart of MessageSchema::Dispatch(), for frames that
+// start with a :TypeField: type and whose handlers are only known at run
+// time, e.g. a driver that handles a different subset of messages per
+// device
+//
+// handlers are registered per type value into a table indexed by the type,
+// routing a frame is a size check, a bounds check and one indirect call,
+// no chain of compares no matter how many types there are
+//
+// register everything before the receiver is started, routing doesn't
+// lock, the table must not change while frames are being routed
+template<typename TypeField = uint32_t>
+class MessageRouter {
+	static_assert(std::is_integral<TypeField>::value, "the type field has to be an integer");
+
+public:
+	// gets the payload (the frame after the type field) and its length
+	using handler_t = std::function<void(const void* payload, size_t len)>;
+
+	// gets the type too, returns false if the frame is bad after all
+	using fallback_t = std::function<bool(TypeField type, const void* payload, size_t len)>;
+
+	// :frame_size: is the exact length of every frame, type field
+	// included, or 0 for frames of any length
+	inline explicit MessageRouter(size_t frame_size = 0): m_frame_size(frame_size) {}
+
+	// routes frames of :type: to :handler:, replacing the old handler
+	// returns 0 on success or -1 on error (EINVAL if :type: is negative or
+	// not below LSC_SCHEMA_MAX_ID, or :handler: is empty)
+	inline int On(TypeField type, handler_t handler) {
+		if (!handler || !valid_type(type)) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		size_t index = (size_t)type;
+		if (index >= m_table.size())
+			m_table.resize(index + 1);
+
+		// the size and check of an earlier typed handler go with it
+		m_table[index] = Entry{std::move(handler)};
+		return 0;
+	}
+
+	// same but for a packed payload struct :T:, the frame has to have at
+	// least sizeof(T) payload bytes and pass MessageCheck<T>, :handler: gets
+	// the payload in place, an empty :T: gets a default made one
+	template<typename T, typename H>
+	inline int On(TypeField type, H&& handler) {
+		static_assert(is_packed_struct<T>::value, "payloads are viewed in place, they have to be packed");
+
+		int res = On(type, [handler = std::forward<H>(handler)](const void* payload, size_t) {
+			if (std::is_empty<T>::value)
+				handler(T{});
+			else
+				handler(*(const T*)payload);
+		});
+		if (res)
+			return res;
+
+		Entry& entry = m_table[(size_t)type];
+		entry.min_size = std::is_empty<T>::value ? 0 : sizeof(T);
+		entry.check = [](const void* payload) {return MessageCheck<T>::Check(*(const T*)payload);};
+		return 0;
+	}
+
+	// stops routing :type:, frames of it go to the fallback
+	inline void Off(TypeField type) {
+		if (valid_type(type) && (size_t)type < m_table.size())
+			m_table[(size_t)type] = Entry();
+	}
+
+	// called for frames of types without a handler, if there's none those
+	// frames are rejected
+	inline void SetFallback(fallback_t fallback) {
+		m_fallback = std::move(fallback);
+	}
+
+	inline bool Has(TypeField type) const {
+		return valid_type(type) && (size_t)type < m_table.size() && m_table[(size_t)type].handler;
+	}
+
+	// routes :frame: to its handler, from one thread at a time
+	// returns false if no handler took it: a bad length, a payload too short
+	// or failing its check, or an unhandled type the fallback didn't take
+	inline bool Route(const void* frame, size_t len) {
+		if (len < sizeof(TypeField) || (m_frame_size && len != m_frame_size)) {
+			m_rejected.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+
+		TypeField type;
+		memcpy(&type, frame, sizeof(type));
+		const char* payload = (const char*)frame + sizeof(type);
+		size_t payload_len = len - sizeof(type);
+
+		if (valid_type(type) && (size_t)type < m_table.size()) {
+			const Entry& entry = m_table[(size_t)type];
+			if (entry.handler) {
+				if (payload_len < entry.min_size || (entry.check && !entry.check(payload))) {
+					m_rejected.fetch_add(1, std::memory_order_relaxed);
+					return false;
+				}
+
+				entry.handler(payload, payload_len);
+				return true;
+			}
+		}
+
+		if (m_fallback && m_fallback(type, payload, payload_len))
+			return true;
+
+		m_rejected.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	// a ThreadedRecvLoop callback that routes into this, with :on_reject:
+	// called for frames that weren't taken, this has to outlive the receiver
+	inline std::function<void(void*, size_t)> AsCallback(std::function<void(void*, size_t)> on_reject = nullptr) {
+		return [this, on_reject](void* frame, size_t len) {
+			if (!Route(frame, len) && on_reject)
+				on_reject(frame, len);
+		};
+	}
+
+	// frames Route() returned false for so far, thread safe
+	inline size_t GetRejectedCount() const {
+		return m_rejected.load(std::memory_order_relaxed);
+	}
+
+private:
+	struct Entry {
+		handler_t handler;
+		size_t min_size = 0;
+		bool (*check)(const void* payload) = nullptr;
+	};
+
+	static inline bool valid_type(TypeField type) {
+		// uint64_t types past INT64_MAX are past the limit anyway
+		return (int64_t)type >= 0 && (int64_t)type < LSC_SCHEMA_MAX_ID;
+	}
+
+	size_t m_frame_size;
+	std::vector<Entry> m_table;
+	fallback_t m_fallback;
+	std::atomic<size_t> m_rejected{0};
+}; // class MessageRouter
+
+#endif // #ifndef __LAZY_SOCKET_ROUTER
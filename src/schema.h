@@ -0,0 +1,215 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// schema.h - compile time message schemas, sizes, encoders and dispatch
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+#ifndef __LAZY_SOCKET_SCHEMA
+#define __LAZY_SOCKET_SCHEMA
+
+// include parent header
+#include "lazy_sockets.h"
+
+
+// a message type of a schema, :ID: is the value of the type field on the
+// wire and :T: the packed payload struct, an empty :T: is a message that
+// is only its type
+template<uint32_t ID, typename T>
+struct MessageDef {
+	static_assert(is_packed_struct<T>::value, "payloads are viewed in place, they have to be packed");
+
+	static constexpr uint32_t id = ID;
+	using type = T;
+	static constexpr size_t size = std::is_empty<T>::value ? 0 : sizeof(T);
+};
+
+// checks a payload can be trusted past its size, e.g. that a length field
+// doesn't point outside the payload, specialize it for such payloads
+// a payload that fails this is treated like an unknown message type
+template<typename T>
+struct MessageCheck {
+	static bool Check(const T&) {
+		return true;
+	}
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// SizeTable - payload size by message id
+///////////////////////////////////////////////////////////////////////////////
+
+// everything here is constexpr, a size lookup is a loop the compiler folds
+// or a single compare per message type at worst
+template<typename... Defs>
+struct SizeTable {
+	static_assert(sizeof...(Defs) > 0, "a schema needs at least one message");
+
+	static constexpr uint32_t k_ids[] = {Defs::id...};
+	static constexpr size_t k_sizes[] = {Defs::size...};
+	static constexpr size_t k_count = sizeof...(Defs);
+
+	// payload size of :id:, 0 if unknown (or empty)
+	static constexpr size_t SizeOf(uint32_t id) {
+		for (size_t i=0; i < k_count; i++)
+			if (k_ids[i] == id)
+				return k_sizes[i];
+		return 0;
+	}
+
+	static constexpr bool Has(uint32_t id) {
+		for (size_t i=0; i < k_count; i++)
+			if (k_ids[i] == id)
+				return true;
+		return false;
+	}
+
+	// biggest payload
+	static constexpr size_t MaxSize() {
+		size_t out = 0;
+		for (size_t i=0; i < k_count; i++)
+			out = std::max(out, k_sizes[i]);
+		return out;
+	}
+
+	static constexpr uint32_t MaxId() {
+		uint32_t out = 0;
+		for (size_t i=0; i < k_count; i++)
+			out = std::max(out, k_ids[i]);
+		return out;
+	}
+
+	// true if no id is used twice
+	static constexpr bool UniqueIds() {
+		for (size_t i=0; i < k_count; i++)
+			for (size_t j=i + 1; j < k_count; j++)
+				if (k_ids[i] == k_ids[j])
+					return false;
+		return true;
+	}
+
+	// id of the message with payload :T:, there has to be exactly one
+	template<typename T>
+	static constexpr uint32_t IdOf() {
+		static_assert((std::is_same<T, typename Defs::type>::value + ...) == 1, "payload type has to be in the schema exactly once");
+
+		uint32_t out = 0;
+		((out = std::is_same<T, typename Defs::type>::value ? Defs::id : out), ...);
+		return out;
+	}
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// MessageSchema - messages of a type field and a fixed size payload area
+///////////////////////////////////////////////////////////////////////////////
+
+// the layout of a packed struct like
+//   struct Msg {TypeField type; union {...} data; Tag terminator;};
+// the union being :PAYLOAD: bytes, at least as big as every payload
+//
+// Encode() writes a frame (everything before the terminator) for a payload,
+// Dispatch() validates a frame once and calls a visitor with the payload
+// viewed in place, through a jump table indexed by the type field, so a
+// new message type is one more MessageDef, no new size checks or switch
+// cases anywhere
+template<typename TypeField, size_t PAYLOAD, typename... Defs>
+class MessageSchema: public SizeTable<Defs...> {
+	using table = SizeTable<Defs...>;
+
+	static_assert(std::is_integral<TypeField>::value, "the type field has to be an integer");
+	static_assert(table::UniqueIds(), "message ids have to be unique");
+	static_assert(table::MaxSize() <= PAYLOAD, "a payload doesn't fit the payload area");
+	static_assert(table::MaxId() < LSC_SCHEMA_MAX_ID, "ids too sparse for a jump table, raise LSC_SCHEMA_MAX_ID");
+
+public:
+	static constexpr size_t k_payload_size = PAYLOAD;
+	static constexpr size_t k_frame_size = sizeof(TypeField) + PAYLOAD;
+
+	// writes the k_frame_size byte frame for :payload: to :frame:,
+	// unused payload bytes are zeroed
+	template<typename T>
+	static void Encode(const T& payload, void* frame) {
+		constexpr uint32_t id = table::template IdOf<T>();
+		TypeField type = (TypeField)id;
+
+		char* p = (char*)frame;
+		memcpy(p, &type, sizeof(type));
+		constexpr size_t size = table::SizeOf(id);
+		if (size)
+			memcpy(p + sizeof(type), &payload, size);
+		memset(p + sizeof(type) + size, 0, PAYLOAD - size);
+	}
+
+	// appends the frame for :payload: to :out:
+	template<typename T>
+	static void Encode(const T& payload, std::string& out) {
+		size_t off = out.size();
+		out.resize(off + k_frame_size);
+		Encode(payload, &out[off]);
+	}
+
+	// calls :visitor:(const T&) with the payload of :frame: in place
+	// (an empty T for messages that are only a type)
+	// returns false without calling :visitor: if :len: isn't k_frame_size,
+	// the type is unknown or the payload fails its MessageCheck
+	template<typename V>
+	static bool Dispatch(const void* frame, size_t len, V&& visitor) {
+		using visitor_t = std::remove_reference_t<V>;
+		static constexpr auto k_table = make_table<visitor_t>();
+
+		if (len != k_frame_size)
+			return false;
+
+		TypeField type;
+		memcpy(&type, frame, sizeof(type));
+		if ((uint64_t)type >= k_table.size())
+			return false;
+
+		return k_table[(size_t)type]((const char*)frame + sizeof(type), visitor);
+	}
+
+	// type field of :frame:, for logging, no checks beyond the size
+	static bool PeekType(const void* frame, size_t len, TypeField& type) {
+		if (len < sizeof(type))
+			return false;
+
+		memcpy(&type, frame, sizeof(type));
+		return true;
+	}
+
+private:
+	template<typename V>
+	using handler_t = bool (*)(const char* payload, V& visitor);
+
+	template<typename V, typename Def>
+	static bool handle(const char* payload, V& visitor) {
+		using T = typename Def::type;
+		if (std::is_empty<T>::value) {
+			visitor(T{});
+			return true;
+		}
+
+		const T& msg = *(const T*)payload;
+		if (!MessageCheck<T>::Check(msg))
+			return false;
+
+		visitor(msg);
+		return true;
+	}
+
+	template<typename V>
+	static bool reject(const char*, V&) {
+		return false;
+	}
+
+	template<typename V>
+	static constexpr std::array<handler_t<V>, table::MaxId() + 1> make_table() {
+		std::array<handler_t<V>, table::MaxId() + 1> out = {};
+		for (size_t i=0; i < out.size(); i++)
+			out[i] = &reject<V>;
+		((out[Defs::id] = &handle<V, Defs>), ...);
+		return out;
+	}
+}; // class MessageSchema
+
+#endif // #ifndef __LAZY_SOCKET_SCHEMA
@@ -0,0 +1,631 @@
+#ifndef __LAZY_SOCKET_SENDERS
+#define __LAZY_SOCKET_SENDERS
+
+// include parent header
+#include "lazy_sockets.h"
+
+
+///////////////////////////////////////////////////////////////////////////////
+// ThreadedSendLoop - a threaded send loop, any thread can queue frames
+//			 which a single writer thread sends out in vectored batches
+///////////////////////////////////////////////////////////////////////////////
+
+
+// send lane scheduling classes
+enum ESendPriority: int {
+	ESendPrio_realtime = 0, // always sent first, strict priority
+	ESendPrio_bulk = 1 // shares the rest of the bandwidth by weight
+};
+
+// frames are never interleaved on the wire, a frame is always sent out
+// completely (partial writes are finished) before the next one starts
+//
+// frames are queued into lanes, lane 0 always exists and is a bulk lane,
+// more can be added with AddLane(), frames within a lane keep their order
+// each batch the writer takes everything queued on realtime lanes first,
+// then fills up with bulk frames using deficit round robin, a bulk lane
+// gets weight * LSC_SEND_QUANTUM bytes per round
+// a batch holds at most LSC_SEND_BATCH_BYTES of bulk data, so a realtime
+// frame never waits for more than that (plus one frame) to go out
+//
+// optionally the writer can hold frames back to coalesce them,
+// see SetCoalescing(), realtime frames are never held back
+//
+// the loop only keeps a weak reference to the socket,
+// same as with ThreadedRecvLoop releasing the socket makes the writer exit
+// has to be a purely inlined class because template bs
+template<int FAM, int TYP, int PROTO>
+class ThreadedSendLoop {
+	struct Lane {
+		MpscQueue<std::string> queue;
+		ESendPriority priority;
+		size_t quantum; // bulk lanes only, bytes added to deficit per round
+		size_t deficit = 0;
+
+		// bulk frame that was popped, but didn't fit into the last round
+		std::string head;
+		bool has_head = false;
+	};
+
+public:
+	inline ThreadedSendLoop(
+		std::shared_ptr<LSocket<FAM, TYP, PROTO>> soc
+	): m_soc(soc) {
+		AddLane(ESendPrio_bulk);
+	}
+
+	inline ~ThreadedSendLoop() {
+		Stop();
+	}
+
+	// has to be called before Start()
+	// adds a lane with :priority:, :weight: only matters for bulk lanes
+	// returns the lane id to pass to Send()
+	inline int AddLane(ESendPriority priority, size_t weight = 1) {
+		auto lane = std::make_unique<Lane>();
+		lane->priority = priority;
+		lane->quantum = (weight ? weight : 1) * LSC_SEND_QUANTUM;
+		m_lanes.push_back(std::move(lane));
+		return (int)m_lanes.size() - 1;
+	}
+
+	// has to be called before Start()
+	// the writer waits until :max_bytes: are queued or the oldest queued
+	// frame has waited for :max_delay:, whichever comes first, and then
+	// sends everything in one go
+	// a :max_delay: of 0 disables coalescing, frames are sent as soon as
+	// the writer gets to them
+	// on stream sockets nagle's algorithm is disabled on Start(),
+	// it would otherwise add its own delay on top of ours
+	inline void SetCoalescing(size_t max_bytes, std::chrono::microseconds max_delay) {
+		m_coalesce_bytes = max_bytes;
+		m_coalesce_delay = max_delay;
+	}
+
+	inline void Start() {
+		if (TYP == SOCK_STREAM && m_coalesce_delay.count() > 0) {
+			auto soc = m_soc.lock();
+			if (soc)
+				soc->SetNoDelay(true); // not every stream socket is tcp, ignore errors
+		}
+
+		m_is_alive = true;
+		m_thread = std::make_unique<std::thread>(ThreadedSendLoop::thread_enter, this);
+	}
+
+	inline bool IsAlive() {
+		return m_is_alive;
+	}
+
+	// stops the writer after it has sent out everything queued so far,
+	// every SendString() that returned true included
+	inline void Stop() {
+		m_is_alive = false;
+		wake_writer();
+		if (m_thread)
+			if (m_thread->joinable())
+				m_thread->join();
+	}
+
+	// queues a copy of :size: bytes from :buff: as a single frame, thread safe
+	// returns false if the writer isn't running or :lane: doesn't exist
+	inline bool Send(const void* buff, size_t size, int lane = 0) {
+		return SendString(std::string((const char*)buff, size), lane);
+	}
+
+	// queues :frame: without copying it, thread safe
+	// returns false if the writer isn't running or :lane: doesn't exist
+	inline bool SendString(std::string&& frame, int lane = 0) {
+		if (lane < 0 || lane >= (int)m_lanes.size())
+			return false;
+
+		// the writer doesn't exit while we're between the check and the push,
+		// pairs with the m_is_alive/m_producers loads in thread_internal()
+		m_producers.fetch_add(1, std::memory_order_seq_cst);
+		if (!m_is_alive.load(std::memory_order_seq_cst)) {
+			m_producers.fetch_sub(1, std::memory_order_release);
+			return false;
+		}
+
+		size_t queued = m_queued_bytes.fetch_add(frame.size(), std::memory_order_relaxed) + frame.size();
+		m_lanes[lane]->queue.Push(std::move(frame));
+		m_producers.fetch_sub(1, std::memory_order_release);
+
+		// pairs with the fence in wait_for_frames(),
+		// either we see the writer sleeping or it sees our frame
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_writer_sleeping.load(std::memory_order_relaxed)) {
+			if (m_lanes[lane]->priority == ESendPrio_realtime
+				|| queued >= m_wake_bytes.load(std::memory_order_relaxed))
+				wake_writer();
+		}
+
+		return true;
+	}
+
+	// number of bytes queued but not yet handed to the kernel
+	inline size_t GetQueuedBytes() {
+		return m_queued_bytes.load(std::memory_order_relaxed);
+	}
+
+	// last socket error seen by the writer, 0 if none
+	inline int GetLastError() {
+		return m_last_error;
+	}
+
+
+private:
+	inline static void thread_enter(ThreadedSendLoop* self) {
+		self->thread_internal();
+	}
+
+	inline void wake_writer() {
+		std::lock_guard<std::mutex> lk(m_wake_mutex);
+		m_wake_cv.notify_one();
+	}
+
+	// writer thread only
+	inline bool lanes_empty() {
+		for (auto& lane : m_lanes)
+			if (lane->has_head || !lane->queue.Empty())
+				return false;
+
+		return true;
+	}
+
+	// blocks until there is something in the queue, we're stopped or
+	// :deadline: is reached
+	// producers only wake us once at least :wake_bytes: are queued
+	// or a realtime frame comes in
+	inline void wait_for_frames(
+		std::chrono::steady_clock::time_point deadline,
+		size_t wake_bytes
+	) {
+		std::unique_lock<std::mutex> lk(m_wake_mutex);
+		m_wake_bytes.store(wake_bytes, std::memory_order_relaxed);
+		m_writer_sleeping.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		bool should_wait = wake_bytes
+			? m_queued_bytes.load(std::memory_order_relaxed) < wake_bytes && !realtime_pending()
+			: lanes_empty();
+
+		if (should_wait && m_is_alive)
+			m_wake_cv.wait_until(lk, deadline);
+
+		m_writer_sleeping.store(false, std::memory_order_relaxed);
+	}
+
+	// writer thread only
+	inline bool realtime_pending() {
+		for (auto& lane : m_lanes)
+			if (lane->priority == ESendPrio_realtime && !lane->queue.Empty())
+				return true;
+
+		return false;
+	}
+
+	// sends all of :iov:, finishing partial writes
+	// returns false on a socket error
+	inline bool send_batch(liovec_t* iov, int count, ESendFlags flags) {
+		auto soc = m_soc.lock();
+		if (!soc) {
+			m_last_error = EPIPE;
+			return false;
+		}
+
+		// a vectored send is a single datagram, so frames have to go out
+		// one by one, the socket counts datagrams itself
+		if (TYP == SOCK_DGRAM) {
+			for (int i=0; i < count; i++) {
+				if (soc->SendV(iov + i, 1, flags) < 0) {
+					m_last_error = lerrno;
+					return false;
+				}
+			}
+
+			return true;
+		}
+
+		// count frames before SendAllV trims the iovs
+		SocketStats& stats = soc->GetStats();
+		for (int i=0; i < count; i++)
+			stats.OnFrameOut(get_iovec_len(iov[i]));
+
+		if (soc->SendAllV(iov, count, flags) < 0) {
+			m_last_error = lerrno;
+			return false;
+		}
+
+		return true;
+	}
+
+	// moves frames from the lanes into :batch:
+	// realtime lanes are drained first, then bulk lanes are served with
+	// deficit round robin until the batch holds LSC_IOV_MAX frames or
+	// LSC_SEND_BATCH_BYTES bulk bytes, whatever is first
+	// returns true if any realtime frames were taken
+	inline bool gather(std::vector<std::string>& batch, liovec_t* iov, int& count, size_t& batch_bytes) {
+		bool realtime = false;
+
+		for (auto& lane : m_lanes) {
+			if (lane->priority != ESendPrio_realtime)
+				continue;
+
+			while (count < LSC_IOV_MAX && lane->queue.TryPop(batch[count])) {
+				set_iovec(iov[count], batch[count].data(), batch[count].size());
+				batch_bytes += batch[count].size();
+				count++;
+				realtime = true;
+			}
+		}
+
+		size_t lanes = m_lanes.size();
+		size_t bulk_bytes = 0;
+		while (count < LSC_IOV_MAX && bulk_bytes < LSC_SEND_BATCH_BYTES) {
+			bool pending = false;
+
+			for (; m_rr_pos < lanes; m_rr_pos++, m_rr_visited = false) {
+				Lane& lane = *m_lanes[m_rr_pos];
+				if (lane.priority != ESendPrio_bulk)
+					continue;
+
+				if (!lane.has_head)
+					lane.has_head = lane.queue.TryPop(lane.head);
+				if (!lane.has_head) {
+					lane.deficit = 0; // idle lanes don't get to save up
+					continue;
+				}
+
+				// a lane gets its quantum once per round, even if the batch
+				// filled up in the middle of serving it
+				if (!m_rr_visited) {
+					lane.deficit += lane.quantum;
+					m_rr_visited = true;
+				}
+
+				while (lane.has_head && lane.head.size() <= lane.deficit) {
+					if (count >= LSC_IOV_MAX || bulk_bytes >= LSC_SEND_BATCH_BYTES)
+						return realtime; // resume with this lane next batch
+
+					lane.deficit -= lane.head.size();
+					bulk_bytes += lane.head.size();
+
+					std::swap(batch[count], lane.head);
+					set_iovec(iov[count], batch[count].data(), batch[count].size());
+					batch_bytes += batch[count].size();
+					count++;
+
+					lane.has_head = lane.queue.TryPop(lane.head);
+				}
+
+				if (lane.has_head)
+					pending = true; // needs more rounds to save up for its frame
+				else
+					lane.deficit = 0;
+			}
+
+			m_rr_pos = 0; // round done
+
+			if (!pending)
+				break; // all bulk lanes are drained
+		}
+
+		return realtime;
+	}
+
+	inline void thread_internal() {
+		std::vector<std::string> batch(LSC_IOV_MAX);
+		liovec_t iov[LSC_IOV_MAX];
+
+		int count = 0;
+		size_t batch_bytes = 0;
+		bool realtime = false;
+		std::chrono::steady_clock::time_point flush_deadline;
+
+		while (true) {
+			// gather as many frames as we can fit into one syscall
+			realtime |= gather(batch, iov, count, batch_bytes);
+
+			auto now = std::chrono::steady_clock::now();
+
+			if (!count) {
+				// stopped, no producer is about to push and all is drained
+				if (!m_is_alive.load(std::memory_order_seq_cst)
+					&& !m_producers.load(std::memory_order_seq_cst) && lanes_empty())
+					break;
+
+				wait_for_frames(now + std::chrono::milliseconds(100), 0);
+				continue;
+			}
+
+			// hold the batch back if we're coalescing and there's still room
+			if (m_coalesce_delay.count() > 0 && m_is_alive && !realtime
+				&& count < LSC_IOV_MAX && batch_bytes < m_coalesce_bytes) {
+				if (flush_deadline == std::chrono::steady_clock::time_point())
+					flush_deadline = now + m_coalesce_delay; // first frame of the batch
+
+				if (now < flush_deadline) {
+					wait_for_frames(flush_deadline, m_coalesce_bytes);
+					continue;
+				}
+			}
+
+			// if the batch was cut short by the iov limit, tell the kernel
+			// more is coming so it doesn't push out a runt segment
+			int flags = ESend_nosignal;
+			if (TYP == SOCK_STREAM && count == LSC_IOV_MAX && !lanes_empty())
+				flags |= ESend_more;
+
+			bool ok = send_batch(iov, count, (ESendFlags)flags);
+			m_queued_bytes.fetch_sub(batch_bytes, std::memory_order_relaxed);
+			count = 0;
+			batch_bytes = 0;
+			realtime = false;
+			flush_deadline = std::chrono::steady_clock::time_point();
+
+			if (!ok)
+				break;
+		}
+
+		// this can be used as a signal by other threads,
+		// so we need to reset it here
+		m_is_alive = false;
+	}
+
+private:
+	std::weak_ptr<LSocket<FAM, TYP, PROTO>> m_soc;
+
+	// fixed after Start(), the lanes themselves are thread safe
+	std::vector<std::unique_ptr<Lane>> m_lanes;
+	std::atomic<size_t> m_queued_bytes{0};
+
+	// writer thread only scheduling state
+	size_t m_rr_pos = 0; // bulk lane the current round is at
+	bool m_rr_visited = false; // m_rr_pos already got its quantum this round
+
+	// coalescing settings
+	size_t m_coalesce_bytes = 0;
+	std::chrono::microseconds m_coalesce_delay{0};
+
+	// writer wake up, only touched when the writer runs out of frames
+	std::mutex m_wake_mutex;
+	std::condition_variable m_wake_cv;
+	std::atomic<bool> m_writer_sleeping{false};
+	std::atomic<size_t> m_wake_bytes{0};
+
+	std::unique_ptr<std::thread> m_thread = nullptr;
+	std::atomic<bool> m_is_alive{false};
+	std::atomic<int> m_producers{0}; // SendString() calls past the alive check
+	std::atomic<int> m_last_error{0};
+}; // class ThreadedSendLoop
+
+
+///////////////////////////////////////////////////////////////////////////////
+// BufferedWriter - non blocking writer with a user space outbound buffer
+//			 and high/low watermark backpressure signalling
+///////////////////////////////////////////////////////////////////////////////
+
+
+// Write() never blocks, whatever the kernel doesn't take right away is kept
+// in the outbound buffer and sent out by later Write()/Flush() calls,
+// frames are always kept whole and in order, on datagram sockets every
+// Write() stays its own datagram
+//
+// once the buffered amount reaches the high watermark :on_high: is called,
+// producers should stop writing until :on_low: is called, which happens
+// once the buffer drains down to the low watermark
+//
+// not thread safe, use a single producer thread or a ThreadedSendLoop
+// on windows the socket has to be switched to non blocking mode with
+// LSocket::SetNonBlocking() first, there is no per call MSG_DONTWAIT
+template<int FAM, int TYP, int PROTO>
+class BufferedWriter {
+public:
+	inline BufferedWriter(
+		std::shared_ptr<LSocket<FAM, TYP, PROTO>> soc,
+		size_t high_watermark = 1024 * 1024,
+		size_t low_watermark = 256 * 1024
+	): m_soc(soc), m_high_watermark(high_watermark), m_low_watermark(low_watermark) {}
+
+	// :on_high: and :on_low: are called with the current buffered amount
+	inline void SetWatermarkCallbacks(
+		std::function<void(size_t)> on_high,
+		std::function<void(size_t)> on_low
+	) {
+		m_on_high = on_high;
+		m_on_low = on_low;
+	}
+
+	// sends :size: bytes from :buff: or buffers what couldn't be sent
+	// returns 0 on success or -1 on a socket error, the frame is dropped then
+	inline int Write(const void* buff, size_t size) {
+		// don't jump the queue, older data has to go out first
+		if (has_buffered() && Flush() < 0)
+			return -1;
+
+		bool blocked = false;
+		if constexpr (TYP == SOCK_DGRAM) {
+			if (m_datagrams.empty() && send_some(buff, size, blocked) < 0)
+				return -1;
+
+			// datagrams go out whole or not at all
+			if (blocked || !m_datagrams.empty()) {
+				m_datagrams.emplace_back((const char*)buff, size);
+				m_datagram_bytes += size;
+				check_high();
+			}
+
+			return 0; // the socket counts datagrams itself
+		}
+
+		size_t sent = 0;
+		if (!has_buffered()) {
+			int res = send_some(buff, size, blocked);
+			if (res < 0)
+				return -1;
+
+			sent = res;
+		}
+
+		if (sent < size) {
+			m_buffer.insert(m_buffer.end(), (const char*)buff + sent, (const char*)buff + size);
+			check_high();
+		}
+
+		auto soc = m_soc.lock();
+		if (soc)
+			soc->GetStats().OnFrameOut(size);
+
+		return 0;
+	}
+
+	// tries to send out buffered data without blocking
+	// returns the number of bytes still buffered or -1 on a socket error
+	inline int Flush() {
+		if constexpr (TYP == SOCK_DGRAM) {
+			while (!m_datagrams.empty()) {
+				bool blocked = false;
+				const std::string& datagram = m_datagrams.front();
+				if (send_some(datagram.data(), datagram.size(), blocked) < 0)
+					return -1;
+				if (blocked)
+					break; // kernel buffer is full
+
+				m_datagram_bytes -= datagram.size();
+				m_datagrams.pop_front();
+			}
+
+			check_low();
+			return (int)GetBufferedBytes();
+		}
+
+		while (GetBufferedBytes()) {
+			bool blocked = false;
+			int res = send_some(m_buffer.data() + m_read_off, GetBufferedBytes(), blocked);
+			if (res < 0)
+				return -1;
+			if (blocked)
+				break; // kernel buffer is full
+
+			m_read_off += res;
+		}
+
+		// reclaim the sent part once it dominates the buffer
+		if (m_read_off == m_buffer.size()) {
+			m_buffer.clear();
+			m_read_off = 0;
+		} else if (m_read_off > m_buffer.size() / 2) {
+			m_buffer.erase(m_buffer.begin(), m_buffer.begin() + m_read_off);
+			m_read_off = 0;
+		}
+
+		check_low();
+		return (int)GetBufferedBytes();
+	}
+
+	// blocks up to :timeout_ms: (-1 for forever) until the buffer is empty
+	// returns 0 once drained or -1 on error or timeout
+	inline int FlushAll(int timeout_ms = -1) {
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+		while (true) {
+			int res = Flush();
+			if (res < 0 || !has_buffered())
+				return res;
+
+			int wait_ms = -1;
+			if (timeout_ms >= 0) {
+				auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+					deadline - std::chrono::steady_clock::now()
+				).count();
+				if (left <= 0) {
+					errno = ETIMEDOUT;
+					return -1;
+				}
+				wait_ms = (int)left;
+			}
+
+			auto soc = m_soc.lock();
+			if (!soc || (soc->Poll(EPoll_out, wait_ms) < 0 && lerrno != LSOCK_EINTR))
+				return -1;
+		}
+	}
+
+	inline size_t GetBufferedBytes() {
+		if (TYP == SOCK_DGRAM)
+			return m_datagram_bytes;
+
+		return m_buffer.size() - m_read_off;
+	}
+
+	// true between the high watermark being hit and the buffer draining
+	// down to the low watermark
+	inline bool IsThrottled() {
+		return m_throttled;
+	}
+
+private:
+	// empty datagrams are buffered too, they just don't add any bytes
+	inline bool has_buffered() {
+		return GetBufferedBytes() || !m_datagrams.empty();
+	}
+
+	// returns the number of bytes the kernel took or -1,
+	// :blocked: is set if it took nothing because its buffer is full
+	inline int send_some(const void* buff, size_t size, bool& blocked) {
+		auto soc = m_soc.lock();
+		if (!soc) {
+			errno = EPIPE;
+			return -1;
+		}
+
+		while (true) {
+			int res = soc->Send(buff, size, (ESendFlags)(ESend_nowait | ESend_nosignal));
+			if (res >= 0)
+				return res;
+
+			int err = lerrno;
+			if (err == LSOCK_WOULDBLOCK) {
+				blocked = true;
+				return 0;
+			}
+			if (err != LSOCK_EINTR)
+				return -1;
+		}
+	}
+
+	inline void check_high() {
+		if (!m_throttled && GetBufferedBytes() >= m_high_watermark) {
+			m_throttled = true;
+			if (m_on_high)
+				m_on_high(GetBufferedBytes());
+		}
+	}
+
+	inline void check_low() {
+		if (m_throttled && GetBufferedBytes() <= m_low_watermark) {
+			m_throttled = false;
+			if (m_on_low)
+				m_on_low(GetBufferedBytes());
+		}
+	}
+
+private:
+	std::weak_ptr<LSocket<FAM, TYP, PROTO>> m_soc;
+
+	std::vector<char> m_buffer;
+	size_t m_read_off = 0; // start of the unsent data in m_buffer
+
+	// datagram sockets only, one entry per datagram
+	std::deque<std::string> m_datagrams;
+	size_t m_datagram_bytes = 0;
+
+	size_t m_high_watermark;
+	size_t m_low_watermark;
+	bool m_throttled = false;
+
+	std::function<void(size_t)> m_on_high;
+	std::function<void(size_t)> m_on_low;
+}; // class BufferedWriter
+
+#endif // #ifndef __LAZY_SOCKET_SENDERS
@@ -0,0 +1,172 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// simd.h - small vectorized helpers for checking and reshaping float data
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+#ifndef __LAZY_SOCKET_SIMD
+#define __LAZY_SOCKET_SIMD
+
+// include parent header
+#include "lazy_sockets.h"
+
+
+// everything here takes untyped pointers, the floats usually live in
+// packed structs where they can sit at any address, and a float* to
+// them would be lying about the alignment
+
+
+// true if none of the :count: floats at :data: is a NaN or an infinity
+inline bool AllFinite(const void* data, size_t count) {
+	const char* p = (const char*)data;
+	size_t i = 0;
+
+	// a float is NaN/inf when all of its exponent bits are set
+	#ifdef LSC_SSE2
+	const __m128i exp_mask = _mm_set1_epi32(0x7f800000);
+	__m128i bad = _mm_setzero_si128();
+	for (; i + 4 <= count; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(p + i * 4));
+		bad = _mm_or_si128(bad, _mm_cmpeq_epi32(_mm_and_si128(v, exp_mask), exp_mask));
+	}
+	if (_mm_movemask_epi8(bad))
+		return false;
+	#endif // #ifdef LSC_SSE2
+
+	for (; i < count; i++) {
+		uint32_t bits;
+		memcpy(&bits, p + i * 4, 4);
+		if ((bits & 0x7f800000) == 0x7f800000)
+			return false;
+	}
+
+	return true;
+}
+
+// squared length of the 4 floats at :q:, 1 for a unit quaternion
+inline float SquaredNorm4(const void* q) {
+	#ifdef LSC_SSE2
+	__m128 v = _mm_loadu_ps((const float*)q);
+	__m128 sq = _mm_mul_ps(v, v);
+	__m128 sum = _mm_add_ps(sq, _mm_shuffle_ps(sq, sq, _MM_SHUFFLE(2, 3, 0, 1)));
+	sum = _mm_add_ss(sum, _mm_movehl_ps(sum, sum));
+	return _mm_cvtss_f32(sum);
+	#else
+	float v[4];
+	memcpy(v, q, sizeof(v));
+	return v[0] * v[0] + v[1] * v[1] + v[2] * v[2] + v[3] * v[3];
+	#endif // #ifdef LSC_SSE2
+}
+
+// copies :count: records of :fields: floats each, :stride: bytes apart,
+// into one array per field (structure of arrays), out[f][i] is field f
+// of record i, fields are moved 4x4 at a time with register transposes
+inline void DeinterleaveFloats(const void* src, size_t stride, size_t count, size_t fields, float* const* out) {
+	const char* p = (const char*)src;
+	size_t i = 0;
+
+	#ifdef LSC_SSE2
+	if (fields >= 4) {
+		for (; i + 4 <= count; i += 4) {
+			const char* rec = p + i * stride;
+			for (size_t f=0; f < fields; f += 4) {
+				// the last group overlaps the one before if fields isn't a multiple of 4
+				size_t first = f + 4 <= fields ? f : fields - 4;
+				__m128 r0 = _mm_loadu_ps((const float*)(rec + first * 4));
+				__m128 r1 = _mm_loadu_ps((const float*)(rec + stride + first * 4));
+				__m128 r2 = _mm_loadu_ps((const float*)(rec + 2 * stride + first * 4));
+				__m128 r3 = _mm_loadu_ps((const float*)(rec + 3 * stride + first * 4));
+				_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+				_mm_storeu_ps(out[first] + i, r0);
+				_mm_storeu_ps(out[first + 1] + i, r1);
+				_mm_storeu_ps(out[first + 2] + i, r2);
+				_mm_storeu_ps(out[first + 3] + i, r3);
+			}
+		}
+	}
+	#endif // #ifdef LSC_SSE2
+
+	for (; i < count; i++)
+		for (size_t f=0; f < fields; f++)
+			memcpy(out[f] + i, p + i * stride + f * 4, 4);
+}
+
+// the reverse of DeinterleaveFloats, writes :count: records of :fields:
+// floats, :stride: bytes apart, from one array per field,
+// bytes of a record past :fields: floats are left alone
+inline void InterleaveFloats(const float* const* in, size_t count, size_t fields, void* dst, size_t stride) {
+	char* p = (char*)dst;
+	size_t i = 0;
+
+	#ifdef LSC_SSE2
+	if (fields >= 4) {
+		for (; i + 4 <= count; i += 4) {
+			char* rec = p + i * stride;
+			for (size_t f=0; f < fields; f += 4) {
+				size_t first = f + 4 <= fields ? f : fields - 4;
+				__m128 r0 = _mm_loadu_ps(in[first] + i);
+				__m128 r1 = _mm_loadu_ps(in[first + 1] + i);
+				__m128 r2 = _mm_loadu_ps(in[first + 2] + i);
+				__m128 r3 = _mm_loadu_ps(in[first + 3] + i);
+				_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+				_mm_storeu_ps((float*)(rec + first * 4), r0);
+				_mm_storeu_ps((float*)(rec + stride + first * 4), r1);
+				_mm_storeu_ps((float*)(rec + 2 * stride + first * 4), r2);
+				_mm_storeu_ps((float*)(rec + 3 * stride + first * 4), r3);
+			}
+		}
+	}
+	#endif // #ifdef LSC_SSE2
+
+	for (; i < count; i++)
+		for (size_t f=0; f < fields; f++)
+			memcpy(p + i * stride + f * 4, in[f] + i, 4);
+}
+
+// scales :count: quaternions given as 4 separate component arrays
+// to unit length, in place, 4 at a time,
+// a zero length quaternion becomes the identity (1, 0, 0, 0)
+inline void NormalizeQuaternions(float* w, float* x, float* y, float* z, size_t count) {
+	size_t i = 0;
+
+	#ifdef LSC_SSE2
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	for (; i + 4 <= count; i += 4) {
+		__m128 vw = _mm_loadu_ps(w + i);
+		__m128 vx = _mm_loadu_ps(x + i);
+		__m128 vy = _mm_loadu_ps(y + i);
+		__m128 vz = _mm_loadu_ps(z + i);
+
+		__m128 norm = _mm_add_ps(
+			_mm_add_ps(_mm_mul_ps(vw, vw), _mm_mul_ps(vx, vx)),
+			_mm_add_ps(_mm_mul_ps(vy, vy), _mm_mul_ps(vz, vz))
+		);
+		__m128 is_zero = _mm_cmpeq_ps(norm, zero);
+		// full precision divide, rsqrt is too rough for poses
+		__m128 inv = _mm_div_ps(one, _mm_sqrt_ps(_mm_or_ps(norm, _mm_and_ps(is_zero, one))));
+
+		vw = _mm_or_ps(_mm_andnot_ps(is_zero, _mm_mul_ps(vw, inv)), _mm_and_ps(is_zero, one));
+		_mm_storeu_ps(w + i, vw);
+		_mm_storeu_ps(x + i, _mm_mul_ps(vx, inv));
+		_mm_storeu_ps(y + i, _mm_mul_ps(vy, inv));
+		_mm_storeu_ps(z + i, _mm_mul_ps(vz, inv));
+	}
+	#endif // #ifdef LSC_SSE2
+
+	for (; i < count; i++) {
+		float norm = w[i] * w[i] + x[i] * x[i] + y[i] * y[i] + z[i] * z[i];
+		if (norm == 0.0f) {
+			w[i] = 1.0f;
+			continue;
+		}
+
+		float inv = 1.0f / std::sqrt(norm);
+		w[i] *= inv;
+		x[i] *= inv;
+		y[i] *= inv;
+		z[i] *= inv;
+	}
+}
+
+#endif // #ifndef __LAZY_SOCKET_SIMD
@@ -0,0 +1,354 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// simnet.h - in process simulated network links
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+#ifndef __LAZY_SOCKET_SIMNET
+#define __LAZY_SOCKET_SIMNET
+
+// include parent header
+#include "lazy_sockets.h"
+
+
+// largest chunk a stream link reads off the sender in one go,
+// smaller segments make the bandwidth limit smoother
+#ifndef LSC_SIMNET_SEGMENT
+#define LSC_SIMNET_SEGMENT (16 * 1024)
+#endif
+
+// how behaves one direction of a SimLink
+struct SimLinkParams {
+	uint64_t latency_ns = 0; // one way delay
+	uint64_t jitter_ns = 0; // extra delay, uniform in [0, jitter_ns], streams stay in order
+	uint64_t bandwidth = 0; // bytes per second, 0 for unlimited
+	size_t max_chunk = 0; // streams: delivered in writes of 1 to max_chunk bytes, 0 as read
+	double loss = 0.0; // datagrams: chance for each datagram to be dropped
+	size_t queue_limit = 256 * 1024; // bytes in flight before the link stops reading,
+	                                 // after that the sender sees backpressure
+	uint64_t seed = 1; // same seed and same traffic, same jitter/chunks/losses
+};
+
+// plain copy of the counters of one direction of a SimLink
+struct SimLinkStats {
+	uint64_t bytes_in; // taken from the sender
+	uint64_t bytes_out; // handed to the receiver
+	uint64_t segments; // stream reads or datagrams taken from the sender
+	uint64_t chunks; // writes to the receiver
+	uint64_t dropped; // datagrams lost on purpose
+	uint64_t stalls; // times the receiver side was full
+};
+
+// direction of a SimLink
+enum ESimLinkDir {
+	ESimLink_a_to_b = 0,
+	ESimLink_b_to_a = 1
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// SimLink - two connected sockets with a simulated network between them
+///////////////////////////////////////////////////////////////////////////////
+
+
+// the endpoints are plain LSockets, so receivers/senders/tests use them
+// like any other connected socket, under the hood each endpoint is one end
+// of a local socket pair and a pump thread per direction moves the data
+// between the inner ends, applying the SimLinkParams on the way
+//
+// closing a stream endpoint shows up as eof on the other one once
+// everything in flight was delivered, datagram endpoints get an empty
+// datagram from Close() to wake up blocked receives
+template<int FAM, int TYP, int PROTO>
+class SimLink {
+public:
+	using socket_t = LSocket<FAM, TYP, PROTO>;
+
+	SimLink() = default;
+
+	inline ~SimLink() {
+		Close();
+	}
+
+	// no moving/coping this object, the pump threads hold on to it
+	SimLink(const SimLink&) = delete;
+	SimLink& operator=(const SimLink&) = delete;
+
+	// creates the endpoints and starts pumping
+	// returns 0 on success or -1 on error
+	inline int Open(const SimLinkParams& a_to_b, const SimLinkParams& b_to_a) {
+		Close();
+
+		lsocket_t a[2], b[2];
+		if (make_socket_pair(TYP, a))
+			return -1;
+		if (make_socket_pair(TYP, b)) {
+			close(a[0]);
+			close(a[1]);
+			return -1;
+		}
+
+		m_a = std::make_shared<socket_t>(a[0], EStat_connected);
+		m_b = std::make_shared<socket_t>(b[0], EStat_connected);
+		m_inner_a = std::make_unique<socket_t>(a[1], EStat_connected);
+		m_inner_b = std::make_unique<socket_t>(b[1], EStat_connected);
+		m_inner_a->SetNonBlocking(true);
+		m_inner_b->SetNonBlocking(true);
+
+		m_dirs[ESimLink_a_to_b].params = a_to_b;
+		m_dirs[ESimLink_b_to_a].params = b_to_a;
+		for (auto& dir : m_dirs)
+			dir.stats.Reset();
+
+		m_is_alive = true;
+		m_dirs[ESimLink_a_to_b].thread = std::thread(&SimLink::pump, this, m_inner_a.get(), m_inner_b.get(), std::ref(m_dirs[ESimLink_a_to_b]));
+		m_dirs[ESimLink_b_to_a].thread = std::thread(&SimLink::pump, this, m_inner_b.get(), m_inner_a.get(), std::ref(m_dirs[ESimLink_b_to_a]));
+		return 0;
+	}
+
+	// same parameters both ways
+	inline int Open(const SimLinkParams& params) {
+		SimLinkParams reverse = params;
+		reverse.seed = params.seed + 1; // but not the same dice
+		return Open(params, reverse);
+	}
+
+	// stops the pumps, whatever was in flight is lost
+	// the endpoints stay valid until their last owner lets go
+	inline void Close() {
+		m_is_alive = false;
+		for (auto& dir : m_dirs)
+			if (dir.thread.joinable())
+				dir.thread.join();
+
+		if (TYP == SOCK_DGRAM && m_inner_a && m_inner_b) {
+			// nothing like eof for datagrams, wake up anyone blocked instead
+			char dummy = 0;
+			m_inner_a->Send(&dummy, 0, ESend_nosignal);
+			m_inner_b->Send(&dummy, 0, ESend_nosignal);
+		}
+
+		m_inner_a.reset();
+		m_inner_b.reset();
+		m_a.reset();
+		m_b.reset();
+	}
+
+	inline std::shared_ptr<socket_t> GetA() {
+		return m_a;
+	}
+
+	inline std::shared_ptr<socket_t> GetB() {
+		return m_b;
+	}
+
+	inline SimLinkStats GetStats(ESimLinkDir dir) {
+		const Counters& c = m_dirs[dir].stats;
+		SimLinkStats out;
+		out.bytes_in = c.bytes_in.load(std::memory_order_relaxed);
+		out.bytes_out = c.bytes_out.load(std::memory_order_relaxed);
+		out.segments = c.segments.load(std::memory_order_relaxed);
+		out.chunks = c.chunks.load(std::memory_order_relaxed);
+		out.dropped = c.dropped.load(std::memory_order_relaxed);
+		out.stalls = c.stalls.load(std::memory_order_relaxed);
+		return out;
+	}
+
+private:
+	struct Segment {
+		uint64_t due_ns; // get_time_ns() when it arrives
+		std::string data;
+		size_t off; // already delivered
+	};
+
+	struct Counters {
+		std::atomic<uint64_t> bytes_in{0};
+		std::atomic<uint64_t> bytes_out{0};
+		std::atomic<uint64_t> segments{0};
+		std::atomic<uint64_t> chunks{0};
+		std::atomic<uint64_t> dropped{0};
+		std::atomic<uint64_t> stalls{0};
+
+		inline void Reset() {
+			for (auto i : {&bytes_in, &bytes_out, &segments, &chunks, &dropped, &stalls})
+				i->store(0, std::memory_order_relaxed);
+		}
+	};
+
+	struct Direction {
+		SimLinkParams params;
+		Counters stats;
+		std::thread thread;
+	};
+
+	// xorshift64*, good enough for dice and reproducible everywhere
+	inline static uint64_t next_random(uint64_t& state) {
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return state * 2685821657736338717ull;
+	}
+
+	inline static void shutdown_write(socket_t& soc) {
+		// compile time check for windows stupidity
+		#ifdef WIN
+		shutdown(soc.GetHandle(), SD_SEND);
+		#elif defined(LINUX)
+		shutdown(soc.GetHandle(), SHUT_WR);
+		#else
+		#error "unsupported platform"
+		#endif // #ifdef WIN
+	}
+
+	// moves data from :in: to :out: until Close()
+	inline void pump(socket_t* in, socket_t* out, Direction& dir) {
+		const SimLinkParams& p = dir.params;
+		Counters& stats = dir.stats;
+
+		uint64_t rng = p.seed ? p.seed : 1;
+		std::vector<Segment> queue; // ordered by due time
+		size_t queue_head = 0;
+		size_t queued_bytes = 0;
+		uint64_t wire_free_ns = 0; // when the simulated wire is done with the last segment
+		uint64_t last_due_ns = 0;
+		bool eof = false;
+		bool eof_sent = false;
+		bool blocked = false;
+
+		std::vector<char> buff(TYP == SOCK_DGRAM ? 64 * 1024 : LSC_SIMNET_SEGMENT);
+
+		while (m_is_alive) {
+			uint64_t now = get_time_ns();
+
+			// hand over everything that's due
+			blocked = false;
+			while (queue_head < queue.size() && queue[queue_head].due_ns <= now) {
+				Segment& seg = queue[queue_head];
+				size_t size = seg.data.size() - seg.off;
+				if (TYP != SOCK_DGRAM && p.max_chunk) {
+					size_t chunk = 1 + next_random(rng) % p.max_chunk;
+					size = chunk < size ? chunk : size;
+				}
+
+				int res = out->Send(seg.data.data() + seg.off, size, ESend_nosignal);
+				if (res < 0) {
+					if (lerrno == LSOCK_WOULDBLOCK) {
+						stats.stalls.fetch_add(1, std::memory_order_relaxed);
+						blocked = true;
+						break;
+					}
+
+					// the receiving endpoint is gone, nothing left to do but drain
+					res = (int)(seg.data.size() - seg.off);
+				} else {
+					stats.chunks.fetch_add(1, std::memory_order_relaxed);
+					stats.bytes_out.fetch_add(res, std::memory_order_relaxed);
+				}
+
+				seg.off += res;
+				if (seg.off >= seg.data.size() || TYP == SOCK_DGRAM) {
+					queued_bytes -= seg.data.size();
+					queue_head++;
+				}
+			}
+
+			// don't let the delivered segments pile up
+			if (queue_head == queue.size()) {
+				queue.clear();
+				queue_head = 0;
+			}
+
+			if (eof && queue_head == queue.size() && !eof_sent) {
+				shutdown_write(*out);
+				eof_sent = true;
+			}
+
+			// sleep until something comes in, the next segment is due,
+			// or the receiver has room again, but check m_is_alive every 10ms
+			int timeout_ms = 10;
+			if (!blocked && queue_head < queue.size()) {
+				uint64_t wait = queue[queue_head].due_ns > now ? queue[queue_head].due_ns - now : 0;
+				// round up, waking up early just means another round
+				int wait_ms = (int)((wait + 999999) / 1000000);
+				timeout_ms = wait_ms < timeout_ms ? wait_ms : timeout_ms;
+			}
+
+			bool reading = !eof && queued_bytes < p.queue_limit;
+			struct pollfd fds[2];
+			int nfds = 0;
+			if (reading) {
+				fds[nfds].fd = in->GetHandle();
+				fds[nfds].events = POLLIN;
+				fds[nfds].revents = 0;
+				nfds++;
+			}
+			if (blocked) {
+				fds[nfds].fd = out->GetHandle();
+				fds[nfds].events = POLLOUT;
+				fds[nfds].revents = 0;
+				nfds++;
+			}
+
+			if (nfds)
+				poll(fds, nfds, timeout_ms);
+			else if (timeout_ms)
+				std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+
+			if (!reading || !(fds[0].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+
+			// take what the sender has, a datagram or a chunk of the stream
+			int res = in->Recv(buff.data(), buff.size());
+			if (res < 0)
+				continue;
+
+			if (res == 0 && TYP != SOCK_DGRAM) {
+				eof = true;
+				continue;
+			}
+
+			stats.segments.fetch_add(1, std::memory_order_relaxed);
+			stats.bytes_in.fetch_add(res, std::memory_order_relaxed);
+
+			if (TYP == SOCK_DGRAM && p.loss > 0.0
+				&& (next_random(rng) >> 11) * (1.0 / 9007199254740992.0) < p.loss) {
+				stats.dropped.fetch_add(1, std::memory_order_relaxed);
+				continue;
+			}
+
+			now = get_time_ns();
+			uint64_t depart = now > wire_free_ns ? now : wire_free_ns;
+			wire_free_ns = depart + (p.bandwidth ? (uint64_t)res * 1000000000ull / p.bandwidth : 0);
+
+			uint64_t due = wire_free_ns + p.latency_ns;
+			if (p.jitter_ns)
+				due += next_random(rng) % (p.jitter_ns + 1);
+
+			if (TYP != SOCK_DGRAM) {
+				// a stream never reorders
+				due = due > last_due_ns ? due : last_due_ns;
+				last_due_ns = due;
+			}
+
+			Segment seg{due, std::string(buff.data(), res), 0};
+			queued_bytes += res;
+
+			// datagrams may overtake each other when jitter says so
+			auto pos = std::upper_bound(
+				queue.begin() + queue_head, queue.end(), due,
+				[](uint64_t value, const Segment& s) {return value < s.due_ns;}
+			);
+			queue.insert(pos, std::move(seg));
+		}
+	}
+
+	std::shared_ptr<socket_t> m_a;
+	std::shared_ptr<socket_t> m_b;
+	std::unique_ptr<socket_t> m_inner_a;
+	std::unique_ptr<socket_t> m_inner_b;
+
+	std::array<Direction, 2> m_dirs;
+	std::atomic<bool> m_is_alive{false};
+}; // class SimLink
+
+#endif // #ifndef __LAZY_SOCKET_SIMNET
@@ -4,6 +4,10 @@
 
 #include "lazy_sockets.h"
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
 
 namespace lsc {
 
@@ -21,4 +25,80 @@ lcsockaddr_in get_inet_addr(int family, const std::string& addr, int port) {
 	return serv_addr;
 }
 
+int make_socket_pair(int type, lsocket_t fds[2]) {
+	return socketpair(AF_UNIX, type, 0, fds);
+}
+
+
+/////////////////////////////
+// MappedFile
+/////////////////////////////
+
+int MappedFile::Create(const std::string& path, size_t size) {
+	Close();
+
+	int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+
+	if (ftruncate(fd, size)) {
+		close(fd);
+		return -1;
+	}
+
+	void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd); // the mapping keeps the file open
+	if (data == MAP_FAILED)
+		return -1;
+
+	m_data = (char*)data;
+	m_size = size;
+	return 0;
+}
+
+int MappedFile::OpenReadOnly(const std::string& path) {
+	Close();
+
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	struct stat st;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+
+	// nothing to map
+	if (st.st_size <= 0) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return -1;
+
+	m_data = (char*)data;
+	m_size = st.st_size;
+	return 0;
+}
+
+int MappedFile::Sync(bool wait) {
+	if (!m_data)
+		return 0;
+
+	return msync(m_data, m_size, wait ? MS_SYNC : MS_ASYNC);
+}
+
+void MappedFile::Close() {
+	if (m_data)
+		munmap(m_data, m_size);
+
+	m_data = nullptr;
+	m_size = 0;
+}
+
 }  // namespace lsc
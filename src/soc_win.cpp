@@ -21,4 +21,174 @@ lcsockaddr_in get_inet_addr(int family, const std::string& addr, int port) {
 	return serv_addr;
 }
 
+// no socketpair() here, so the pair goes over loopback
+int make_socket_pair(int type, lsocket_t fds[2]) {
+	fds[0] = fds[1] = INVALID_SOCKET;
+
+	lcsockaddr_in addr = get_inet_addr(AF_INET, "127.0.0.1", 0);
+	int addr_size = sizeof(addr);
+
+	if (type == SOCK_STREAM) {
+		lsocket_t listener = lsocket(AF_INET, SOCK_STREAM, 0);
+		if (listener == INVALID_SOCKET)
+			return -1;
+
+		if (bind(listener, (sockaddr*)&addr, sizeof(addr))
+			|| listen(listener, 1)
+			|| getsockname(listener, (sockaddr*)&addr, &addr_size)) {
+			close(listener);
+			return -1;
+		}
+
+		fds[0] = lsocket(AF_INET, SOCK_STREAM, 0);
+		if (fds[0] == INVALID_SOCKET || connect(fds[0], (sockaddr*)&addr, sizeof(addr))) {
+			if (fds[0] != INVALID_SOCKET)
+				close(fds[0]);
+			close(listener);
+			return -1;
+		}
+
+		fds[1] = accept4(listener, nullptr, nullptr, 0);
+		close(listener);
+		if (fds[1] == INVALID_SOCKET) {
+			close(fds[0]);
+			return -1;
+		}
+
+		return 0;
+	}
+
+	// two datagram sockets connected to each other
+	lcsockaddr_in addrs[2];
+	for (int i=0; i < 2; i++) {
+		addr_size = sizeof(addr);
+		fds[i] = lsocket(AF_INET, type, 0);
+		if (fds[i] == INVALID_SOCKET
+			|| bind(fds[i], (sockaddr*)&addr, sizeof(addr))
+			|| getsockname(fds[i], (sockaddr*)&addrs[i], &addr_size)) {
+			for (int j=0; j <= i; j++)
+				if (fds[j] != INVALID_SOCKET)
+					close(fds[j]);
+			return -1;
+		}
+	}
+
+	if (connect(fds[0], (sockaddr*)&addrs[1], sizeof(addr))
+		|| connect(fds[1], (sockaddr*)&addrs[0], sizeof(addr))) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/////////////////////////////
+// MappedFile
+/////////////////////////////
+
+int MappedFile::Create(const std::string& path, size_t size) {
+	Close();
+
+	m_file = CreateFileA(
+		path.c_str(),
+		GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ,
+		NULL,
+		CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL
+	);
+	if (m_file == INVALID_HANDLE_VALUE)
+		return -1;
+
+	// creating the mapping with a size grows the file to it
+	m_mapping = CreateFileMappingA(
+		m_file,
+		NULL,
+		PAGE_READWRITE,
+		(DWORD)((uint64_t)size >> 32),
+		(DWORD)size,
+		NULL
+	);
+	if (!m_mapping) {
+		Close();
+		return -1;
+	}
+
+	m_data = (char*)MapViewOfFile(m_mapping, FILE_MAP_WRITE, 0, 0, size);
+	if (!m_data) {
+		Close();
+		return -1;
+	}
+
+	m_size = size;
+	return 0;
+}
+
+int MappedFile::OpenReadOnly(const std::string& path) {
+	Close();
+
+	m_file = CreateFileA(
+		path.c_str(),
+		GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL,
+		OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL,
+		NULL
+	);
+	if (m_file == INVALID_HANDLE_VALUE)
+		return -1;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(m_file, &size) || size.QuadPart <= 0) {
+		Close();
+		return -1;
+	}
+
+	m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!m_mapping) {
+		Close();
+		return -1;
+	}
+
+	m_data = (char*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!m_data) {
+		Close();
+		return -1;
+	}
+
+	m_size = (size_t)size.QuadPart;
+	return 0;
+}
+
+int MappedFile::Sync(bool wait) {
+	if (!m_data)
+		return 0;
+
+	if (!FlushViewOfFile(m_data, m_size))
+		return -1;
+
+	if (wait && !FlushFileBuffers(m_file))
+		return -1;
+
+	return 0;
+}
+
+void MappedFile::Close() {
+	if (m_data)
+		UnmapViewOfFile(m_data);
+	if (m_mapping)
+		CloseHandle(m_mapping);
+	if (m_file != INVALID_HANDLE_VALUE)
+		CloseHandle(m_file);
+
+	m_data = nullptr;
+	m_size = 0;
+	m_mapping = NULL;
+	m_file = INVALID_HANDLE_VALUE;
+}
+
 }  // namespace lsc
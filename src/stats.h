@@ -0,0 +1,167 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// stats.h - per socket statistics counters
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+#ifndef __LAZY_SOCKET_STATS
+#define __LAZY_SOCKET_STATS
+
+// include parent header
+#include "lazy_sockets.h"
+
+
+///////////////////////////////////////////////////////////////////////////////
+// SocketStats - cheap always on per socket counters
+///////////////////////////////////////////////////////////////////////////////
+
+
+// plain copy of the counters at some point in time
+struct SocketStatsSnapshot {
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t msgs_in; // frames for stream receivers, datagrams for dgram sockets
+	uint64_t msgs_out;
+	uint64_t recv_calls; // receive syscalls
+	uint64_t send_calls; // send syscalls
+	uint64_t eagains; // calls that failed with EAGAIN/EWOULDBLOCK
+	uint64_t partial_writes; // sends where the kernel took less than asked
+	uint64_t framing_errors; // incomplete or rejected frames
+	uint64_t buffer_grows; // receive buffer reallocations
+	uint64_t max_frame_size; // largest frame seen in either direction
+};
+
+// tcp connection state as seen by the kernel, see LSocket::GetTcpInfo
+// fields the platform doesn't report are left at 0
+struct LTcpInfo {
+	uint32_t rtt_us; // smoothed round trip time
+	uint32_t rtt_var_us; // round trip time variance
+	uint32_t retransmits; // total retransmitted segments
+	uint32_t cwnd_bytes; // congestion window
+	uint32_t unacked_bytes; // sent but not acknowledged yet
+	uint32_t send_queue; // bytes in the send buffer that weren't sent yet
+	uint32_t recv_queue; // bytes in the receive buffer the app hasn't read yet
+	uint64_t sample_time_ns; // get_time_ns() when this was sampled
+};
+
+// receive and send side counters live on their own cache lines,
+// so a receiver thread and a sender thread never fight over them
+// all updates are relaxed atomics, a snapshot isn't a consistent cut
+// across counters, but every counter on its own is exact
+class SocketStats {
+public:
+	/////////////////////////////
+	// receive side
+	/////////////////////////////
+
+	// :res: is the return value of a receive syscall
+	inline void OnRecv(int res) {
+		m_rx.calls.fetch_add(1, std::memory_order_relaxed);
+		if (res > 0)
+			m_rx.bytes.fetch_add(res, std::memory_order_relaxed);
+		else if (res < 0 && lerrno == LSOCK_WOULDBLOCK)
+			m_rx.eagains.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	inline void OnFrameIn(size_t size) {
+		m_rx.msgs.fetch_add(1, std::memory_order_relaxed);
+		update_max(m_rx.max_frame_size, size);
+	}
+
+	inline void OnFramingError() {
+		m_rx.framing_errors.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	inline void OnBufferGrow() {
+		m_rx.buffer_grows.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	/////////////////////////////
+	// send side
+	/////////////////////////////
+
+	// :res: is the return value of a send syscall that was asked to send :size:
+	inline void OnSend(int res, size_t size) {
+		m_tx.calls.fetch_add(1, std::memory_order_relaxed);
+		if (res >= 0) {
+			m_tx.bytes.fetch_add(res, std::memory_order_relaxed);
+			if ((size_t)res < size)
+				m_tx.partial_writes.fetch_add(1, std::memory_order_relaxed);
+		} else if (lerrno == LSOCK_WOULDBLOCK) {
+			m_tx.eagains.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	inline void OnFrameOut(size_t size) {
+		m_tx.msgs.fetch_add(1, std::memory_order_relaxed);
+		update_max(m_tx.max_frame_size, size);
+	}
+
+	// optional send syscall timing, not thread safe to enable
+	inline void EnableSendLatency() {
+		if (!m_send_latency)
+			m_send_latency = std::make_unique<LatencyHistogram>();
+	}
+
+	// nullptr unless enabled
+	inline LatencyHistogram* GetSendLatency() {
+		return m_send_latency.get();
+	}
+
+	/////////////////////////////
+	// utility
+	/////////////////////////////
+
+	inline SocketStatsSnapshot Snapshot() const {
+		SocketStatsSnapshot out;
+		out.bytes_in = m_rx.bytes.load(std::memory_order_relaxed);
+		out.bytes_out = m_tx.bytes.load(std::memory_order_relaxed);
+		out.msgs_in = m_rx.msgs.load(std::memory_order_relaxed);
+		out.msgs_out = m_tx.msgs.load(std::memory_order_relaxed);
+		out.recv_calls = m_rx.calls.load(std::memory_order_relaxed);
+		out.send_calls = m_tx.calls.load(std::memory_order_relaxed);
+		out.eagains = m_rx.eagains.load(std::memory_order_relaxed)
+			+ m_tx.eagains.load(std::memory_order_relaxed);
+		out.partial_writes = m_tx.partial_writes.load(std::memory_order_relaxed);
+		out.framing_errors = m_rx.framing_errors.load(std::memory_order_relaxed);
+		out.buffer_grows = m_rx.buffer_grows.load(std::memory_order_relaxed);
+
+		uint64_t max_in = m_rx.max_frame_size.load(std::memory_order_relaxed);
+		uint64_t max_out = m_tx.max_frame_size.load(std::memory_order_relaxed);
+		out.max_frame_size = max_in > max_out ? max_in : max_out;
+		return out;
+	}
+
+private:
+	inline static void update_max(std::atomic<uint64_t>& max, uint64_t value) {
+		uint64_t cur = max.load(std::memory_order_relaxed);
+		while (value > cur && !max.compare_exchange_weak(cur, value, std::memory_order_relaxed));
+	}
+
+private:
+	struct alignas(LSC_CACHE_LINE_SIZE) RecvCounters {
+		std::atomic<uint64_t> bytes{0};
+		std::atomic<uint64_t> msgs{0};
+		std::atomic<uint64_t> calls{0};
+		std::atomic<uint64_t> eagains{0};
+		std::atomic<uint64_t> framing_errors{0};
+		std::atomic<uint64_t> buffer_grows{0};
+		std::atomic<uint64_t> max_frame_size{0};
+	};
+
+	struct alignas(LSC_CACHE_LINE_SIZE) SendCounters {
+		std::atomic<uint64_t> bytes{0};
+		std::atomic<uint64_t> msgs{0};
+		std::atomic<uint64_t> calls{0};
+		std::atomic<uint64_t> eagains{0};
+		std::atomic<uint64_t> partial_writes{0};
+		std::atomic<uint64_t> max_frame_size{0};
+	};
+
+	RecvCounters m_rx;
+	SendCounters m_tx;
+
+	std::unique_ptr<LatencyHistogram> m_send_latency;
+}; // class SocketStats
+
+#endif // #ifndef __LAZY_SOCKET_STATS
@@ -0,0 +1,255 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// trace.h - compile time selectable tracing of hot paths
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+#ifndef __LAZY_SOCKET_TRACE
+#define __LAZY_SOCKET_TRACE
+
+// include parent header
+#include "lazy_sockets.h"
+
+
+// events kept per thread, older ones are overwritten, has to be a power of 2
+#ifndef LSC_TRACE_RING_SIZE
+#define LSC_TRACE_RING_SIZE 8192
+#endif
+
+// rings of exited threads kept around for the next dump, past that the
+// oldest ones are dropped when a new thread registers
+#ifndef LSC_TRACE_EXITED_RINGS
+#define LSC_TRACE_EXITED_RINGS 16
+#endif
+
+
+///////////////////////////////////////////////////////////////////////////////
+// trace points, compiled out unless LSC_ENABLE_TRACING is defined
+///////////////////////////////////////////////////////////////////////////////
+
+
+// :name: has to be a string literal, only the pointer is stored
+#ifdef LSC_ENABLE_TRACING
+#define LSC_TRACE_BEGIN(name) ::lsc::trace_event('B', name, 0)
+#define LSC_TRACE_END(name, arg) ::lsc::trace_event('E', name, (int64_t)(arg))
+#define LSC_TRACE_INSTANT(name, arg) ::lsc::trace_event('i', name, (int64_t)(arg))
+#else
+#define LSC_TRACE_BEGIN(name) ((void)0)
+#define LSC_TRACE_END(name, arg) ((void)0)
+#define LSC_TRACE_INSTANT(name, arg) ((void)0)
+#endif // #ifdef LSC_ENABLE_TRACING
+
+
+///////////////////////////////////////////////////////////////////////////////
+// TraceRing - per thread ring of trace events
+///////////////////////////////////////////////////////////////////////////////
+
+
+struct TraceEvent {
+	uint64_t time_ns; // get_time_ns()
+	const char* name;
+	int64_t arg; // shows up as args.v in the trace
+	char phase; // chrome trace phase: 'B'egin, 'E'nd or 'i'nstant
+};
+
+// only the owning thread writes, a dump may read at any time,
+// it re-checks the head afterwards and drops anything that could
+// have been overwritten while it was copying
+class TraceRing {
+public:
+	inline explicit TraceRing(int tid): m_tid(tid) {}
+
+	// no moving/coping this object, the registry holds on to it
+	TraceRing(const TraceRing&) = delete;
+	TraceRing& operator=(const TraceRing&) = delete;
+
+	// owning thread only
+	inline void Push(char phase, const char* name, int64_t arg) {
+		uint64_t head = m_head.load(std::memory_order_relaxed);
+		TraceEvent& ev = m_events[head & (LSC_TRACE_RING_SIZE - 1)];
+		ev.time_ns = get_time_ns();
+		ev.name = name;
+		ev.arg = arg;
+		ev.phase = phase;
+		m_head.store(head + 1, std::memory_order_release);
+	}
+
+	// appends the events still in the ring to :out:, oldest first
+	inline void Copy(std::vector<TraceEvent>& out) const {
+		uint64_t head = m_head.load(std::memory_order_acquire);
+		uint64_t start = head > LSC_TRACE_RING_SIZE ? head - LSC_TRACE_RING_SIZE : 0;
+
+		size_t first = out.size();
+		for (uint64_t i=start; i < head; i++)
+			out.push_back(m_events[i & (LSC_TRACE_RING_SIZE - 1)]);
+
+		// anything the writer lapped while we were copying is garbage,
+		// +1 for the event it might be in the middle of writing
+		std::atomic_thread_fence(std::memory_order_acquire);
+		uint64_t new_head = m_head.load(std::memory_order_relaxed) + 1;
+		if (new_head > start + LSC_TRACE_RING_SIZE) {
+			size_t lapped = new_head - start - LSC_TRACE_RING_SIZE;
+			if (lapped > head - start)
+				lapped = head - start;
+			out.erase(out.begin() + first, out.begin() + first + lapped);
+		}
+	}
+
+	inline void Clear() {
+		m_head.store(0, std::memory_order_release);
+	}
+
+	inline int GetTid() const {
+		return m_tid;
+	}
+
+	// set by the owning thread on its way out
+	inline void MarkExited() {
+		m_exited.store(true, std::memory_order_release);
+	}
+
+	inline bool IsExited() const {
+		return m_exited.load(std::memory_order_acquire);
+	}
+
+private:
+	std::atomic<uint64_t> m_head{0};
+	std::atomic<bool> m_exited{false};
+	int m_tid;
+	std::array<TraceEvent, LSC_TRACE_RING_SIZE> m_events;
+}; // class TraceRing
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Tracer - registry of all thread rings and the chrome trace dump
+///////////////////////////////////////////////////////////////////////////////
+
+
+// rings outlive their threads, so a dump after a receiver stopped
+// still shows what it was doing, the next dump is the last one they
+// show up in, short lived threads don't pile up rings that way
+class Tracer {
+public:
+	// ring of the calling thread, registered on first use
+	inline static TraceRing& ThreadRing() {
+		thread_local ThreadHandle handle;
+		return *handle.ring;
+	}
+
+	// all events of all threads as chrome trace-event json,
+	// load it in chrome://tracing or ui.perfetto.dev
+	inline static std::string DumpChromeJson() {
+		std::vector<std::shared_ptr<TraceRing>> rings;
+		{
+			Tracer& self = instance();
+			std::lock_guard<std::mutex> lk(self.m_mutex);
+			rings = self.m_rings;
+
+			// dumped one last time below
+			self.m_rings.erase(
+				std::remove_if(self.m_rings.begin(), self.m_rings.end(), [](const std::shared_ptr<TraceRing>& ring) {
+					return ring->IsExited();
+				}),
+				self.m_rings.end()
+			);
+		}
+
+		std::string out = "{\"traceEvents\":[";
+		bool first = true;
+		std::vector<TraceEvent> events;
+		char line[256];
+		for (auto& ring : rings) {
+			events.clear();
+			ring->Copy(events);
+
+			for (auto& ev : events) {
+				// chrome wants microseconds
+				snprintf(
+					line, sizeof(line),
+					"%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03llu,\"pid\":1,\"tid\":%d%s,\"args\":{\"v\":%lld}}",
+					first ? "" : ",",
+					ev.name,
+					ev.phase,
+					(unsigned long long)(ev.time_ns / 1000),
+					(unsigned long long)(ev.time_ns % 1000),
+					ring->GetTid(),
+					ev.phase == 'i' ? ",\"s\":\"t\"" : "",
+					(long long)ev.arg
+				);
+				out += line;
+				first = false;
+			}
+		}
+
+		out += "\n]}\n";
+		return out;
+	}
+
+	// writes DumpChromeJson() to :path:
+	// returns 0 on success or -1 on error
+	inline static int WriteChromeJson(const std::string& path) {
+		FILE* f = fopen(path.c_str(), "wb");
+		if (!f)
+			return -1;
+
+		std::string json = DumpChromeJson();
+		size_t written = fwrite(json.data(), 1, json.size(), f);
+		fclose(f);
+		return written == json.size() ? 0 : -1;
+	}
+
+	// drops all recorded events, threads should be quiet while this runs
+	inline static void Clear() {
+		std::lock_guard<std::mutex> lk(instance().m_mutex);
+		for (auto& ring : instance().m_rings)
+			ring->Clear();
+	}
+
+private:
+	// marks the ring as exited when its thread is done
+	struct ThreadHandle {
+		std::shared_ptr<TraceRing> ring = register_thread();
+
+		inline ~ThreadHandle() {
+			ring->MarkExited();
+		}
+	};
+
+	inline static Tracer& instance() {
+		static Tracer tracer;
+		return tracer;
+	}
+
+	inline static std::shared_ptr<TraceRing> register_thread() {
+		Tracer& self = instance();
+		std::lock_guard<std::mutex> lk(self.m_mutex);
+
+		// nobody dumped in a while, forget the oldest exited threads
+		size_t exited = 0;
+		for (auto& ring : self.m_rings)
+			exited += ring->IsExited();
+		for (auto it = self.m_rings.begin(); exited > LSC_TRACE_EXITED_RINGS && it != self.m_rings.end();) {
+			if ((*it)->IsExited()) {
+				it = self.m_rings.erase(it);
+				exited--;
+			} else {
+				++it;
+			}
+		}
+
+		auto ring = std::make_shared<TraceRing>(++self.m_last_tid);
+		self.m_rings.push_back(ring);
+		return ring;
+	}
+
+	std::mutex m_mutex;
+	std::vector<std::shared_ptr<TraceRing>> m_rings;
+	int m_last_tid = 0;
+}; // class Tracer
+
+// what the LSC_TRACE_* macros expand to
+inline void trace_event(char phase, const char* name, int64_t arg) {
+	Tracer::ThreadRing().Push(phase, name, arg);
+}
+
+#endif // #ifndef __LAZY_SOCKET_TRACE
@@ -0,0 +1,132 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// views.h - typed zero copy views of received frames
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+#ifndef __LAZY_SOCKET_VIEWS
+#define __LAZY_SOCKET_VIEWS
+
+// include parent header
+#include "lazy_sockets.h"
+
+
+// views only work on packed structs (#pragma pack(push, 1)), they have an
+// alignment of 1, so a pointer into a receive buffer is always aligned
+// and the struct can be used in place, without memcpy-ing it out first
+template<typename T>
+struct is_packed_struct: std::integral_constant<bool,
+	std::is_trivially_copyable<T>::value && alignof(T) == 1
+> {};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// single messages
+///////////////////////////////////////////////////////////////////////////////
+
+
+// views a frame handed out by a receiver as a :T: that ends in its :Tag:,
+// receivers strip the tag, so :len: has to be sizeof(T) - sizeof(Tag)
+// the terminator member isn't part of the frame, don't read it
+// returns nullptr if the size doesn't match
+template<typename T, typename Tag>
+inline const T* ViewFrame(const void* frame, size_t len) {
+	static_assert(is_packed_struct<T>::value, "frames can only be viewed as packed structs");
+	static_assert(sizeof(T) > sizeof(Tag), "the message has to end in its tag");
+
+	if (len != sizeof(T) - sizeof(Tag))
+		return nullptr;
+
+	return (const T*)frame;
+}
+
+// views a whole message, terminator included, as a :T: that ends in :tag:
+// returns nullptr if the size or the terminator doesn't match
+template<typename T, typename Tag>
+inline const T* ViewMessage(const void* buff, size_t len, const Tag& tag) {
+	static_assert(is_packed_struct<T>::value, "messages can only be viewed as packed structs");
+	static_assert(sizeof(T) > sizeof(Tag), "the message has to end in its tag");
+
+	if (len != sizeof(T))
+		return nullptr;
+	if (memcmp((const char*)buff + sizeof(T) - sizeof(Tag), &tag, sizeof(Tag)))
+		return nullptr;
+
+	return (const T*)buff;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// PackedSpan - array of packed records in a buffer
+///////////////////////////////////////////////////////////////////////////////
+
+
+// a run of :T: records back to back in someone else's buffer,
+// valid as long as that buffer is
+template<typename T>
+class PackedSpan {
+	static_assert(is_packed_struct<T>::value, "spans only work on packed structs");
+
+public:
+	PackedSpan() = default;
+
+	inline PackedSpan(const void* data, size_t count): m_data((const T*)data), m_count(count) {}
+
+	// a span over :len: bytes of :buff:,
+	// returns false if :len: isn't a whole number of records
+	inline static bool FromBytes(const void* buff, size_t len, PackedSpan& out) {
+		if (len % sizeof(T))
+			return false;
+
+		out = PackedSpan(buff, len / sizeof(T));
+		return true;
+	}
+
+	inline const T& operator[](size_t index) const {
+		return m_data[index];
+	}
+
+	inline const T* begin() const {
+		return m_data;
+	}
+
+	inline const T* end() const {
+		return m_data + m_count;
+	}
+
+	inline const T* data() const {
+		return m_data;
+	}
+
+	inline size_t size() const {
+		return m_count;
+	}
+
+	inline bool empty() const {
+		return m_count == 0;
+	}
+
+	inline size_t SizeBytes() const {
+		return m_count * sizeof(T);
+	}
+
+private:
+	const T* m_data = nullptr;
+	size_t m_count = 0;
+}; // class PackedSpan
+
+
+// builds a visitor out of lambdas, for the view dispatchers:
+//   Visit(frame, len, overloaded{
+//       [](const A& a) {...},
+//       [](const B& b) {...}
+//   });
+template<typename... Ts>
+struct overloaded: Ts... {
+	using Ts::operator()...;
+};
+
+template<typename... Ts>
+overloaded(Ts...) -> overloaded<Ts...>;
+
+#endif // #ifndef __LAZY_SOCKET_VIEWS
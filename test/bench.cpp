@@ -0,0 +1,353 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// bench.cpp - lazy sockets benchmarks, prints results as json
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+// usage: lsc_bench [--quick] [--out results.json]
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include "lazy_sockets.h"
+#include "socket_pairs.h"
+#include <errno.h>
+
+#include <thread>
+
+using namespace lsc;
+
+using tcp_socket = LSocket<AF_INET, SOCK_STREAM, 0>;
+using udp_socket = LSocket<AF_INET, SOCK_DGRAM, 0>;
+
+struct bench_tag {
+	char a;
+	char b;
+	char c;
+};
+
+using tcp_receiver_loop = ThreadedRecvLoop<AF_INET, SOCK_STREAM, 0, bench_tag>;
+
+static constexpr bench_tag g_tag = {'\t', '\r', '\n'};
+
+using bench_clock = std::chrono::steady_clock;
+
+static double seconds_since(bench_clock::time_point start) {
+	return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+// results are collected as json objects, one per measurement
+static std::vector<std::string> g_results;
+
+static bool g_quick = false;
+
+static void report(const std::string& json) {
+	g_results.push_back(json);
+	std::cerr << json << std::endl; // progress for humans
+}
+
+static std::string make_frame(size_t size) {
+	std::string frame(size, 'x');
+	frame.append((const char*)&g_tag, sizeof(g_tag));
+	return frame;
+}
+
+// waits for :count: to reach :target:, gives up after :timeout_s:
+static bool wait_for(std::atomic<uint64_t>& count, uint64_t target, double timeout_s = 30.0) {
+	auto start = bench_clock::now();
+	while (count.load(std::memory_order_relaxed) < target) {
+		if (seconds_since(start) > timeout_s)
+			return false;
+		std::this_thread::yield();
+	}
+
+	return true;
+}
+
+/////////////////////////////
+// scenarios
+/////////////////////////////
+
+// how fast ThreadedRecvLoop splits a stream into frames, by frame size
+static void bench_framing() {
+	for (size_t size : {16, 64, 256, 1024, 4096}) {
+		uint64_t frames = (g_quick ? 4 : 32) * 1024 * 1024 / (size + sizeof(g_tag));
+
+		std::shared_ptr<tcp_socket> tx, rx;
+		if (make_connected_pair(tx, rx)) {
+			std::cerr << "failed to make a socket pair: " << getString(lerrno) << std::endl;
+			exit(1);
+		}
+
+		std::atomic<uint64_t> received{0};
+		tcp_receiver_loop recv_loop(
+			rx,
+			g_tag,
+			[&received](void*, size_t) {received.fetch_add(1, std::memory_order_relaxed);},
+			64 * 1024
+		);
+		recv_loop.Start();
+
+		// batch frames into bigger writes so the sender isn't what's measured
+		std::string frame = make_frame(size);
+		std::string batch;
+		size_t per_batch = 64 * 1024 / frame.size() + 1;
+		for (size_t i=0; i < per_batch; i++)
+			batch += frame;
+
+		auto start = bench_clock::now();
+		std::thread sender([&]() {
+			for (uint64_t sent=0; sent < frames; sent += per_batch) {
+				size_t count = frames - sent < per_batch ? frames - sent : per_batch;
+				tx->SendAll(batch.data(), count * frame.size());
+			}
+		});
+
+		bool ok = wait_for(received, frames);
+		double elapsed = seconds_since(start);
+		sender.join();
+
+		tx.reset();
+		rx.reset();
+		recv_loop.Stop();
+
+		std::ostringstream json;
+		json << "{\"scenario\":\"framing\",\"msg_size\":" << size
+			<< ",\"frames\":" << received.load()
+			<< ",\"ok\":" << (ok ? "true" : "false")
+			<< ",\"frames_per_sec\":" << (uint64_t)(received.load() / elapsed)
+			<< ",\"mb_per_sec\":" << received.load() * frame.size() / elapsed / (1024.0 * 1024.0)
+			<< "}";
+		report(json.str());
+	}
+}
+
+// round trip of a small frame over loopback tcp, echoed by another thread
+static void bench_echo() {
+	int rounds = g_quick ? 2000 : 20000;
+	static constexpr size_t SIZE = 64;
+
+	std::shared_ptr<tcp_socket> client, server;
+	if (make_tcp_pair(client, server, true)) {
+		std::cerr << "failed to make a socket pair: " << getString(lerrno) << std::endl;
+		exit(1);
+	}
+
+	std::thread echo([&server]() {
+		char buff[SIZE];
+		while (true) {
+			size_t off = 0;
+			while (off < SIZE) {
+				int res = server->Recv(buff + off, SIZE - off);
+				if (res <= 0)
+					return;
+				off += res;
+			}
+
+			if (server->SendAll(buff, SIZE) < 0)
+				return;
+		}
+	});
+
+	char buff[SIZE] = {};
+	LatencyHistogram hist;
+	bool ok = true;
+	for (int i=0; i < rounds && ok; i++) {
+		uint64_t start = get_time_ns();
+		ok = client->SendAll(buff, SIZE) == (int)SIZE;
+
+		size_t off = 0;
+		while (ok && off < SIZE) {
+			int res = client->Recv(buff + off, SIZE - off);
+			ok = res > 0;
+			off += res;
+		}
+
+		hist.Record(get_time_ns() - start);
+	}
+
+	shutdown(client->GetHandle(), SHUT_RDWR); // stops the echo thread
+	echo.join();
+
+	HistogramSnapshot snap = hist.Snapshot();
+	std::ostringstream json;
+	json << "{\"scenario\":\"tcp_echo\",\"msg_size\":" << SIZE
+		<< ",\"rounds\":" << snap.Count()
+		<< ",\"ok\":" << (ok ? "true" : "false")
+		<< ",\"rtt_ns\":{\"mean\":" << (uint64_t)snap.Mean()
+		<< ",\"p50\":" << snap.Percentile(50)
+		<< ",\"p90\":" << snap.Percentile(90)
+		<< ",\"p99\":" << snap.Percentile(99)
+		<< ",\"p999\":" << snap.Percentile(99.9)
+		<< ",\"max\":" << snap.Max()
+		<< "}}";
+	report(json.str());
+}
+
+// SendTo/RecvFrom packets per second over loopback udp
+static void bench_udp() {
+	for (size_t size : {64, 512, 1400}) {
+		uint64_t packets = g_quick ? 20000 : 200000;
+
+		udp_socket rx, tx;
+		lcsockaddr_in addr;
+		socklen_t addr_size = sizeof(addr);
+		if (rx.Bind("127.0.0.1", 0) || getsockname(rx.GetHandle(), (sockaddr*)&addr, &addr_size)) {
+			std::cerr << "failed to bind: " << getString(lerrno) << std::endl;
+			exit(1);
+		}
+
+		// big buffer so bursts aren't dropped right away
+		int rcvbuf = 8 * 1024 * 1024;
+		rx.SetSockOpt(SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+		std::atomic<uint64_t> received{0};
+		std::atomic<bool> done{false};
+		bench_clock::time_point last_recv;
+		std::thread receiver([&]() {
+			char buff[2048];
+			lcsockaddr_in sender;
+			size_t sender_size = sizeof(sender);
+			while (true) {
+				// finish once the sender is done and nothing arrived for a bit
+				if (rx.Poll(EPoll_in, 100) <= 0) {
+					if (done)
+						return;
+					continue;
+				}
+
+				if (rx.RecvFrom(buff, sizeof(buff), sender, sender_size) > 0) {
+					received.fetch_add(1, std::memory_order_relaxed);
+					last_recv = bench_clock::now();
+				}
+			}
+		});
+
+		std::string packet(size, 'u');
+		auto start = bench_clock::now();
+		uint64_t sent = 0;
+		for (; sent < packets; sent++) {
+			if (tx.SendTo(packet.data(), packet.size(), addr, sizeof(addr)) < 0)
+				break;
+		}
+		double send_elapsed = seconds_since(start);
+
+		done = true;
+		receiver.join();
+		double recv_elapsed = std::chrono::duration<double>(last_recv - start).count();
+
+		std::ostringstream json;
+		json << "{\"scenario\":\"udp\",\"msg_size\":" << size
+			<< ",\"sent\":" << sent
+			<< ",\"received\":" << received.load()
+			<< ",\"send_pps\":" << (uint64_t)(sent / send_elapsed)
+			<< ",\"recv_pps\":" << (uint64_t)(recv_elapsed > 0 ? received.load() / recv_elapsed : 0)
+			<< ",\"loss\":" << (sent ? 1.0 - (double)received.load() / sent : 0.0)
+			<< "}";
+		report(json.str());
+	}
+}
+
+// total framing throughput with N connections, one receiver thread each
+static void bench_scaling() {
+	static constexpr size_t SIZE = 64;
+
+	for (int conns : {1, 2, 4, 8}) {
+		uint64_t frames_per_conn = (g_quick ? 100000 : 1000000) / conns;
+
+		std::vector<std::shared_ptr<tcp_socket>> txs(conns), rxs(conns);
+		std::vector<std::unique_ptr<tcp_receiver_loop>> loops;
+		std::atomic<uint64_t> received{0};
+
+		for (int i=0; i < conns; i++) {
+			if (make_connected_pair(txs[i], rxs[i])) {
+				std::cerr << "failed to make a socket pair: " << getString(lerrno) << std::endl;
+				exit(1);
+			}
+			loops.push_back(std::make_unique<tcp_receiver_loop>(
+				rxs[i],
+				g_tag,
+				[&received](void*, size_t) {received.fetch_add(1, std::memory_order_relaxed);},
+				64 * 1024
+			));
+			loops.back()->Start();
+		}
+
+		std::string frame = make_frame(SIZE);
+		std::string batch;
+		size_t per_batch = 64 * 1024 / frame.size();
+		for (size_t i=0; i < per_batch; i++)
+			batch += frame;
+
+		auto start = bench_clock::now();
+		std::vector<std::thread> senders;
+		for (int i=0; i < conns; i++)
+			senders.emplace_back([&, i]() {
+				for (uint64_t sent=0; sent < frames_per_conn; sent += per_batch) {
+					size_t count = frames_per_conn - sent < per_batch ? frames_per_conn - sent : per_batch;
+					txs[i]->SendAll(batch.data(), count * frame.size());
+				}
+			});
+
+		bool ok = wait_for(received, frames_per_conn * conns);
+		double elapsed = seconds_since(start);
+		for (auto& i : senders)
+			i.join();
+
+		txs.clear();
+		rxs.clear();
+		loops.clear(); // joins the receivers
+
+		std::ostringstream json;
+		json << "{\"scenario\":\"recv_scaling\",\"connections\":" << conns
+			<< ",\"msg_size\":" << SIZE
+			<< ",\"frames\":" << received.load()
+			<< ",\"ok\":" << (ok ? "true" : "false")
+			<< ",\"frames_per_sec\":" << (uint64_t)(received.load() / elapsed)
+			<< "}";
+		report(json.str());
+	}
+}
+
+int main(int argc, char** argv) {
+	std::string out_path;
+	for (int i=1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--quick") {
+			g_quick = true;
+		} else if (arg == "--out" && i + 1 < argc) {
+			out_path = argv[++i];
+		} else {
+			std::cerr << "usage: " << argv[0] << " [--quick] [--out results.json]" << std::endl;
+			return 1;
+		}
+	}
+
+	bench_framing();
+	bench_echo();
+	bench_udp();
+	bench_scaling();
+
+	std::ostringstream json;
+	json << "{\"version\":\"" << __LAZY_SOCKETS_VERSION << "\""
+		<< ",\"build\":" << __LAZY_SOCKETS_BUILD
+		<< ",\"hardware_threads\":" << std::thread::hardware_concurrency()
+		<< ",\"quick\":" << (g_quick ? "true" : "false")
+		<< ",\"results\":[";
+	for (size_t i=0; i < g_results.size(); i++)
+		json << (i ? ",\n" : "\n") << g_results[i];
+	json << "\n]}\n";
+
+	if (out_path.empty()) {
+		std::cout << json.str();
+	} else {
+		std::ofstream out(out_path);
+		out << json.str();
+		if (!out) {
+			std::cerr << "failed to write " << out_path << std::endl;
+			return 1;
+		}
+	}
+
+	return 0;
+}
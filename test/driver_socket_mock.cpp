@@ -13,6 +13,9 @@
 
 #include "timer.h"
 #include "packets.h"
+#include "packet_views.h"
+#include "udu_layout.h"
+#include "pose_predictor.h"
 
 
 #define DriverLog MESSAGE
@@ -21,10 +24,13 @@ using namespace lsc;
 
 using tcp_socket = LSocket<AF_INET, SOCK_STREAM, 0>;
 using tcp_receiver_loop = ThreadedRecvLoop<AF_INET, SOCK_STREAM, 0, PacketEndTag>;
+using tcp_sender_loop = ThreadedSendLoop<AF_INET, SOCK_STREAM, 0>;
 
 static constexpr int VRInitError_IPC_ServerInitFailed = -1;
 static constexpr int VRInitError_IPC_ConnectFailed = -2;
 
+static constexpr const char* g_FlightRecorderPath = "driver_flight_recorder.bin";
+
 class MockTrackingReference_hobovr {
 
 public:
@@ -36,92 +42,100 @@ public:
         CHECK_FALSE_MESSAGE(res, "tracking reference: failed to connect: errno=", lerrno);
 
 	    // send an id message saying this is a manager socket
-	    res = m_pSocketComm->Send(KHoboVR_ManagerIdMessage, sizeof(KHoboVR_ManagerIdMessage));
+	    res = m_pSocketComm->SendAll(KHoboVR_ManagerIdMessage, sizeof(KHoboVR_ManagerIdMessage));
 
         CHECK_FALSE_MESSAGE(res < 0, "tracking reference: failed to send id message: errno=", lerrno);
 
 	    MESSAGE("tracking reference: manager socket fd=", (int)m_pSocketComm->GetHandle());
 
+	    // only the udu string is handled, the rest of the known messages are
+	    // logged, anything else gets an invalid response
+	    m_router.On<HoboVR_ManagerMsgUduString_t>(EManagerMsgType_uduString,
+	        [this](const HoboVR_ManagerMsgUduString_t& udu) {OnUduString(udu);}
+	    );
+	    m_router.SetFallback([](uint32_t type, const void*, size_t) {
+	        if (!hobovr::ManagerSchema::Has(type))
+	            return false;
+
+	        DriverLog("tracking reference: got a packet lol");
+	        return true;
+	    });
+
 	    m_pReceiver = std::make_unique<tcp_receiver_loop>(
 	        m_pSocketComm,
 	        g_EndTag,
-	        std::bind(&MockTrackingReference_hobovr::OnPacket, this, std::placeholders::_1, std::placeholders::_2)
+	        m_router.AsCallback(std::bind(&MockTrackingReference_hobovr::OnBadPacket, this, std::placeholders::_1, std::placeholders::_2))
 	    );
 	    m_pReceiver->Start();
 
 	    DriverLog("tracking reference: receiver startup status: ", m_pReceiver->IsAlive());
 	}
 
-	void OnPacket(void* buff, size_t len) {
-		// yeah dumb ass, it was this stupid of a fix
-	    if (len != sizeof(HoboVR_ManagerMsg_t) - sizeof(PacketEndTag)) {
-	        DriverLog("tracking reference: bad message");
-	        HoboVR_ManagerResp_t resp{EManagerResp_invalid};
-	        m_pSocketComm->Send(
-	            &resp,
-	            sizeof(resp)
-	        );
-
-	        return; // do nothing if bad message
-	    }
-
+	void OnBadPacket(void*, size_t) {
+	    // yeah dumb ass, it was this stupid of a fix
+	    DriverLog("tracking reference: bad message");
+	    HoboVR_ManagerResp_t resp{EManagerResp_invalid};
+	    m_pSocketComm->Send(
+	        &resp,
+	        sizeof(resp)
+	    );
+	}
 
-	    DriverLog("tracking reference: got a packet lol");
-
-	    HoboVR_ManagerMsg_t* message = (HoboVR_ManagerMsg_t*)buff;
-
-	    if (message->type == EManagerMsgType_uduString) {
-	    	std::string temp;
-            for (int i=0; i < message->data.udu.len; i++) {
-                if (message->data.udu.devices[i] == 0)
-                    temp += "h";
-                else if (message->data.udu.devices[i] == 1)
-                    temp += "c";
-                else if (message->data.udu.devices[i] == 2)
-                    temp += "t";
-                else if (message->data.udu.devices[i] == 3)
-                    temp += "g";
-            }
-            _vpUduChangeBuffer = temp;
-
-            // vr::VREvent_Notification_t event_data = {20, 0};
-            // vr::VRServerDriverHost()->VendorSpecificEvent(
-            //     m_unObjectId,
-            //     vr::VREvent_VendorSpecific_HoboVR_UduChange,
-            //     (vr::VREvent_Data_t&)event_data,
-            //     0
-            // );
-            _UduEvent = true;
-
-            DriverLog(
-                "tracking reference: udu settings change request processed"
-            );
-            HoboVR_ManagerResp_t resp{EManagerResp_ok};
+	void OnUduString(const HoboVR_ManagerMsgUduString_t& udu) {
+	    std::string temp;
+        for (int i=0; i < udu.len; i++) {
+            if (udu.devices[i] == 0)
+                temp += "h";
+            else if (udu.devices[i] == 1)
+                temp += "c";
+            else if (udu.devices[i] == 2)
+                temp += "t";
+            else if (udu.devices[i] == 3)
+                temp += "g";
+        }
+        // hand the new device list over to the driver thread
+        if (!m_uduChangeQueue.TryPush(std::move(temp))) {
+            DriverLog("tracking reference: too many pending udu changes");
+            HoboVR_ManagerResp_t resp{EManagerResp_failedToProcess};
             m_pSocketComm->Send(
                 &resp,
                 sizeof(resp)
             );
-	    }
+            return;
+        }
+
+        // vr::VREvent_Notification_t event_data = {20, 0};
+        // vr::VRServerDriverHost()->VendorSpecificEvent(
+        //     m_unObjectId,
+        //     vr::VREvent_VendorSpecific_HoboVR_UduChange,
+        //     (vr::VREvent_Data_t&)event_data,
+        //     0
+        // );
+
+        DriverLog(
+            "tracking reference: udu settings change request processed"
+        );
+        HoboVR_ManagerResp_t resp{EManagerResp_ok};
+        m_pSocketComm->Send(
+            &resp,
+            sizeof(resp)
+        );
 	}
 
-	bool GetUduEvent() {
-	    if (!_UduEvent)
+	// pops the oldest pending udu change into :udu:, returns false if there is none
+	bool GetUduEvent(std::string& udu) {
+	    if (!m_uduChangeQueue.TryPop(udu))
 	        return false;
 
-	    _UduEvent = false; // consume a true call
 	    DriverLog("tracking reference: consume call triggered");
 	    return true;
 	}
 
-	std::string GetUduBuffer() {
-		return _vpUduChangeBuffer;
-	}
-
 private:
-	// interproc sync
-    bool _UduEvent;
-    std::string _vpUduChangeBuffer; // for passing udu data
+	// interproc sync, receiver thread produces, driver timer thread consumes
+    lsc::SpscRing<std::string> m_uduChangeQueue{4}; // for passing udu data
 
+    lsc::MessageRouter<uint32_t> m_router{hobovr::ManagerSchema::k_frame_size};
     std::shared_ptr<tcp_socket> m_pSocketComm;
     std::unique_ptr<tcp_receiver_loop> m_pReceiver;
 };
@@ -129,22 +143,6 @@ private:
 using HobovrTrackingRef_SettManager = MockTrackingReference_hobovr;
 
 
-namespace util {
-	inline size_t udu2sizet(std::string udu_string) {
-		size_t out = 0;
-		for (auto i : udu_string) {
-			switch(i) {
-				case 'h': {out += sizeof(HoboVR_HeadsetPose_t); 		break;}
-				case 'c': {out += sizeof(HoboVR_ControllerState_t); 	break;}
-				case 't': {out += sizeof(HoboVR_TrackerPose_t); 		break;}
-				case 'g': {out += sizeof(HoboVR_GazeState_t); 			break;}
-			}
-		}
-
-		return out;
-	}
-}
-
 class MockServerDriver_hobovr {
 private:
 	int bad_packet_count = 0;
@@ -164,7 +162,7 @@ public:
 		DriverLog("driver: tracking socket fd=", (int)mlSocket->GetHandle());
 
 		// send an id message saying this is a tracking socket
-		res = mlSocket->Send(KHoboVR_TrackingIdMessage, sizeof(KHoboVR_TrackingIdMessage));
+		res = mlSocket->SendAll(KHoboVR_TrackingIdMessage, sizeof(KHoboVR_TrackingIdMessage));
 		if (res < 0) {
 	        DriverLog("driver: failed to send id message: errno=\n", lerrno);
 	        return VRInitError_IPC_ConnectFailed;
@@ -180,8 +178,25 @@ public:
 	        DriverLog("driver: failed to init receiver\n");
 	        return -5;
 		}
+
+		// keep the last frames around for when a poser misbehaves
+		mpRecorder = std::make_shared<FlightRecorder>();
+		if (mpRecorder->Open(g_FlightRecorderPath, 64, 1024))
+			DriverLog("driver: failed to open the flight recorder: errno=", lerrno);
+		else
+			mpReceiver->AttachFlightRecorder(mpRecorder);
+
+		// poses are timed by when they came in, not when we got to them
+		if (mpReceiver->EnableTimestamps())
+			DriverLog("driver: no kernel receive timestamps, using callback time: errno=", lerrno);
+
 		mpReceiver->Start();
 
+		// responses come from both the receiver thread and Cleanup(),
+		// so all of them go through a single writer
+		mpSender = std::make_unique<tcp_sender_loop>(mlSocket);
+		mpSender->Start();
+
 		// create manager now
 		mpSettingsManager = std::make_unique<HobovrTrackingRef_SettManager>("trsm0");
 		// misc start timer
@@ -193,11 +208,19 @@ public:
 			[this]() {
 				// fast part
 				// check of incoming udu events
-				if (mpSettingsManager->GetUduEvent() && !mbUduEvent.load()) {
+				std::string udu;
+				if (!mbUduEvent.load() && mpSettingsManager->GetUduEvent(udu)) {
 					DriverLog("udu change event");
-					muInternalBufferSize = util::udu2sizet(
-						mpSettingsManager->GetUduBuffer()
-					);		
+					// offsets are worked out once here, not on every packet
+					auto layout = std::make_shared<hobovr::UduLayout>();
+					if (layout->Compile(udu)) {
+						DriverLog("driver: bad udu string: ", udu);
+						return;
+					}
+					// layout first, a packet of the new size never meets the old one
+					std::atomic_store(&mpLayout, std::shared_ptr<const hobovr::UduLayout>(layout));
+					std::atomic_store(&mpPredictor, std::make_shared<hobovr::PosePredictor>(*layout));
+					muInternalBufferSize = layout->GetPacketSize();
 
 					// pause packet processing
 					mbUduEvent.store(true);
@@ -219,13 +242,10 @@ public:
 		mpTimer.reset();
 
 		// // send a "driver exit" notification to the poser
-		uint32_t fake_data = 0;
-		HoboVR_PoserResp_t resp{
-			EPoserRespType_driverShutdown,
-			(HoboVR_RespData_t&)fake_data,
-			g_EndTag
-		};
-		mlSocket->Send(&resp, sizeof(resp));
+		if (mpSender) {
+			mpSender->SendString(hobovr::EncodeMessage<hobovr::PoserRespSchema>(hobovr::PoserRespDriverShutdown{}));
+			mpSender->Stop(); // flushes the notification
+		}
 
 		std::this_thread::sleep_for(std::chrono::milliseconds(200));
 
@@ -234,6 +254,10 @@ public:
 
 		// call stop to make sure the receiver thread has joined
 		mpReceiver->Stop();
+
+		// a mock run leaves nothing behind in the working directory
+		mpRecorder.reset();
+		remove(g_FlightRecorderPath);
 	}
 
 	void OnPacket(void* buff, size_t len) {
@@ -242,19 +266,13 @@ public:
 			// TODO: make different responses for different fuck ups...
 			// 							and detect different fuck ups
 			HoboVR_RespBufSize_t expected_size = {(uint32_t)muInternalBufferSize};
-
-			HoboVR_PoserResp_t resp{
-				EPoserRespType_badDeviceList,
-				(HoboVR_RespData_t&)expected_size,
-				g_EndTag
-			};
-
-			int res = mlSocket->Send(
-				&resp,
-				sizeof(resp)
-			);
+			mpSender->SendString(hobovr::EncodeMessage<hobovr::PoserRespSchema>(expected_size));
 			// GOD FUCKING FINALLY
 
+			// make sure the evidence hits the disk
+			if (mpRecorder->IsOpen())
+				mpRecorder->Sync();
+
 			// so logs in steamvr take ages to complete... TOO BAD!
 			DriverLog("driver: posers are getting ignored~ expected ",
 				(int)muInternalBufferSize,
@@ -283,6 +301,18 @@ public:
 
 		bad_packet_count = 0;
 
+		auto layout = std::atomic_load(&mpLayout);
+		size_t bad_device = 0;
+		if (layout && !layout->Validate(buff, len, 0.01f, &bad_device)) {
+			DriverLog("driver: ignoring packet with a broken pose for device ", (int)bad_device);
+			return;
+		}
+
+		// render time queries go to the predictor, they never wait on us
+		auto predictor = std::atomic_load(&mpPredictor);
+		if (predictor)
+			predictor->Update(buff, len, GetReceiveTime());
+
 		// DriverLog("received buffer ", (int)len);
 	}
 
@@ -292,10 +322,27 @@ private:
 
 	}
 
-	size_t muInternalBufferSize = 16;
+	// receive time of the current packet on the get_time_ns() clock,
+	// the kernel timestamp is wall clock so it's moved over by its age,
+	// time spent queued in the socket then doesn't make poses look newer
+	uint64_t GetReceiveTime() {
+		uint64_t now = get_time_ns();
+		uint64_t kernel_time = mpReceiver->GetLastFrameTimestamp();
+		uint64_t wall_now = get_wall_time_ns();
+		if (!kernel_time || kernel_time > wall_now || wall_now - kernel_time > now)
+			return now; // no timestamp or the wall clock jumped
+
+		return now - (wall_now - kernel_time);
+	}
+
+	std::atomic<size_t> muInternalBufferSize{16};
 
 	std::shared_ptr<tcp_socket> mlSocket;
 	std::unique_ptr<tcp_receiver_loop> mpReceiver;
+	std::unique_ptr<tcp_sender_loop> mpSender;
+	std::shared_ptr<FlightRecorder> mpRecorder;
+	std::shared_ptr<const hobovr::UduLayout> mpLayout; // swapped on udu changes
+	std::shared_ptr<hobovr::PosePredictor> mpPredictor; // swapped with mpLayout
 	std::unique_ptr<hobovr::Timer> mpTimer;
 
 	std::unique_ptr<HobovrTrackingRef_SettManager> mpSettingsManager;
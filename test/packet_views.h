@@ -0,0 +1,128 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+#ifndef __HOBOVR_PACKET_VIEWS
+#define __HOBOVR_PACKET_VIEWS
+
+#include "lazy_sockets.h"
+#include "packets.h"
+
+// the udu length is the only field that can point outside its message
+namespace lsc {
+template<>
+struct MessageCheck<HoboVR_ManagerMsgUduString_t> {
+	static bool Check(const HoboVR_ManagerMsgUduString_t& msg) {
+		return msg.len <= sizeof(msg.devices);
+	}
+};
+} // namespace lsc
+
+namespace hobovr {
+
+// no-payload marker for manager messages that are just a request
+struct ManagerMsgGetTrkBuffSize {};
+
+// no-payload marker for the driver shutdown notification
+struct PoserRespDriverShutdown {};
+
+////////////////////////////////////////////////////////////////////////////////
+// Schemas
+////////////////////////////////////////////////////////////////////////////////
+
+// HoboVR_ManagerMsg_t, the frame is everything before the terminator
+using ManagerSchema = lsc::MessageSchema<uint32_t, sizeof(HoboVR_ManagerData_t),
+	lsc::MessageDef<EManagerMsgType_ipd, HoboVR_ManagerMsgIpd_t>,
+	lsc::MessageDef<EManagerMsgType_uduString, HoboVR_ManagerMsgUduString_t>,
+	lsc::MessageDef<EManagerMsgType_poseTimeOffset, HoboVR_ManagerMsgPoseTimeOff_t>,
+	lsc::MessageDef<EManagerMsgType_distortion, HoboVR_ManagerMsgDistortion_t>,
+	lsc::MessageDef<EManagerMsgType_eyeGap, HoboVR_ManagerMsgEyeGap_t>,
+	lsc::MessageDef<EManagerMsgType_setSelfPose, HoboVR_ManagerMsgSelfPose_t>,
+	lsc::MessageDef<EManagerMsgType_getTrkBuffSize, ManagerMsgGetTrkBuffSize>
+>;
+
+// HoboVR_PoserResp_t, same deal
+using PoserRespSchema = lsc::MessageSchema<uint32_t, sizeof(HoboVR_RespData_t),
+	lsc::MessageDef<EPoserRespType_badDeviceList, HoboVR_RespBufSize_t>,
+	lsc::MessageDef<EPoserRespType_driverShutdown, PoserRespDriverShutdown>,
+	lsc::MessageDef<EPoserRespType_haptics, HoboVR_HapticResponse_t>
+>;
+
+// device poses of a pose packet by udu character
+using DeviceSizes = lsc::SizeTable<
+	lsc::MessageDef<'h', HoboVR_HeadsetPose_t>,
+	lsc::MessageDef<'c', HoboVR_ControllerState_t>,
+	lsc::MessageDef<'t', HoboVR_TrackerPose_t>,
+	lsc::MessageDef<'g', HoboVR_GazeState_t>
+>;
+
+static_assert(ManagerSchema::k_frame_size + sizeof(PacketEndTag) == sizeof(HoboVR_ManagerMsg_t), "schema and struct disagree");
+static_assert(PoserRespSchema::k_frame_size + sizeof(PacketEndTag) == sizeof(HoboVR_PoserResp_t), "schema and struct disagree");
+
+// a whole message with its end tag, ready for ThreadedSendLoop::SendString()
+template<typename Schema, typename T>
+inline std::string EncodeMessage(const T& payload) {
+	std::string out;
+	out.reserve(Schema::k_frame_size + sizeof(PacketEndTag));
+	Schema::Encode(payload, out);
+	out.append((const char*)&g_EndTag, sizeof(g_EndTag));
+	return out;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Manager messages
+////////////////////////////////////////////////////////////////////////////////
+
+// validates a manager frame, as handed out by a receiver, once and calls
+// :visitor: with a reference to the typed payload in place, one of:
+//   HoboVR_ManagerMsgIpd_t, HoboVR_ManagerMsgUduString_t,
+//   HoboVR_ManagerMsgPoseTimeOff_t, HoboVR_ManagerMsgDistortion_t,
+//   HoboVR_ManagerMsgEyeGap_t, HoboVR_ManagerMsgSelfPose_t,
+//   ManagerMsgGetTrkBuffSize
+// returns false without calling :visitor: on a bad size, type or udu length
+template<typename V>
+inline bool VisitManagerMsg(const void* frame, size_t len, V&& visitor) {
+	return ManagerSchema::Dispatch(frame, len, visitor);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Poser responses
+////////////////////////////////////////////////////////////////////////////////
+
+// same as VisitManagerMsg, for the responses the driver sends the poser,
+// :visitor: gets one of:
+//   HoboVR_RespBufSize_t (bad device list), HoboVR_HapticResponse_t,
+//   PoserRespDriverShutdown
+template<typename V>
+inline bool VisitPoserResp(const void* frame, size_t len, V&& visitor) {
+	return PoserRespSchema::Dispatch(frame, len, visitor);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Pose blobs
+////////////////////////////////////////////////////////////////////////////////
+
+using HeadsetPoses = lsc::PackedSpan<HoboVR_HeadsetPose_t>;
+using ControllerStates = lsc::PackedSpan<HoboVR_ControllerState_t>;
+using TrackerPoses = lsc::PackedSpan<HoboVR_TrackerPose_t>;
+using GazeStates = lsc::PackedSpan<HoboVR_GazeState_t>;
+
+} // namespace hobovr
+
+////////////////////////////////////////////////////////////////////////////////
+// Utility
+////////////////////////////////////////////////////////////////////////////////
+
+namespace util {
+	// size of a pose packet (without the end tag) for a udu string,
+	// the packet is the device poses concatenated in udu order
+	inline size_t udu2sizet(const std::string& udu_string) {
+		size_t out = 0;
+		for (char c : udu_string)
+			out += hobovr::DeviceSizes::SizeOf((uint8_t)c);
+
+		return out;
+	}
+}
+
+#endif // #ifndef __HOBOVR_PACKET_VIEWS
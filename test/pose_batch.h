@@ -0,0 +1,157 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+#ifndef __HOBOVR_POSE_BATCH
+#define __HOBOVR_POSE_BATCH
+
+#include <cstddef>
+#include "lazy_sockets.h"
+#include "packets.h"
+#include "packet_views.h"
+#include "udu_layout.h"
+
+namespace hobovr {
+
+// floats of a headset/tracker pose, in struct order
+enum EPoseField {
+	EPoseField_pos_x = 0,
+	EPoseField_pos_y,
+	EPoseField_pos_z,
+	EPoseField_rot_w,
+	EPoseField_rot_x,
+	EPoseField_rot_y,
+	EPoseField_rot_z,
+	EPoseField_vel_x,
+	EPoseField_vel_y,
+	EPoseField_vel_z,
+	EPoseField_ang_x,
+	EPoseField_ang_y,
+	EPoseField_ang_z,
+	EPoseField_count
+};
+
+static_assert(sizeof(HoboVR_TrackerPose_t) == EPoseField_count * sizeof(float), "tracker pose is all floats");
+static_assert(sizeof(HoboVR_HeadsetPose_t) == sizeof(HoboVR_TrackerPose_t), "headset and tracker poses share a layout");
+
+////////////////////////////////////////////////////////////////////////////////
+// PoseBatch - headset/tracker poses as one array per field
+////////////////////////////////////////////////////////////////////////////////
+
+// the wire has poses as back to back structs, this keeps them transposed,
+// all position x's together, all position y's together and so on, so math
+// over the whole batch runs 4 poses per instruction instead of one struct
+// at a time, storage is reused between decodes
+class PoseBatch {
+public:
+	PoseBatch() = default;
+
+	size_t GetCount() const {
+		return m_count;
+	}
+
+	// GetCount() floats of :field:, one per pose
+	float* GetField(EPoseField field) {
+		return m_data.data() + field * m_capacity;
+	}
+
+	const float* GetField(EPoseField field) const {
+		return m_data.data() + field * m_capacity;
+	}
+
+	// udu slot each pose came from, only filled by the packet decode
+	const std::vector<uint32_t>& GetDevices() const {
+		return m_devices;
+	}
+
+	// replaces the batch with :poses:
+	void Decode(const TrackerPoses& poses) {
+		m_devices.clear();
+		reserve(poses.size());
+		m_count = 0;
+		append(poses.data(), poses.size());
+	}
+
+	// replaces the batch with every headset and tracker of a pose packet,
+	// in udu order, controllers and gaze are skipped
+	// returns false and leaves the batch empty if :len: doesn't match
+	bool Decode(const UduLayout& layout, const void* packet, size_t len) {
+		m_count = 0;
+		m_devices.clear();
+		if (len != layout.GetPacketSize())
+			return false;
+
+		reserve(layout.GetTypeCount('h') + layout.GetTypeCount('t'));
+
+		// neighbouring poses go through in one transpose
+		const char* p = (const char*)packet;
+		size_t run_start = 0, run_len = 0;
+		for (size_t i=0; i < layout.GetDeviceCount(); i++) {
+			const UduSlot& slot = layout.GetSlot(i);
+			if (slot.type == 'h' || slot.type == 't') {
+				if (!run_len)
+					run_start = i;
+				run_len++;
+				m_devices.push_back((uint32_t)i);
+				continue;
+			}
+
+			if (run_len)
+				append(p + layout.GetSlot(run_start).offset, run_len);
+			run_len = 0;
+		}
+		if (run_len)
+			append(p + layout.GetSlot(run_start).offset, run_len);
+
+		return true;
+	}
+
+	// writes the batch back out as GetCount() back to back tracker poses
+	void Encode(void* dst) const {
+		const float* fields[EPoseField_count];
+		for (int f=0; f < EPoseField_count; f++)
+			fields[f] = GetField((EPoseField)f);
+
+		lsc::InterleaveFloats(fields, m_count, EPoseField_count, dst, sizeof(HoboVR_TrackerPose_t));
+	}
+
+	// scales every orientation to unit length
+	void NormalizeOrientations() {
+		lsc::NormalizeQuaternions(
+			GetField(EPoseField_rot_w),
+			GetField(EPoseField_rot_x),
+			GetField(EPoseField_rot_y),
+			GetField(EPoseField_rot_z),
+			m_count
+		);
+	}
+
+private:
+	// room for at least :count: poses, drops the contents on growth
+	void reserve(size_t count) {
+		if (count <= m_capacity)
+			return;
+
+		m_capacity = (count + 3) & ~(size_t)3; // whole vectors per field
+		m_data.assign(m_capacity * EPoseField_count, 0.0f);
+	}
+
+	// transposes :count: poses at :src: onto the end of the batch
+	void append(const void* src, size_t count) {
+		float* fields[EPoseField_count];
+		for (int f=0; f < EPoseField_count; f++)
+			fields[f] = GetField((EPoseField)f) + m_count;
+
+		lsc::DeinterleaveFloats(src, sizeof(HoboVR_TrackerPose_t), count, EPoseField_count, fields);
+		m_count += count;
+	}
+
+	std::vector<float> m_data; // EPoseField_count arrays of m_capacity floats
+	size_t m_capacity = 0;
+	size_t m_count = 0;
+	std::vector<uint32_t> m_devices;
+}; // class PoseBatch
+
+} // namespace hobovr
+
+#endif // #ifndef __HOBOVR_POSE_BATCH
@@ -0,0 +1,341 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+#ifndef __HOBOVR_POSE_CODEC
+#define __HOBOVR_POSE_CODEC
+
+#include <cstddef>
+#include "lazy_sockets.h"
+#include "packets.h"
+#include "udu_layout.h"
+
+namespace hobovr {
+
+////////////////////////////////////////////////////////////////////////////////
+// Compact pose frames
+////////////////////////////////////////////////////////////////////////////////
+
+// an optional compact encoding of pose packets, meant for links where
+// bandwidth matters more than a few cycles, e.g. wireless trackers
+//
+// every headset, controller and tracker is quantized into ints:
+//   positions - fixed point, 0.1 mm steps
+//   velocities - fixed point, 1 mm/s and 1 mrad/s steps
+//   orientations - smallest three, 15 bits per component
+//   controller scalar inputs - fixed point, 1/10000 steps
+// gaze devices are sent as they are
+//
+// a frame is:
+//   varint seq
+//   varint distance back to the baseline frame, 0 for a keyframe
+//   per device: varint bit mask of the fields that differ from the
+//     baseline, then a zigzag varint difference for each of them
+//     (a keyframe is a delta against all zeros)
+// the result is byte stuffed so it never contains the end tag and gets
+// g_EndTag appended, so it goes through a ThreadedSendLoop and a
+// ThreadedRecvLoop like any other frame
+//
+// the baseline is the last frame the decoding side acked, how acks get
+// back is up to the transport, until the first ack every frame is a
+// keyframe, a device that didn't move costs 1 byte in a delta frame
+
+// frames both sides remember, a baseline older than this isn't used
+static constexpr uint32_t k_pose_codec_history = 32;
+
+// shared between the encoder and the decoder
+class PoseQuantizer {
+public:
+	explicit PoseQuantizer(const UduLayout& layout): m_layout(layout) {
+		for (size_t i=0; i < layout.GetDeviceCount(); i++) {
+			m_field_offsets.push_back((uint32_t)m_field_count);
+			m_field_count += field_count(layout.GetSlot(i).type);
+		}
+
+		for (Frame& frame : m_history)
+			frame.fields.resize(m_field_count);
+	}
+
+	const UduLayout& GetLayout() const {
+		return m_layout;
+	}
+
+protected:
+	static constexpr float k_position_scale = 10000.0f;
+	static constexpr float k_velocity_scale = 1000.0f;
+	static constexpr float k_input_scale = 10000.0f;
+	static constexpr int k_quat_bits = 15;
+
+	// quantized fields of a frame, by seq
+	struct Frame {
+		uint32_t seq = 0; // 0 for none
+		std::vector<int32_t> fields;
+	};
+
+	static size_t field_count(char type) {
+		switch (type) {
+			case 'h':
+			case 't': return 13;
+			case 'c': return 17;
+			default: return 0;
+		}
+	}
+
+	// the frame with :seq:, nullptr if it isn't remembered anymore
+	Frame* find_frame(uint32_t seq) {
+		Frame& frame = m_history[seq % k_pose_codec_history];
+		return seq && frame.seq == seq ? &frame : nullptr;
+	}
+
+	Frame& new_frame(uint32_t seq) {
+		Frame& frame = m_history[seq % k_pose_codec_history];
+		frame.seq = seq;
+		return frame;
+	}
+
+	// :packet: into m_field_count ints at :out:
+	void quantize(const char* packet, int32_t* out) const {
+		for (size_t i=0; i < m_layout.GetDeviceCount(); i++) {
+			const UduSlot& slot = m_layout.GetSlot(i);
+			const char* p = packet + slot.offset;
+			int32_t* fields = out + m_field_offsets[i];
+			if (slot.type == 'g')
+				continue;
+
+			// headset, tracker and the start of a controller are the same
+			float v[16];
+			memcpy(v, p, (slot.type == 'c' ? 16 : 13) * sizeof(float));
+			for (int j=0; j < 3; j++)
+				fields[j] = lsc::QuantizeFixed(v[j], k_position_scale);
+			lsc::QuantizeQuat(v + 3, k_quat_bits, fields + 3);
+			for (int j=7; j < 13; j++)
+				fields[j] = lsc::QuantizeFixed(v[j], k_velocity_scale);
+
+			if (slot.type == 'c') {
+				for (int j=13; j < 16; j++)
+					fields[j] = lsc::QuantizeFixed(v[j], k_input_scale);
+				fields[16] = p[offsetof(HoboVR_ControllerState_t, scalar_inputs) + sizeof(float) * 3] & 0x3f;
+			}
+		}
+	}
+
+	// the reverse of quantize(), gaze devices are left alone
+	void dequantize(const int32_t* in, char* packet) const {
+		for (size_t i=0; i < m_layout.GetDeviceCount(); i++) {
+			const UduSlot& slot = m_layout.GetSlot(i);
+			char* p = packet + slot.offset;
+			const int32_t* fields = in + m_field_offsets[i];
+			if (slot.type == 'g')
+				continue;
+
+			float v[16];
+			for (int j=0; j < 3; j++)
+				v[j] = lsc::DequantizeFixed(fields[j], k_position_scale);
+			lsc::DequantizeQuat(fields + 3, k_quat_bits, v + 3);
+			for (int j=7; j < 13; j++)
+				v[j] = lsc::DequantizeFixed(fields[j], k_velocity_scale);
+
+			if (slot.type != 'c') {
+				memcpy(p, v, 13 * sizeof(float));
+				continue;
+			}
+
+			for (int j=13; j < 16; j++)
+				v[j] = lsc::DequantizeFixed(fields[j], k_input_scale);
+			memcpy(p, v, 16 * sizeof(float));
+			p[offsetof(HoboVR_ControllerState_t, scalar_inputs) + sizeof(float) * 3] = (char)(fields[16] & 0x3f);
+		}
+	}
+
+	UduLayout m_layout;
+	std::vector<uint32_t> m_field_offsets; // first field of each device
+	size_t m_field_count = 0;
+	std::array<Frame, k_pose_codec_history> m_history;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// PoseEncoder - pose packets into compact frames
+////////////////////////////////////////////////////////////////////////////////
+
+class PoseEncoder: public PoseQuantizer {
+public:
+	explicit PoseEncoder(const UduLayout& layout): PoseQuantizer(layout) {}
+
+	// encodes the pose packet :packet: into :frame:, end tag included,
+	// ready for ThreadedSendLoop::SendString()
+	// returns 0 on success or -1 on error (EINVAL if :len: doesn't match
+	// the layout)
+	int Encode(const void* packet, size_t len, std::string& frame) {
+		if (len != m_layout.GetPacketSize()) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		uint32_t seq = ++m_seq;
+		if (!seq) // 0 means no frame, skip it on wrap around
+			seq = ++m_seq;
+
+		// the new frame takes a history slot, the baseline must not be in it
+		const Frame* base = nullptr;
+		if (m_baseline && seq - m_baseline < k_pose_codec_history)
+			base = find_frame(m_baseline);
+
+		uint32_t base_seq = base ? base->seq : 0;
+		Frame& cur = new_frame(seq);
+		quantize((const char*)packet, cur.fields.data());
+
+		m_scratch.clear();
+		lsc::PutVarint(m_scratch, seq);
+		lsc::PutVarint(m_scratch, base ? seq - base_seq : 0);
+
+		const char* p = (const char*)packet;
+		for (size_t i=0; i < m_layout.GetDeviceCount(); i++) {
+			const UduSlot& slot = m_layout.GetSlot(i);
+			if (slot.type == 'g') {
+				m_scratch.append(p + slot.offset, slot.size);
+				continue;
+			}
+
+			const int32_t* fields = cur.fields.data() + m_field_offsets[i];
+			const int32_t* base_fields = base ? base->fields.data() + m_field_offsets[i] : nullptr;
+			size_t count = field_count(slot.type);
+
+			uint32_t mask = 0;
+			for (size_t j=0; j < count; j++)
+				if (fields[j] != (base_fields ? base_fields[j] : 0))
+					mask |= 1u << j;
+
+			lsc::PutVarint(m_scratch, mask);
+			for (size_t j=0; j < count; j++)
+				if (mask & (1u << j))
+					lsc::PutVarint(m_scratch, lsc::ZigZag((int64_t)fields[j] - (base_fields ? base_fields[j] : 0)));
+		}
+
+		frame.clear();
+		lsc::EscapeBytes(m_scratch.data(), m_scratch.size(), g_EndTag.a, frame);
+		frame.append((const char*)&g_EndTag, sizeof(g_EndTag));
+		return 0;
+	}
+
+	// the decoding side has decoded frame :seq:, later frames are deltas
+	// against it, acks for unknown or older frames than the current
+	// baseline are ignored
+	void Ack(uint32_t seq) {
+		if (seq > m_baseline && seq <= m_seq && find_frame(seq))
+			m_baseline = seq;
+	}
+
+	// forgets the baseline, the next frame is a keyframe,
+	// e.g. after a reconnect
+	void Reset() {
+		m_baseline = 0;
+	}
+
+	// seq of the last encoded frame
+	uint32_t GetLastSeq() const {
+		return m_seq;
+	}
+
+private:
+	uint32_t m_seq = 0;
+	uint32_t m_baseline = 0;
+	std::string m_scratch;
+}; // class PoseEncoder
+
+////////////////////////////////////////////////////////////////////////////////
+// PoseDecoder - compact frames back into pose packets
+////////////////////////////////////////////////////////////////////////////////
+
+class PoseDecoder: public PoseQuantizer {
+public:
+	explicit PoseDecoder(const UduLayout& layout): PoseQuantizer(layout) {}
+
+	// decodes :frame:, as handed out by a receiver, into the pose packet
+	// :packet: and its sequence number :seq:, which should be acked back
+	// to the encoder
+	// returns 0 on success or -1 on error (EINVAL for a malformed frame,
+	// ENOENT if the baseline isn't known, e.g. it was never received)
+	int Decode(const void* frame, size_t len, std::string& packet, uint32_t& seq) {
+		m_scratch.clear();
+		if (!lsc::UnescapeBytes(frame, len, m_scratch)) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		const char* p = m_scratch.data();
+		const char* end = p + m_scratch.size();
+		uint64_t frame_seq, back;
+		if (!lsc::GetVarint(p, end, frame_seq) || !lsc::GetVarint(p, end, back) ||
+			!frame_seq || frame_seq > UINT32_MAX || back >= k_pose_codec_history || back >= frame_seq) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		const Frame* base = nullptr;
+		if (back) {
+			base = find_frame((uint32_t)(frame_seq - back));
+			if (!base) {
+				errno = ENOENT;
+				return -1;
+			}
+		}
+
+		// decoded into a scratch frame first, a bad frame must not
+		// overwrite a good baseline in the history
+		m_fields.resize(m_field_count);
+		packet.resize(m_layout.GetPacketSize());
+		for (size_t i=0; i < m_layout.GetDeviceCount(); i++) {
+			const UduSlot& slot = m_layout.GetSlot(i);
+			if (slot.type == 'g') {
+				if ((size_t)(end - p) < slot.size) {
+					errno = EINVAL;
+					return -1;
+				}
+				memcpy(&packet[slot.offset], p, slot.size);
+				p += slot.size;
+				continue;
+			}
+
+			int32_t* fields = m_fields.data() + m_field_offsets[i];
+			const int32_t* base_fields = base ? base->fields.data() + m_field_offsets[i] : nullptr;
+			size_t count = field_count(slot.type);
+
+			uint64_t mask;
+			if (!lsc::GetVarint(p, end, mask) || mask >> count) {
+				errno = EINVAL;
+				return -1;
+			}
+
+			for (size_t j=0; j < count; j++) {
+				int64_t value = base_fields ? base_fields[j] : 0;
+				if (mask & (1u << j)) {
+					uint64_t diff;
+					if (!lsc::GetVarint(p, end, diff)) {
+						errno = EINVAL;
+						return -1;
+					}
+					value += lsc::UnZigZag(diff);
+				}
+				fields[j] = (int32_t)value;
+			}
+		}
+
+		if (p != end) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		dequantize(m_fields.data(), &packet[0]);
+		new_frame((uint32_t)frame_seq).fields.swap(m_fields);
+		seq = (uint32_t)frame_seq;
+		return 0;
+	}
+
+private:
+	std::string m_scratch;
+	std::vector<int32_t> m_fields;
+}; // class PoseDecoder
+
+} // namespace hobovr
+
+#endif // #ifndef __HOBOVR_POSE_CODEC
@@ -0,0 +1,484 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// pose_loadgen.cpp - emulates a HoboVR poser streaming poses into a driver,
+// measures end to end frame latency and cpu cost per device, prints json
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+// usage: pose_loadgen [--devices 1,10,100] [--hz 250] [--seconds 5]
+//                     [--udu-every 1.0] [--quick] [--out results.json]
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <ctime>
+#include "lazy_sockets.h"
+#include "socket_pairs.h"
+#include <errno.h>
+
+#include <thread>
+
+#include "packets.h"
+#include "packet_views.h"
+
+using namespace lsc;
+
+using tcp_socket = LSocket<AF_INET, SOCK_STREAM, 0>;
+using tcp_receiver_loop = ThreadedRecvLoop<AF_INET, SOCK_STREAM, 0, PacketEndTag>;
+
+using loadgen_clock = std::chrono::steady_clock;
+
+// results are collected as json objects, one per run
+static std::vector<std::string> g_results;
+
+// cpu time used by the calling thread in nanoseconds
+static uint64_t thread_cpu_ns() {
+#ifdef LINUX
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#else
+	return 0; // not reported
+#endif
+}
+
+// a typical setup, headset first, two controllers, then trackers
+// with a gaze master every 8 devices
+static std::string make_udu(int devices) {
+	std::string udu;
+	for (int i=0; i < devices; i++) {
+		if (i == 0)
+			udu += 'h';
+		else if (i < 3)
+			udu += 'c';
+		else if (i % 8 == 7)
+			udu += 'g';
+		else
+			udu += 't';
+	}
+
+	return udu;
+}
+
+static uint8_t udu_device_type(char c) {
+	switch (c) {
+		case 'h': return EDeviceType_headset;
+		case 'c': return EDeviceType_controller;
+		case 't': return EDeviceType_tracker;
+		case 'g': return EDeviceType_gazeMaster;
+	}
+
+	return (uint8_t)EDeviceType_invalid;
+}
+
+/////////////////////////////
+// driver side
+/////////////////////////////
+
+// what the driver does with the poser connections, the same way
+// the real driver uses the receivers: a tracking socket carrying pose
+// packets and a manager socket carrying settings changes
+class LoadgenDriver {
+public:
+	LoadgenDriver(
+		std::shared_ptr<tcp_socket> tracking,
+		std::shared_ptr<tcp_socket> manager,
+		const std::string& udu,
+		const std::vector<std::atomic<uint64_t>>& send_times
+	): m_manager_soc(manager), m_send_times(send_times) {
+		m_expected_size = util::udu2sizet(udu);
+
+		m_tracking = std::make_unique<tcp_receiver_loop>(
+			tracking,
+			g_EndTag,
+			std::bind(&LoadgenDriver::OnPose, this, std::placeholders::_1, std::placeholders::_2),
+			m_expected_size + sizeof(PacketEndTag)
+		);
+		m_manager = std::make_unique<tcp_receiver_loop>(
+			manager,
+			g_EndTag,
+			std::bind(&LoadgenDriver::OnManagerMsg, this, std::placeholders::_1, std::placeholders::_2),
+			sizeof(HoboVR_ManagerMsg_t)
+		);
+
+		m_tracking->Start();
+		m_manager->Start();
+	}
+
+	// the sockets have to be released by the owner first
+	void Stop() {
+		m_manager_soc.reset();
+		m_tracking->Stop();
+		m_manager->Stop();
+	}
+
+	void OnPose(void* buff, size_t len) {
+		uint64_t now = get_time_ns();
+		if (!m_cpu_start)
+			m_cpu_start = thread_cpu_ns();
+
+		m_frames.fetch_add(1, std::memory_order_relaxed);
+
+		if (len != m_expected_size.load(std::memory_order_relaxed)) {
+			// in flight during a udu change, or an end tag hiding in the pose data
+			m_bad_frames.fetch_add(1, std::memory_order_relaxed);
+		} else {
+			// the poser stores the frame number in the headset x position
+			const HoboVR_HeadsetPose_t& pose = hobovr::HeadsetPoses(buff, 1)[0];
+			uint64_t seq = (uint64_t)pose.position[0];
+			if (seq < m_send_times.size()) {
+				uint64_t sent = m_send_times[seq].load(std::memory_order_acquire);
+				if (sent && now >= sent)
+					m_latency.Record(now - sent);
+			}
+		}
+
+		m_cpu_end.store(thread_cpu_ns() - m_cpu_start, std::memory_order_relaxed);
+	}
+
+	void OnManagerMsg(void* buff, size_t len) {
+		HoboVR_ManagerResp_t resp{EManagerResp_invalid};
+		hobovr::VisitManagerMsg(buff, len, overloaded{
+			[this, &resp](const HoboVR_ManagerMsgUduString_t& msg) {
+				std::string udu;
+				for (int i=0; i < msg.len; i++)
+					udu += "hctg"[msg.devices[i] & 3];
+
+				size_t size = util::udu2sizet(udu);
+				m_expected_size = size;
+				m_tracking->ReallocInternalBuffer(size + sizeof(PacketEndTag));
+				m_udu_changes.fetch_add(1, std::memory_order_relaxed);
+				resp.status = EManagerResp_ok;
+			},
+			[](const auto&) {}
+		});
+
+		if (auto soc = m_manager_soc)
+			soc->SendAll(&resp, sizeof(resp));
+	}
+
+	uint64_t GetFrames() const {
+		return m_frames.load(std::memory_order_relaxed);
+	}
+
+	uint64_t GetBadFrames() const {
+		return m_bad_frames.load(std::memory_order_relaxed);
+	}
+
+	uint64_t GetUduChanges() const {
+		return m_udu_changes.load(std::memory_order_relaxed);
+	}
+
+	// receiver thread cpu time from the first pose to the last one
+	uint64_t GetCpuNs() const {
+		return m_cpu_end.load(std::memory_order_relaxed);
+	}
+
+	HistogramSnapshot GetLatency() const {
+		return m_latency.Snapshot();
+	}
+
+private:
+	std::shared_ptr<tcp_socket> m_manager_soc;
+	const std::vector<std::atomic<uint64_t>>& m_send_times;
+
+	std::unique_ptr<tcp_receiver_loop> m_tracking;
+	std::unique_ptr<tcp_receiver_loop> m_manager;
+
+	std::atomic<size_t> m_expected_size;
+	std::atomic<uint64_t> m_frames{0};
+	std::atomic<uint64_t> m_bad_frames{0};
+	std::atomic<uint64_t> m_udu_changes{0};
+
+	uint64_t m_cpu_start = 0; // receiver thread only
+	std::atomic<uint64_t> m_cpu_end{0};
+
+	LatencyHistogram m_latency;
+};
+
+/////////////////////////////
+// poser side
+/////////////////////////////
+
+// writes the poses of :udu: for frame :seq: at time :t: into :out:,
+// everything moves a little so the data isn't all zeros
+static void fill_poses(std::string& out, const std::string& udu, uint64_t seq, double t) {
+	out.clear();
+	for (size_t i=0; i < udu.size(); i++) {
+		float phase = (float)(t + i * 0.1);
+		float pos[3] = {std::sin(phase), 1.5f + 0.1f * std::cos(phase), 0.5f * std::sin(phase * 0.5f)};
+		float rot[4] = {std::cos(phase * 0.5f), 0.0f, std::sin(phase * 0.5f), 0.0f};
+		float vel[3] = {std::cos(phase), -0.1f * std::sin(phase), 0.25f * std::cos(phase * 0.5f)};
+		float ang[3] = {0.0f, 0.5f, 0.0f};
+
+		if (i == 0)
+			pos[0] = (float)seq; // frame number for the latency measurement, exact up to 2^24
+
+		switch (udu[i]) {
+			case 'h': {
+				HoboVR_HeadsetPose_t pose;
+				memcpy(pose.position, pos, sizeof(pos));
+				memcpy(pose.orientation, rot, sizeof(rot));
+				memcpy(pose.velocity, vel, sizeof(vel));
+				memcpy(pose.angular_velocity, ang, sizeof(ang));
+				out.append((const char*)&pose, sizeof(pose));
+				break;
+			}
+			case 'c': {
+				HoboVR_ControllerState_t state;
+				memset(&state, 0, sizeof(state));
+				memcpy(state.position, pos, sizeof(pos));
+				memcpy(state.orientation, rot, sizeof(rot));
+				memcpy(state.velocity, vel, sizeof(vel));
+				memcpy(state.angular_velocity, ang, sizeof(ang));
+				state.scalar_inputs[0] = 0.5f + 0.5f * std::sin(phase);
+				state.inputs_mask = seq & 0b111111;
+				out.append((const char*)&state, sizeof(state));
+				break;
+			}
+			case 't': {
+				HoboVR_TrackerPose_t pose;
+				memcpy(pose.position, pos, sizeof(pos));
+				memcpy(pose.orientation, rot, sizeof(rot));
+				memcpy(pose.velocity, vel, sizeof(vel));
+				memcpy(pose.angular_velocity, ang, sizeof(ang));
+				out.append((const char*)&pose, sizeof(pose));
+				break;
+			}
+			case 'g': {
+				HoboVR_GazeState_t state;
+				memset(&state, 0, sizeof(state));
+				state.status = EGazeStatus_active;
+				state.pupil_position_r[0] = 0.1f * std::sin(phase);
+				state.pupil_position_l[0] = 0.1f * std::sin(phase);
+				state.pupil_dilation_r = 0.5f;
+				state.pupil_dilation_l = 0.5f;
+				out.append((const char*)&state, sizeof(state));
+				break;
+			}
+		}
+	}
+
+	out.append((const char*)&g_EndTag, sizeof(g_EndTag));
+}
+
+// sends a udu change on the manager socket and waits for the answer
+// returns 0 on success or -1 on error (EINVAL if :udu: doesn't fit a message)
+static int send_udu_change(tcp_socket& manager, const std::string& udu) {
+	HoboVR_ManagerMsgUduString_t udu_msg;
+	if (udu.size() > sizeof(udu_msg.devices)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(&udu_msg, 0, sizeof(udu_msg));
+	udu_msg.len = (uint16_t)udu.size();
+	for (size_t i=0; i < udu.size(); i++)
+		udu_msg.devices[i] = udu_device_type(udu[i]);
+
+	std::string msg = hobovr::EncodeMessage<hobovr::ManagerSchema>(udu_msg);
+	if (manager.SendAll(msg.data(), msg.size()) < 0)
+		return -1;
+
+	HoboVR_ManagerResp_t resp;
+	size_t off = 0;
+	while (off < sizeof(resp)) {
+		int res = manager.Recv((char*)&resp + off, sizeof(resp) - off);
+		if (res <= 0)
+			return -1;
+		off += res;
+	}
+
+	return resp.status == EManagerResp_ok ? 0 : -1;
+}
+
+struct LoadgenOptions {
+	std::vector<int> devices = {1, 10, 100};
+	int hz = 250;
+	double seconds = 5.0;
+	double udu_every = 1.0; // seconds between udu changes, 0 disables them
+};
+
+// streams :devices: worth of poses at :hz: for a while, every :udu_every:
+// seconds a tracker gets plugged in or out, like the real poser does
+static void run_loadgen(int devices, const LoadgenOptions& opt) {
+	std::shared_ptr<tcp_socket> poser_tracking, driver_tracking;
+	std::shared_ptr<tcp_socket> poser_manager, driver_manager;
+	if (make_tcp_pair(poser_tracking, driver_tracking, true) || make_tcp_pair(poser_manager, driver_manager, true)) {
+		std::cerr << "failed to make a socket pair: " << getString(lerrno) << std::endl;
+		exit(1);
+	}
+
+	uint64_t frames = (uint64_t)(opt.hz * opt.seconds);
+	std::vector<std::atomic<uint64_t>> send_times(frames);
+
+	std::string base_udu = make_udu(devices);
+	std::string udu = base_udu;
+
+	// the udu changes add a tracker, or drop one when the list is full
+	std::string alt_udu = base_udu;
+	if (alt_udu.size() < sizeof(HoboVR_ManagerMsgUduString_t::devices))
+		alt_udu += 't';
+	else
+		alt_udu.pop_back();
+	LoadgenDriver driver(driver_tracking, driver_manager, udu, send_times);
+
+	std::clock_t process_start = std::clock();
+	uint64_t poser_cpu_start = thread_cpu_ns();
+
+	std::string packet;
+	uint64_t udu_changes = 0;
+	bool ok = true;
+	auto period = std::chrono::duration<double>(1.0 / opt.hz);
+	auto start = loadgen_clock::now();
+	auto next_udu = start + std::chrono::duration<double>(opt.udu_every);
+
+	uint64_t seq = 0;
+	for (; seq < frames && ok; seq++) {
+		auto tick = start + std::chrono::duration_cast<loadgen_clock::duration>(period * (double)seq);
+		std::this_thread::sleep_until(tick);
+
+		if (opt.udu_every > 0 && tick >= next_udu) {
+			std::string new_udu = udu == base_udu ? alt_udu : base_udu;
+			if (send_udu_change(*poser_manager, new_udu)) {
+				std::cerr << "udu change failed" << std::endl;
+				ok = false;
+				break;
+			}
+
+			udu = new_udu;
+			udu_changes++;
+			next_udu = tick + std::chrono::duration<double>(opt.udu_every);
+		}
+
+		fill_poses(packet, udu, seq, std::chrono::duration<double>(tick - start).count());
+		send_times[seq].store(get_time_ns(), std::memory_order_release);
+		ok = poser_tracking->SendAll(packet.data(), packet.size()) == (int)packet.size();
+	}
+
+	double elapsed = std::chrono::duration<double>(loadgen_clock::now() - start).count();
+	uint64_t poser_cpu = thread_cpu_ns() - poser_cpu_start;
+
+	// let the driver catch up before taking the numbers
+	auto deadline = loadgen_clock::now() + std::chrono::seconds(5);
+	while (driver.GetFrames() < seq && loadgen_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	double process_cpu = (double)(std::clock() - process_start) / CLOCKS_PER_SEC;
+
+	poser_tracking.reset();
+	poser_manager.reset();
+	driver_tracking.reset();
+	driver_manager.reset();
+	driver.Stop();
+
+	HistogramSnapshot snap = driver.GetLatency();
+	double driver_cpu_s = driver.GetCpuNs() / 1e9;
+
+	std::ostringstream json;
+	json << "{\"scenario\":\"pose_stream\",\"devices\":" << devices
+		<< ",\"udu\":\"" << base_udu << "\""
+		<< ",\"packet_size\":" << util::udu2sizet(base_udu) + sizeof(PacketEndTag)
+		<< ",\"hz\":" << opt.hz
+		<< ",\"ok\":" << (ok ? "true" : "false")
+		<< ",\"frames_sent\":" << seq
+		<< ",\"frames_received\":" << driver.GetFrames()
+		<< ",\"bad_frames\":" << driver.GetBadFrames()
+		<< ",\"udu_changes\":" << udu_changes
+		<< ",\"udu_changes_applied\":" << driver.GetUduChanges()
+		<< ",\"latency_ns\":{\"count\":" << snap.Count()
+		<< ",\"mean\":" << (uint64_t)snap.Mean()
+		<< ",\"p50\":" << snap.Percentile(50)
+		<< ",\"p90\":" << snap.Percentile(90)
+		<< ",\"p99\":" << snap.Percentile(99)
+		<< ",\"p999\":" << snap.Percentile(99.9)
+		<< ",\"max\":" << snap.Max()
+		<< "},\"cpu\":{\"driver_pct\":" << driver_cpu_s / elapsed * 100.0
+		<< ",\"driver_us_per_device_sec\":" << driver_cpu_s * 1e6 / elapsed / devices
+		<< ",\"poser_pct\":" << poser_cpu / 1e9 / elapsed * 100.0
+		<< ",\"process_pct\":" << process_cpu / elapsed * 100.0
+		<< "}}";
+
+	g_results.push_back(json.str());
+	std::cerr << json.str() << std::endl; // progress for humans
+}
+
+// parses "1,10,100"
+static bool parse_list(const std::string& arg, std::vector<int>& out) {
+	out.clear();
+	std::istringstream in(arg);
+	std::string item;
+	while (std::getline(in, item, ',')) {
+		int value = atoi(item.c_str());
+		if (value <= 0 || value > 512)
+			return false;
+		out.push_back(value);
+	}
+
+	return !out.empty();
+}
+
+int main(int argc, char** argv) {
+	LoadgenOptions opt;
+	std::string out_path;
+	bool usage = false;
+
+	for (int i=1; i < argc && !usage; i++) {
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+		if (arg == "--quick") {
+			opt.seconds = 1.0;
+			opt.udu_every = 0.25;
+		} else if (arg == "--devices" && has_value) {
+			usage = !parse_list(argv[++i], opt.devices);
+		} else if (arg == "--hz" && has_value) {
+			opt.hz = atoi(argv[++i]);
+			usage = opt.hz <= 0;
+		} else if (arg == "--seconds" && has_value) {
+			opt.seconds = atof(argv[++i]);
+			usage = opt.seconds <= 0;
+		} else if (arg == "--udu-every" && has_value) {
+			opt.udu_every = atof(argv[++i]);
+		} else if (arg == "--out" && has_value) {
+			out_path = argv[++i];
+		} else {
+			usage = true;
+		}
+	}
+
+	if (usage) {
+		std::cerr << "usage: " << argv[0]
+			<< " [--devices 1,10,100] [--hz 250] [--seconds 5] [--udu-every 1.0]"
+			<< " [--quick] [--out results.json]" << std::endl;
+		return 1;
+	}
+
+	for (int devices : opt.devices)
+		run_loadgen(devices, opt);
+
+	std::ostringstream json;
+	json << "{\"version\":\"" << __LAZY_SOCKETS_VERSION << "\""
+		<< ",\"build\":" << __LAZY_SOCKETS_BUILD
+		<< ",\"hardware_threads\":" << std::thread::hardware_concurrency()
+		<< ",\"hz\":" << opt.hz
+		<< ",\"seconds\":" << opt.seconds
+		<< ",\"udu_every\":" << opt.udu_every
+		<< ",\"results\":[";
+	for (size_t i=0; i < g_results.size(); i++)
+		json << (i ? ",\n" : "\n") << g_results[i];
+	json << "\n]}\n";
+
+	if (out_path.empty()) {
+		std::cout << json.str();
+	} else {
+		std::ofstream out(out_path);
+		out << json.str();
+		if (!out) {
+			std::cerr << "failed to write " << out_path << std::endl;
+			return 1;
+		}
+	}
+
+	return 0;
+}
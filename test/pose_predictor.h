@@ -0,0 +1,172 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+#ifndef __HOBOVR_POSE_PREDICTOR
+#define __HOBOVR_POSE_PREDICTOR
+
+#include <cmath>
+#include <cstddef>
+#include "lazy_sockets.h"
+#include "packets.h"
+#include "udu_layout.h"
+
+namespace hobovr {
+
+// a received pose and when it was received
+struct TimedPose {
+	uint64_t time_ns;
+	HoboVR_TrackerPose_t pose;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// PosePredictor - per device pose history, extrapolated to any time
+////////////////////////////////////////////////////////////////////////////////
+
+// the receiver thread pushes every pose packet with its receive time,
+// the render side asks for the pose at the time the frame will be shown,
+// neither side ever waits for the other, a query is a couple of atomic
+// loads and a few multiplies
+//
+// poses are extrapolated from the newest sample not newer than the query
+// time, with the velocity and angular velocity of that sample, both taken
+// to be in tracking space, so a late or bunched up packet moves the
+// prediction by its velocity instead of making the device jump
+//
+// all times are whatever clock the caller uses, as long as Update() and
+// Predict() agree, e.g. get_time_ns()
+// made once per udu layout, swap the whole thing on udu changes
+class PosePredictor {
+public:
+	// keeps the last :history: poses of every headset, controller and
+	// tracker in :layout:, gaze devices have no pose
+	explicit PosePredictor(const UduLayout& layout, size_t history = 8): m_layout(layout) {
+		for (size_t i=0; i < layout.GetDeviceCount(); i++) {
+			char type = layout.GetSlot(i).type;
+			if (type == 'g')
+				m_rings.emplace_back(nullptr);
+			else
+				m_rings.emplace_back(std::make_unique<lsc::SeqlockRing<TimedPose>>(history));
+		}
+	}
+
+	size_t GetDeviceCount() const {
+		return m_rings.size();
+	}
+
+	// shifts every sample by :seconds:, negative if poses are older than
+	// their receive time says, same meaning as the driver pose time offset
+	// sent with HoboVR_ManagerMsgPoseTimeOff_t, thread safe
+	void SetTimeOffset(double seconds) {
+		m_offset_ns.store((int64_t)(seconds * 1e9), std::memory_order_relaxed);
+	}
+
+	// predictions don't go further than :limit: past the sample they
+	// start from, a device that stopped sending freezes instead of
+	// flying off, 50 ms by default, thread safe
+	void SetMaxExtrapolation(std::chrono::microseconds limit) {
+		m_max_extrapolation_ns.store((uint64_t)limit.count() * 1000, std::memory_order_relaxed);
+	}
+
+	// adds the poses in :packet: with the receive time :time_ns:
+	// only from a single thread, normally the receiver
+	// returns false if :len: doesn't match the layout
+	bool Update(const void* packet, size_t len, uint64_t time_ns) {
+		if (len != m_layout.GetPacketSize())
+			return false;
+
+		const char* p = (const char*)packet;
+		TimedPose sample;
+		sample.time_ns = time_ns;
+		for (size_t i=0; i < m_rings.size(); i++) {
+			if (!m_rings[i])
+				continue;
+
+			// the controller state starts with the same fields
+			memcpy(&sample.pose, p + m_layout.GetSlot(i).offset, sizeof(sample.pose));
+			m_rings[i]->Push(sample);
+		}
+
+		return true;
+	}
+
+	// copies the sample of :device: pushed :age: updates ago into :out:
+	// returns false if there is none or :device: has no pose
+	bool GetSample(size_t device, size_t age, TimedPose& out) const {
+		if (device >= m_rings.size() || !m_rings[device])
+			return false;
+
+		return m_rings[device]->Get(age, out);
+	}
+
+	// pose of :device: at :time_ns:, thread safe and lock free
+	// returns false if nothing was received for :device: yet
+	bool Predict(size_t device, uint64_t time_ns, HoboVR_TrackerPose_t& out) const {
+		if (device >= m_rings.size() || !m_rings[device])
+			return false;
+
+		// the newest sample that isn't from after :time_ns:,
+		// or the oldest one we have
+		const lsc::SeqlockRing<TimedPose>& ring = *m_rings[device];
+		int64_t offset = m_offset_ns.load(std::memory_order_relaxed);
+		TimedPose sample;
+		bool found = false;
+		for (size_t age=0; age < ring.Capacity() && ring.Get(age, sample); age++) {
+			found = true;
+			if ((int64_t)(time_ns - sample.time_ns) >= offset)
+				break;
+		}
+		if (!found)
+			return false;
+
+		int64_t dt_ns = (int64_t)(time_ns - sample.time_ns) - offset;
+		int64_t max_ns = (int64_t)m_max_extrapolation_ns.load(std::memory_order_relaxed);
+		dt_ns = std::min(std::max(dt_ns, (int64_t)0), max_ns);
+
+		Extrapolate(sample.pose, (float)(dt_ns * 1e-9), out);
+		return true;
+	}
+
+	// :pose: moved along its velocity and angular velocity for :dt: seconds
+	static void Extrapolate(const HoboVR_TrackerPose_t& pose, float dt, HoboVR_TrackerPose_t& out) {
+		float v[13];
+		memcpy(v, &pose, sizeof(v));
+		float* pos = v;
+		float* q = v + 3; // w, x, y, z
+		const float* vel = v + 7;
+		const float* ang = v + 10;
+
+		for (int i=0; i < 3; i++)
+			pos[i] += vel[i] * dt;
+
+		// rotation by angle |ang| * dt around ang, applied in tracking space
+		float speed = std::sqrt(ang[0] * ang[0] + ang[1] * ang[1] + ang[2] * ang[2]);
+		if (speed > 0.0f) {
+			float half = speed * dt * 0.5f;
+			float s = std::sin(half) / speed;
+			float d[4] = {std::cos(half), ang[0] * s, ang[1] * s, ang[2] * s};
+			float r[4] = {
+				d[0] * q[0] - d[1] * q[1] - d[2] * q[2] - d[3] * q[3],
+				d[0] * q[1] + d[1] * q[0] + d[2] * q[3] - d[3] * q[2],
+				d[0] * q[2] - d[1] * q[3] + d[2] * q[0] + d[3] * q[1],
+				d[0] * q[3] + d[1] * q[2] - d[2] * q[1] + d[3] * q[0]
+			};
+
+			float norm = std::sqrt(r[0] * r[0] + r[1] * r[1] + r[2] * r[2] + r[3] * r[3]);
+			for (int i=0; i < 4; i++)
+				q[i] = norm > 0.0f ? r[i] / norm : q[i];
+		}
+
+		memcpy(&out, v, sizeof(v));
+	}
+
+private:
+	UduLayout m_layout;
+	std::vector<std::unique_ptr<lsc::SeqlockRing<TimedPose>>> m_rings; // nullptr for gaze
+	std::atomic<int64_t> m_offset_ns{0};
+	std::atomic<uint64_t> m_max_extrapolation_ns{50000000};
+}; // class PosePredictor
+
+} // namespace hobovr
+
+#endif // #ifndef __HOBOVR_POSE_PREDICTOR
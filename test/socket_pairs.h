@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// socket_pairs.h - connected socket pairs for the tests and benchmarks
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+#ifndef __LSC_TEST_SOCKET_PAIRS
+#define __LSC_TEST_SOCKET_PAIRS
+
+#include <memory>
+#include "lazy_sockets.h"
+
+// connected pair of sockets of the same type as :a: and :b:, no ports
+// needed, goes through make_socket_pair() so it works on windows too
+// returns 0 on success or -1 on error
+template<int FAM, int TYP, int PROTO>
+inline int make_connected_pair(
+	std::shared_ptr<lsc::LSocket<FAM, TYP, PROTO>>& a,
+	std::shared_ptr<lsc::LSocket<FAM, TYP, PROTO>>& b
+) {
+	lsc::lsocket_t fds[2];
+	if (lsc::make_socket_pair(TYP, fds))
+		return -1;
+
+	a = std::make_shared<lsc::LSocket<FAM, TYP, PROTO>>(fds[0], lsc::EStat_connected);
+	b = std::make_shared<lsc::LSocket<FAM, TYP, PROTO>>(fds[1], lsc::EStat_connected);
+	return 0;
+}
+
+// connected pair of tcp sockets over loopback, on a kernel picked port,
+// for when the test needs real tcp (tcp_info, nagle, ...)
+// returns 0 on success or -1 on error
+template<int PROTO>
+inline int make_tcp_pair(
+	std::shared_ptr<lsc::LSocket<AF_INET, SOCK_STREAM, PROTO>>& a,
+	std::shared_ptr<lsc::LSocket<AF_INET, SOCK_STREAM, PROTO>>& b,
+	bool no_delay = false
+) {
+	using socket_t = lsc::LSocket<AF_INET, SOCK_STREAM, PROTO>;
+
+	socket_t listener;
+	lsc::lcsockaddr_in addr;
+	socklen_t addr_size = sizeof(addr);
+	if (listener.Bind("127.0.0.1", 0) || listener.Listen(1)
+		|| getsockname(listener.GetHandle(), (sockaddr*)&addr, &addr_size))
+		return -1;
+
+	a = std::make_shared<socket_t>();
+	if (a->Connect(addr))
+		return -1;
+
+	lsc::lsocket_t accepted = listener.Accept();
+	if (accepted == lsc::EAccept_error)
+		return -1;
+	b = std::make_shared<socket_t>(accepted, lsc::EStat_connected);
+
+	if (no_delay && (a->SetNoDelay(true) || b->SetNoDelay(true)))
+		return -1;
+	return 0;
+}
+
+#endif // #ifndef __LSC_TEST_SOCKET_PAIRS
@@ -103,8 +103,8 @@ TEST_CASE("Threaded send and receive") {
 	// send loop
 
 	for (int i=0; i<10; i++) {
-		int res = client->Send(msg, MSG_SIZE + sizeof(my_tag));
-		CHECK(res >= 0);
+		int res = client->SendAll(msg, MSG_SIZE + sizeof(my_tag));
+		CHECK(res == MSG_SIZE + sizeof(my_tag));
 	
 		std::this_thread::sleep_for(std::chrono::milliseconds(2)); // let the server setup first
 	}
@@ -0,0 +1,305 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+
+#define NOMINMAX
+#include <iostream>
+#include "lazy_sockets.h"
+#include <errno.h>
+
+#include <thread>
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+
+using namespace lsc;
+
+using udp_socket = LSocket<AF_INET, SOCK_DGRAM, IPPROTO_UDP>;
+using udp_link = SimLink<AF_INET, SOCK_DGRAM, 0>;
+
+// two channels wired straight to each other, datagrams sit in a queue
+// until delivered, :drop: decides which ones get lost on the way
+struct ChannelPair {
+	struct Wire {
+		std::deque<std::string> queue;
+		std::function<bool(size_t)> drop; // by datagram index
+		size_t count = 0;
+	};
+
+	Wire a_to_b, b_to_a;
+	DatagramChannel a{[this](const void* data, size_t len) {return put(a_to_b, data, len);}};
+	DatagramChannel b{[this](const void* data, size_t len) {return put(b_to_a, data, len);}};
+
+	static int put(Wire& wire, const void* data, size_t len) {
+		if (!wire.drop || !wire.drop(wire.count))
+			wire.queue.emplace_back((const char*)data, len);
+		wire.count++;
+		return (int)len;
+	}
+
+	// delivers everything queued and updates both ends at :now_ns:, until
+	// neither end has anything more to say
+	void Step(uint64_t now_ns) {
+		for (int i=0; i < 16 && (i == 0 || !a_to_b.queue.empty() || !b_to_a.queue.empty()); i++) {
+			while (!a_to_b.queue.empty()) {
+				b.OnDatagram(a_to_b.queue.front().data(), a_to_b.queue.front().size(), now_ns);
+				a_to_b.queue.pop_front();
+			}
+			while (!b_to_a.queue.empty()) {
+				a.OnDatagram(b_to_a.queue.front().data(), b_to_a.queue.front().size(), now_ns);
+				b_to_a.queue.pop_front();
+			}
+			REQUIRE(a.Update(now_ns) == 0);
+			REQUIRE(b.Update(now_ns) == 0);
+		}
+	}
+};
+
+TEST_CASE("DatagramChannel delivers reliable messages in order despite losses") {
+	ChannelPair pair;
+	pair.a_to_b.drop = [](size_t i) {return i % 3 == 1;};
+	pair.b_to_a.drop = [](size_t i) {return i % 4 == 2;}; // acks get lost too
+
+	for (int i=0; i < 100; i++)
+		REQUIRE(pair.a.Send(std::to_string(i), EChannel_reliable) == 0);
+
+	std::vector<std::string> got;
+	uint64_t now = get_time_ns();
+	for (int step=0; step < 100 && got.size() < 100; step++) {
+		now += 20000000;
+		pair.Step(now);
+
+		std::string msg;
+		EChannelMode mode;
+		while (pair.b.Receive(msg, mode)) {
+			CHECK(mode == EChannel_reliable);
+			got.push_back(msg);
+		}
+	}
+
+	REQUIRE(got.size() == 100);
+	for (int i=0; i < 100; i++)
+		CHECK(got[i] == std::to_string(i));
+
+	// once the acks made it back nothing is left
+	pair.Step(now + 1000000000);
+	ChannelStats stats = pair.a.GetStats();
+	CHECK(stats.in_flight == 0);
+	CHECK(stats.acked == 100);
+	CHECK(stats.resent >= 33);
+}
+
+TEST_CASE("DatagramChannel resends on a selective ack before the timeout") {
+	ChannelPair pair;
+	pair.a_to_b.drop = [](size_t i) {return i == 0;};
+
+	uint64_t now = get_time_ns();
+	for (int i=0; i < 4; i++)
+		REQUIRE(pair.a.Send("x", 1, EChannel_reliable) == 0);
+
+	// b acks 2..4 with 1 missing, a gets 1 again a round trip later
+	// without waiting out the initial timeout
+	pair.Step(now + (uint64_t)LSC_CHANNEL_INITIAL_RTO / 10);
+
+	std::string msg;
+	EChannelMode mode;
+	int got = 0;
+	while (pair.b.Receive(msg, mode))
+		got++;
+	CHECK(got == 4);
+	CHECK(pair.a.GetStats().resent == 1);
+}
+
+TEST_CASE("DatagramChannel drops stale latest messages") {
+	std::vector<std::string> sent;
+	DatagramChannel a([&](const void* data, size_t len) {
+		sent.emplace_back((const char*)data, len);
+		return (int)len;
+	});
+	DatagramChannel b([](const void*, size_t len) {return (int)len;});
+
+	for (int i=0; i < 3; i++)
+		REQUIRE(a.Send(std::to_string(i), EChannel_latest) == 0);
+	CHECK(a.GetInFlight() == 0); // never resent
+
+	uint64_t now = get_time_ns();
+	CHECK(b.OnDatagram(sent[1].data(), sent[1].size(), now));
+	CHECK(b.OnDatagram(sent[0].data(), sent[0].size(), now)); // late
+	CHECK(b.OnDatagram(sent[1].data(), sent[1].size(), now)); // duplicate
+	CHECK(b.OnDatagram(sent[2].data(), sent[2].size(), now));
+	CHECK_FALSE(b.OnDatagram("junk", 4, now));
+	CHECK_FALSE(b.OnDatagram(std::string(sizeof(ChannelHeader), 'x').data(), sizeof(ChannelHeader), now));
+
+	std::string msg;
+	EChannelMode mode;
+	REQUIRE(b.Receive(msg, mode));
+	CHECK(msg == "1");
+	CHECK(mode == EChannel_latest);
+	REQUIRE(b.Receive(msg, mode));
+	CHECK(msg == "2");
+	CHECK_FALSE(b.Receive(msg, mode));
+
+	ChannelStats stats = b.GetStats();
+	CHECK(stats.stale == 2);
+	CHECK(stats.malformed == 2);
+
+	// nothing reliable came in, so nothing to ack
+	size_t before = sent.size();
+	CHECK(b.Update(now) == 0);
+	CHECK(a.Update(now) == 0);
+	CHECK(sent.size() == before);
+}
+
+TEST_CASE("DatagramChannel limits") {
+	int sends = 0;
+	DatagramChannel a([&](const void*, size_t len) {sends++; return (int)len;});
+
+	std::string big(LSC_CHANNEL_MAX_PAYLOAD + 1, 'x');
+	CHECK(a.Send(big, EChannel_latest) == -1);
+	CHECK(errno == EMSGSIZE);
+	big.pop_back();
+	CHECK(a.Send(big, EChannel_latest) == 0);
+
+	for (int i=0; i < LSC_CHANNEL_WINDOW; i++)
+		REQUIRE(a.Send("x", 1, EChannel_reliable) == 0);
+	CHECK(a.Send("x", 1, EChannel_reliable) == -1);
+	CHECK(errno == EAGAIN);
+	CHECK(a.GetInFlight() == LSC_CHANNEL_WINDOW);
+
+	// nobody ever acks, the peer is gone eventually
+	uint64_t now = get_time_ns();
+	int res = 0;
+	for (int i=0; i < 100 && !res; i++) {
+		now += (uint64_t)LSC_CHANNEL_MAX_RTO;
+		res = a.Update(now);
+	}
+	CHECK(res == -1);
+	CHECK(errno == ETIMEDOUT);
+}
+
+TEST_CASE("DatagramChannel over a lossy link") {
+	SimLinkParams params;
+	params.latency_ns = 2000000;
+	params.jitter_ns = 3000000;
+	params.loss = 0.2;
+	params.seed = 11;
+
+	udp_link link;
+	REQUIRE(link.Open(params) == 0);
+	auto soc_a = link.GetA();
+	auto soc_b = link.GetB();
+
+	DatagramChannel a(ChannelSend(soc_a));
+	DatagramChannel b(ChannelSend(soc_b));
+
+	// control messages one way, poses the other, all at once
+	const int count = 50;
+	int sent = 0, poses = 0, control = 0, last_pose = -1;
+	uint32_t next_pose = 0;
+	bool in_order = true;
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while (control < count && std::chrono::steady_clock::now() < deadline) {
+		if (sent < count)
+			REQUIRE(a.Send(std::to_string(sent++), EChannel_reliable) == 0);
+
+		uint32_t pose = next_pose++;
+		REQUIRE(b.Send(&pose, sizeof(pose), EChannel_latest) == 0);
+
+		REQUIRE(PumpChannel(*soc_a, a, 1) >= 0);
+		REQUIRE(PumpChannel(*soc_b, b, 1) >= 0);
+
+		std::string msg;
+		EChannelMode mode;
+		while (b.Receive(msg, mode)) {
+			REQUIRE(mode == EChannel_reliable);
+			in_order = in_order && msg == std::to_string(control);
+			control++;
+		}
+
+		while (a.Receive(msg, mode)) {
+			REQUIRE(mode == EChannel_latest);
+			REQUIRE(msg.size() == sizeof(uint32_t));
+			int value;
+			memcpy(&value, msg.data(), sizeof(value));
+			in_order = in_order && value > last_pose;
+			last_pose = value;
+			poses++;
+		}
+	}
+
+	CHECK(control == count);
+	CHECK(in_order);
+	CHECK(poses > 0);
+	CHECK(link.GetStats(ESimLink_a_to_b).dropped > 0);
+	MESSAGE("resent ", a.GetStats().resent, " srtt ", a.GetStats().srtt_ns, " ns");
+
+	link.Close();
+}
+
+TEST_CASE("DatagramChannel with SendTo and RecvFrom") {
+	auto soc_a = std::make_shared<udp_socket>();
+	auto soc_b = std::make_shared<udp_socket>();
+	REQUIRE(soc_a->Bind("127.0.0.1", 58761) == 0);
+	REQUIRE(soc_b->Bind("127.0.0.1", 58762) == 0);
+	lcsockaddr_in addr_a = get_inet_addr(AF_INET, "127.0.0.1", 58761);
+	lcsockaddr_in addr_b = get_inet_addr(AF_INET, "127.0.0.1", 58762);
+
+	DatagramChannel a(ChannelSendTo(soc_a, addr_b));
+	DatagramChannel b(ChannelSendTo(soc_b, addr_a));
+
+	// a stranger's datagrams are ignored
+	udp_socket stranger;
+	CHECK(stranger.SendTo("junk", 4, addr_b, sizeof(addr_b)) == 4);
+
+	REQUIRE(a.Send("hello", 5, EChannel_reliable) == 0);
+
+	std::string msg;
+	EChannelMode mode;
+	bool got = false;
+	for (int i=0; i < 100 && !got; i++) {
+		REQUIRE(PumpChannel(*soc_b, b, 10, &addr_a) >= 0);
+		got = b.Receive(msg, mode);
+	}
+	REQUIRE(got);
+	CHECK(msg == "hello");
+	CHECK(b.GetStats().malformed == 0);
+
+	// the ack comes back with the next update
+	for (int i=0; i < 100 && a.GetInFlight(); i++)
+		REQUIRE(PumpChannel(*soc_a, a, 10, &addr_b) >= 0);
+	CHECK(a.GetInFlight() == 0);
+}
+
+TEST_CASE("DatagramChannel waits out a peer that isn't up yet") {
+	auto soc_a = std::make_shared<udp_socket>();
+	REQUIRE(soc_a->Connect("127.0.0.1", 58781) == 0);
+	lcsockaddr_in addr_a;
+	socklen_t addr_size = sizeof(addr_a);
+	REQUIRE(getsockname(soc_a->GetHandle(), (sockaddr*)&addr_a, &addr_size) == 0);
+
+	DatagramChannel a(ChannelSend(soc_a));
+	REQUIRE(a.Send("hello", 5, EChannel_reliable) == 0);
+
+	// nobody on the other end, the port unreachables are just losses
+	for (int i=0; i < 10; i++) {
+		REQUIRE(PumpChannel(*soc_a, a, 5) >= 0);
+		REQUIRE(a.Send("x", 1, EChannel_latest) == 0);
+	}
+
+	// and once the peer shows up the message gets through
+	auto soc_b = std::make_shared<udp_socket>();
+	REQUIRE(soc_b->Bind("127.0.0.1", 58781) == 0);
+	DatagramChannel b(ChannelSendTo(soc_b, addr_a));
+
+	std::string msg;
+	EChannelMode mode;
+	bool got = false;
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (!got && std::chrono::steady_clock::now() < deadline) {
+		REQUIRE(PumpChannel(*soc_a, a, 5) >= 0);
+		REQUIRE(PumpChannel(*soc_b, b, 5, &addr_a) >= 0);
+		while (b.Receive(msg, mode))
+			got = got || (mode == EChannel_reliable && msg == "hello");
+	}
+	CHECK(got);
+}
@@ -0,0 +1,202 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+
+#define NOMINMAX
+#include <iostream>
+#include <random>
+#include "lazy_sockets.h"
+#include <errno.h>
+
+#include <thread>
+#ifdef LINUX
+#include <signal.h>
+#include <pthread.h>
+#endif
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+
+using namespace lsc;
+
+using tcp_socket = LSocket<AF_INET, SOCK_STREAM, 0>;
+using udp_socket = LSocket<AF_INET, SOCK_DGRAM, 0>;
+
+// a remote clock running :drift: fast and :offset_ns: ahead of ours
+struct FakeRemote {
+	double offset_ns;
+	double drift;
+
+	double ToRemote(double local_ns) const {
+		return local_ns + offset_ns + local_ns * drift;
+	}
+
+	double ToLocal(double remote_ns) const {
+		return (remote_ns - offset_ns) / (1.0 + drift);
+	}
+};
+
+// feeds :sync: :count: ping pongs :period_ns: apart, starting at :start_ns:,
+// every leg takes 100 us, half of them also get stuck in a queue
+static void feed(ClockSync& sync, const FakeRemote& remote, uint64_t start_ns, uint64_t period_ns, int count, std::mt19937& rng) {
+	std::uniform_real_distribution<double> queueing(3e5, 2e6);
+	std::uniform_int_distribution<int> lucky(0, 1);
+	for (int i=0; i < count; i++) {
+		double t1 = (double)(start_ns + i * period_ns);
+		double there = 100e3 + (lucky(rng) ? queueing(rng) : 0);
+		double back = 100e3 + (lucky(rng) ? queueing(rng) : 0);
+
+		double t2 = remote.ToRemote(t1 + there);
+		double t3 = t2 + 20e3; // the remote takes a moment to answer
+		double t4 = remote.ToLocal(t3) + back;
+		sync.AddSample((uint64_t)t1, (uint64_t)t2, (uint64_t)t3, (uint64_t)t4);
+	}
+}
+
+TEST_CASE("ClockSync estimates offset from the shortest round trips") {
+	ClockSync sync;
+	CHECK_FALSE(sync.IsSynced());
+	CHECK(sync.RemoteToLocal(1234) == 1234);
+
+	std::mt19937 rng(3);
+	FakeRemote remote = {5e9, 0};
+	feed(sync, remote, 1000000000, 1000000, 64, rng); // 64 ms, too short for drift
+
+	ClockEstimate est;
+	REQUIRE(sync.GetEstimate(est));
+	CHECK(est.drift == 0);
+	CHECK(est.rtt_ns == 200000);
+	CHECK(std::llabs(est.offset_ns - 5000000000LL) < 2000);
+
+	uint64_t local = 1050000000;
+	CHECK(std::llabs((int64_t)(sync.LocalToRemote(local) - (local + 5000000000ULL))) < 2000);
+	CHECK(std::llabs((int64_t)(sync.RemoteToLocal(sync.LocalToRemote(local)) - local)) <= 1);
+}
+
+TEST_CASE("ClockSync follows drift") {
+	ClockSync sync;
+	std::mt19937 rng(5);
+
+	// 50 ppm fast and 3 s ahead, a ping pong every 100 ms for 6.4 s
+	FakeRemote remote = {3e9, 50e-6};
+	feed(sync, remote, 1000000000, 100000000, 64, rng);
+
+	ClockEstimate est;
+	REQUIRE(sync.GetEstimate(est));
+	CHECK(std::fabs(est.drift - 50e-6) < 1e-6);
+
+	// the mapping holds well past the last sample
+	for (double local : {2e9, 7.4e9, 10e9}) {
+		double want = remote.ToRemote(local);
+		CHECK(std::fabs((double)sync.LocalToRemote((uint64_t)local) - want) < 5000);
+		CHECK(std::fabs((double)sync.RemoteToLocal((uint64_t)want) - local) < 5000);
+	}
+}
+
+TEST_CASE("ClockSync only takes replies to its own requests") {
+	ClockSync sync;
+	ClockSyncMsg msg;
+	sync.MakeRequest(msg);
+	CHECK(msg.magic == LSC_CLOCK_SYNC_MAGIC);
+	CHECK(msg.seq == 1);
+
+	CHECK_FALSE(sync.OnReply(msg, get_time_ns())); // not answered
+
+	ClockSyncMsg reply = msg;
+	REQUIRE(AnswerClockSync(reply, get_time_ns()));
+	CHECK_FALSE(AnswerClockSync(reply, get_time_ns())); // already an answer
+
+	ClockSyncMsg bad = reply;
+	bad.magic = 0;
+	CHECK_FALSE(sync.OnReply(bad, get_time_ns()));
+	bad = reply;
+	bad.seq = 2;
+	CHECK_FALSE(sync.OnReply(bad, get_time_ns())); // never asked
+
+	CHECK(sync.OnReply(reply, get_time_ns()));
+	CHECK_FALSE(sync.OnReply(reply, get_time_ns())); // duplicate
+	CHECK(sync.IsSynced());
+}
+
+TEST_CASE("Clock sync over a stream connection") {
+	lsocket_t fds[2];
+	REQUIRE(make_socket_pair(SOCK_STREAM, fds) == 0);
+	auto client = std::make_unique<tcp_socket>(fds[0], EStat_connected);
+	tcp_socket server_soc(fds[1], EStat_connected);
+
+	int served = -2;
+	std::thread server([&]() {served = ServeClockSync(server_soc);});
+
+	ClockSync sync;
+	CHECK(RunClockSync(*client, sync, 200) == 200);
+
+	// same clock on both ends, so the offset is just the estimation error
+	ClockEstimate est;
+	REQUIRE(sync.GetEstimate(est));
+	MESSAGE("offset ", est.offset_ns, " ns, min rtt ", est.rtt_ns, " ns");
+	CHECK(std::llabs(est.offset_ns) < 100000);
+
+	uint64_t now = get_time_ns();
+	CHECK(std::llabs((int64_t)(sync.RemoteToLocal(now) - now)) < 100000);
+
+	client.reset(); // closing ends the server
+	server.join();
+	CHECK(served == 0);
+}
+
+TEST_CASE("Clock sync over datagrams") {
+	lsocket_t fds[2];
+	REQUIRE(make_socket_pair(SOCK_DGRAM, fds) == 0);
+	udp_socket client(fds[0], EStat_connected);
+	udp_socket server_soc(fds[1], EStat_connected);
+
+	int served = -2;
+	std::thread server([&]() {served = ServeClockSync(server_soc);});
+
+	// junk in between is ignored by both sides
+	CHECK(client.Send("junk", 4) == 4);
+
+	ClockSync sync;
+	CHECK(RunClockSync(client, sync, 50) == 50);
+
+	ClockEstimate est;
+	REQUIRE(sync.GetEstimate(est));
+	CHECK(std::llabs(est.offset_ns) < 100000);
+
+	CHECK(client.Send("", 0) == 0); // empty datagram ends the server
+	server.join();
+	CHECK(served == 0);
+}
+
+#ifdef LINUX
+static void ignore_signal(int) {}
+
+TEST_CASE("ServeClockSync keeps going through signals") {
+	// a handler without SA_RESTART, so the blocked poll comes back with EINTR
+	struct sigaction act{}, old{};
+	act.sa_handler = ignore_signal;
+	sigemptyset(&act.sa_mask);
+	REQUIRE(sigaction(SIGUSR1, &act, &old) == 0);
+
+	lsocket_t fds[2];
+	REQUIRE(make_socket_pair(SOCK_STREAM, fds) == 0);
+	auto client = std::make_unique<tcp_socket>(fds[0], EStat_connected);
+	tcp_socket server_soc(fds[1], EStat_connected);
+
+	int served = -2;
+	std::thread server([&]() {served = ServeClockSync(server_soc);});
+
+	ClockSync sync;
+	for (int i=0; i < 10; i++) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		pthread_kill(server.native_handle(), SIGUSR1);
+		CHECK(RunClockSync(*client, sync, 5) == 5);
+	}
+
+	client.reset(); // closing ends the server
+	server.join();
+	CHECK(served == 0);
+
+	sigaction(SIGUSR1, &old, nullptr);
+}
+#endif // LINUX
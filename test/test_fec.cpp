@@ -0,0 +1,279 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+
+#define NOMINMAX
+#include <iostream>
+#include "lazy_sockets.h"
+#include <errno.h>
+
+#include <thread>
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+
+using namespace lsc;
+
+using udp_socket = LSocket<AF_INET, SOCK_DGRAM, IPPROTO_UDP>;
+using udp_link = SimLink<AF_INET, SOCK_DGRAM, 0>;
+
+// datagrams of message :i:, different lengths so the padding gets used
+static std::string make_msg(int i) {
+	std::string out = "msg" + std::to_string(i);
+	out.append((size_t)(i * 7 % 23), (char)('a' + i % 26));
+	return out;
+}
+
+// encodes :count: messages into datagrams, the last group flushed
+static std::vector<std::string> encode(const FecParams& params, int count) {
+	std::vector<std::string> out;
+	FecEncoder enc(params, [&](const void* data, size_t len) {
+		out.emplace_back((const char*)data, len);
+		return (int)len;
+	});
+
+	for (int i=0; i < count; i++)
+		REQUIRE(enc.Send(make_msg(i)) == 0);
+	REQUIRE(enc.Flush() == 0);
+	return out;
+}
+
+// what comes out of a decoder fed :datagrams:, sorted
+static std::vector<std::string> decode(const std::vector<std::string>& datagrams, FecStats* stats = nullptr) {
+	FecDecoder dec;
+	for (const std::string& datagram : datagrams)
+		dec.OnDatagram(datagram.data(), datagram.size());
+
+	std::vector<std::string> out;
+	std::string msg;
+	while (dec.Receive(msg))
+		out.push_back(msg);
+	std::sort(out.begin(), out.end());
+
+	if (stats)
+		*stats = dec.GetStats();
+	return out;
+}
+
+static std::vector<std::string> sorted_msgs(int count) {
+	std::vector<std::string> out;
+	for (int i=0; i < count; i++)
+		out.push_back(make_msg(i));
+	std::sort(out.begin(), out.end());
+	return out;
+}
+
+TEST_CASE("GF(256) arithmetic") {
+	CHECK(GfMul(0, 7) == 0);
+	CHECK(GfMul(1, 7) == 7);
+	CHECK(GfMul(2, 0x80) == 0x1d); // wraps through the polynomial
+	for (int a=1; a < 256; a++) {
+		REQUIRE(GfMul((uint8_t)a, GfInv((uint8_t)a)) == 1);
+		CHECK(GfMul((uint8_t)a, 3) == (GfMul((uint8_t)a, 2) ^ a));
+	}
+
+	uint8_t dst[19], src[19];
+	for (int i=0; i < 19; i++) {
+		dst[i] = (uint8_t)(i * 13);
+		src[i] = (uint8_t)(i * 31 + 1);
+	}
+	uint8_t want[19];
+	for (int i=0; i < 19; i++)
+		want[i] = dst[i] ^ GfMul(0x53, src[i]);
+	GfMulAdd(dst, src, 0x53, sizeof(dst));
+	CHECK(memcmp(dst, want, sizeof(dst)) == 0);
+
+	// the first parity row is plain xor
+	for (int i=0; i < 8; i++)
+		CHECK(FecParams::Coefficient(3, 0, (uint8_t)i) == 1);
+}
+
+TEST_CASE("FEC with xor parity rebuilds any single loss per group") {
+	FecParams params;
+	params.data_shards = 4;
+	params.parity_shards = 1;
+	std::vector<std::string> datagrams = encode(params, 8);
+	REQUIRE(datagrams.size() == 10);
+
+	for (size_t lost=0; lost < 5; lost++) {
+		std::vector<std::string> some = datagrams;
+		some.erase(some.begin() + 5 + lost); // from the second group
+		some.erase(some.begin() + lost); // from the first
+
+		FecStats stats;
+		CHECK(decode(some, &stats) == sorted_msgs(8));
+		CHECK(stats.recovered == (lost < 4 ? 2u : 0u));
+	}
+
+	// two from the same group are too many
+	std::vector<std::string> some = datagrams;
+	some.erase(some.begin() + 1);
+	some.erase(some.begin());
+	FecStats stats;
+	CHECK(decode(some, &stats).size() == 6);
+	CHECK(stats.recovered == 0);
+}
+
+TEST_CASE("FEC with reed-solomon parity rebuilds any three losses") {
+	FecParams params;
+	params.data_shards = 8;
+	params.parity_shards = 3;
+	std::vector<std::string> datagrams = encode(params, 8);
+	REQUIRE(datagrams.size() == 11);
+
+	int combos = 0;
+	for (size_t a=0; a < 11; a++) {
+		for (size_t b=a + 1; b < 11; b++) {
+			for (size_t c=b + 1; c < 11; c++) {
+				std::vector<std::string> some;
+				for (size_t i=0; i < 11; i++)
+					if (i != a && i != b && i != c)
+						some.push_back(datagrams[i]);
+
+				// parity first, then data, order doesn't matter
+				std::reverse(some.begin(), some.end());
+				REQUIRE(decode(some) == sorted_msgs(8));
+				combos++;
+			}
+		}
+	}
+	CHECK(combos == 165);
+}
+
+TEST_CASE("FEC partial groups, duplicates and junk") {
+	FecParams params;
+	params.data_shards = 8;
+	params.parity_shards = 2;
+	std::vector<std::string> datagrams = encode(params, 3); // flushed early
+	REQUIRE(datagrams.size() == 5);
+
+	std::vector<std::string> some = {datagrams[0], datagrams[3], datagrams[3], datagrams[4], "junk"};
+	FecStats stats;
+	CHECK(decode(some, &stats) == sorted_msgs(3));
+	CHECK(stats.recovered == 2);
+	CHECK(stats.duplicates == 1);
+	CHECK(stats.malformed == 1);
+
+	// a group that never got its parity, counted as lost when pushed out
+	FecDecoder dec;
+	FecEncoder enc(params, [&](const void* data, size_t len) {
+		std::string datagram((const char*)data, len);
+		FecHeader header;
+		memcpy(&header, data, sizeof(header));
+		if (header.group > 0 || (header.index != 1 && header.index < 4))
+			dec.OnDatagram(datagram.data(), datagram.size());
+		return (int)len;
+	});
+	for (int i=0; i < 8 * (LSC_FEC_GROUPS + 1); i++)
+		REQUIRE(enc.Send(make_msg(i)) == 0);
+	stats = dec.GetStats();
+	CHECK(stats.lost == 1);
+	CHECK(stats.delivered == 8 * (LSC_FEC_GROUPS + 1) - 5);
+
+	CHECK(enc.Send(std::string(k_fec_max_payload + 1, 'x')) == -1);
+	CHECK(errno == EMSGSIZE);
+}
+
+TEST_CASE("FecParams for a loss rate") {
+	FecParams none = FecParams::ForLoss(0.0);
+	CHECK(none.parity_shards == 1);
+
+	FecParams some = FecParams::ForLoss(0.05, 10, 1e-3);
+	FecParams more = FecParams::ForLoss(0.2, 10, 1e-3);
+	CHECK(some.data_shards == 10);
+	CHECK(some.parity_shards >= 2);
+	CHECK(more.parity_shards > some.parity_shards);
+
+	// capped by the overhead
+	FecParams capped = FecParams::ForLoss(0.5, 10, 1e-6, 0.3);
+	CHECK(capped.parity_shards == 3);
+}
+
+TEST_CASE("FEC over a lossy link") {
+	SimLinkParams params;
+	params.latency_ns = 1000000;
+	params.loss = 0.05;
+	params.seed = 7;
+
+	udp_link link;
+	REQUIRE(link.Open(params) == 0);
+	auto soc_a = link.GetA();
+	auto soc_b = link.GetB();
+
+	FecEncoder enc(FecParams::ForLoss(params.loss, 8, 1e-3), ChannelSend(soc_a));
+	FecDecoder dec;
+
+	const int count = 400;
+	std::vector<bool> got(count, false);
+	for (int i=0; i < count; i++) {
+		uint32_t pose = (uint32_t)i;
+		REQUIRE(enc.Send(&pose, sizeof(pose)) == 0);
+
+		// pace it a little, the link queue is not what's being tested
+		REQUIRE(PumpFec(*soc_b, dec, i % 16 ? 0 : 1) >= 0);
+	}
+	REQUIRE(enc.Flush() == 0);
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+	while (std::chrono::steady_clock::now() < deadline)
+		if (PumpFec(*soc_b, dec, 50) == 0)
+			break;
+
+	std::string msg;
+	int delivered = 0;
+	while (dec.Receive(msg)) {
+		REQUIRE(msg.size() == sizeof(uint32_t));
+		uint32_t pose;
+		memcpy(&pose, msg.data(), sizeof(pose));
+		REQUIRE(pose < (uint32_t)count);
+		CHECK_FALSE(got[pose]);
+		got[pose] = true;
+		delivered++;
+	}
+
+	FecStats stats = dec.GetStats();
+	uint64_t dropped = link.GetStats(ESimLink_a_to_b).dropped;
+	MESSAGE("dropped ", dropped, " recovered ", stats.recovered, " delivered ", delivered);
+	CHECK(dropped > 0);
+	CHECK(stats.recovered > 0);
+	CHECK(delivered >= count - 4);
+
+	link.Close();
+}
+
+TEST_CASE("FEC with SendTo and RecvFrom") {
+	auto soc_a = std::make_shared<udp_socket>();
+	auto soc_b = std::make_shared<udp_socket>();
+	REQUIRE(soc_a->Bind("127.0.0.1", 58771) == 0);
+	REQUIRE(soc_b->Bind("127.0.0.1", 58772) == 0);
+	lcsockaddr_in addr_a = get_inet_addr(AF_INET, "127.0.0.1", 58771);
+	lcsockaddr_in addr_b = get_inet_addr(AF_INET, "127.0.0.1", 58772);
+
+	FecParams params;
+	params.data_shards = 2;
+	params.parity_shards = 1;
+
+	// the first datagram never makes it out
+	auto send_to = ChannelSendTo(soc_a, addr_b);
+	int sends = 0;
+	FecEncoder enc(params, [&](const void* data, size_t len) {
+		return sends++ ? send_to(data, len) : (int)len;
+	});
+	FecDecoder dec;
+
+	REQUIRE(enc.Send("first", 5) == 0);
+	REQUIRE(enc.Send("second", 6) == 0);
+
+	std::vector<std::string> got;
+	std::string msg;
+	for (int i=0; i < 100 && got.size() < 2; i++) {
+		REQUIRE(PumpFec(*soc_b, dec, 10, &addr_a) >= 0);
+		while (dec.Receive(msg))
+			got.push_back(msg);
+	}
+
+	REQUIRE(got.size() == 2);
+	CHECK(got[0] == "second");
+	CHECK(got[1] == "first");
+	CHECK(dec.GetStats().recovered == 1);
+}
@@ -0,0 +1,608 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+
+#define NOMINMAX
+#include <iostream>
+#include <cmath>
+#include <limits>
+#include <random>
+#include "lazy_sockets.h"
+#include <errno.h>
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+
+#include "packets.h"
+#include "packet_views.h"
+#include "udu_layout.h"
+#include "pose_batch.h"
+#include "pose_codec.h"
+#include "pose_predictor.h"
+
+using namespace lsc;
+
+static HoboVR_TrackerPose_t make_tracker(float x) {
+	HoboVR_TrackerPose_t pose;
+	memset(&pose, 0, sizeof(pose));
+	pose.position[0] = x;
+	pose.orientation[0] = 1.0f;
+	return pose;
+}
+
+// a pose packet for :udu: with unit orientations and position x = device index
+static std::string make_packet(const std::string& udu) {
+	std::string out;
+	for (size_t i=0; i < udu.size(); i++) {
+		switch (udu[i]) {
+			case 'h':
+			case 't': {
+				HoboVR_TrackerPose_t pose = make_tracker((float)i); // same layout as the headset
+				out.append((const char*)&pose, sizeof(pose));
+				break;
+			}
+			case 'c': {
+				HoboVR_ControllerState_t state;
+				memset(&state, 0, sizeof(state));
+				state.position[0] = (float)i;
+				state.orientation[0] = 1.0f;
+				out.append((const char*)&state, sizeof(state));
+				break;
+			}
+			case 'g': {
+				HoboVR_GazeState_t state;
+				memset(&state, 0, sizeof(state));
+				state.pupil_dilation_l = (float)i;
+				out.append((const char*)&state, sizeof(state));
+				break;
+			}
+		}
+	}
+
+	return out;
+}
+
+// patches a float at :offset: of :packet:
+static void put_float(std::string& packet, size_t offset, float value) {
+	memcpy(&packet[offset], &value, sizeof(value));
+}
+
+TEST_CASE("AllFinite and SquaredNorm4") {
+	float values[11];
+	for (int i=0; i < 11; i++)
+		values[i] = (float)i - 5.0f;
+
+	// unaligned on purpose
+	char buff[sizeof(values) + 1];
+	memcpy(buff + 1, values, sizeof(values));
+	CHECK(AllFinite(buff + 1, 11));
+
+	// in the vector part and in the scalar tail
+	for (int bad : {2, 9, 10}) {
+		for (float value : {std::numeric_limits<float>::quiet_NaN(), std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity()}) {
+			memcpy(buff + 1, values, sizeof(values));
+			memcpy(buff + 1 + bad * sizeof(float), &value, sizeof(value));
+			CHECK_FALSE(AllFinite(buff + 1, 11));
+			CHECK(AllFinite(buff + 1, bad)); // everything before it is fine
+		}
+	}
+
+	float q[4] = {0.5f, 0.5f, 0.5f, 0.5f};
+	memcpy(buff + 1, q, sizeof(q));
+	CHECK(SquaredNorm4(buff + 1) == doctest::Approx(1.0f));
+	q[3] = 2.0f;
+	memcpy(buff + 1, q, sizeof(q));
+	CHECK(SquaredNorm4(buff + 1) == doctest::Approx(4.75f));
+}
+
+TEST_CASE("UduLayout compiles offsets") {
+	hobovr::UduLayout layout;
+	REQUIRE(layout.Compile("hcctg") == 0);
+
+	CHECK(layout.GetPacketSize() == util::udu2sizet("hcctg"));
+	REQUIRE(layout.GetDeviceCount() == 5);
+	CHECK(layout.GetTypeCount('c') == 2);
+	CHECK(layout.GetTypeCount('t') == 1);
+
+	size_t offset = 0;
+	const char* udu = "hcctg";
+	for (size_t i=0; i < 5; i++) {
+		CHECK(layout.GetSlot(i).offset == offset);
+		CHECK(layout.GetSlot(i).type == udu[i]);
+		offset += util::udu2sizet(std::string(1, udu[i]));
+	}
+	CHECK(layout.GetSlot(2).type_index == 1); // second controller
+
+	// the controller input mask ends a float run, the headset and tracker
+	// floats don't, so h+c, c, t, g floats
+	CHECK(layout.GetFloatRuns().size() == 4);
+
+	// a wall of trackers is one long run
+	REQUIRE(layout.Compile("htttttttt") == 0);
+	REQUIRE(layout.GetFloatRuns().size() == 1);
+	CHECK(layout.GetFloatRuns()[0].count == 9 * 13);
+
+	CHECK(layout.Compile("hx") == -1);
+	CHECK(errno == EINVAL);
+	CHECK(layout.GetUdu() == "htttttttt"); // unchanged on error
+	CHECK(layout.Compile(std::string(513, 't')) == -1);
+}
+
+TEST_CASE("UduLayout visits devices in place") {
+	hobovr::UduLayout layout;
+	REQUIRE(layout.Compile("hctgt") == 0);
+	std::string packet = make_packet("hctgt");
+
+	std::string seen;
+	std::vector<float> xs;
+	bool ok = layout.Visit(packet.data(), packet.size(), overloaded{
+		[&](const hobovr::UduSlot& slot, const HoboVR_HeadsetPose_t& pose) {
+			seen += slot.type;
+			xs.push_back(pose.position[0]);
+		},
+		[&](const hobovr::UduSlot& slot, const HoboVR_ControllerState_t& state) {
+			seen += slot.type;
+			xs.push_back(state.position[0]);
+		},
+		[&](const hobovr::UduSlot& slot, const HoboVR_TrackerPose_t& pose) {
+			seen += slot.type;
+			xs.push_back(pose.position[0]);
+			CHECK((const char*)&pose == packet.data() + slot.offset); // no copies
+		},
+		[&](const hobovr::UduSlot& slot, const HoboVR_GazeState_t& state) {
+			seen += slot.type;
+			xs.push_back(state.pupil_dilation_l);
+		}
+	});
+
+	CHECK(ok);
+	CHECK(seen == "hctgt");
+	CHECK(xs == std::vector<float>{0, 1, 2, 3, 4});
+
+	CHECK_FALSE(layout.Visit(packet.data(), packet.size() - 1, [](const hobovr::UduSlot&, const auto&) {}));
+}
+
+TEST_CASE("UduLayout validates floats and orientations") {
+	hobovr::UduLayout layout;
+	REQUIRE(layout.Compile("hcttg") == 0);
+	std::string good = make_packet("hcttg");
+
+	size_t bad = 99;
+	CHECK(layout.Validate(good.data(), good.size(), 0.01f, &bad));
+	CHECK(bad == 99);
+
+	SUBCASE("NaN velocity") {
+		std::string packet = good;
+		put_float(packet, layout.GetSlot(3).offset + offsetof(HoboVR_TrackerPose_t, velocity) + 4, std::nanf(""));
+		CHECK_FALSE(layout.Validate(packet.data(), packet.size(), 0.01f, &bad));
+		CHECK(bad == 3);
+	}
+
+	SUBCASE("infinite controller trigger") {
+		std::string packet = good;
+		put_float(packet, layout.GetSlot(1).offset + offsetof(HoboVR_ControllerState_t, scalar_inputs), INFINITY);
+		CHECK_FALSE(layout.Validate(packet.data(), packet.size(), 0.01f, &bad));
+		CHECK(bad == 1);
+	}
+
+	SUBCASE("not a unit quaternion") {
+		std::string packet = good;
+		put_float(packet, layout.GetSlot(2).offset + offsetof(HoboVR_TrackerPose_t, orientation), 0.0f);
+		CHECK_FALSE(layout.Validate(packet.data(), packet.size(), 0.01f, &bad));
+		CHECK(bad == 2);
+
+		// within tolerance is fine
+		put_float(packet, layout.GetSlot(2).offset + offsetof(HoboVR_TrackerPose_t, orientation), 1.002f);
+		CHECK(layout.Validate(packet.data(), packet.size(), 0.01f, &bad));
+	}
+
+	SUBCASE("NaN gaze age") {
+		std::string packet = good;
+		double age = std::nan("");
+		memcpy(&packet[layout.GetSlot(4).offset + offsetof(HoboVR_GazeState_t, age_seconds)], &age, sizeof(age));
+		CHECK_FALSE(layout.Validate(packet.data(), packet.size(), 0.01f, &bad));
+		CHECK(bad == 4);
+	}
+
+	CHECK_FALSE(layout.Validate(good.data(), good.size() + 1));
+}
+
+TEST_CASE("DeinterleaveFloats and InterleaveFloats round trip") {
+	// odd field count and a record count that leaves a scalar tail
+	static constexpr size_t FIELDS = 7, COUNT = 11, STRIDE = FIELDS * sizeof(float) + 2;
+
+	std::vector<char> records(1 + COUNT * STRIDE, 'z');
+	for (size_t i=0; i < COUNT; i++) {
+		for (size_t f=0; f < FIELDS; f++) {
+			float value = (float)(i * 100 + f);
+			memcpy(records.data() + 1 + i * STRIDE + f * sizeof(float), &value, sizeof(value));
+		}
+	}
+
+	std::vector<float> soa(FIELDS * COUNT);
+	float* out[FIELDS];
+	for (size_t f=0; f < FIELDS; f++)
+		out[f] = soa.data() + f * COUNT;
+
+	DeinterleaveFloats(records.data() + 1, STRIDE, COUNT, FIELDS, out);
+	for (size_t i=0; i < COUNT; i++)
+		for (size_t f=0; f < FIELDS; f++)
+			CHECK(out[f][i] == (float)(i * 100 + f));
+
+	std::vector<char> back(records.size(), 'z');
+	InterleaveFloats(out, COUNT, FIELDS, back.data() + 1, STRIDE);
+	CHECK(back == records); // padding between records untouched
+}
+
+TEST_CASE("NormalizeQuaternions") {
+	float w[6] = {2, 0, 1, 0, 0, 3};
+	float x[6] = {0, 0, 1, 3, 0, 4};
+	float y[6] = {0, 0, 1, 4, 0, 0};
+	float z[6] = {0, 0, 1, 0, 5, 0};
+	NormalizeQuaternions(w, x, y, z, 6);
+
+	for (int i=0; i < 6; i++)
+		CHECK(w[i] * w[i] + x[i] * x[i] + y[i] * y[i] + z[i] * z[i] == doctest::Approx(1.0f));
+
+	CHECK(w[0] == doctest::Approx(1.0f));
+	CHECK(w[1] == 1.0f); // zero becomes identity
+	CHECK(x[1] == 0.0f);
+	CHECK(w[2] == doctest::Approx(0.5f));
+	CHECK(x[3] == doctest::Approx(0.6f));
+	CHECK(y[3] == doctest::Approx(0.8f));
+	CHECK(x[5] == doctest::Approx(0.8f)); // scalar tail
+}
+
+TEST_CASE("PoseBatch decodes a tracker wall") {
+	static constexpr size_t COUNT = 10;
+
+	std::vector<char> buff(1 + COUNT * sizeof(HoboVR_TrackerPose_t));
+	for (size_t i=0; i < COUNT; i++) {
+		float fields[hobovr::EPoseField_count];
+		for (int f=0; f < hobovr::EPoseField_count; f++)
+			fields[f] = (float)(i * 100 + f);
+		memcpy(buff.data() + 1 + i * sizeof(HoboVR_TrackerPose_t), fields, sizeof(fields));
+	}
+
+	hobovr::TrackerPoses poses;
+	REQUIRE(hobovr::TrackerPoses::FromBytes(buff.data() + 1, buff.size() - 1, poses));
+
+	hobovr::PoseBatch batch;
+	batch.Decode(poses);
+	REQUIRE(batch.GetCount() == COUNT);
+	for (size_t i=0; i < COUNT; i++) {
+		CHECK(batch.GetField(hobovr::EPoseField_pos_x)[i] == poses[i].position[0]);
+		CHECK(batch.GetField(hobovr::EPoseField_rot_w)[i] == poses[i].orientation[0]);
+		CHECK(batch.GetField(hobovr::EPoseField_vel_z)[i] == poses[i].velocity[2]);
+		CHECK(batch.GetField(hobovr::EPoseField_ang_z)[i] == poses[i].angular_velocity[2]);
+	}
+
+	std::vector<char> back(buff.size() - 1);
+	batch.Encode(back.data());
+	CHECK(memcmp(back.data(), buff.data() + 1, back.size()) == 0);
+
+	// a smaller batch reuses the storage
+	const float* before = batch.GetField(hobovr::EPoseField_pos_x);
+	REQUIRE(hobovr::TrackerPoses::FromBytes(buff.data() + 1, 3 * sizeof(HoboVR_TrackerPose_t), poses));
+	batch.Decode(poses);
+	CHECK(batch.GetCount() == 3);
+	CHECK(batch.GetField(hobovr::EPoseField_pos_x) == before);
+}
+
+TEST_CASE("PoseBatch decodes headsets and trackers of a pose packet") {
+	hobovr::UduLayout layout;
+	REQUIRE(layout.Compile("httcttttgt") == 0);
+	std::string packet = make_packet("httcttttgt");
+	put_float(packet, layout.GetSlot(5).offset + offsetof(HoboVR_TrackerPose_t, orientation), 2.0f);
+
+	hobovr::PoseBatch batch;
+	REQUIRE(batch.Decode(layout, packet.data(), packet.size()));
+	REQUIRE(batch.GetCount() == 8);
+	CHECK(batch.GetDevices() == std::vector<uint32_t>{0, 1, 2, 4, 5, 6, 7, 9});
+
+	// position x is the device index in make_packet
+	for (size_t i=0; i < batch.GetCount(); i++)
+		CHECK(batch.GetField(hobovr::EPoseField_pos_x)[i] == (float)batch.GetDevices()[i]);
+
+	CHECK(batch.GetField(hobovr::EPoseField_rot_w)[4] == 2.0f);
+	batch.NormalizeOrientations();
+	CHECK(batch.GetField(hobovr::EPoseField_rot_w)[4] == doctest::Approx(1.0f));
+
+	CHECK_FALSE(batch.Decode(layout, packet.data(), packet.size() - 1));
+	CHECK(batch.GetCount() == 0);
+}
+
+TEST_CASE("Quantization helpers") {
+	CHECK(QuantizeFixed(1.23456f, 10000.0f) == 12346);
+	CHECK(QuantizeFixed(-1.23454f, 10000.0f) == -12345);
+	CHECK(DequantizeFixed(12346, 10000.0f) == doctest::Approx(1.2346f));
+	CHECK(QuantizeFixed(1e30f, 10000.0f) == INT32_MAX);
+	CHECK(QuantizeFixed(std::nanf(""), 10000.0f) == 0);
+
+	std::mt19937 rng(7);
+	std::normal_distribution<float> dist;
+	for (int i=0; i < 1000; i++) {
+		float q[4] = {dist(rng), dist(rng), dist(rng), dist(rng)};
+		float norm = std::sqrt(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+		for (float& c : q)
+			c /= norm;
+
+		int32_t packed[4];
+		float back[4];
+		QuantizeQuat(q, 15, packed);
+		DequantizeQuat(packed, 15, back);
+
+		// same rotation, possibly with the sign flipped
+		float dot = q[0] * back[0] + q[1] * back[1] + q[2] * back[2] + q[3] * back[3];
+		CHECK(std::fabs(dot) == doctest::Approx(1.0f).epsilon(1e-6));
+	}
+
+	for (int64_t value : {(int64_t)0, (int64_t)-1, (int64_t)1, (int64_t)-300, (int64_t)INT32_MAX, (int64_t)INT32_MIN}) {
+		std::string buff;
+		PutVarint(buff, ZigZag(value));
+		const char* p = buff.data();
+		uint64_t got;
+		REQUIRE(GetVarint(p, buff.data() + buff.size(), got));
+		CHECK(p == buff.data() + buff.size());
+		CHECK(UnZigZag(got) == value);
+	}
+	std::string small;
+	PutVarint(small, ZigZag(-3));
+	CHECK(small.size() == 1);
+
+	const char* p = "\x80\x80";
+	uint64_t got;
+	CHECK_FALSE(GetVarint(p, p + 2, got)); // truncated
+
+	std::string raw("a\t\r\nb}\t", 7), escaped, back;
+	EscapeBytes(raw.data(), raw.size(), '\t', escaped);
+	CHECK(escaped.find('\t') == std::string::npos);
+	REQUIRE(UnescapeBytes(escaped.data(), escaped.size(), back));
+	CHECK(back == raw);
+	CHECK_FALSE(UnescapeBytes("x}", 2, back));
+}
+
+// a pose packet for :udu: where every device moved a little since :frame:
+static std::string make_moving_packet(const hobovr::UduLayout& layout, int frame) {
+	std::string packet = make_packet(layout.GetUdu());
+	for (size_t i=0; i < layout.GetDeviceCount(); i++) {
+		const hobovr::UduSlot& slot = layout.GetSlot(i);
+		if (slot.type == 'g')
+			continue;
+
+		// 1 mm per frame, slowly turning, 0.25 m/s
+		float angle = frame * 0.002f + (float)i;
+		float q[4] = {std::cos(angle), 0.0f, std::sin(angle), 0.0f};
+		float v[3] = {0.25f, 0.0f, -0.1f};
+		put_float(packet, slot.offset, (float)i + frame * 0.001f);
+		memcpy(&packet[slot.offset + offsetof(HoboVR_TrackerPose_t, orientation)], q, sizeof(q));
+		memcpy(&packet[slot.offset + offsetof(HoboVR_TrackerPose_t, velocity)], v, sizeof(v));
+		if (slot.type == 'c') {
+			put_float(packet, slot.offset + offsetof(HoboVR_ControllerState_t, scalar_inputs), 0.5f);
+			packet[slot.offset + offsetof(HoboVR_ControllerState_t, scalar_inputs) + 3 * sizeof(float)] = 0b100001;
+		}
+	}
+
+	return packet;
+}
+
+TEST_CASE("PoseEncoder and PoseDecoder round trip with deltas") {
+	hobovr::UduLayout layout;
+	REQUIRE(layout.Compile("hccttg") == 0);
+
+	hobovr::PoseEncoder encoder(layout);
+	hobovr::PoseDecoder decoder(layout);
+
+	std::string frame, packet;
+	uint32_t seq = 0;
+	size_t delta_bytes = 0;
+	for (int i=0; i < 20; i++) {
+		std::string orig = make_moving_packet(layout, i);
+		REQUIRE(encoder.Encode(orig.data(), orig.size(), frame) == 0);
+
+		// framed like everything else
+		REQUIRE(frame.size() > sizeof(g_EndTag));
+		CHECK(memcmp(frame.data() + frame.size() - sizeof(g_EndTag), &g_EndTag, sizeof(g_EndTag)) == 0);
+		CHECK(frame.find('\t') == frame.size() - sizeof(g_EndTag));
+
+		REQUIRE(decoder.Decode(frame.data(), frame.size() - sizeof(g_EndTag), packet, seq) == 0);
+		CHECK(seq == encoder.GetLastSeq());
+		REQUIRE(packet.size() == orig.size());
+
+		bool ok = layout.Visit(packet.data(), packet.size(), overloaded{
+			[&](const hobovr::UduSlot& slot, const HoboVR_GazeState_t&) {
+				CHECK(memcmp(&packet[slot.offset], &orig[slot.offset], slot.size) == 0);
+			},
+			[&](const hobovr::UduSlot& slot, const auto& pose) {
+				const auto& want = *(const std::remove_reference_t<decltype(pose)>*)&orig[slot.offset];
+				for (int j=0; j < 3; j++) {
+					CHECK(pose.position[j] == doctest::Approx(want.position[j]).epsilon(1e-4));
+					CHECK(pose.velocity[j] == doctest::Approx(want.velocity[j]).epsilon(1e-3));
+				}
+
+				float dot = 0;
+				for (int j=0; j < 4; j++)
+					dot += pose.orientation[j] * want.orientation[j];
+				CHECK(std::fabs(dot) == doctest::Approx(1.0f).epsilon(1e-6));
+			}
+		});
+		CHECK(ok);
+
+		if (i) // the first one is a keyframe
+			delta_bytes += frame.size();
+		encoder.Ack(seq);
+	}
+
+	CHECK(decoder.Decode(frame.data(), frame.size(), packet, seq) == -1); // end tag is no varint data
+
+	// controllers and trackers shrink at least 3x once deltas kick in,
+	// gaze goes through raw so it's left out
+	size_t raw = layout.GetPacketSize() - sizeof(HoboVR_GazeState_t);
+	size_t gaze = sizeof(HoboVR_GazeState_t);
+	CHECK((delta_bytes / 19 - gaze) * 3 <= raw);
+	MESSAGE("raw ", raw, " bytes, delta ", delta_bytes / 19 - gaze, " bytes");
+}
+
+TEST_CASE("PoseDecoder handles lost frames and missing baselines") {
+	hobovr::UduLayout layout;
+	REQUIRE(layout.Compile("hct") == 0);
+
+	hobovr::PoseEncoder encoder(layout);
+	hobovr::PoseDecoder decoder(layout);
+	std::string frame, packet, orig;
+	uint32_t seq = 0;
+
+	orig = make_moving_packet(layout, 0);
+	REQUIRE(encoder.Encode(orig.data(), orig.size(), frame) == 0);
+	REQUIRE(decoder.Decode(frame.data(), frame.size() - 3, packet, seq) == 0);
+	encoder.Ack(seq);
+
+	// a lost frame doesn't matter, deltas are against the acked one
+	orig = make_moving_packet(layout, 1);
+	REQUIRE(encoder.Encode(orig.data(), orig.size(), frame) == 0);
+	orig = make_moving_packet(layout, 2);
+	REQUIRE(encoder.Encode(orig.data(), orig.size(), frame) == 0);
+	REQUIRE(decoder.Decode(frame.data(), frame.size() - 3, packet, seq) == 0);
+	CHECK(seq == 3);
+	std::string want = packet;
+
+	// a decoder that never saw the baseline can't do anything with it
+	hobovr::PoseDecoder late(layout);
+	CHECK(late.Decode(frame.data(), frame.size() - 3, packet, seq) == -1);
+	CHECK(errno == ENOENT);
+
+	// until the encoder is reset
+	encoder.Reset();
+	REQUIRE(encoder.Encode(orig.data(), orig.size(), frame) == 0);
+	REQUIRE(late.Decode(frame.data(), frame.size() - 3, packet, seq) == 0);
+	CHECK(packet == want);
+
+	// garbage
+	CHECK(decoder.Decode(frame.data(), 5, packet, seq) == -1);
+	CHECK(errno == EINVAL);
+	CHECK(encoder.Encode(orig.data(), orig.size() - 1, frame) == -1);
+	CHECK(errno == EINVAL);
+
+	// an old ack doesn't move the baseline back, one for a frame that
+	// wasn't encoded yet doesn't move it at all
+	REQUIRE(seq == 4);
+	encoder.Ack(seq);
+	encoder.Ack(1);
+	encoder.Ack(100);
+	CHECK(encoder.GetLastSeq() == 4);
+
+	orig = make_moving_packet(layout, 3);
+	REQUIRE(encoder.Encode(orig.data(), orig.size(), frame) == 0);
+
+	std::string raw;
+	REQUIRE(lsc::UnescapeBytes(frame.data(), frame.size() - 3, raw));
+	const char* p = raw.data();
+	uint64_t frame_seq = 0, back = 0;
+	REQUIRE(lsc::GetVarint(p, raw.data() + raw.size(), frame_seq));
+	REQUIRE(lsc::GetVarint(p, raw.data() + raw.size(), back));
+	CHECK(frame_seq == 5);
+	CHECK(back == 1); // against 4
+
+	// and 4 is all the late decoder has
+	REQUIRE(late.Decode(frame.data(), frame.size() - 3, packet, seq) == 0);
+	CHECK(seq == 5);
+}
+
+// packet for :udu: where device :device: sits at x = :x: moving along x at
+// :vel: m/s and turning around y at :spin: rad/s
+static std::string make_motion_packet(const hobovr::UduLayout& layout, size_t device, float x, float vel, float spin) {
+	std::string packet = make_packet(layout.GetUdu());
+	size_t off = layout.GetSlot(device).offset;
+	put_float(packet, off, x);
+	put_float(packet, off + offsetof(HoboVR_TrackerPose_t, velocity), vel);
+	put_float(packet, off + offsetof(HoboVR_TrackerPose_t, angular_velocity) + sizeof(float), spin);
+	return packet;
+}
+
+TEST_CASE("PosePredictor extrapolates from the newest sample") {
+	hobovr::UduLayout layout;
+	REQUIRE(layout.Compile("hctg") == 0);
+	hobovr::PosePredictor predictor(layout, 4);
+
+	HoboVR_TrackerPose_t pose;
+	CHECK_FALSE(predictor.Predict(0, 0, pose)); // nothing yet
+	CHECK_FALSE(predictor.Predict(3, 0, pose)); // gaze has no pose
+	CHECK_FALSE(predictor.Update("x", 1, 0));
+
+	static constexpr uint64_t MS = 1000000;
+	std::string packet = make_motion_packet(layout, 2, 1.0f, 2.0f, (float)M_PI);
+	REQUIRE(predictor.Update(packet.data(), packet.size(), 1000 * MS));
+
+	// 10 ms later, 2 cm further and turned by pi / 100 around y
+	REQUIRE(predictor.Predict(2, 1010 * MS, pose));
+	CHECK(pose.position[0] == doctest::Approx(1.02f));
+	CHECK(pose.orientation[0] == doctest::Approx(std::cos((float)M_PI / 200)));
+	CHECK(pose.orientation[2] == doctest::Approx(std::sin((float)M_PI / 200)));
+	CHECK(pose.orientation[1] == doctest::Approx(0.0f));
+
+	// controllers too, still devices stay put
+	REQUIRE(predictor.Predict(1, 1010 * MS, pose));
+	CHECK(pose.position[0] == 1.0f);
+	CHECK(pose.orientation[0] == 1.0f);
+
+	// never further than the limit
+	REQUIRE(predictor.Predict(2, 5000 * MS, pose));
+	CHECK(pose.position[0] == doctest::Approx(1.1f));
+	predictor.SetMaxExtrapolation(std::chrono::milliseconds(20));
+	REQUIRE(predictor.Predict(2, 5000 * MS, pose));
+	CHECK(pose.position[0] == doctest::Approx(1.04f));
+
+	// a query from before a newer sample uses the older one
+	packet = make_motion_packet(layout, 2, 1.5f, 2.0f, 0.0f);
+	REQUIRE(predictor.Update(packet.data(), packet.size(), 1020 * MS));
+	REQUIRE(predictor.Predict(2, 1015 * MS, pose));
+	CHECK(pose.position[0] == doctest::Approx(1.03f));
+	REQUIRE(predictor.Predict(2, 1025 * MS, pose));
+	CHECK(pose.position[0] == doctest::Approx(1.51f));
+
+	// poses that are 5 ms older than their receive time
+	predictor.SetTimeOffset(-0.005);
+	REQUIRE(predictor.Predict(2, 1025 * MS, pose));
+	CHECK(pose.position[0] == doctest::Approx(1.52f));
+
+	hobovr::TimedPose sample;
+	REQUIRE(predictor.GetSample(2, 1, sample));
+	CHECK(sample.time_ns == 1000 * MS);
+	CHECK_FALSE(predictor.GetSample(2, 2, sample));
+}
+
+TEST_CASE("PosePredictor queries while the receiver updates") {
+	hobovr::UduLayout layout;
+	REQUIRE(layout.Compile("t") == 0);
+
+	// x always equals the receive time in seconds, velocity 1 m/s,
+	// so any prediction has to land exactly on the query time,
+	// the history holds everything so the sample before the query time
+	// is always still there, however far the receiver got meanwhile
+	hobovr::PosePredictor predictor(layout, 32768);
+	std::atomic<bool> done{false};
+	std::thread receiver([&]() {
+		for (uint64_t t=1; t <= 20000; t++) {
+			std::string packet = make_motion_packet(layout, 0, (float)t * 1e-3f, 1.0f, 0.0f);
+			predictor.Update(packet.data(), packet.size(), t * 1000000);
+		}
+		done = true;
+	});
+
+	int bad = 0;
+	HoboVR_TrackerPose_t pose;
+	while (!done) {
+		hobovr::TimedPose newest;
+		if (!predictor.GetSample(0, 0, newest))
+			continue;
+
+		uint64_t t = newest.time_ns + 500000;
+		REQUIRE(predictor.Predict(0, t, pose));
+		if (std::fabs(pose.position[0] - (float)(t * 1e-9)) > 1e-4f)
+			bad++;
+	}
+	receiver.join();
+
+	CHECK(bad == 0);
+}
@@ -0,0 +1,297 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+
+#define NOMINMAX
+#include <iostream>
+#include "lazy_sockets.h"
+#include "socket_pairs.h"
+#include <errno.h>
+
+#include <thread>
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+
+using namespace lsc;
+
+using tcp_socket = LSocket<AF_INET, SOCK_STREAM, 0>;
+
+struct my_tag {
+	char a;
+	char b;
+	char c;
+};
+
+using tcp_receiver_loop = ThreadedRecvLoop<AF_INET, SOCK_STREAM, 0, my_tag>;
+
+static constexpr my_tag g_tag = {'\t', '\r', '\n'};
+
+TEST_CASE("Flight recorder keeps the last frames") {
+	const std::string path = "flight_recorder_test.bin";
+
+	{
+		FlightRecorder recorder;
+		REQUIRE(recorder.Open(path, 8, 16) == 0);
+
+		for (int i=0; i < 20; i++) {
+			std::string frame = "frame " + std::to_string(i);
+			recorder.Record(frame.data(), frame.size(), 1000 + i);
+		}
+
+		// too long for a slot, gets cut off
+		std::string big(100, 'b');
+		recorder.Record(big.data(), big.size(), 5000);
+		CHECK(recorder.GetRecordCount() == 21);
+
+		// read it back while it's still mapped, like after a crash
+		std::vector<FlightRecord> records;
+		REQUIRE(FlightRecorder::ReadFile(path, records) == 0);
+		REQUIRE(records.size() == 8);
+
+		for (int i=0; i < 7; i++) {
+			CHECK(records[i].seq == (uint64_t)14 + i);
+			CHECK(records[i].timestamp_ns == (uint64_t)1013 + i);
+			CHECK(records[i].data == "frame " + std::to_string(13 + i));
+			CHECK(records[i].size == records[i].data.size());
+		}
+
+		CHECK(records[7].seq == 21);
+		CHECK(records[7].size == 100);
+		CHECK(records[7].data == std::string(16, 'b'));
+	}
+
+	// and after it was closed
+	std::vector<FlightRecord> records;
+	REQUIRE(FlightRecorder::ReadFile(path, records) == 0);
+	CHECK(records.size() == 8);
+
+	// not a recorder file
+	FILE* f = fopen(path.c_str(), "wb");
+	fputs("definitely not a flight recorder", f);
+	fclose(f);
+	CHECK(FlightRecorder::ReadFile(path, records) == -1);
+	CHECK(FlightRecorder::ReadFile("does_not_exist.bin", records) == -1);
+
+	remove(path.c_str());
+}
+
+TEST_CASE("Receiver feeds the flight recorder") {
+	const std::string path = "flight_recorder_recv_test.bin";
+
+	std::shared_ptr<tcp_socket> tx, rx;
+	REQUIRE(make_connected_pair(tx, rx) == 0);
+
+	auto recorder = std::make_shared<FlightRecorder>();
+	REQUIRE(recorder->Open(path, 4, 64) == 0);
+
+	std::atomic<int> received{0};
+	tcp_receiver_loop recv_loop(rx, g_tag, [&received](void*, size_t) {received++;}, 64);
+	recv_loop.AttachFlightRecorder(recorder);
+	recv_loop.Start();
+
+	uint64_t before = get_wall_time_ns();
+	for (int i=0; i < 10; i++) {
+		std::string frame = "pose " + std::to_string(i);
+		frame.append((const char*)&g_tag, sizeof(g_tag));
+		REQUIRE(tx->SendAll(frame.data(), frame.size()) == (int)frame.size());
+	}
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (received < 10 && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	REQUIRE(received == 10);
+
+	tx.reset();
+	rx.reset();
+	recv_loop.Stop();
+
+	std::vector<FlightRecord> records;
+	REQUIRE(FlightRecorder::ReadFile(path, records) == 0);
+	REQUIRE(records.size() == 4);
+	for (int i=0; i < 4; i++) {
+		CHECK(records[i].data == "pose " + std::to_string(6 + i));
+		CHECK(records[i].timestamp_ns >= before);
+	}
+
+	remove(path.c_str());
+}
+
+TEST_CASE("Capture a session and replay it") {
+	const std::string path = "capture_test.lsccap";
+
+	// capture a live session
+	{
+		std::shared_ptr<tcp_socket> tx, rx;
+		REQUIRE(make_connected_pair(tx, rx) == 0);
+
+		auto capture = std::make_shared<CaptureWriter>();
+		REQUIRE(capture->Open(path, g_tag) == 0);
+
+		std::atomic<int> received{0};
+		tcp_receiver_loop recv_loop(rx, g_tag, [&received](void*, size_t) {received++;}, 64);
+		recv_loop.AttachCapture(capture);
+		recv_loop.Start();
+
+		for (int i=0; i < 100; i++) {
+			std::string frame = "pose " + std::to_string(i);
+			frame.append((const char*)&g_tag, sizeof(g_tag));
+			REQUIRE(tx->SendAll(frame.data(), frame.size()) == (int)frame.size());
+		}
+
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+		while (received < 100 && std::chrono::steady_clock::now() < deadline)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+		REQUIRE(received == 100);
+
+		tx.reset();
+		rx.reset();
+		recv_loop.Stop();
+
+		CHECK(capture->GetFrameCount() == 100);
+		CHECK(capture->Flush() == 0);
+	}
+
+	CaptureReader reader;
+	REQUIRE(reader.Open(path) == 0);
+	REQUIRE(reader.GetFrameCount() == 100);
+	CHECK(reader.GetTagSize() == sizeof(g_tag));
+	CHECK(reader.GetSockType() == SOCK_STREAM);
+	for (size_t i=1; i < reader.GetFrameCount(); i++)
+		CHECK(reader.GetFrame(i).timestamp_ns >= reader.GetFrame(i - 1).timestamp_ns);
+
+	// replay it into a fresh receiver at line rate
+	{
+		std::shared_ptr<tcp_socket> tx, rx;
+		REQUIRE(make_connected_pair(tx, rx) == 0);
+
+		std::vector<std::string> frames;
+		std::atomic<int> received{0};
+		tcp_receiver_loop recv_loop(
+			rx,
+			g_tag,
+			[&frames, &received](void* buff, size_t len) {
+				frames.emplace_back((const char*)buff, len);
+				received++;
+			},
+			64
+		);
+		recv_loop.Start();
+
+		CHECK(ReplayCapture(reader, *tx) == 100);
+
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+		while (received < 100 && std::chrono::steady_clock::now() < deadline)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+		tx.reset();
+		rx.reset();
+		recv_loop.Stop();
+
+		REQUIRE(frames.size() == 100);
+		for (int i=0; i < 100; i++)
+			CHECK(frames[i] == "pose " + std::to_string(i));
+	}
+
+	remove(path.c_str());
+}
+
+TEST_CASE("Replay with original timing") {
+	const std::string path = "capture_timing_test.lsccap";
+
+	// 5 frames 20ms apart
+	{
+		CaptureWriter capture;
+		REQUIRE(capture.Open(path, g_tag) == 0);
+		for (int i=0; i < 5; i++)
+			REQUIRE(capture.Write("tick", 4, 1000000000ull + i * 20000000ull) == 0);
+	}
+
+	CaptureReader reader;
+	REQUIRE(reader.Open(path) == 0);
+	REQUIRE(reader.GetFrameCount() == 5);
+
+	std::shared_ptr<tcp_socket> tx, rx;
+	REQUIRE(make_connected_pair(tx, rx) == 0);
+
+	auto start = std::chrono::steady_clock::now();
+	CHECK(ReplayCapture(reader, *tx, EReplay_original) == 5);
+	auto took = std::chrono::steady_clock::now() - start;
+	CHECK(took >= std::chrono::milliseconds(80));
+	CHECK(took < std::chrono::milliseconds(1000));
+
+	// twice as fast
+	reader.Rewind();
+	start = std::chrono::steady_clock::now();
+	CHECK(ReplayCapture(reader, *tx, EReplay_original, 2.0) == 5);
+	auto took_fast = std::chrono::steady_clock::now() - start;
+	CHECK(took_fast >= std::chrono::milliseconds(40));
+	CHECK(took_fast < took);
+
+	// a speed that would stall or run backwards
+	reader.Rewind();
+	CHECK(ReplayCapture(reader, *tx, EReplay_original, 0.0) == -1);
+	CHECK(errno == EINVAL);
+	CHECK(ReplayCapture(reader, *tx, EReplay_original, -1.0) == -1);
+	CHECK(errno == EINVAL);
+
+	// everything arrived with the tags back on
+	std::string expected;
+	for (int i=0; i < 10; i++) {
+		expected += "tick";
+		expected.append((const char*)&g_tag, sizeof(g_tag));
+	}
+
+	std::string got(expected.size(), '\0');
+	size_t off = 0;
+	while (off < got.size()) {
+		int res = rx->Recv(&got[off], got.size() - off);
+		REQUIRE(res > 0);
+		off += res;
+	}
+	CHECK(got == expected);
+
+	remove(path.c_str());
+}
+
+TEST_CASE("Replay datagrams and truncated captures") {
+	const std::string path = "capture_dgram_test.lsccap";
+
+	{
+		CaptureWriter capture;
+		REQUIRE(capture.Open(path, g_tag, SOCK_DGRAM) == 0);
+		REQUIRE(capture.Write("first", 5) == 0);
+		REQUIRE(capture.Write("second", 6) == 0);
+	}
+
+	// cut the last frame in half, like a crash while writing
+	{
+		FILE* f = fopen(path.c_str(), "ab");
+		CaptureRecordHeader record = {0, 100};
+		fwrite(&record, sizeof(record), 1, f);
+		fwrite("half", 4, 1, f);
+		fclose(f);
+	}
+
+	CaptureReader reader;
+	REQUIRE(reader.Open(path) == 0);
+	REQUIRE(reader.GetFrameCount() == 2);
+	CHECK(reader.GetSockType() == SOCK_DGRAM);
+
+	std::shared_ptr<LSocket<AF_INET, SOCK_DGRAM, 0>> tx, rx;
+	REQUIRE(make_connected_pair(tx, rx) == 0);
+
+	CHECK(ReplayCapture(reader, *tx) == 2);
+
+	// one datagram per frame
+	char buff[64];
+	REQUIRE(rx->Recv(buff, sizeof(buff)) == 5 + (int)sizeof(g_tag));
+	CHECK(memcmp(buff, "first", 5) == 0);
+	REQUIRE(rx->Recv(buff, sizeof(buff)) == 6 + (int)sizeof(g_tag));
+	CHECK(memcmp(buff, "second", 6) == 0);
+	CHECK(memcmp(buff + 6, &g_tag, sizeof(g_tag)) == 0);
+
+	remove(path.c_str());
+}
@@ -0,0 +1,467 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+
+#define NOMINMAX
+#include <iostream>
+#include "lazy_sockets.h"
+#include "socket_pairs.h"
+#include <errno.h>
+
+#include <thread>
+#include <algorithm>
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+
+using namespace lsc;
+
+using tcp_socket = LSocket<AF_INET, SOCK_STREAM, 0>;
+
+struct my_tag {
+	char a;
+	char b;
+	char c;
+};
+
+using tcp_receiver_loop = ThreadedRecvLoop<AF_INET, SOCK_STREAM, 0, my_tag>;
+
+static constexpr my_tag g_tag = {'\t', '\r', '\n'};
+
+static std::string make_frame(int producer, int seq) {
+	std::string msg = std::to_string(producer) + ":" + std::to_string(seq);
+	msg.append((const char*)&g_tag, sizeof(g_tag));
+	return msg;
+}
+
+// checks that every producer's frames arrive whole and in order
+struct FrameChecker {
+	std::vector<int> next_seq;
+	std::atomic<int> total{0};
+	std::atomic<int> bad{0};
+
+	FrameChecker(int producers): next_seq(producers, 0) {}
+
+	void OnPacket(void* buff, size_t len) {
+		std::string msg((const char*)buff, len);
+		size_t sep = msg.find(':');
+		if (sep == std::string::npos) {
+			bad++;
+			return;
+		}
+
+		int producer = std::stoi(msg.substr(0, sep));
+		int seq = std::stoi(msg.substr(sep + 1));
+		if (producer < 0 || producer >= (int)next_seq.size() || next_seq[producer] != seq)
+			bad++;
+		else
+			next_seq[producer]++;
+
+		total++;
+	}
+
+	bool WaitFor(int count) {
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+		while (total < count && std::chrono::steady_clock::now() < deadline)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+		return total == count;
+	}
+};
+
+TEST_CASE("MpscQueue keeps per producer order") {
+	static constexpr int PRODUCERS = 4;
+	static constexpr int COUNT = 100000;
+
+	MpscQueue<int> queue;
+	std::vector<std::thread> producers;
+	for (int p=0; p < PRODUCERS; p++)
+		producers.emplace_back([&queue, p]() {
+			for (int i=0; i < COUNT; i++)
+				queue.Push(p * COUNT + i);
+		});
+
+	std::vector<int> next(PRODUCERS, 0);
+	int popped = 0;
+	int bad = 0;
+	while (popped < PRODUCERS * COUNT) {
+		int v = 0;
+		if (!queue.TryPop(v)) {
+			std::this_thread::yield();
+			continue;
+		}
+
+		int p = v / COUNT;
+		if (next[p] != v % COUNT)
+			bad++;
+		next[p] = v % COUNT + 1;
+		popped++;
+	}
+
+	for (auto& i : producers)
+		i.join();
+
+	CHECK(bad == 0);
+	CHECK(queue.Empty());
+}
+
+TEST_CASE("ThreadedSendLoop with concurrent senders") {
+	static constexpr int PRODUCERS = 4;
+	static constexpr int COUNT = 5000;
+
+	std::shared_ptr<tcp_socket> tx, rx;
+	REQUIRE(make_connected_pair(tx, rx) == 0);
+
+	FrameChecker checker(PRODUCERS);
+	tcp_receiver_loop recv_loop(
+		rx,
+		g_tag,
+		std::bind(&FrameChecker::OnPacket, &checker, std::placeholders::_1, std::placeholders::_2),
+		64
+	);
+	recv_loop.Start();
+
+	ThreadedSendLoop<AF_INET, SOCK_STREAM, 0> send_loop(tx);
+	send_loop.Start();
+
+	std::vector<std::thread> producers;
+	for (int p=0; p < PRODUCERS; p++)
+		producers.emplace_back([&send_loop, p]() {
+			for (int i=0; i < COUNT; i++)
+				CHECK(send_loop.SendString(make_frame(p, i)));
+		});
+
+	for (auto& i : producers)
+		i.join();
+
+	CHECK(checker.WaitFor(PRODUCERS * COUNT));
+	CHECK(checker.bad == 0);
+	CHECK(send_loop.GetQueuedBytes() == 0);
+	CHECK(send_loop.GetLastError() == 0);
+
+	send_loop.Stop();
+	CHECK_FALSE(send_loop.SendString(make_frame(0, COUNT))); // stopped
+
+	rx.reset();
+	tx.reset();
+	recv_loop.Stop();
+}
+
+TEST_CASE("ThreadedSendLoop sends one datagram per frame") {
+	using dgram_socket = LSocket<AF_INET, SOCK_DGRAM, 0>;
+
+	std::shared_ptr<dgram_socket> tx, rx;
+	REQUIRE(make_connected_pair(tx, rx) == 0);
+
+	// held back until all of them are queued, so they go out in one batch
+	ThreadedSendLoop<AF_INET, SOCK_DGRAM, 0> send_loop(tx);
+	send_loop.SetCoalescing(1024 * 1024, std::chrono::milliseconds(20));
+	send_loop.Start();
+	for (int i=0; i < 8; i++)
+		REQUIRE(send_loop.SendString(make_frame(0, i)));
+
+	char buff[64];
+	for (int i=0; i < 8; i++) {
+		std::string frame = make_frame(0, i);
+		REQUIRE(rx->Poll(EPoll_in, 1000) == 1);
+		REQUIRE(rx->Recv(buff, sizeof(buff)) == (int)frame.size());
+		CHECK(memcmp(buff, frame.data(), frame.size()) == 0);
+	}
+
+	send_loop.Stop();
+	CHECK(send_loop.GetLastError() == 0);
+}
+
+TEST_CASE("ThreadedSendLoop sends everything accepted before Stop()") {
+	static constexpr int PRODUCERS = 4;
+
+	for (int round=0; round < 20; round++) {
+		std::shared_ptr<tcp_socket> tx, rx;
+		REQUIRE(make_connected_pair(tx, rx) == 0);
+
+		FrameChecker checker(PRODUCERS);
+		tcp_receiver_loop recv_loop(
+			rx,
+			g_tag,
+			std::bind(&FrameChecker::OnPacket, &checker, std::placeholders::_1, std::placeholders::_2),
+			64
+		);
+		recv_loop.Start();
+
+		ThreadedSendLoop<AF_INET, SOCK_STREAM, 0> send_loop(tx);
+		send_loop.Start();
+
+		// producers keep going until the loop turns them away
+		std::atomic<int> accepted{0};
+		std::vector<std::thread> producers;
+		for (int p=0; p < PRODUCERS; p++)
+			producers.emplace_back([&send_loop, &accepted, p]() {
+				for (int i=0; send_loop.SendString(make_frame(p, i)); i++)
+					accepted++;
+			});
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+		send_loop.Stop();
+		for (auto& i : producers)
+			i.join();
+
+		CHECK(checker.WaitFor(accepted));
+		CHECK(checker.bad == 0);
+
+		tx.reset();
+		rx.reset();
+		recv_loop.Stop();
+	}
+}
+
+TEST_CASE("SendAll finishes partial writes") {
+	std::shared_ptr<tcp_socket> tx, rx;
+	REQUIRE(make_connected_pair(tx, rx) == 0);
+
+	// way more than the socket buffers can hold at once
+	std::string msg(4 * 1024 * 1024, 'x');
+	for (size_t i=0; i < msg.size(); i++)
+		msg[i] = (char)(i * 7);
+
+	REQUIRE(tx->SetNonBlocking(true) == 0);
+
+	std::string got;
+	std::thread reader([&rx, &got, &msg]() {
+		char buff[64 * 1024];
+		while (got.size() < msg.size()) {
+			int res = rx->Recv(buff, sizeof(buff));
+			if (res <= 0)
+				break;
+			got.append(buff, res);
+		}
+	});
+
+	CHECK(tx->SendAll(msg.data(), msg.size()) == (int)msg.size());
+
+	reader.join();
+	CHECK(got == msg);
+}
+
+TEST_CASE("BufferedWriter watermarks") {
+	std::shared_ptr<tcp_socket> tx, rx;
+	REQUIRE(make_connected_pair(tx, rx) == 0);
+
+	static constexpr size_t FRAME_SIZE = 1000;
+	static constexpr size_t HIGH = 256 * 1024;
+	static constexpr size_t LOW = 16 * 1024;
+
+	BufferedWriter<AF_INET, SOCK_STREAM, 0> writer(tx, HIGH, LOW);
+
+	int high_calls = 0;
+	int low_calls = 0;
+	writer.SetWatermarkCallbacks(
+		[&high_calls](size_t buffered) {high_calls++; CHECK(buffered >= HIGH);},
+		[&low_calls](size_t buffered) {low_calls++; CHECK(buffered <= LOW);}
+	);
+
+	// nobody reads yet, so eventually the kernel buffer fills up
+	// and the writer has to start buffering
+	std::string frame(FRAME_SIZE, 'a');
+	size_t written = 0;
+	while (!writer.IsThrottled()) {
+		frame[0] = (char)written; // make frames distinguishable
+		REQUIRE(writer.Write(frame.data(), frame.size()) == 0);
+		written += frame.size();
+		REQUIRE(written < 64 * 1024 * 1024);
+	}
+
+	CHECK(high_calls == 1);
+	CHECK(low_calls == 0);
+	CHECK(writer.GetBufferedBytes() >= HIGH);
+
+	size_t got = 0;
+	std::thread reader([&rx, &got, written]() {
+		char buff[64 * 1024];
+		while (got < written) {
+			int res = rx->Recv(buff, sizeof(buff));
+			if (res <= 0)
+				break;
+			got += res;
+		}
+	});
+
+	CHECK(writer.FlushAll(5000) == 0);
+	reader.join();
+
+	CHECK(got == written);
+	CHECK(high_calls == 1);
+	CHECK(low_calls == 1);
+	CHECK_FALSE(writer.IsThrottled());
+}
+
+TEST_CASE("BufferedWriter keeps datagrams apart") {
+	using dgram_socket = LSocket<AF_INET, SOCK_DGRAM, 0>;
+
+	std::shared_ptr<dgram_socket> tx, rx;
+	REQUIRE(make_connected_pair(tx, rx) == 0);
+
+	BufferedWriter<AF_INET, SOCK_DGRAM, 0> writer(tx);
+
+	// datagram :i: is :i: % 200 bytes of (char):i:, so some are empty
+	auto make_datagram = [](int i) {
+		return std::string((size_t)(i % 200), (char)i);
+	};
+
+	// nobody reads yet, fill the kernel buffer and then some
+	int count = 0;
+	while (!writer.GetBufferedBytes()) {
+		std::string datagram = make_datagram(count++);
+		REQUIRE(writer.Write(datagram.data(), datagram.size()) == 0);
+		REQUIRE(count < 1000000);
+	}
+	for (int i=0; i < 400; i++) {
+		std::string datagram = make_datagram(count++);
+		REQUIRE(writer.Write(datagram.data(), datagram.size()) == 0);
+	}
+
+	// every datagram comes out as it went in
+	char buff[256];
+	int got = 0;
+	bool whole = true;
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (got < count && std::chrono::steady_clock::now() < deadline) {
+		REQUIRE(writer.Flush() >= 0);
+		while (got < count && rx->Poll(EPoll_in, 1) > 0) {
+			int res = rx->Recv(buff, sizeof(buff));
+			REQUIRE(res >= 0);
+			std::string datagram = make_datagram(got++);
+			whole = whole && res == (int)datagram.size() && memcmp(buff, datagram.data(), res) == 0;
+		}
+	}
+
+	CHECK(got == count);
+	CHECK(whole);
+	CHECK(writer.Flush() == 0);
+}
+
+TEST_CASE("ThreadedSendLoop coalescing") {
+	using namespace std::chrono;
+
+	std::shared_ptr<tcp_socket> tx, rx;
+	REQUIRE(make_connected_pair(tx, rx) == 0);
+
+	FrameChecker checker(1);
+	tcp_receiver_loop recv_loop(
+		rx,
+		g_tag,
+		std::bind(&FrameChecker::OnPacket, &checker, std::placeholders::_1, std::placeholders::_2),
+		64
+	);
+	recv_loop.Start();
+
+	SUBCASE("flush on deadline") {
+		ThreadedSendLoop<AF_INET, SOCK_STREAM, 0> send_loop(tx);
+		send_loop.SetCoalescing(1024 * 1024, milliseconds(20));
+		send_loop.Start();
+
+		auto start = steady_clock::now();
+		for (int i=0; i < 10; i++)
+			send_loop.SendString(make_frame(0, i));
+
+		// frames are held back, nowhere near the byte threshold
+		std::this_thread::sleep_for(milliseconds(5));
+		CHECK(checker.total == 0);
+
+		CHECK(checker.WaitFor(10));
+		auto took = steady_clock::now() - start;
+		CHECK(took >= milliseconds(20));
+		CHECK(took < milliseconds(500));
+	}
+
+	SUBCASE("flush on byte threshold") {
+		ThreadedSendLoop<AF_INET, SOCK_STREAM, 0> send_loop(tx);
+		send_loop.SetCoalescing(4, seconds(10));
+		send_loop.Start();
+
+		auto start = steady_clock::now();
+		for (int i=0; i < 20; i++)
+			send_loop.SendString(make_frame(0, i));
+
+		// every frame is past the threshold on its own, nothing waits for the deadline
+		CHECK(checker.WaitFor(20));
+		CHECK(steady_clock::now() - start < seconds(5));
+	}
+
+	CHECK(checker.bad == 0);
+
+	rx.reset();
+	tx.reset();
+	recv_loop.Stop();
+}
+
+TEST_CASE("ThreadedSendLoop priority lanes") {
+	static constexpr size_t BULK_SIZE = 520; // a manager message worth of payload
+	static constexpr int BULK_COUNT = 4000;
+
+	std::shared_ptr<tcp_socket> tx, rx;
+	REQUIRE(make_connected_pair(tx, rx) == 0);
+
+	// frames are tagged by their first byte
+	std::vector<char> order;
+	std::atomic<int> received{0};
+	tcp_receiver_loop recv_loop(
+		rx,
+		g_tag,
+		[&order, &received](void* buff, size_t len) {
+			if (len)
+				order.push_back(*(char*)buff);
+			received++;
+		},
+		1024
+	);
+
+	ThreadedSendLoop<AF_INET, SOCK_STREAM, 0> send_loop(tx);
+	int realtime = send_loop.AddLane(ESendPrio_realtime);
+	int heavy = send_loop.AddLane(ESendPrio_bulk, 3);
+	send_loop.Start();
+
+	std::string bulk(BULK_SIZE, 'b');
+	bulk.append((const char*)&g_tag, sizeof(g_tag));
+	std::string bulk_heavy(BULK_SIZE, 'h');
+	bulk_heavy.append((const char*)&g_tag, sizeof(g_tag));
+
+	// nobody is reading yet, so most of this piles up in the lanes
+	for (int i=0; i < BULK_COUNT; i++) {
+		send_loop.Send(bulk.data(), bulk.size());
+		send_loop.Send(bulk_heavy.data(), bulk_heavy.size(), heavy);
+	}
+
+	std::string haptics = "r";
+	haptics.append((const char*)&g_tag, sizeof(g_tag));
+	send_loop.Send(haptics.data(), haptics.size(), realtime);
+
+	recv_loop.Start();
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while (received < BULK_COUNT * 2 + 1 && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	send_loop.Stop();
+	tx.reset(); // unblocks the receiver once it read everything
+	rx.reset();
+	recv_loop.Stop();
+
+	REQUIRE(order.size() == BULK_COUNT * 2 + 1);
+
+	// the realtime frame only waits for what was already in flight:
+	// the kernel socket buffer plus one batch, not for 4 MB of bulk data
+	size_t realtime_pos = std::find(order.begin(), order.end(), 'r') - order.begin();
+	CHECK(realtime_pos < 1000);
+
+	// while both bulk lanes are backlogged the heavy one gets 3x the bandwidth,
+	// look at a window well past the realtime frame
+	int light_count = 0;
+	int heavy_count = 0;
+	for (size_t i=2000; i < 4000; i++) {
+		light_count += order[i] == 'b';
+		heavy_count += order[i] == 'h';
+	}
+
+	CHECK(heavy_count > light_count * 2);
+	CHECK(heavy_count < light_count * 4);
+}
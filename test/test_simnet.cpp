@@ -0,0 +1,278 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+
+#define NOMINMAX
+#include <iostream>
+#include "lazy_sockets.h"
+#include <errno.h>
+
+#include <thread>
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+
+using namespace lsc;
+
+using tcp_socket = LSocket<AF_INET, SOCK_STREAM, 0>;
+using udp_socket = LSocket<AF_INET, SOCK_DGRAM, 0>;
+
+struct my_tag {
+	char a;
+	char b;
+	char c;
+};
+
+using tcp_receiver_loop = ThreadedRecvLoop<AF_INET, SOCK_STREAM, 0, my_tag>;
+using tcp_link = SimLink<AF_INET, SOCK_STREAM, 0>;
+using udp_link = SimLink<AF_INET, SOCK_DGRAM, 0>;
+
+static constexpr my_tag g_tag = {'\t', '\r', '\n'};
+
+static std::string make_frame(int seq) {
+	std::string msg = "frame " + std::to_string(seq);
+	msg.append((const char*)&g_tag, sizeof(g_tag));
+	return msg;
+}
+
+// waits up to :timeout_ms: for :pred:
+template<typename F>
+static bool wait_until(F pred, int timeout_ms = 5000) {
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+	while (!pred()) {
+		if (std::chrono::steady_clock::now() > deadline)
+			return false;
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+
+	return true;
+}
+
+TEST_CASE("SimLink adds latency") {
+	SimLinkParams params;
+	params.latency_ns = 20000000; // 20ms
+
+	tcp_link link;
+	REQUIRE(link.Open(params) == 0);
+	auto tx = link.GetA();
+	auto rx = link.GetB();
+
+	std::atomic<uint64_t> arrived{0};
+	tcp_receiver_loop recv_loop(
+		rx,
+		g_tag,
+		[&arrived](void*, size_t) {arrived = get_time_ns();},
+		64
+	);
+	recv_loop.Start();
+
+	std::string frame = make_frame(0);
+	uint64_t sent = get_time_ns();
+	REQUIRE(tx->SendAll(frame.data(), frame.size()) == (int)frame.size());
+
+	CHECK(wait_until([&]() {return arrived != 0;}));
+	CHECK(arrived - sent >= params.latency_ns);
+	CHECK(arrived - sent < params.latency_ns + 500000000ull); // generous for loaded machines
+
+	tx.reset();
+	rx.reset();
+	link.Close();
+	recv_loop.Stop();
+}
+
+TEST_CASE("SimLink partial reads and jitter keep framing intact") {
+	static constexpr int COUNT = 500;
+
+	SimLinkParams params;
+	params.max_chunk = 3; // every frame arrives in pieces
+	params.jitter_ns = 200000;
+	params.seed = 42;
+
+	tcp_link link;
+	REQUIRE(link.Open(params) == 0);
+	auto tx = link.GetA();
+	auto rx = link.GetB();
+
+	std::atomic<int> next{0};
+	std::atomic<int> bad{0};
+	tcp_receiver_loop recv_loop(
+		rx,
+		g_tag,
+		[&](void* buff, size_t len) {
+			std::string expected = make_frame(next);
+			expected.resize(expected.size() - sizeof(g_tag));
+			if (std::string((char*)buff, len) != expected)
+				bad++;
+			next++;
+		},
+		64
+	);
+	recv_loop.Start();
+
+	std::string all;
+	for (int i=0; i < COUNT; i++)
+		all += make_frame(i);
+	REQUIRE(tx->SendAll(all.data(), all.size()) == (int)all.size());
+
+	CHECK(wait_until([&]() {return next == COUNT;}));
+	CHECK(bad == 0);
+
+	SimLinkStats stats = link.GetStats(ESimLink_a_to_b);
+	CHECK(stats.bytes_in == all.size());
+	CHECK(stats.bytes_out == all.size());
+	CHECK(stats.chunks >= all.size() / 3);
+
+	tx.reset();
+	rx.reset();
+	link.Close();
+	recv_loop.Stop();
+}
+
+TEST_CASE("SimLink bandwidth limit") {
+	SimLinkParams params;
+	params.bandwidth = 1024 * 1024; // 1MB/s
+
+	tcp_link link;
+	REQUIRE(link.Open(params) == 0);
+	auto tx = link.GetA();
+	auto rx = link.GetB();
+
+	// 64KB at 1MB/s, about 62ms on the wire
+	std::string msg(64 * 1024, 'b');
+	uint64_t start = get_time_ns();
+	REQUIRE(tx->SendAll(msg.data(), msg.size()) == (int)msg.size());
+
+	size_t got = 0;
+	char buff[4096];
+	while (got < msg.size()) {
+		int res = rx->Recv(buff, sizeof(buff));
+		REQUIRE(res > 0);
+		got += res;
+	}
+	uint64_t took = get_time_ns() - start;
+
+	CHECK(took >= 60000000ull);
+	CHECK(took < 1000000000ull);
+}
+
+TEST_CASE("SimLink pushes back on the sender") {
+	SimLinkParams params;
+	params.queue_limit = 4096;
+
+	tcp_link link;
+	REQUIRE(link.Open(params) == 0);
+	auto tx = link.GetA();
+	auto rx = link.GetB();
+	REQUIRE(tx->SetNonBlocking(true) == 0);
+
+	// nobody reads rx, so sooner or later the sender has to stall
+	std::string chunk(1024, 'p');
+	std::string sent;
+	bool stalled = false;
+	for (int i=0; i < 64 * 1024 && !stalled; i++) {
+		for (size_t j=0; j < chunk.size(); j++)
+			chunk[j] = (char)(i + j);
+
+		int res = tx->Send(chunk.data(), chunk.size(), ESend_nosignal);
+		if (res < 0) {
+			REQUIRE(lerrno == LSOCK_WOULDBLOCK);
+			// give the pump a moment, it might just be behind
+			if (tx->Poll(EPoll_out, 50) <= 0)
+				stalled = true;
+			continue;
+		}
+
+		sent.append(chunk.data(), res);
+	}
+
+	CHECK(stalled);
+	CHECK(sent.size() < 64 * 1024 * 1024);
+
+	// now drain it, everything has to come out intact and in order
+	std::string got;
+	char buff[64 * 1024];
+	while (got.size() < sent.size()) {
+		if (rx->Poll(EPoll_in, 2000) <= 0)
+			break;
+		int res = rx->Recv(buff, sizeof(buff));
+		if (res <= 0)
+			break;
+		got.append(buff, res);
+	}
+
+	CHECK(got == sent);
+	CHECK(link.GetStats(ESimLink_a_to_b).stalls > 0);
+}
+
+TEST_CASE("SimLink eof after in flight data") {
+	SimLinkParams params;
+	params.latency_ns = 5000000;
+
+	tcp_link link;
+	REQUIRE(link.Open(params) == 0);
+	auto tx = link.GetA();
+	auto rx = link.GetB();
+
+	// closing the endpoint, not the link, which would drop what's in flight
+	REQUIRE(tx->SendAll("bye", 3) == 3);
+	tx->Close();
+
+	char buff[16];
+	int got = 0;
+	int res;
+	while ((res = rx->Recv(buff + got, sizeof(buff) - got)) > 0)
+		got += res;
+
+	CHECK(res == 0);
+	CHECK(got == 3);
+	CHECK(memcmp(buff, "bye", 3) == 0);
+}
+
+// every datagram takes one dice roll, so the same seed drops the same ones
+static std::vector<int> run_lossy_link(uint64_t seed) {
+	static constexpr int COUNT = 1000;
+
+	SimLinkParams params;
+	params.loss = 0.3;
+	params.seed = seed;
+
+	udp_link link;
+	REQUIRE(link.Open(params) == 0);
+	auto tx = link.GetA();
+	auto rx = link.GetB();
+
+	std::thread sender([&tx]() {
+		for (int i=0; i < COUNT; i++)
+			tx->Send(&i, sizeof(i));
+	});
+
+	std::vector<int> got;
+	while (true) {
+		SimLinkStats stats = link.GetStats(ESimLink_a_to_b);
+		if (stats.segments == COUNT && stats.dropped + got.size() == COUNT)
+			break;
+
+		if (rx->Poll(EPoll_in, 2000) <= 0)
+			break;
+
+		int seq;
+		if (rx->Recv(&seq, sizeof(seq)) == sizeof(seq))
+			got.push_back(seq);
+	}
+
+	sender.join();
+	CHECK(link.GetStats(ESimLink_a_to_b).dropped + got.size() == COUNT);
+	return got;
+}
+
+TEST_CASE("SimLink datagram loss is reproducible") {
+	std::vector<int> first = run_lossy_link(7);
+	std::vector<int> second = run_lossy_link(7);
+	std::vector<int> other = run_lossy_link(8);
+
+	CHECK(first.size() > 600);
+	CHECK(first.size() < 800);
+	CHECK(first == second);
+	CHECK(first != other);
+	CHECK(std::is_sorted(first.begin(), first.end())); // no jitter, no reordering
+}
@@ -0,0 +1,198 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+
+#define NOMINMAX
+#include <iostream>
+#include "lazy_sockets.h"
+#include "socket_pairs.h"
+#include <errno.h>
+
+#include <thread>
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+
+using namespace lsc;
+
+using tcp_socket = LSocket<AF_INET, SOCK_STREAM, 0>;
+
+struct my_tag {
+	char a;
+	char b;
+	char c;
+};
+
+static constexpr my_tag g_tag = {'\t', '\r', '\n'};
+
+TEST_CASE("SpscRing single thread") {
+	SpscRing<int> ring(3);
+
+	CHECK(ring.Capacity() == 4);
+	CHECK(ring.Empty());
+
+	for (int i=0; i < 4; i++)
+		CHECK(ring.TryPush(i));
+
+	CHECK_FALSE(ring.TryPush(4)); // full
+
+	int out = -1;
+	CHECK(ring.TryPop(out));
+	CHECK(out == 0);
+	CHECK(ring.TryPush(4)); // room again
+
+	for (int i=1; i < 5; i++) {
+		CHECK(ring.TryPop(out));
+		CHECK(out == i);
+	}
+
+	CHECK_FALSE(ring.TryPop(out));
+	CHECK(ring.Front() == nullptr);
+}
+
+TEST_CASE("SpscRing across threads") {
+	static constexpr int COUNT = 1000000;
+	SpscRing<int> ring(64);
+
+	std::thread producer([&ring]() {
+		for (int i=0; i < COUNT; i++)
+			while (!ring.TryPush(i))
+				std::this_thread::yield();
+	});
+
+	int expected = 0;
+	while (expected < COUNT) {
+		int* v = ring.Front();
+		if (!v) {
+			std::this_thread::yield();
+			continue;
+		}
+
+		if (*v != expected)
+			break;
+
+		ring.Pop();
+		expected++;
+	}
+
+	producer.join();
+
+	CHECK(expected == COUNT);
+	CHECK(ring.Empty());
+}
+
+TEST_CASE("SeqlockRing single thread") {
+	SeqlockRing<uint64_t> ring(3); // rounded up to 4
+	CHECK(ring.Capacity() == 4);
+
+	uint64_t value = 0;
+	CHECK_FALSE(ring.Latest(value));
+
+	for (uint64_t i=1; i <= 6; i++)
+		ring.Push(i * 10);
+
+	CHECK(ring.Count() == 6);
+	REQUIRE(ring.Latest(value));
+	CHECK(value == 60);
+	REQUIRE(ring.Get(3, value));
+	CHECK(value == 30);
+	CHECK_FALSE(ring.Get(4, value)); // overwritten
+}
+
+TEST_CASE("SeqlockRing readers never see torn values") {
+	// bigger than a word, so a torn read would show up as mixed fields
+	struct Value {
+		uint64_t a, b, c, d, e;
+	};
+
+	SeqlockRing<Value> ring(4);
+	std::atomic<bool> done{false};
+
+	static constexpr uint64_t COUNT = 200000;
+	std::thread writer([&]() {
+		for (uint64_t i=1; i <= COUNT; i++)
+			ring.Push(Value{i, i, i, i, i});
+		done = true;
+	});
+
+	uint64_t reads = 0, last = 0;
+	bool torn = false, backwards = false;
+	while (!done || reads == 0) {
+		Value v;
+		for (size_t age=0; age < 4; age++) {
+			if (!ring.Get(age, v))
+				continue;
+
+			torn |= !(v.a == v.b && v.b == v.c && v.c == v.d && v.d == v.e);
+			if (age == 0) {
+				backwards |= v.a < last;
+				last = v.a;
+			}
+			reads++;
+		}
+	}
+	writer.join();
+
+	CHECK_FALSE(torn);
+	CHECK_FALSE(backwards);
+	Value v;
+	REQUIRE(ring.Latest(v));
+	CHECK(v.a == COUNT);
+}
+
+TEST_CASE("QueuedRecvLoop polls frames") {
+	std::shared_ptr<tcp_socket> reader, writer;
+	REQUIRE(make_connected_pair(reader, writer) == 0);
+
+	QueuedRecvLoop<AF_INET, SOCK_STREAM, 0, my_tag> recv_loop(reader, g_tag, 8, 4);
+	recv_loop.Start();
+
+	static constexpr int FRAMES = 5;
+	for (int i=0; i < FRAMES; i++) {
+		std::string msg = "frame number " + std::to_string(i);
+		msg.append((const char*)&g_tag, sizeof(g_tag));
+		CHECK(writer->Send(msg.data(), msg.size()) == (int)msg.size());
+
+		// wait for the frame, there is no callback to tell us about it
+		RecvFrame frame;
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+		while (!recv_loop.Poll(frame) && std::chrono::steady_clock::now() < deadline)
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+
+		CHECK(frame.data == "frame number " + std::to_string(i));
+	}
+
+	CHECK(recv_loop.GetDroppedCount() == 0);
+
+	// releasing ownership of the reader lets the receiver exit
+	// once the writer closes the connection
+	reader.reset();
+	writer.reset();
+	recv_loop.Stop();
+}
+
+TEST_CASE("QueuedRecvLoop stops when the peer closes") {
+	std::shared_ptr<tcp_socket> reader, writer;
+	REQUIRE(make_connected_pair(reader, writer) == 0);
+
+	QueuedRecvLoop<AF_INET, SOCK_STREAM, 0, my_tag> recv_loop(reader, g_tag, 8, 4);
+	recv_loop.Start();
+
+	std::string msg = "last words";
+	msg.append((const char*)&g_tag, sizeof(g_tag));
+	REQUIRE(writer->Send(msg.data(), msg.size()) == (int)msg.size());
+
+	// we still own the reader, only the closed stream can stop it
+	writer.reset();
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+	while (recv_loop.IsAlive() && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	CHECK_FALSE(recv_loop.IsAlive());
+
+	// what came before the close is still delivered
+	RecvFrame frame;
+	REQUIRE(recv_loop.Poll(frame));
+	CHECK(frame.data == "last words");
+
+	recv_loop.Stop();
+}
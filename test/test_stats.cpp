@@ -0,0 +1,374 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+
+#define NOMINMAX
+#include <iostream>
+#include "lazy_sockets.h"
+#include "socket_pairs.h"
+#include <errno.h>
+
+#include <thread>
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+
+using namespace lsc;
+
+using tcp_socket = LSocket<AF_INET, SOCK_STREAM, 0>;
+
+struct my_tag {
+	char a;
+	char b;
+	char c;
+};
+
+using udp_socket = LSocket<AF_INET, SOCK_DGRAM, 0>;
+
+using tcp_receiver_loop = ThreadedRecvLoop<AF_INET, SOCK_STREAM, 0, my_tag>;
+
+static constexpr my_tag g_tag = {'\t', '\r', '\n'};
+
+TEST_CASE("Socket counters") {
+	std::shared_ptr<tcp_socket> tx, rx;
+	REQUIRE(make_connected_pair(tx, rx) == 0);
+
+	char msg[] = "hello there";
+	CHECK(tx->Send(msg, sizeof(msg)) == sizeof(msg));
+	CHECK(tx->Send(msg, sizeof(msg)) == sizeof(msg));
+
+	char buff[256];
+	CHECK(rx->Recv(buff, sizeof(buff)) == 2 * sizeof(msg));
+
+	// nothing left, a non blocking receive has to fail
+	CHECK(rx->Recv(buff, sizeof(buff), ERecv_nowait) < 0);
+
+	SocketStatsSnapshot tx_stats = tx->GetStatsSnapshot();
+	CHECK(tx_stats.bytes_out == 2 * sizeof(msg));
+	CHECK(tx_stats.send_calls == 2);
+	CHECK(tx_stats.partial_writes == 0);
+	CHECK(tx_stats.bytes_in == 0);
+
+	SocketStatsSnapshot rx_stats = rx->GetStatsSnapshot();
+	CHECK(rx_stats.bytes_in == 2 * sizeof(msg));
+	CHECK(rx_stats.recv_calls == 2);
+	CHECK(rx_stats.eagains == 1);
+	CHECK(rx_stats.bytes_out == 0);
+
+	// clones share the counters
+	tcp_socket clone(*rx);
+	CHECK(clone.GetStatsSnapshot().bytes_in == 2 * sizeof(msg));
+}
+
+TEST_CASE("Receiver and sender frame counters") {
+	std::shared_ptr<tcp_socket> tx, rx;
+	REQUIRE(make_connected_pair(tx, rx) == 0);
+
+	std::atomic<int> received{0};
+	tcp_receiver_loop recv_loop(rx, g_tag, [&received](void*, size_t) {received++;}, 4);
+	recv_loop.Start();
+
+	ThreadedSendLoop<AF_INET, SOCK_STREAM, 0> send_loop(tx);
+	send_loop.Start();
+
+	static constexpr int FRAMES = 100;
+	size_t max_size = 0;
+	for (int i=0; i < FRAMES; i++) {
+		std::string frame(i * 10, 'x');
+		max_size = frame.size();
+		frame.append((const char*)&g_tag, sizeof(g_tag));
+		send_loop.SendString(std::move(frame));
+	}
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (received < FRAMES && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	REQUIRE(received == FRAMES);
+
+	SocketStatsSnapshot rx_stats = recv_loop.GetStatsSnapshot();
+	CHECK(rx_stats.msgs_in == FRAMES);
+	CHECK(rx_stats.max_frame_size == max_size);
+	CHECK(rx_stats.buffer_grows > 0); // started out with a 4 byte buffer
+	CHECK(rx_stats.framing_errors == 0);
+
+	SocketStatsSnapshot tx_stats = tx->GetStatsSnapshot();
+	CHECK(tx_stats.msgs_out == FRAMES);
+	CHECK(tx_stats.bytes_out == rx_stats.bytes_in);
+	CHECK(tx_stats.send_calls <= FRAMES); // batching never makes it worse
+
+	// a frame without an end tag is a framing error once the connection dies
+	send_loop.Send("no tag", 6);
+	send_loop.Stop();
+
+	deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (recv_loop.GetStatsSnapshot().bytes_in < tx->GetStatsSnapshot().bytes_out
+		&& std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	tx.reset();
+	rx.reset();
+	recv_loop.Stop();
+
+	// the loop still holds the last socket reference, so its counters are still there
+	CHECK(recv_loop.GetStatsSnapshot().framing_errors == 1);
+}
+
+TEST_CASE("Histogram buckets and percentiles") {
+	// bucket bounds are contiguous and every value lands inside its bucket
+	for (int b=0; b + 1 < HistogramSnapshot::BUCKETS; b++)
+		REQUIRE(HistogramSnapshot::BucketHigh(b) + 1 == HistogramSnapshot::BucketLow(b + 1));
+
+	for (uint64_t v : {0ull, 1ull, 31ull, 32ull, 63ull, 64ull, 1000ull, 123456789ull, (1ull << 40) - 1}) {
+		int b = HistogramSnapshot::BucketOf(v);
+		CHECK(HistogramSnapshot::BucketLow(b) <= v);
+		CHECK(HistogramSnapshot::BucketHigh(b) >= v);
+	}
+
+	LatencyHistogram hist;
+	CHECK(hist.Snapshot().Percentile(50) == 0); // empty
+
+	// 1us to 10ms, uniform
+	for (uint64_t i=1; i <= 10000; i++)
+		hist.Record(i * 1000);
+
+	HistogramSnapshot snap = hist.Snapshot();
+	CHECK(snap.Count() == 10000);
+	CHECK(snap.Max() == 10000000);
+	CHECK(snap.Mean() == doctest::Approx(5000500.0));
+
+	// within the ~3% bucket resolution
+	CHECK(snap.Percentile(50) == doctest::Approx(5000000.0).epsilon(0.04));
+	CHECK(snap.Percentile(99) == doctest::Approx(9900000.0).epsilon(0.04));
+	CHECK(snap.Percentile(99.9) == doctest::Approx(9990000.0).epsilon(0.04));
+	CHECK(snap.Percentile(100) == 10000000);
+
+	// merging two halves gives the same thing as recording everything once
+	LatencyHistogram low, high;
+	for (uint64_t i=1; i <= 10000; i++)
+		(i <= 5000 ? low : high).Record(i * 1000);
+
+	HistogramSnapshot merged = low.Snapshot();
+	merged.Merge(high.Snapshot());
+	CHECK(merged.Count() == snap.Count());
+	CHECK(merged.Max() == snap.Max());
+	for (double p : {10.0, 50.0, 90.0, 99.0, 99.99})
+		CHECK(merged.Percentile(p) == snap.Percentile(p));
+}
+
+TEST_CASE("Receive and send latency histograms") {
+	std::shared_ptr<tcp_socket> tx, rx;
+	REQUIRE(make_connected_pair(tx, rx) == 0);
+
+	std::atomic<int> received{0};
+	tcp_receiver_loop recv_loop(rx, g_tag, [&received](void*, size_t) {received++;}, 64);
+	recv_loop.EnableLatencyHistogram();
+	recv_loop.Start();
+
+	tx->EnableSendLatency();
+
+	static constexpr int FRAMES = 200;
+	std::string frame = "pose";
+	frame.append((const char*)&g_tag, sizeof(g_tag));
+	for (int i=0; i < FRAMES; i++)
+		REQUIRE(tx->SendAll(frame.data(), frame.size()) == (int)frame.size());
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (received < FRAMES && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	REQUIRE(received == FRAMES);
+
+	HistogramSnapshot recv_lat = recv_loop.GetLatencySnapshot();
+	CHECK(recv_lat.Count() == FRAMES);
+	CHECK(recv_lat.Percentile(50) <= recv_lat.Percentile(99));
+	CHECK(recv_lat.Percentile(99) <= recv_lat.Max());
+
+	HistogramSnapshot send_lat = tx->GetSendLatencySnapshot();
+	CHECK(send_lat.Count() == tx->GetStatsSnapshot().send_calls);
+	CHECK(send_lat.Max() > 0);
+
+	// not enabled, nothing recorded
+	CHECK(rx->GetSendLatencySnapshot().Count() == 0);
+
+	tx.reset();
+	rx.reset();
+	recv_loop.Stop();
+}
+
+TEST_CASE("Kernel receive and transmit timestamps") {
+	// timestamps are wall clock, give them plenty of slack
+	static constexpr uint64_t SLACK = 5000000000ull;
+
+	SUBCASE("framed stream receiver") {
+		// unix sockets don't do timestamps on streams, needs real tcp
+		std::shared_ptr<tcp_socket> tx, rx;
+		REQUIRE(make_tcp_pair(tx, rx) == 0);
+
+		QueuedRecvLoop<AF_INET, SOCK_STREAM, 0, my_tag> recv_loop(rx, g_tag);
+		REQUIRE(recv_loop.EnableTimestamps() == 0);
+		recv_loop.EnableLatencyHistogram();
+		recv_loop.Start();
+
+		uint64_t before = get_wall_time_ns();
+		std::string frame = "pose";
+		frame.append((const char*)&g_tag, sizeof(g_tag));
+
+		// the kernel turns timestamping on for the whole system in the
+		// background the first time anyone asks, so the very first packets
+		// can come without one, keep sending until one has it
+		RecvFrame got;
+		int frames = 0;
+		for (int tries=0; tries < 100 && !got.timestamp_ns; tries++) {
+			REQUIRE(tx->SendAll(frame.data(), frame.size()) == (int)frame.size());
+			frames++;
+
+			got = RecvFrame();
+			auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+			while (!recv_loop.Poll(got) && std::chrono::steady_clock::now() < deadline)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+			REQUIRE(got.data == "pose");
+		}
+
+		CHECK(got.timestamp_ns + SLACK > before);
+		CHECK(got.timestamp_ns < get_wall_time_ns() + SLACK);
+		CHECK(recv_loop.GetLatencySnapshot().Count() == (uint64_t)frames);
+
+		tx.reset();
+		rx.reset();
+		recv_loop.Stop();
+	}
+
+	SUBCASE("datagrams") {
+		udp_socket rx, tx;
+		REQUIRE(rx.Bind("127.0.0.1", 0) == 0);
+
+		lcsockaddr_in rx_addr;
+		socklen_t rx_addr_size = sizeof(rx_addr);
+		REQUIRE(getsockname(rx.GetHandle(), (sockaddr*)&rx_addr, &rx_addr_size) == 0);
+
+		REQUIRE(rx.EnableTimestamps(ETstamp_rx) == 0);
+
+		// same as above, wait for the kernel to start stamping
+		char buff[16];
+		lcsockaddr_in sender;
+		size_t sender_size = sizeof(sender);
+		uint64_t timestamp = 0;
+		for (int tries=0; tries < 100 && !timestamp; tries++) {
+			REQUIRE(tx.SendTo("warm", 4, rx_addr, sizeof(rx_addr)) == 4);
+			REQUIRE(rx.RecvFrom(buff, sizeof(buff), sender, sender_size, timestamp) == 4);
+		}
+
+		REQUIRE(tx.EnableTimestamps(ETstamp_tx) == 0);
+
+		uint64_t before = get_wall_time_ns();
+		for (int i=0; i < 3; i++)
+			REQUIRE(tx.SendTo("pose", 4, rx_addr, sizeof(rx_addr)) == 4);
+
+		sender_size = sizeof(sender);
+		timestamp = 0;
+		REQUIRE(rx.RecvFrom(buff, sizeof(buff), sender, sender_size, timestamp) == 4);
+		CHECK(sender_size == sizeof(sender));
+		CHECK(timestamp + SLACK > before);
+		CHECK(timestamp < get_wall_time_ns() + SLACK);
+
+		// the plain overloads keep working on a timestamped socket
+		CHECK(rx.Recv(buff, sizeof(buff)) == 4);
+
+		// one transmit timestamp per send, numbered in order
+		for (uint32_t i=0; i < 3; i++) {
+			uint64_t tx_time = 0;
+			uint32_t id = 0;
+			int res = -1;
+			for (int tries=0; tries < 1000 && res; tries++) {
+				res = tx.ReadTxTimestamp(tx_time, id);
+				if (res)
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+
+			REQUIRE(res == 0);
+			CHECK(id == i);
+			CHECK(tx_time + SLACK > before);
+		}
+
+		uint64_t tx_time;
+		uint32_t id;
+		CHECK(tx.ReadTxTimestamp(tx_time, id) == -1); // nothing left
+		CHECK(lerrno == LSOCK_WOULDBLOCK);
+	}
+
+	SUBCASE("errors that aren't timestamps") {
+		// a port nobody listens on, the icmp error lands in the error queue
+		udp_socket tx;
+		int val = 1;
+		REQUIRE(tx.SetSockOpt(SOL_IP, IP_RECVERR, &val, sizeof(val)) == 0);
+		REQUIRE(tx.Connect("127.0.0.1", 58791) == 0);
+		REQUIRE(tx.EnableTimestamps(ETstamp_tx) == 0);
+		REQUIRE(tx.Send("pose", 4) == 4);
+
+		// the send's own timestamp and the port unreachable, in either order
+		int timestamps = 0, others = 0;
+		for (int tries=0; tries < 1000 && timestamps + others < 2; tries++) {
+			uint64_t tx_time = 1;
+			uint32_t id = 1;
+			if (tx.ReadTxTimestamp(tx_time, id) == 0) {
+				CHECK(tx_time);
+				timestamps++;
+			} else if (lerrno == ENOMSG) {
+				CHECK(tx_time == 0);
+				others++;
+			} else {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+
+		CHECK(timestamps == 1);
+		CHECK(others == 1);
+	}
+}
+
+TEST_CASE("TCP info") {
+	std::shared_ptr<tcp_socket> tx, rx;
+	REQUIRE(make_tcp_pair(tx, rx) == 0);
+
+	// nobody reads yet, everything sits in the receive queue
+	std::string frame(1000, 'x');
+	frame.append((const char*)&g_tag, sizeof(g_tag));
+	REQUIRE(tx->SendAll(frame.data(), frame.size()) == (int)frame.size());
+
+	LTcpInfo info;
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	do {
+		REQUIRE(rx->GetTcpInfo(info) == 0);
+	} while (info.recv_queue < frame.size() && std::chrono::steady_clock::now() < deadline);
+
+	CHECK(info.recv_queue == frame.size());
+	CHECK(info.sample_time_ns > 0);
+
+	REQUIRE(tx->GetTcpInfo(info) == 0);
+	CHECK(info.rtt_us > 0);
+	CHECK(info.cwnd_bytes > 0);
+	CHECK(info.send_queue == 0); // loopback sends right away
+
+	// the receiver drains it and samples along the way
+	std::atomic<int> received{0};
+	tcp_receiver_loop recv_loop(rx, g_tag, [&received](void*, size_t) {received++;}, 2048);
+	CHECK_FALSE(recv_loop.GetTcpInfoSample(info));
+	recv_loop.EnableTcpInfoSampling(std::chrono::milliseconds(1));
+	recv_loop.Start();
+
+	for (int i=0; i < 10; i++)
+		REQUIRE(tx->SendAll(frame.data(), frame.size()) == (int)frame.size());
+
+	while (received < 11 && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	REQUIRE(received == 11);
+	REQUIRE(recv_loop.GetTcpInfoSample(info));
+	CHECK(info.rtt_us > 0);
+
+	tx.reset();
+	rx.reset();
+	recv_loop.Stop();
+}
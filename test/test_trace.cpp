@@ -0,0 +1,119 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+
+#define NOMINMAX
+#include <iostream>
+#include "lazy_sockets.h"
+#include "socket_pairs.h"
+#include <errno.h>
+
+#include <thread>
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+
+using namespace lsc;
+
+using tcp_socket = LSocket<AF_INET, SOCK_STREAM, 0>;
+
+struct my_tag {
+	char a;
+	char b;
+	char c;
+};
+
+using tcp_receiver_loop = ThreadedRecvLoop<AF_INET, SOCK_STREAM, 0, my_tag>;
+
+static constexpr my_tag g_tag = {'\t', '\r', '\n'};
+
+static size_t count_of(const std::string& haystack, const std::string& needle) {
+	size_t count = 0;
+	for (size_t pos = haystack.find(needle); pos != std::string::npos; pos = haystack.find(needle, pos + 1))
+		count++;
+	return count;
+}
+
+TEST_CASE("Receiver trace points") {
+	Tracer::Clear();
+
+	std::shared_ptr<tcp_socket> tx, rx;
+	REQUIRE(make_connected_pair(tx, rx) == 0);
+
+	std::atomic<int> received{0};
+	tcp_receiver_loop recv_loop(rx, g_tag, [&received](void*, size_t) {received++;}, 4);
+	recv_loop.Start();
+
+	static constexpr int FRAMES = 20;
+	std::string frame = "pose";
+	frame.append((const char*)&g_tag, sizeof(g_tag));
+	for (int i=0; i < FRAMES; i++)
+		REQUIRE(tx->Send(frame.data(), frame.size()) == (int)frame.size());
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (received < FRAMES && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	REQUIRE(received == FRAMES);
+
+	tx.reset();
+	rx.reset();
+	recv_loop.Stop();
+
+	std::string json = Tracer::DumpChromeJson();
+	CHECK(json.rfind("{\"traceEvents\":[", 0) == 0);
+	CHECK(json.find("\n]}") != std::string::npos);
+
+	// every callback is bracketed and preceded by its tag
+	CHECK(count_of(json, "\"lsc.recv_loop.callback\",\"ph\":\"B\"") == FRAMES);
+	CHECK(count_of(json, "\"lsc.recv_loop.callback\",\"ph\":\"E\"") == FRAMES);
+	CHECK(count_of(json, "\"lsc.recv_loop.tag\"") == FRAMES);
+
+	// sends on this thread, receives on the receiver thread
+	CHECK(count_of(json, "\"lsc.send\",\"ph\":\"B\"") == FRAMES);
+	CHECK(count_of(json, "\"lsc.recv\",\"ph\":\"B\"") == count_of(json, "\"lsc.recv\",\"ph\":\"E\""));
+	CHECK(count_of(json, "\"lsc.recv\",\"ph\":\"B\"") > 0);
+
+	// started out with a 4 byte buffer
+	CHECK(count_of(json, "\"lsc.recv_loop.grow\"") > 0);
+}
+
+TEST_CASE("Trace ring keeps the newest events") {
+	Tracer::Clear();
+
+	// a fresh thread gets a fresh ring
+	std::thread writer([]() {
+		for (int i=0; i < LSC_TRACE_RING_SIZE + 100; i++)
+			LSC_TRACE_INSTANT("test.event", i);
+	});
+	writer.join();
+
+	// the oldest slot is always skipped, the writer could be reusing it
+	std::string json = Tracer::DumpChromeJson();
+	CHECK(count_of(json, "\"test.event\"") == LSC_TRACE_RING_SIZE - 1);
+	CHECK(json.find("\"v\":100}") == std::string::npos); // overwritten
+	CHECK(json.find("\"v\":101}") != std::string::npos);
+	CHECK(json.find("\"v\":" + std::to_string(LSC_TRACE_RING_SIZE + 99) + "}") != std::string::npos);
+}
+
+TEST_CASE("Trace rings of exited threads are dropped after a dump") {
+	Tracer::Clear();
+
+	std::thread writer([]() {
+		LSC_TRACE_INSTANT("test.exited", 1);
+	});
+	writer.join();
+
+	// still there for one dump, gone after it
+	CHECK(count_of(Tracer::DumpChromeJson(), "\"test.exited\"") == 1);
+	CHECK(count_of(Tracer::DumpChromeJson(), "\"test.exited\"") == 0);
+
+	// and without dumps only a few are kept
+	for (int i=0; i < LSC_TRACE_EXITED_RINGS + 8; i++) {
+		std::thread t([]() {
+			LSC_TRACE_INSTANT("test.exited", 2);
+		});
+		t.join();
+	}
+	CHECK(count_of(Tracer::DumpChromeJson(), "\"test.exited\"") <= LSC_TRACE_EXITED_RINGS + 1);
+}
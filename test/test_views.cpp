@@ -0,0 +1,445 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+
+#define NOMINMAX
+#include <iostream>
+#include "lazy_sockets.h"
+#include "socket_pairs.h"
+#include <errno.h>
+
+#include <thread>
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+
+#include "packets.h"
+#include "packet_views.h"
+
+using namespace lsc;
+
+using tcp_socket = LSocket<AF_INET, SOCK_STREAM, 0>;
+using tcp_receiver_loop = ThreadedRecvLoop<AF_INET, SOCK_STREAM, 0, PacketEndTag>;
+
+static HoboVR_ManagerMsg_t make_manager_msg(uint32_t type) {
+	HoboVR_ManagerMsg_t msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.type = type;
+	msg.terminator = g_EndTag;
+	return msg;
+}
+
+static_assert(is_packed_struct<HoboVR_TrackerPose_t>::value, "packets.h structs are packed");
+static_assert(is_packed_struct<HoboVR_ManagerMsg_t>::value, "packets.h structs are packed");
+static_assert(!is_packed_struct<double>::value, "plain doubles need alignment");
+
+TEST_CASE("ViewFrame and ViewMessage check size and terminator") {
+	HoboVR_ManagerMsg_t msg = make_manager_msg(EManagerMsgType_ipd);
+	size_t frame_len = sizeof(msg) - sizeof(PacketEndTag);
+
+	CHECK(ViewFrame<HoboVR_ManagerMsg_t, PacketEndTag>(&msg, frame_len) == &msg);
+	CHECK(ViewFrame<HoboVR_ManagerMsg_t, PacketEndTag>(&msg, frame_len - 1) == nullptr);
+	CHECK(ViewFrame<HoboVR_ManagerMsg_t, PacketEndTag>(&msg, sizeof(msg)) == nullptr);
+
+	CHECK(ViewMessage<HoboVR_ManagerMsg_t>(&msg, sizeof(msg), g_EndTag) == &msg);
+	CHECK(ViewMessage<HoboVR_ManagerMsg_t>(&msg, frame_len, g_EndTag) == nullptr);
+	msg.terminator.c = 'x';
+	CHECK(ViewMessage<HoboVR_ManagerMsg_t>(&msg, sizeof(msg), g_EndTag) == nullptr);
+}
+
+TEST_CASE("PackedSpan over unaligned records") {
+	static constexpr int COUNT = 5;
+
+	// start one byte in, so nothing is naturally aligned
+	std::vector<char> buff(1 + COUNT * sizeof(HoboVR_TrackerPose_t));
+	for (int i=0; i < COUNT; i++) {
+		HoboVR_TrackerPose_t pose;
+		memset(&pose, 0, sizeof(pose));
+		pose.position[0] = (float)i;
+		pose.orientation[0] = 1.0f;
+		memcpy(buff.data() + 1 + i * sizeof(pose), &pose, sizeof(pose));
+	}
+
+	hobovr::TrackerPoses poses;
+	CHECK_FALSE(hobovr::TrackerPoses::FromBytes(buff.data() + 1, buff.size() - 2, poses));
+	REQUIRE(hobovr::TrackerPoses::FromBytes(buff.data() + 1, buff.size() - 1, poses));
+	REQUIRE(poses.size() == COUNT);
+	CHECK(poses.SizeBytes() == buff.size() - 1);
+	CHECK((const char*)poses.data() == buff.data() + 1); // no copies
+
+	int i = 0;
+	for (auto& pose : poses) {
+		CHECK(pose.position[0] == (float)i);
+		CHECK(pose.orientation[0] == 1.0f);
+		i++;
+	}
+	CHECK(i == COUNT);
+	CHECK(poses[3].position[0] == 3.0f);
+}
+
+TEST_CASE("VisitManagerMsg dispatches on type") {
+	int ipd_calls = 0, udu_calls = 0, other_calls = 0;
+	float ipd = 0;
+	std::string udu;
+	auto visitor = overloaded{
+		[&](const HoboVR_ManagerMsgIpd_t& msg) {ipd = msg.ipd_meters; ipd_calls++;},
+		[&](const HoboVR_ManagerMsgUduString_t& msg) {
+			udu.assign((const char*)msg.devices, msg.len);
+			udu_calls++;
+		},
+		[&](const auto&) {other_calls++;}
+	};
+
+	size_t frame_len = sizeof(HoboVR_ManagerMsg_t) - sizeof(PacketEndTag);
+
+	HoboVR_ManagerMsg_t msg = make_manager_msg(EManagerMsgType_ipd);
+	msg.data.ipd.ipd_meters = 0.064f;
+	CHECK(hobovr::VisitManagerMsg(&msg, frame_len, visitor));
+	CHECK(ipd_calls == 1);
+	CHECK(ipd == 0.064f);
+
+	msg = make_manager_msg(EManagerMsgType_uduString);
+	msg.data.udu.len = 3;
+	msg.data.udu.devices[0] = 0;
+	msg.data.udu.devices[1] = 1;
+	msg.data.udu.devices[2] = 2;
+	CHECK(hobovr::VisitManagerMsg(&msg, frame_len, visitor));
+	CHECK(udu_calls == 1);
+	CHECK(udu == std::string("\0\1\2", 3));
+
+	msg = make_manager_msg(EManagerMsgType_getTrkBuffSize);
+	CHECK(hobovr::VisitManagerMsg(&msg, frame_len, visitor));
+	CHECK(other_calls == 1);
+
+	// rejected without calling anything
+	msg = make_manager_msg(EManagerMsgType_uduString);
+	msg.data.udu.len = 513;
+	CHECK_FALSE(hobovr::VisitManagerMsg(&msg, frame_len, visitor));
+	msg = make_manager_msg(12345);
+	CHECK_FALSE(hobovr::VisitManagerMsg(&msg, frame_len, visitor));
+	msg = make_manager_msg(EManagerMsgType_ipd);
+	CHECK_FALSE(hobovr::VisitManagerMsg(&msg, frame_len - 1, visitor));
+	CHECK(ipd_calls == 1);
+	CHECK(udu_calls == 1);
+	CHECK(other_calls == 1);
+}
+
+TEST_CASE("VisitPoserResp dispatches on type") {
+	HoboVR_PoserResp_t resp;
+	memset(&resp, 0, sizeof(resp));
+	resp.type = EPoserRespType_badDeviceList;
+	resp.data.buf_size.size = 55;
+	resp.terminator = g_EndTag;
+
+	uint32_t size = 0;
+	bool shutdown = false;
+	auto visitor = overloaded{
+		[&](const HoboVR_RespBufSize_t& msg) {size = msg.size;},
+		[&](const hobovr::PoserRespDriverShutdown&) {shutdown = true;},
+		[](const HoboVR_HapticResponse_t&) {}
+	};
+
+	size_t frame_len = sizeof(resp) - sizeof(PacketEndTag);
+	CHECK(hobovr::VisitPoserResp(&resp, frame_len, visitor));
+	CHECK(size == 55);
+
+	resp.type = EPoserRespType_driverShutdown;
+	CHECK(hobovr::VisitPoserResp(&resp, frame_len, visitor));
+	CHECK(shutdown);
+
+	resp.type = EPoserRespType_invalid;
+	CHECK_FALSE(hobovr::VisitPoserResp(&resp, frame_len, visitor));
+}
+
+// a made up schema with a sparse id, a 16 bit type field and a checked payload
+#pragma pack(push, 1)
+struct test_ping {
+	uint32_t seq;
+};
+
+struct test_blob {
+	uint8_t len;
+	char data[7];
+};
+#pragma pack(pop)
+
+struct test_hello {};
+
+namespace lsc {
+template<>
+struct MessageCheck<test_blob> {
+	static bool Check(const test_blob& msg) {
+		return msg.len <= sizeof(msg.data);
+	}
+};
+} // namespace lsc
+
+using test_schema = MessageSchema<uint16_t, 12,
+	MessageDef<1, test_ping>,
+	MessageDef<7, test_hello>,
+	MessageDef<300, test_blob>
+>;
+
+static_assert(test_schema::k_frame_size == 14, "type field plus payload area");
+static_assert(test_schema::SizeOf(1) == 4, "");
+static_assert(test_schema::SizeOf(7) == 0, "empty payloads take no space");
+static_assert(test_schema::SizeOf(2) == 0, "unknown");
+static_assert(test_schema::Has(300) && !test_schema::Has(2), "");
+static_assert(test_schema::MaxSize() == 8, "");
+static_assert(test_schema::IdOf<test_blob>() == 300, "");
+static_assert(hobovr::DeviceSizes::SizeOf('c') == sizeof(HoboVR_ControllerState_t), "");
+
+TEST_CASE("MessageSchema encodes and dispatches") {
+	std::string frame;
+	test_schema::Encode(test_ping{42}, frame);
+	REQUIRE(frame.size() == test_schema::k_frame_size);
+	CHECK(frame.substr(0, 2) == std::string("\x01\x00", 2));
+	CHECK(frame.substr(6) == std::string(8, '\0')); // rest of the payload area zeroed
+
+	uint32_t seq = 0;
+	int hellos = 0, blobs = 0;
+	const void* seen = nullptr;
+	auto visitor = overloaded{
+		[&](const test_ping& msg) {seq = msg.seq; seen = &msg;},
+		[&](const test_hello&) {hellos++;},
+		[&](const test_blob& msg) {blobs += msg.len;}
+	};
+
+	CHECK(test_schema::Dispatch(frame.data(), frame.size(), visitor));
+	CHECK(seq == 42);
+	CHECK(seen == frame.data() + 2); // in place
+
+	frame.clear();
+	test_schema::Encode(test_hello{}, frame);
+	CHECK(test_schema::Dispatch(frame.data(), frame.size(), visitor));
+	CHECK(hellos == 1);
+
+	test_blob blob = {3, "abc"};
+	frame.clear();
+	test_schema::Encode(blob, frame);
+	CHECK(test_schema::Dispatch(frame.data(), frame.size(), visitor));
+	CHECK(blobs == 3);
+
+	// failing the payload check
+	frame[2] = 8;
+	CHECK_FALSE(test_schema::Dispatch(frame.data(), frame.size(), visitor));
+
+	// bad size, unknown types inside and past the jump table
+	CHECK_FALSE(test_schema::Dispatch(frame.data(), frame.size() - 1, visitor));
+	uint16_t type = 2;
+	memcpy(&frame[0], &type, sizeof(type));
+	CHECK_FALSE(test_schema::Dispatch(frame.data(), frame.size(), visitor));
+	type = 301;
+	memcpy(&frame[0], &type, sizeof(type));
+	CHECK_FALSE(test_schema::Dispatch(frame.data(), frame.size(), visitor));
+	CHECK(blobs == 3);
+	CHECK(hellos == 1);
+
+	CHECK(test_schema::PeekType(frame.data(), frame.size(), type));
+	CHECK(type == 301);
+}
+
+TEST_CASE("HoboVR schemas match the hand written structs") {
+	// encoded by the schema, read as the struct
+	HoboVR_ManagerMsgIpd_t ipd = {0.063f};
+	std::string msg = hobovr::EncodeMessage<hobovr::ManagerSchema>(ipd);
+	REQUIRE(msg.size() == sizeof(HoboVR_ManagerMsg_t));
+	const HoboVR_ManagerMsg_t* view = ViewMessage<HoboVR_ManagerMsg_t>(msg.data(), msg.size(), g_EndTag);
+	REQUIRE(view);
+	CHECK(view->type == EManagerMsgType_ipd);
+	CHECK(view->data.ipd.ipd_meters == 0.063f);
+
+	HoboVR_RespBufSize_t size = {99};
+	msg = hobovr::EncodeMessage<hobovr::PoserRespSchema>(size);
+	REQUIRE(msg.size() == sizeof(HoboVR_PoserResp_t));
+	const HoboVR_PoserResp_t* resp = ViewMessage<HoboVR_PoserResp_t>(msg.data(), msg.size(), g_EndTag);
+	REQUIRE(resp);
+	CHECK(resp->type == EPoserRespType_badDeviceList);
+	CHECK(resp->data.buf_size.size == 99);
+
+	msg = hobovr::EncodeMessage<hobovr::PoserRespSchema>(hobovr::PoserRespDriverShutdown{});
+	bool shutdown = false;
+	CHECK(hobovr::VisitPoserResp(msg.data(), msg.size() - sizeof(PacketEndTag), overloaded{
+		[&](const hobovr::PoserRespDriverShutdown&) {shutdown = true;},
+		[](const auto&) {}
+	}));
+	CHECK(shutdown);
+
+	CHECK(util::udu2sizet("hctg") == sizeof(HoboVR_HeadsetPose_t) + sizeof(HoboVR_ControllerState_t) + sizeof(HoboVR_TrackerPose_t) + sizeof(HoboVR_GazeState_t));
+	CHECK(util::udu2sizet("x") == 0);
+}
+
+TEST_CASE("MessageRouter routes by type") {
+	MessageRouter<uint32_t> router(hobovr::ManagerSchema::k_frame_size);
+	const size_t len = hobovr::ManagerSchema::k_frame_size;
+
+	float ipd = 0;
+	int udus = 0, raw = 0, trk = 0;
+	CHECK(router.On<HoboVR_ManagerMsgIpd_t>(EManagerMsgType_ipd, [&](const HoboVR_ManagerMsgIpd_t& msg) {ipd = msg.ipd_meters;}) == 0);
+	CHECK(router.On<HoboVR_ManagerMsgUduString_t>(EManagerMsgType_uduString, [&](const HoboVR_ManagerMsgUduString_t&) {udus++;}) == 0);
+	CHECK(router.On<hobovr::ManagerMsgGetTrkBuffSize>(EManagerMsgType_getTrkBuffSize, [&](const hobovr::ManagerMsgGetTrkBuffSize&) {trk++;}) == 0);
+	CHECK(router.On(EManagerMsgType_eyeGap, [&](const void*, size_t payload_len) {raw += (int)payload_len;}) == 0);
+	CHECK(router.Has(EManagerMsgType_ipd));
+	CHECK_FALSE(router.Has(EManagerMsgType_distortion));
+	CHECK_FALSE(router.Has(100000));
+
+	CHECK(router.On(LSC_SCHEMA_MAX_ID, [](const void*, size_t) {}) == -1);
+	CHECK(router.On(1, nullptr) == -1);
+
+	HoboVR_ManagerMsg_t msg = make_manager_msg(EManagerMsgType_ipd);
+	msg.data.ipd.ipd_meters = 0.065f;
+	CHECK(router.Route(&msg, len));
+	CHECK(ipd == 0.065f);
+
+	msg = make_manager_msg(EManagerMsgType_getTrkBuffSize);
+	CHECK(router.Route(&msg, len));
+	CHECK(trk == 1);
+
+	msg = make_manager_msg(EManagerMsgType_eyeGap);
+	CHECK(router.Route(&msg, len));
+	CHECK(raw == (int)sizeof(HoboVR_ManagerData_t));
+
+	// failing MessageCheck
+	msg = make_manager_msg(EManagerMsgType_uduString);
+	msg.data.udu.len = 1000;
+	CHECK_FALSE(router.Route(&msg, len));
+	msg.data.udu.len = 2;
+	CHECK(router.Route(&msg, len));
+	CHECK(udus == 1);
+
+	// wrong size, unhandled and out of table types
+	CHECK_FALSE(router.Route(&msg, len - 1));
+	msg = make_manager_msg(EManagerMsgType_distortion);
+	CHECK_FALSE(router.Route(&msg, len));
+	msg = make_manager_msg(0xffffffff);
+	CHECK_FALSE(router.Route(&msg, len));
+	CHECK(router.GetRejectedCount() == 4);
+
+	// the fallback gets everything without a handler
+	std::vector<uint32_t> fell;
+	router.SetFallback([&](uint32_t type, const void*, size_t) {
+		fell.push_back(type);
+		return type != 0xffffffff;
+	});
+	router.Off(EManagerMsgType_ipd);
+	msg = make_manager_msg(EManagerMsgType_ipd);
+	CHECK(router.Route(&msg, len));
+	msg = make_manager_msg(0xffffffff);
+	CHECK_FALSE(router.Route(&msg, len));
+	CHECK(fell == std::vector<uint32_t>{EManagerMsgType_ipd, 0xffffffff});
+	CHECK(router.GetRejectedCount() == 5);
+}
+
+TEST_CASE("MessageRouter replaces typed handlers whole") {
+	MessageRouter<uint32_t> router;
+
+	int typed = 0, raw = 0;
+	REQUIRE(router.On<HoboVR_ManagerMsgUduString_t>(EManagerMsgType_uduString, [&](const HoboVR_ManagerMsgUduString_t&) {typed++;}) == 0);
+
+	// too short for the struct and failing its check
+	char frame[8] = {};
+	uint32_t type = EManagerMsgType_uduString;
+	memcpy(frame, &type, sizeof(type));
+	frame[4] = (char)0xff;
+	frame[5] = (char)0xff;
+	CHECK_FALSE(router.Route(frame, sizeof(frame)));
+
+	// a raw handler takes any payload, the old size and check are gone
+	REQUIRE(router.On(EManagerMsgType_uduString, [&](const void*, size_t len) {raw += (int)len;}) == 0);
+	CHECK(router.Route(frame, sizeof(frame)));
+	CHECK(raw == 4);
+	CHECK(typed == 0);
+	CHECK(router.GetRejectedCount() == 1);
+}
+
+TEST_CASE("MessageRouter with a small signed type field") {
+	MessageRouter<int8_t> router;
+
+	int got = 0;
+	CHECK(router.On(-1, [&](const void*, size_t) {got++;}) == -1);
+	CHECK(router.On(5, [&](const void*, size_t len) {got += (int)len;}) == 0);
+
+	char frame[4] = {5, 1, 2, 3};
+	CHECK(router.Route(frame, sizeof(frame)));
+	CHECK(router.Route(frame, 1)); // no payload is fine without a frame size
+	CHECK(got == 3);
+
+	frame[0] = -1;
+	CHECK_FALSE(router.Route(frame, sizeof(frame)));
+	CHECK_FALSE(router.Route(frame, 0));
+}
+
+TEST_CASE("Views straight out of a receiver") {
+	std::shared_ptr<tcp_socket> tx, rx;
+	REQUIRE(make_connected_pair(tx, rx) == 0);
+
+	std::atomic<int> got{0};
+	std::atomic<float> eye_gap{0};
+	tcp_receiver_loop recv_loop(
+		rx,
+		g_EndTag,
+		[&](void* buff, size_t len) {
+			hobovr::VisitManagerMsg(buff, len, overloaded{
+				[&](const HoboVR_ManagerMsgEyeGap_t& msg) {eye_gap = (float)msg.width;},
+				[](const auto&) {}
+			});
+			got++;
+		},
+		sizeof(HoboVR_ManagerMsg_t)
+	);
+	recv_loop.Start();
+
+	HoboVR_ManagerMsg_t msg = make_manager_msg(EManagerMsgType_eyeGap);
+	msg.data.eye_offset.width = 12;
+	REQUIRE(tx->SendAll(&msg, sizeof(msg)) == (int)sizeof(msg));
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (got < 1 && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	CHECK(got == 1);
+	CHECK(eye_gap == 12.0f);
+
+	tx.reset();
+	rx.reset();
+	recv_loop.Stop();
+}
+
+TEST_CASE("MessageRouter as a receiver callback") {
+	std::shared_ptr<tcp_socket> tx, rx;
+	REQUIRE(make_connected_pair(tx, rx) == 0);
+
+	MessageRouter<uint32_t> router(hobovr::ManagerSchema::k_frame_size);
+	std::atomic<int> got{0}, bad{0};
+	std::atomic<float> eye_gap{0};
+	router.On<HoboVR_ManagerMsgEyeGap_t>(EManagerMsgType_eyeGap, [&](const HoboVR_ManagerMsgEyeGap_t& msg) {
+		eye_gap = (float)msg.width;
+		got++;
+	});
+
+	tcp_receiver_loop recv_loop(
+		rx,
+		g_EndTag,
+		router.AsCallback([&](void*, size_t) {bad++;}),
+		sizeof(HoboVR_ManagerMsg_t)
+	);
+	recv_loop.Start();
+
+	HoboVR_ManagerMsg_t msg = make_manager_msg(EManagerMsgType_ipd);
+	REQUIRE(tx->SendAll(&msg, sizeof(msg)) == (int)sizeof(msg));
+	msg = make_manager_msg(EManagerMsgType_eyeGap);
+	msg.data.eye_offset.width = 7;
+	REQUIRE(tx->SendAll(&msg, sizeof(msg)) == (int)sizeof(msg));
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (got < 1 && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+	CHECK(got == 1);
+	CHECK(bad == 1);
+	CHECK(eye_gap == 7.0f);
+
+	rx.reset();
+	tx.reset();
+	recv_loop.Stop();
+}
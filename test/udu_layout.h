@@ -0,0 +1,227 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+// Copyright (C) 2020-2021 Oleg Vorobiov <oleg.vorobiov@hobovrlabs.org>
+
+#ifndef __HOBOVR_UDU_LAYOUT
+#define __HOBOVR_UDU_LAYOUT
+
+#include <cmath>
+#include <cstddef>
+#include "lazy_sockets.h"
+#include "packets.h"
+
+namespace hobovr {
+
+// where a device sits in a pose packet
+struct UduSlot {
+	uint32_t offset; // bytes from the start of the packet
+	uint32_t size;
+	char type; // udu character: 'h', 'c', 't' or 'g'
+	uint16_t type_index; // n-th device of its type in the packet
+};
+
+// a stretch of floats checked in one go,
+// neighbouring devices with nothing but floats in between share one
+struct UduFloatRun {
+	uint32_t offset;
+	uint32_t count;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// UduLayout - udu string compiled into an offset table
+////////////////////////////////////////////////////////////////////////////////
+
+// compiled once per udu change, after that a pose packet is split into
+// per device views by walking the table, nothing is copied or re-parsed
+class UduLayout {
+public:
+	UduLayout() = default;
+
+	// builds the table for :udu:
+	// returns 0 on success or -1 on error (EINVAL for an unknown device
+	// type or more devices than a udu message can carry)
+	int Compile(const std::string& udu) {
+		UduLayout out;
+		if (udu.size() > sizeof(HoboVR_ManagerMsgUduString_t::devices)) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		uint32_t offset = 0;
+		for (char c : udu) {
+			const DeviceInfo* info = get_info(c);
+			if (!info) {
+				errno = EINVAL;
+				return -1;
+			}
+
+			int type = (int)(info - k_devices);
+			out.m_slots.push_back({offset, info->size, c, out.m_type_counts[type]++});
+
+			// floats that directly follow the previous run extend it
+			uint32_t float_off = offset + info->float_off;
+			UduFloatRun* last = out.m_float_runs.empty() ? nullptr : &out.m_float_runs.back();
+			if (last && last->offset + last->count * sizeof(float) == float_off)
+				last->count += info->float_count;
+			else
+				out.m_float_runs.push_back({float_off, info->float_count});
+
+			if (info->quat_off >= 0)
+				out.m_quats.push_back(offset + info->quat_off);
+			if (info->double_off >= 0)
+				out.m_doubles.push_back(offset + info->double_off);
+
+			offset += info->size;
+		}
+
+		out.m_udu = udu;
+		out.m_size = offset;
+		*this = std::move(out);
+		return 0;
+	}
+
+	const std::string& GetUdu() const {
+		return m_udu;
+	}
+
+	// pose packet size, without the end tag
+	size_t GetPacketSize() const {
+		return m_size;
+	}
+
+	size_t GetDeviceCount() const {
+		return m_slots.size();
+	}
+
+	const UduSlot& GetSlot(size_t index) const {
+		return m_slots[index];
+	}
+
+	// number of devices of :type: ('h', 'c', 't' or 'g')
+	size_t GetTypeCount(char type) const {
+		const DeviceInfo* info = get_info(type);
+		return info ? m_type_counts[info - k_devices] : 0;
+	}
+
+	const std::vector<UduFloatRun>& GetFloatRuns() const {
+		return m_float_runs;
+	}
+
+	// calls :visitor:(const UduSlot&, const T&) for every device in order,
+	// with T being the pose struct of the device, viewed in place
+	// returns false without calling :visitor: if :len: doesn't match
+	template<typename V>
+	bool Visit(const void* packet, size_t len, V&& visitor) const {
+		if (len != m_size)
+			return false;
+
+		const char* p = (const char*)packet;
+		for (const UduSlot& slot : m_slots) {
+			switch (slot.type) {
+				case 'h': {visitor(slot, *(const HoboVR_HeadsetPose_t*)(p + slot.offset)); break;}
+				case 'c': {visitor(slot, *(const HoboVR_ControllerState_t*)(p + slot.offset)); break;}
+				case 't': {visitor(slot, *(const HoboVR_TrackerPose_t*)(p + slot.offset)); break;}
+				case 'g': {visitor(slot, *(const HoboVR_GazeState_t*)(p + slot.offset)); break;}
+			}
+		}
+
+		return true;
+	}
+
+	// checks that no float/double in :packet: is NaN or infinite and that
+	// every orientation is a unit quaternion, give or take :tolerance:
+	// on the squared length
+	// returns false if not, with the first device that failed the first
+	// failing check in :bad_device:
+	bool Validate(const void* packet, size_t len, float tolerance = 0.01f, size_t* bad_device = nullptr) const {
+		if (len != m_size) {
+			if (bad_device)
+				*bad_device = m_slots.size();
+			return false;
+		}
+
+		const char* p = (const char*)packet;
+		for (const UduFloatRun& run : m_float_runs) {
+			if (lsc::AllFinite(p + run.offset, run.count))
+				continue;
+
+			// narrow it down to a device, only on the slow path
+			if (bad_device) {
+				for (uint32_t i=0; i < run.count; i++) {
+					if (!lsc::AllFinite(p + run.offset + i * sizeof(float), 1)) {
+						*bad_device = device_at(run.offset + i * sizeof(float));
+						break;
+					}
+				}
+			}
+			return false;
+		}
+
+		for (uint32_t off : m_quats) {
+			float norm = lsc::SquaredNorm4(p + off);
+			if (!(std::fabs(norm - 1.0f) <= tolerance)) {
+				if (bad_device)
+					*bad_device = device_at(off);
+				return false;
+			}
+		}
+
+		for (uint32_t off : m_doubles) {
+			double value;
+			memcpy(&value, p + off, sizeof(value));
+			if (!std::isfinite(value)) {
+				if (bad_device)
+					*bad_device = device_at(off);
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+private:
+	// what is where inside each device struct
+	struct DeviceInfo {
+		char type;
+		uint32_t size;
+		uint32_t float_off; // first float
+		uint32_t float_count; // floats back to back from float_off
+		int32_t quat_off; // orientation, -1 for none
+		int32_t double_off; // -1 for none
+	};
+
+	static constexpr DeviceInfo k_devices[] = {
+		{'h', sizeof(HoboVR_HeadsetPose_t), 0, 13, offsetof(HoboVR_HeadsetPose_t, orientation), -1},
+		{'c', sizeof(HoboVR_ControllerState_t), 0, 16, offsetof(HoboVR_ControllerState_t, orientation), -1},
+		{'t', sizeof(HoboVR_TrackerPose_t), 0, 13, offsetof(HoboVR_TrackerPose_t, orientation), -1},
+		{'g', sizeof(HoboVR_GazeState_t), offsetof(HoboVR_GazeState_t, pupil_position_r), 8, -1, offsetof(HoboVR_GazeState_t, age_seconds)},
+	};
+
+	static const DeviceInfo* get_info(char type) {
+		for (const DeviceInfo& info : k_devices)
+			if (info.type == type)
+				return &info;
+		return nullptr;
+	}
+
+	// slot containing the byte at :offset:
+	size_t device_at(uint32_t offset) const {
+		auto it = std::upper_bound(
+			m_slots.begin(), m_slots.end(), offset,
+			[](uint32_t value, const UduSlot& slot) {return value < slot.offset;}
+		);
+		return (size_t)(it - m_slots.begin()) - 1;
+	}
+
+	std::string m_udu;
+	size_t m_size = 0;
+	std::vector<UduSlot> m_slots;
+	std::vector<UduFloatRun> m_float_runs;
+	std::vector<uint32_t> m_quats; // offsets of the orientations
+	std::vector<uint32_t> m_doubles; // offsets of double fields
+	std::array<uint16_t, 4> m_type_counts = {};
+}; // class UduLayout
+
+} // namespace hobovr
+
+#endif // #ifndef __HOBOVR_UDU_LAYOUT